@@ -0,0 +1,422 @@
+//Microbenchmarks for the per-packet hot paths: advertisement parsing,
+//ATT PDU encoding and decoding, UUID conversion and attribute lookup.
+//
+//Build with cmake -DWITH_BENCHMARKS=ON (needs Google Benchmark), then run
+//bench/blepp_bench. Besides the usual ns/op, each benchmark reports
+//allocs/op and bytes/op, counted by the operator new replacement below.
+#include <blepp/lescan.h>
+#include <blepp/att.h>
+#include <blepp/att_pdu.h>
+#include <blepp/uuid.h>
+#include <blepp/logging.h>
+#ifdef BLEPP_SERVER_SUPPORT
+#include <blepp/bleattributedb.h>
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace BLEPP;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Allocation counting
+//
+
+static std::atomic<size_t> alloc_count(0);
+static std::atomic<size_t> alloc_bytes(0);
+
+//The replacements below go through these two, kept out of line so that
+//GCC cannot inline malloc() into a new and free() into a delete, and then
+//warn (-Wmismatched-new-delete) that the pair does not match.
+__attribute__((noinline)) static void* counted_alloc(size_t n)
+{
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+	return std::malloc(n ? n : 1);
+}
+
+__attribute__((noinline)) static void counted_free(void* p)
+{
+	std::free(p);
+}
+
+void* operator new(size_t n)
+{
+	if(void* p = counted_alloc(n))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	counted_free(p);
+}
+
+//Snapshot the counters at construction and report the difference as
+//per-iteration averages when destroyed, after the timing loop.
+class AllocCounter
+{
+	public:
+		AllocCounter(benchmark::State& s)
+		:state(s), count(alloc_count.load()), bytes(alloc_bytes.load())
+		{
+		}
+
+		~AllocCounter()
+		{
+			state.counters["allocs/op"] = benchmark::Counter(alloc_count.load() - count, benchmark::Counter::kAvgIterations);
+			state.counters["bytes/op"] = benchmark::Counter(alloc_bytes.load() - bytes, benchmark::Counter::kAvgIterations);
+		}
+
+	private:
+		benchmark::State& state;
+		size_t count, bytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Corpora
+//
+
+//Parse "> 04 3E ..." as printed by hcidump into bytes.
+static std::vector<uint8_t> to_data(const std::string& ss)
+{
+	std::istringstream s(ss);
+	std::string tmp;
+	s >> tmp >> std::hex;
+
+	std::vector<uint8_t> ret;
+	for(int x; s >> x;)
+		ret.push_back(x);
+	return ret;
+}
+
+//LE advertising reports captured from real devices.
+static const std::vector<std::vector<uint8_t>>& advert_corpus()
+{
+	static const std::vector<std::vector<uint8_t>> corpus = {
+		//Flags + 128 bit service UUID
+		to_data("> 04 3E 21 02 01 00 00 1B EE B5 80 07 00 15 02 01 06 11 06 64 97 81 D1 ED BA 6B AC 11 4C 9D 34 3E 20 09 73 BC"),
+		//Scan response with a complete local name
+		to_data("> 04 3E 24 02 01 04 00 1B EE B5 80 07 00 18 17 09 44 79 6E 6F 66 69 74 20 49 6E 63 20 44 4F 54 53 20 78 78 78 78 31 BE"),
+		//Flags + Apple manufacturer data
+		to_data("> 04 3E 17 02 01 00 01 0B 57 16 21 76 7C 0B 02 01 1A 07 FF 4C 00 10 02 0A 00 BC"),
+		//iBeacon
+		to_data("> 04 3E 2A 02 01 03 01 C7 8A 2D 45 E1 F0 1E 02 01 06 1A FF 4C 00 02 15 E2 C5 6D B5 DF FB 48 D2 B0 60 D0 F5 A7 10 96 E0 00 01 00 02 C5 B3"),
+		//Eddystone URL: flags, 16 bit UUID list, service data
+		to_data("> 04 3E 21 02 01 00 01 5A 3C 1B 8E 4F D2 15 02 01 06 03 03 AA FE 0D 16 AA FE 10 EB 03 67 6F 6F 67 6C 65 07 A9"),
+	};
+	return corpus;
+}
+
+//Read By Type response to a characteristic discovery: six declarations of
+//handle, properties, value handle and 16 bit UUID.
+static const std::vector<uint8_t> read_by_type_rsp = {
+	ATT_OP_READ_BY_TYPE_RESP, 7,
+	0x02, 0x00, 0x02, 0x03, 0x00, 0x00, 0x2A,
+	0x04, 0x00, 0x02, 0x05, 0x00, 0x01, 0x2A,
+	0x06, 0x00, 0x0A, 0x07, 0x00, 0x04, 0x2A,
+	0x09, 0x00, 0x12, 0x0A, 0x00, 0x19, 0x2A,
+	0x0C, 0x00, 0x10, 0x0D, 0x00, 0x37, 0x2A,
+	0x0F, 0x00, 0x02, 0x10, 0x00, 0x38, 0x2A,
+};
+
+//Read By Group Type response to a primary service discovery.
+static const std::vector<uint8_t> read_by_group_rsp = {
+	ATT_OP_READ_BY_GROUP_RESP, 6,
+	0x01, 0x00, 0x07, 0x00, 0x00, 0x18,
+	0x08, 0x00, 0x0B, 0x00, 0x01, 0x18,
+	0x0C, 0x00, 0x10, 0x00, 0x0D, 0x18,
+	0x11, 0x00, 0x1A, 0x00, 0x0A, 0x18,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Advertisement parsing
+//
+
+static void BM_parse_advertisement_packet(benchmark::State& state)
+{
+	const auto& corpus = advert_corpus();
+	AllocCounter allocs(state);
+
+	size_t i=0;
+	for(auto _: state)
+	{
+		auto r = parse_advertisement_packet(corpus[i++ % corpus.size()]);
+		benchmark::DoNotOptimize(r);
+	}
+}
+BENCHMARK(BM_parse_advertisement_packet);
+
+static void BM_parse_advertisement_views(benchmark::State& state)
+{
+	const auto& corpus = advert_corpus();
+	AdvertisementView views[max_advertising_reports];
+	AllocCounter allocs(state);
+
+	size_t i=0;
+	for(auto _: state)
+	{
+		const std::vector<uint8_t>& p = corpus[i++ % corpus.size()];
+		benchmark::DoNotOptimize(parse_advertisement_views(p.data(), p.size(), views, max_advertising_reports));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_parse_advertisement_views);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ATT encoding and decoding
+//
+
+static void BM_enc_read_by_type_req(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	bt_uuid_t uuid;
+	bt_uuid16_create(&uuid, GATT_CHARACTERISTIC);
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		benchmark::DoNotOptimize(enc_read_by_type_req(0x0001, 0xFFFF, &uuid, pdu, sizeof(pdu)));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_enc_read_by_type_req);
+
+static void BM_enc_write_req(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	const uint8_t value[20] = {};
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		benchmark::DoNotOptimize(enc_write_req(0x0010, value, sizeof(value), pdu, sizeof(pdu)));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_enc_write_req);
+
+static void BM_enc_read_multi_req(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	const uint16_t handles[] = {0x0003, 0x0005, 0x0007, 0x000A, 0x000D};
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		benchmark::DoNotOptimize(enc_read_multi_req(handles, 5, false, pdu, sizeof(pdu)));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_enc_read_multi_req);
+
+static void BM_dec_read_by_type_req(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	bt_uuid_t uuid;
+	bt_uuid16_create(&uuid, GATT_CHARACTERISTIC);
+	uint16_t len = enc_read_by_type_req(0x0001, 0xFFFF, &uuid, pdu, sizeof(pdu));
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		uint16_t start, end;
+		bt_uuid_t out;
+		benchmark::DoNotOptimize(dec_read_by_type_req(pdu, len, &start, &end, &out));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_dec_read_by_type_req);
+
+static void BM_dec_read_resp(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint8_t value[20] = {};
+	uint16_t len = enc_read_resp(value, sizeof(value), pdu, sizeof(pdu));
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		uint8_t out[ATT_DEFAULT_LE_MTU];
+		benchmark::DoNotOptimize(dec_read_resp(pdu, len, out, sizeof(out)));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_dec_read_resp);
+
+static void BM_dec_write_req(benchmark::State& state)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	const uint8_t value[20] = {};
+	uint16_t len = enc_write_req(0x0010, value, sizeof(value), pdu, sizeof(pdu));
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		uint16_t handle;
+		uint8_t out[ATT_DEFAULT_LE_MTU];
+		size_t vlen;
+		benchmark::DoNotOptimize(dec_write_req(pdu, len, &handle, out, &vlen));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_dec_write_req);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Response accessors, as used by the client state machine
+//
+
+static void BM_PDUReadByTypeResponse(benchmark::State& state)
+{
+	PDUResponse p(read_by_type_rsp.data(), read_by_type_rsp.size());
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		PDUReadByTypeResponse r(p);
+		unsigned int sum=0;
+		for(int i=0; i < r.num_elements(); i++)
+			sum += r.handle(i) + *r.value(i).first;
+		benchmark::DoNotOptimize(sum);
+	}
+}
+BENCHMARK(BM_PDUReadByTypeResponse);
+
+static void BM_PDUReadGroupByTypeResponse(benchmark::State& state)
+{
+	PDUResponse p(read_by_group_rsp.data(), read_by_group_rsp.size());
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		PDUReadGroupByTypeResponse r(p);
+		unsigned int sum=0;
+		for(int i=0; i < r.num_elements(); i++)
+			sum += r.start_handle(i) + r.end_handle(i) + r.value_uint16(i);
+		benchmark::DoNotOptimize(sum);
+	}
+}
+BENCHMARK(BM_PDUReadGroupByTypeResponse);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// UUID conversion
+//
+
+static void BM_bt_string_to_uuid(benchmark::State& state)
+{
+	const char* strings[] = {"7309203e-349d-4c11-ac6b-baedd1819764", "0x2A19", "0000180f-0000-1000-8000-00805f9b34fb"};
+	AllocCounter allocs(state);
+
+	size_t i=0;
+	for(auto _: state)
+	{
+		bt_uuid_t uuid;
+		benchmark::DoNotOptimize(bt_string_to_uuid(&uuid, strings[i++ % 3]));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_bt_string_to_uuid);
+
+static void BM_bt_uuid_to_string(benchmark::State& state)
+{
+	bt_uuid_t uuids[2];
+	bt_string_to_uuid(&uuids[0], "7309203e-349d-4c11-ac6b-baedd1819764");
+	bt_uuid16_create(&uuids[1], 0x2A19);
+	AllocCounter allocs(state);
+
+	size_t i=0;
+	for(auto _: state)
+	{
+		char buf[MAX_LEN_UUID_STR];
+		benchmark::DoNotOptimize(bt_uuid_to_string(&uuids[i++ % 2], buf, sizeof(buf)));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_bt_uuid_to_string);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Attribute database
+//
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+//A database the size of a busy peripheral: state.range(0) services of
+//eight characteristics, half of which are notifiable and get a CCCD.
+static void populate(BLEAttributeDatabase& db, int services)
+{
+	for(int s=0; s < services; s++)
+	{
+		uint16_t service = db.add_primary_service(UUID(0x1800 + s));
+		for(int c=0; c < 8; c++)
+		{
+			uint8_t props = GATT_CHR_PROP_READ | (c % 2 ? GATT_CHR_PROP_NOTIFY : 0);
+			uint16_t decl = db.add_characteristic(service, UUID(0x2A00 + c), props, ATT_PERM_READ);
+			if(c % 2)
+				db.add_descriptor(decl, UUID(GATT_CLIENT_CHARACTERISTIC_CONFIGURATION), ATT_PERM_READ | ATT_PERM_WRITE);
+		}
+	}
+}
+
+static void BM_find_by_type(benchmark::State& state)
+{
+	BLEAttributeDatabase db;
+	populate(db, state.range(0));
+	UUID characteristic(GATT_CHARACTERISTIC);
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		auto r = db.find_by_type(0x0001, 0xFFFF, characteristic);
+		benchmark::DoNotOptimize(r);
+	}
+}
+BENCHMARK(BM_find_by_type)->Arg(4)->Arg(32);
+
+//The paged form used during discovery: a short range deep in the table.
+static void BM_find_by_type_range(benchmark::State& state)
+{
+	BLEAttributeDatabase db;
+	populate(db, state.range(0));
+	UUID characteristic(GATT_CHARACTERISTIC);
+	uint16_t start = db.size() / 2;
+	AllocCounter allocs(state);
+
+	for(auto _: state)
+	{
+		auto r = db.find_by_type(start, start + 20, characteristic);
+		benchmark::DoNotOptimize(r);
+	}
+}
+BENCHMARK(BM_find_by_type_range)->Arg(4)->Arg(32);
+
+#endif
+
+int main(int argc, char** argv)
+{
+	//The parsers log at Info, which would dominate the timings.
+	log_level = LogLevels::Error;
+
+	benchmark::Initialize(&argc, argv);
+	if(benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_ALLOC_STATS_H
+#define __INC_BLEPP_ALLOC_STATS_H
+
+#include <blepp/blepp_config.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace BLEPP
+{
+	/// Library subsystems that heap allocations are charged to
+	enum class AllocSubsystem : uint8_t
+	{
+		Other = 0,          ///< Outside any instrumented entry point
+		Scanner,            ///< BLEScanner and advertisement parsing
+		ClientTransport,    ///< BLEClientTransport implementations
+		StateMachine,       ///< BLEGATTStateMachine and BLEDevice
+		Server,             ///< BLEGATTServer and its transports
+		AttributeDB,        ///< BLEAttributeDatabase
+		Count
+	};
+
+	/// Allocation counters for one subsystem
+	struct AllocCounters
+	{
+		uint64_t allocations = 0;
+		uint64_t bytes = 0;
+	};
+
+	/// @return true if the library was built with WITH_ALLOC_STATS
+	bool alloc_stats_enabled();
+
+	/// Counters for a subsystem since start-up or the last reset
+	/// Always zero unless alloc_stats_enabled().
+	AllocCounters alloc_stats(AllocSubsystem subsystem);
+
+	/// Zero all counters
+	void reset_alloc_stats();
+
+	/// Printable name of a subsystem
+	const char* alloc_subsystem_name(AllocSubsystem subsystem);
+
+	/// Charges allocations made on this thread to a subsystem while in scope
+	/// Scopes nest; the innermost one wins, so attribute database work done
+	/// on behalf of the server is charged to the database.
+	class AllocScope
+	{
+	public:
+		explicit AllocScope(AllocSubsystem subsystem)
+			: previous_(current_)
+		{
+			current_ = subsystem;
+		}
+
+		~AllocScope()
+		{
+			current_ = previous_;
+		}
+
+		AllocScope(const AllocScope&) = delete;
+		AllocScope& operator=(const AllocScope&) = delete;
+
+		/// Subsystem the calling thread is currently charging
+		static AllocSubsystem current() { return current_; }
+
+	private:
+		AllocSubsystem previous_;
+		static thread_local AllocSubsystem current_;
+	};
+
+} // namespace BLEPP
+
+/// Charge allocations until the end of the enclosing block to a subsystem
+/// Compiles to nothing unless built with BLEPP_ALLOC_STATS.
+#ifdef BLEPP_ALLOC_STATS
+#define ALLOC_SCOPE(X) BLEPP::AllocScope blepp_alloc_scope_(BLEPP::AllocSubsystem::X)
+#else
+#define ALLOC_SCOPE(X) do{}while(0)
+#endif
+
+namespace BLEPP
+{
+	/// Invoke an application callback from inside an ALLOC_SCOPE
+	/// The callback's allocations are charged to AllocSubsystem::Other
+	/// rather than to the library subsystem that called it.
+	template<class F, class... Args>
+	auto call_user(F&& f, Args&&... args) -> decltype(f(std::forward<Args>(args)...))
+	{
+		ALLOC_SCOPE(Other);
+		return f(std::forward<Args>(args)...);
+	}
+
+} // namespace BLEPP
+
+#endif // __INC_BLEPP_ALLOC_STATS_H
@@ -142,6 +142,8 @@ namespace BLEPP
 #define ATT_OP_HANDLE_NOTIFY		0x1B
 #define ATT_OP_HANDLE_IND		0x1D
 #define ATT_OP_HANDLE_CNF		0x1E
+#define ATT_OP_READ_MULTI_VAR_REQ	0x20
+#define ATT_OP_READ_MULTI_VAR_RESP	0x21
 #define ATT_OP_SIGNED_WRITE_CMD		0xD2
 
 	/* Error codes for Error response PDU */
@@ -327,6 +329,8 @@ namespace BLEPP
 	uint16_t enc_write_resp(uint8_t *pdu, size_t len);
 	uint16_t dec_write_resp(const uint8_t *pdu, size_t len);
 	uint16_t enc_read_req(uint16_t handle, uint8_t *pdu, size_t len);
+	uint16_t enc_read_multi_req(const uint16_t *handles, size_t num, bool variable,
+							uint8_t *pdu, size_t len);
 	uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 			size_t len);
 	uint16_t dec_read_req(const uint8_t *pdu, size_t len, uint16_t *handle);
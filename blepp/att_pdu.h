@@ -40,6 +40,7 @@
 #include <cassert>
 #include <stdexcept>
 #include <utility>
+#include <vector>
 
 #include <blepp/att.h>
 #include <blepp/logging.h>
@@ -167,6 +168,78 @@ namespace BLEPP
 
 
 
+	/* Response to read_multiple_variable, 3.F.3.4.4.12 (Core 5.2) */
+	class PDUReadMultipleVariableResponse: public PDUResponse
+	{
+		public:
+			PDUReadMultipleVariableResponse(const PDUResponse& p_)
+			:PDUResponse(p_)
+			{
+				type_check(ATT_OP_READ_MULTI_VAR_RESP);
+
+				//Each element is a 2 byte length followed by the value. The
+				//server cuts the response at the MTU, so the last value may
+				//be short, and a length field cut in half is dropped.
+				for(int i=1; i + 2 <= length; )
+				{
+					offsets.push_back(i);
+					i += 2 + uint16(i);
+				}
+			}
+
+			int num_elements() const
+			{
+				return offsets.size();
+			}
+
+			//Length of the full value, which may exceed what was sent
+			int value_length(int i) const
+			{
+				return uint16(offsets[i]);
+			}
+
+			//Return pointer span of the ith value
+			std::pair<const uint8_t*, const uint8_t*> value(int i) const
+			{
+				const uint8_t* begin = data + offsets[i] + 2;
+				const uint8_t* end = begin + value_length(i);
+				if(end > data + length)
+					end = data + length;
+				return std::make_pair(begin, end);
+			}
+
+			//True if the ith value was cut short; the rest can be fetched
+			//with Read Blob requests
+			bool truncated(int i) const
+			{
+				return data + offsets[i] + 2 + value_length(i) > data + length;
+			}
+
+		private:
+			std::vector<int> offsets;
+	};
+
+	/* Response to read_blob, 3.F.3.4.4.6 */
+	class PDUReadBlobResponse: public PDUResponse
+	{
+		public:
+			PDUReadBlobResponse(const PDUResponse& p_)
+			:PDUResponse(p_)
+			{
+				type_check(ATT_OP_READ_BLOB_RESP);
+			}
+
+			int num_elements() const
+			{
+				return length-1;
+			}
+
+			std::pair<const uint8_t*, const uint8_t*> value() const
+			{
+				return std::make_pair(data + 1, data + length);
+			}
+	};
+
 	/* Response to read_by_type, 3.F.3.4.4.2 */
 	class PDUReadByTypeResponse: public PDUResponse
 	{
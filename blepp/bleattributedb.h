@@ -32,6 +32,7 @@
 #include <cstdint>
 #include <vector>
 #include <map>
+#include <array>
 #include <functional>
 #include <memory>
 
@@ -142,6 +143,11 @@ namespace BLEPP
 
 	/// GATT Attribute Database
 	/// Manages all services, characteristics, and descriptors
+	///
+	/// Attributes are stored in a vector sorted by handle, with a per-UUID
+	/// index of handles, so range and type queries cost O(log n + k).
+	/// Pointers returned by get_attribute() and the query functions are
+	/// invalidated when attributes are added or the database is cleared.
 	class BLEAttributeDatabase
 	{
 	public:
@@ -228,6 +234,10 @@ namespace BLEPP
 		/// Get total number of attributes
 		size_t size() const { return attributes_.size(); }
 
+		/// Layout generation, bumped whenever attributes are added or cleared
+		/// Lets callers tell when anything derived from the handle layout is stale.
+		uint32_t generation() const { return generation_; }
+
 		/// Clear all attributes
 		void clear();
 
@@ -254,8 +264,14 @@ namespace BLEPP
 		                                       const std::vector<uint8_t>& data)> cb);
 
 	private:
-		std::map<uint16_t, Attribute> attributes_;
+		/// Canonical 128-bit form of a UUID, so 16-bit and 128-bit
+		/// spellings of the same type share one index entry
+		typedef std::array<uint8_t, 16> UUIDKey;
+
+		std::vector<Attribute> attributes_;             // Sorted by handle
+		std::map<UUIDKey, std::vector<uint16_t>> type_index_; // UUID -> sorted handles
 		uint16_t next_handle_;
+		uint32_t generation_;
 
 		// Service handle tracking for end_group_handle updates
 		struct ServiceInfo {
@@ -267,6 +283,15 @@ namespace BLEPP
 		/// Allocate a new handle
 		uint16_t allocate_handle();
 
+		/// Insert an attribute in handle order and index it by UUID
+		void insert_attribute(Attribute&& attr);
+
+		/// Index key for a UUID
+		static UUIDKey uuid_key(const UUID& uuid);
+
+		/// Iterator to the first attribute with handle >= the given one
+		std::vector<Attribute>::const_iterator lower_bound(uint16_t handle) const;
+
 		/// Update service end group handle
 		void update_service_end_handle(uint16_t service_handle, uint16_t last_handle);
 
@@ -23,6 +23,9 @@
 #ifndef __INC_BLEPP_BLECLIENTTRANSPORT_H
 #define __INC_BLEPP_BLECLIENTTRANSPORT_H
 
+#include <blepp/duplicate_filter.h>
+#include <blepp/scan_filter.h>
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -54,6 +57,13 @@ namespace BLEPP
 		uint16_t window_ms = 26;        // Scan window in ms (default: 2% duty cycle)
 		FilterPolicy filter_policy = FilterPolicy::All;
 		FilterDuplicates filter_duplicates = FilterDuplicates::Software;  // Duplicate filtering mode
+		DuplicateFilterParams duplicate_filter;  // Software mode: expiry, payload change reporting, memory bound
+		ScanFilter filter;                      // Only adverts matching this are reported (default: all)
+
+		// Batching of HCI event reads (BlueZ). Once the first event has arrived,
+		// get_advertisements() keeps draining pending events until either limit is hit.
+		uint16_t max_batch = 64;          // Max HCI events per get_advertisements() call (1 = unbatched)
+		uint16_t batch_budget_us = 2000;  // Time budget for draining a batch in microseconds (0 = no limit)
 	};
 
 	/// Advertisement data received during scanning
@@ -77,6 +87,14 @@ namespace BLEPP
 		uint16_t timeout = 400;         // Supervision timeout (units of 10ms)
 	};
 
+	/// Counters for report filtering since the last start_scan()
+	struct ScanFilterStats
+	{
+		uint64_t rejected = 0;    // Dropped by ScanParams::filter
+		uint64_t reported = 0;    // Passed on to the caller
+		uint64_t suppressed = 0;  // Held back as software duplicates
+	};
+
 	/// Abstract interface for BLE client transport layer
 	/// Supports both BlueZ (HCI/L2CAP) and Nimble (ioctl) backends
 	class BLEClientTransport
@@ -161,12 +179,44 @@ namespace BLEPP
 		/// @return MAC address as string in format "XX:XX:XX:XX:XX:XX", or empty string on error
 		virtual std::string get_mac_address() const = 0;
 
+		/// Get report filtering counters; safe to call from any thread
+		/// @return Counters since the last start_scan()
+		ScanFilterStats get_scan_filter_stats() const;
+
 		// ===== Callbacks (optional, for async operation) =====
 
 		std::function<void(const AdvertisementData&)> on_advertisement;
 		std::function<void(int fd)> on_connected;
 		std::function<void(int fd)> on_disconnected;
 		std::function<void(int fd, const uint8_t* data, size_t len)> on_data_received;
+
+	protected:
+		/// Set up report filtering for a new scan; forgets every device seen
+		/// @param params Scan parameters
+		void reset_report_filter(const ScanParams& params);
+
+		/// Decide whether to report an advert: apply ScanParams::filter, then
+		/// software duplicate filtering. Transports call this on the raw
+		/// report, before anything is copied out of the controller's event,
+		/// so that filtering happens in exactly one place. Not thread
+		/// safe; transports that take reports on several threads serialise calls.
+		/// @param address Packed address, as from pack_address()
+		/// @param address_type 0 = public, 1 = random
+		/// @param event_type Advertising event type (ADV_IND, SCAN_RSP, etc.)
+		/// @param rssi Received signal strength in dBm
+		/// @param data AD payload
+		/// @param len Length of the payload
+		/// @return true if the advert should be reported
+		bool accept_report(uint64_t address, uint8_t address_type, uint8_t event_type,
+		                   int8_t rssi, const uint8_t* data, size_t len);
+
+	private:
+		ScanFilter scan_filter_;
+		ScanParams::FilterDuplicates filter_duplicates_ = ScanParams::FilterDuplicates::Off;
+		DuplicateFilter seen_devices_;  // Software duplicate filtering
+		std::atomic<uint64_t> rejected_{0};
+		std::atomic<uint64_t> reported_{0};
+		std::atomic<uint64_t> suppressed_{0};
 	};
 
 	/// Factory function to create appropriate transport based on build configuration
@@ -24,6 +24,7 @@
 #define __INC_LIBATTGATT_BLEDEVICE_H
 
 #include <cstdint>
+#include <deque>
 #include <vector>
 #include <string>
 #include <blepp/att_pdu.h>
@@ -47,9 +48,26 @@ namespace BLEPP
 
 		//template<class C> void test_fd_(int fd, int line);
 		void test_pdu(int len);
+
+		//Write a PDU without blocking. Returns the length written, 0 if the
+		//socket was full and the PDU is held back for flush_pending(), or
+		//-1 on error.
+		int write_pdu(const std::uint8_t* data, int len);
+
+		//Send the PDUs held back by write_pdu(), in order. Returns true once
+		//none are left, false if the socket filled up again. Errors throw
+		//WriteError.
+		bool flush_pending();
+		bool has_pending() const
+		{
+			return !pending.empty();
+		}
+		std::deque<std::vector<std::uint8_t>> pending;
 		BLEDevice(const int& sock_);
 
 		void send_read_request(std::uint16_t handle);
+		void send_read_blob_request(std::uint16_t handle, std::uint16_t offset);
+		void send_read_multiple(const std::uint16_t* handles, int num, bool variable_length=true);
 		void send_read_by_type(const bt_uuid_t& uuid, std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
 		void send_find_information(std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
 		void send_read_group_by_type(const bt_uuid_t& uuid, std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
@@ -58,6 +76,11 @@ namespace BLEPP
 		void send_handle_value_confirmation();
 		void send_write_command(std::uint16_t handle, const std::uint8_t* data, int length);
 		void send_write_command(std::uint16_t handle, std::uint16_t data);
+
+		//Send a write command without blocking. Returns 1 if it was sent and 0
+		//if the socket is full or PDUs are held back; other errors throw
+		//WriteError.
+		int try_send_write_command(std::uint16_t handle, const std::uint8_t* data, int length);
 		void process_att_mtu_request(PDUResponse &req_pdu);
 		void process_att_mtu_response(PDUResponse &resp_pdu);
 		PDUResponse receive(std::uint8_t* buf, int max);
@@ -30,22 +30,76 @@
 #include <blepp/bletransport.h>
 #include <blepp/bleattributedb.h>
 #include <blepp/gatt_services.h>
+#include <blepp/gatt_metrics.h>
+#include <blepp/peer_quirks.h>
+#include <blepp/prepared_write.h>
+#include <blepp/timer_wheel.h>
 #include <memory>
 #include <map>
+#include <set>
 #include <mutex>
 #include <functional>
 #include <chrono>
+#include <deque>
+#include <tuple>
 
 namespace BLEPP
 {
+	/// How a queued indication ended
+	enum class IndicationResult
+	{
+		Confirmed,     ///< The client sent a Handle Value Confirmation
+		Timeout,       ///< No confirmation within the timeout
+		Dropped,       ///< Pushed out of a full queue, or the transport refused or evicted it
+		Superseded,    ///< Replaced by a newer value for the same handle before being sent
+		Disconnected   ///< The connection closed first
+	};
+
+	/// Called once for every indication accepted by BLEGATTServer::indicate()
+	typedef std::function<void(uint16_t conn_handle, uint16_t char_val_handle,
+	                           IndicationResult result)> IndicationCallback;
+
+	/// What indicate() does with a new value when a connection's queue is full
+	enum class IndicationOverflow
+	{
+		Reject,        ///< Refuse the new value
+		DropOldest,    ///< Drop the oldest value not yet sent
+		Coalesce       ///< Replace any unsent value for the same handle; refuse if there is none
+	};
+
+	/// Indication flow control settings
+	struct IndicationParams
+	{
+		size_t max_depth = 8;              ///< Indications queued per connection, including the one in flight
+		IndicationOverflow overflow = IndicationOverflow::Reject;
+		unsigned int timeout_ms = 30000;   ///< ATT transaction timeout
+	};
+
+	/// An indication waiting to be sent or confirmed
+	struct PendingIndication
+	{
+		uint16_t char_val_handle;
+		std::vector<uint8_t> value;
+		IndicationCallback on_complete;
+	};
+
 	/// Per-connection state for GATT server
 	struct ConnectionState
 	{
 		uint16_t conn_handle;
+		std::string peer_address;
+		uint8_t peer_address_type;
 		uint16_t mtu;                              ///< Negotiated MTU (default 23)
 		std::map<uint16_t, uint16_t> cccd_values;  ///< CCCD values per characteristic
 		bool connected;
 		std::chrono::steady_clock::time_point connection_time;  ///< When connection was established
+		PeerQuirks quirks;                         ///< Workarounds chosen by the quirk policy
+		PreparedWriteQueue prepared_writes;        ///< Prepare Write values awaiting Execute
+		std::map<uint16_t, std::vector<uint8_t>> coalesced; ///< Latest unsent notification PDU per coalesced handle
+		std::deque<PendingIndication> indications; ///< Front is in flight while indication_in_flight
+		bool indication_in_flight = false;
+		uint32_t indication_seq = 0;               ///< Identifies the in-flight indication to its timeout
+		TimerWheel::TimerId indication_timer = 0;  ///< Timeout of the in-flight indication
 	};
 
 	/// BLE GATT Server
@@ -99,13 +153,41 @@ namespace BLEPP
 		int notify(uint16_t conn_handle, uint16_t char_val_handle,
 		          const std::vector<uint8_t>& data);
 
+		/// Coalesce notifications for a characteristic (last value wins)
+		/// While the transport cannot take more, a notification on a coalesced
+		/// handle only replaces the connection's pending value for it, and the
+		/// latest value is sent once there is room. Replaced values are counted
+		/// as superseded in metrics().
+		/// @param char_val_handle Characteristic value handle
+		/// @param enable true to coalesce, false to send every value (default)
+		void set_notify_coalescing(uint16_t char_val_handle, bool enable);
+
+		/// Send a notification to every client subscribed to a characteristic
+		/// The PDU is built once and sent to each subscriber under a single
+		/// lock, using the subscriber index kept up to date by CCCD writes.
+		/// @param char_val_handle Characteristic value handle
+		/// @param data Notification data
+		/// @return Number of connections the notification was sent to, or held back for
+		int notify_all(uint16_t char_val_handle, const std::vector<uint8_t>& data);
+
 		/// Send indication to a client (with acknowledgment)
+		/// Only one indication per connection is outstanding at a time;
+		/// the rest wait in a queue and are sent as confirmations arrive.
 		/// @param conn_handle Connection handle
 		/// @param char_val_handle Characteristic value handle
 		/// @param data Indication data
-		/// @return 0 on success, negative on error
+		/// @param on_complete Called once the indication is confirmed or given up on
+		/// @return 0 if sent or queued, negative on error or if the queue is full
 		int indicate(uint16_t conn_handle, uint16_t char_val_handle,
-		            const std::vector<uint8_t>& data);
+		            const std::vector<uint8_t>& data,
+		            IndicationCallback on_complete = nullptr);
+
+		/// Set queue depth, overflow policy and timeout for indications
+		/// Applies to indications queued from now on.
+		void set_indication_params(const IndicationParams& params);
+
+		/// Number of indications queued on a connection, including the one in flight
+		size_t pending_indications(uint16_t conn_handle);
 
 		/// Disconnect a client
 		/// @param conn_handle Connection handle
@@ -117,6 +199,25 @@ namespace BLEPP
 		/// @return Pointer to connection state, or nullptr if not found
 		ConnectionState* get_connection_state(uint16_t conn_handle);
 
+		/// Drop all cached discovery responses
+		/// The cache notices changes to the database layout by itself; call
+		/// this after changing service or declaration values in place.
+		void invalidate_discovery_cache();
+
+		/// Limit the memory used by Prepare Write Requests
+		/// Requests beyond either limit are refused with Prepare Queue Full.
+		/// @param pool_bytes Total value bytes queued across all connections
+		/// @param per_connection_bytes Value bytes one connection may queue
+		/// @return 0 on success, -1 if prepared writes are currently queued
+		int set_prepared_write_limits(size_t pool_bytes, size_t per_connection_bytes);
+
+		/// Request, callback and per-connection traffic counters
+		/// Off until metrics().set_enabled(true). Use metrics().snapshot()
+		/// to read them, or metrics().prometheus() for the Prometheus text
+		/// format.
+		GATTServerMetrics& metrics() { return metrics_; }
+		const GATTServerMetrics& metrics() const { return metrics_; }
+
 		/// Callbacks
 
 		/// Called when a client connects
@@ -128,6 +229,10 @@ namespace BLEPP
 		/// Called when MTU is exchanged
 		std::function<void(uint16_t conn_handle, uint16_t mtu)> on_mtu_exchanged;
 
+		/// Chooses per-peer workarounds (default: default_peer_quirk_policy())
+		/// Set before clients connect; an empty policy applies no quirks.
+		PeerQuirkPolicy quirk_policy;
+
 	private:
 		std::unique_ptr<BLETransport> transport_;
 		BLEAttributeDatabase db_;
@@ -135,9 +240,58 @@ namespace BLEPP
 		std::mutex connections_mutex_;
 		std::map<uint16_t, ConnectionState> connections_;
 
+		/// Connections with notifications enabled, by characteristic value
+		/// handle (guarded by connections_mutex_)
+		std::map<uint16_t, std::vector<uint16_t>> notify_subscribers_;
+
+		IndicationParams indication_params_;   ///< Guarded by connections_mutex_
+
+		/// Handles whose notifications are coalesced (guarded by connections_mutex_)
+		std::set<uint16_t> coalesced_handles_;
+
 		bool running_;
 		std::mutex running_mutex_;
 
+		/// Deferred work run from the event loop
+		TimerWheel timers_;
+
+		/// Storage for every connection's prepared writes (guarded by connections_mutex_)
+		PreparedWritePool prepared_write_pool_;
+		size_t prepared_write_max_bytes_;
+
+		/// Identifies a discovery request whose response depends only on
+		/// the database layout
+		struct DiscoveryCacheKey
+		{
+			uint8_t opcode;
+			uint16_t start_handle;
+			uint16_t end_handle;
+			uint16_t mtu;
+			std::vector<uint8_t> type;   ///< Raw type UUID, plus the value for Find By Type Value
+
+			bool operator<(const DiscoveryCacheKey& o) const
+			{
+				return std::tie(opcode, start_handle, end_handle, mtu, type)
+				     < std::tie(o.opcode, o.start_handle, o.end_handle, o.mtu, o.type);
+			}
+		};
+
+		/// Upper bound on cached responses; the cache is flushed when exceeded
+		static const size_t discovery_cache_max_entries = 256;
+
+		std::mutex discovery_cache_mutex_;
+		std::map<DiscoveryCacheKey, std::vector<uint8_t>> discovery_cache_;
+		uint32_t discovery_cache_generation_;   ///< db_.generation() the cache was built from
+
+		GATTServerMetrics metrics_;
+
+		/// Look up a cached discovery response
+		/// @return true and fills rsp if the response is cached and current
+		bool find_cached_response(const DiscoveryCacheKey& key, std::vector<uint8_t>& rsp);
+
+		/// Remember a discovery response for later requests
+		void cache_response(const DiscoveryCacheKey& key, const std::vector<uint8_t>& rsp);
+
 		// ATT PDU handlers
 
 		/// Handle incoming ATT PDU
@@ -164,6 +318,9 @@ namespace BLEPP
 		/// Handle Read Blob Request (0x0C)
 		void handle_read_blob_req(uint16_t conn_handle, const uint8_t* pdu, size_t len);
 
+		/// Handle Read Multiple (0x0E) and Read Multiple Variable (0x20) Requests
+		void handle_read_multiple_req(uint16_t conn_handle, const uint8_t* pdu, size_t len);
+
 		/// Handle Read By Group Type Request (0x10)
 		void handle_read_by_group_type_req(uint16_t conn_handle, const uint8_t* pdu, size_t len);
 
@@ -177,8 +334,18 @@ namespace BLEPP
 		void handle_prepare_write_req(uint16_t conn_handle, const uint8_t* pdu, size_t len);
 
 		/// Handle Execute Write Request (0x18)
+		/// The queued writes are applied all or nothing: if a write callback
+		/// fails, the writes already applied are rolled back.
 		void handle_execute_write_req(uint16_t conn_handle, const uint8_t* pdu, size_t len);
 
+		/// Undo an Execute Write whose write callback failed
+		/// @param targets Attributes in the order they were written
+		/// @param previous Their values before the Execute Write
+		/// @param failed Index of the write that failed
+		void rollback_execute_write(uint16_t conn_handle, const std::vector<Attribute*>& targets,
+		                            const std::vector<std::vector<uint8_t>>& previous,
+		                            size_t failed);
+
 		/// Handle Signed Write Command (0xD2)
 		void handle_signed_write_cmd(uint16_t conn_handle, const uint8_t* pdu, size_t len);
 
@@ -192,27 +359,51 @@ namespace BLEPP
 		void send_error_response(uint16_t conn_handle, uint8_t opcode,
 		                        uint16_t handle, uint8_t error_code);
 
+		/// Build an ATT Error Response PDU
+		static std::vector<uint8_t> error_pdu(uint8_t opcode, uint16_t handle,
+		                                      uint8_t error_code);
+
 		/// Send MTU Exchange Response
 		void send_mtu_exchange_rsp(uint16_t conn_handle, uint16_t server_mtu);
 
-		/// Send Find Information Response
-		void send_find_info_rsp(uint16_t conn_handle,
-		                       const std::vector<const Attribute*>& attrs);
+		/// Build Find Information Response
+		void build_find_info_rsp(uint16_t mtu,
+		                        const std::vector<const Attribute*>& attrs,
+		                        std::vector<uint8_t>& rsp);
 
-		/// Send Read By Type Response
-		void send_read_by_type_rsp(uint16_t conn_handle,
-		                          const std::vector<const Attribute*>& attrs);
+		/// Build Read By Type Response
+		void build_read_by_type_rsp(uint16_t conn_handle, uint16_t mtu,
+		                           const std::vector<const Attribute*>& attrs,
+		                           std::vector<uint8_t>& rsp);
 
-		/// Send Read Response
-		void send_read_rsp(uint16_t conn_handle, const std::vector<uint8_t>& value);
+		/// Send Read Response, or Read Blob Response if given its opcode
+		void send_read_rsp(uint16_t conn_handle, const std::vector<uint8_t>& value,
+		                   uint8_t opcode = 0x0B);
 
-		/// Send Read By Group Type Response
-		void send_read_by_group_type_rsp(uint16_t conn_handle,
-		                                const std::vector<const Attribute*>& attrs);
+		/// Build Read By Group Type Response
+		void build_read_by_group_type_rsp(uint16_t mtu,
+		                                 const std::vector<const Attribute*>& attrs,
+		                                 std::vector<uint8_t>& rsp);
+
+		/// Build Find By Type Value Response
+		void build_find_by_type_value_rsp(uint16_t mtu,
+		                                 const std::vector<const Attribute*>& attrs,
+		                                 std::vector<uint8_t>& rsp);
 
 		/// Send Write Response
 		void send_write_rsp(uint16_t conn_handle);
 
+		/// Send a PDU through the transport and count it
+		/// @return Transport result, negative on error
+		int send_pdu(uint16_t conn_handle, const uint8_t* data, size_t len);
+
+		/// Send a PDU now, or from the event loop once delay_ms has passed
+		/// @param conn_handle Connection handle
+		/// @param pdu PDU data
+		/// @param delay_ms Delay in milliseconds (0 = send immediately)
+		void send_pdu_deferred(uint16_t conn_handle, std::vector<uint8_t>&& pdu,
+		                       uint16_t delay_ms);
+
 		// Helper methods
 
 		/// Handle CCCD write
@@ -222,6 +413,34 @@ namespace BLEPP
 		void handle_cccd_write(uint16_t conn_handle, uint16_t cccd_handle,
 		                      uint16_t value);
 
+		/// Send a notification PDU, or hold it back if its handle is coalesced
+		/// and the transport has no room. Caller holds connections_mutex_.
+		/// @return Transport result, or 0 if the value was held back
+		int send_notification(ConnectionState& conn, uint16_t char_val_handle,
+		                      const std::vector<uint8_t>& pdu);
+
+		/// Send a connection's held-back notifications while the transport
+		/// has room. Runs when the transport reports room (on_tx_ready), so
+		/// anything still left waits for the next report.
+		void flush_coalesced(uint16_t conn_handle);
+
+		/// Indication callbacks to run once connections_mutex_ is released
+		typedef std::vector<std::function<void()>> DeferredCalls;
+
+		/// Send the indication at the front of a connection's queue, if none is in flight
+		/// Caller holds connections_mutex_.
+		void send_next_indication(ConnectionState& conn, DeferredCalls& done);
+
+		/// Handle Handle Value Confirmation (0x1E)
+		void handle_indication_confirm(uint16_t conn_handle);
+
+		/// Give up on an indication that was never confirmed
+		void indication_timeout(uint16_t conn_handle, uint32_t seq);
+
+		/// Drop a connection from a characteristic's notification subscribers
+		/// Caller holds connections_mutex_.
+		void remove_notify_subscriber(uint16_t char_val_handle, uint16_t conn_handle);
+
 		/// Invoke attribute read callback if present
 		/// @param attr Attribute
 		/// @param conn_handle Connection handle
@@ -244,6 +463,8 @@ namespace BLEPP
 		void on_transport_disconnected(uint16_t conn_handle);
 		void on_transport_data_received(uint16_t conn_handle,
 		                               const uint8_t* data, size_t len);
+		void on_transport_pdu_dropped(uint16_t conn_handle,
+		                             const uint8_t* data, size_t len);
 	};
 
 } // namespace BLEPP
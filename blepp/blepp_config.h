@@ -55,6 +55,13 @@
 // #define BLEPP_SERVER_SUPPORT
 #endif
 
+// Count heap allocations per library subsystem (see blepp/alloc_stats.h)
+// Replaces the global operator new, so only enable it for profiling builds
+//
+#ifndef BLEPP_ALLOC_STATS
+// #define BLEPP_ALLOC_STATS
+#endif
+
 // ===== Validation =====
 
 // Require at least one transport
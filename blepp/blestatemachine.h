@@ -23,8 +23,10 @@
  */
 
 #include <vector>
+#include <deque>
 #include <stdexcept>
 #include <functional>
+#include <chrono>
 #include <cstring>
 
 #include <blepp/logging.h>
@@ -142,6 +144,7 @@ namespace BLEPP
 		GetClientCharaceristicConfiguration,
 		AwaitingWriteResponse,
 		AwaitingReadResponse,
+		AwaitingReadMultipleResponse,
 	};
 
 	static const int Waiting=-1;
@@ -220,9 +223,11 @@ namespace BLEPP
 		void set_notify_and_indicate(bool , bool, WriteType type=WriteType::Request );
 		std::function<void(const PDUNotificationOrIndication&)> cb_notify_or_indicate;
 		std::function<void(const PDUReadResponse&)> cb_read;
+		std::function<void(const std::uint8_t* begin, const std::uint8_t* end)> cb_read_multiple;
 
 		void write_request(const uint8_t* data, int length);
 		void write_command(const uint8_t* data, int length);
+		void stream_write_command(const uint8_t* data, size_t length);
 		void read_request();
 
 		// Shortcuts for writing values without explicitly using sizeof and pointer cast.
@@ -265,6 +270,21 @@ namespace BLEPP
 	};
 
 
+	//Progress of a stream_write_command() transfer
+	struct WriteStreamStats
+	{
+		size_t total_bytes=0;
+		size_t bytes_sent=0;
+		size_t packets=0;
+		size_t stalls=0;     //Times the socket was full and the stream waited
+		double seconds=0;
+
+		double bytes_per_second() const
+		{
+			return seconds > 0 ? bytes_sent / seconds : 0;
+		}
+	};
+
 	struct ServiceInfo
 	{
 		std::string name, id;
@@ -325,6 +345,38 @@ namespace BLEPP
 			int next_handle_to_read=-1;
 			uint16_t read_req_handle=-1;
 			int last_request=-1;
+
+			//Handles still to be read by read_multiple(), and how many of
+			//them the request in flight covers.
+			std::vector<std::uint16_t> read_multiple_handles;
+			size_t read_multiple_batch=0;
+			bool read_multiple_variable_supported=true;
+
+			//A value cut short at the MTU is completed with Read Blob
+			//requests. This holds what has arrived so far for the first
+			//handle, and its full length if the server gave one (else 0).
+			bool read_multiple_blob=false;
+			std::vector<std::uint8_t> read_multiple_partial;
+			size_t read_multiple_length=0;
+
+			//Requests issued while another is outstanding, in order, and the
+			//completion callbacks of the request in flight.
+			std::deque<std::function<void()>> request_queue;
+			std::function<void(const PDUReadResponse&)> read_done;
+			std::function<void()> write_done;
+
+			//Write command stream in progress
+			struct WriteStream
+			{
+				bool active=false;
+				uint16_t handle=0;
+				std::vector<std::uint8_t> data;
+				size_t offset=0;
+				WriteStreamStats stats;
+				std::chrono::steady_clock::time_point start;
+			} stream;
+
+			void pump_stream();
 			
 			std::vector<std::uint8_t> buf;
 
@@ -338,6 +390,12 @@ namespace BLEPP
 			void reset();
 			void state_machine_write();
 			void unexpected_error(const PDUErrorResponse&);
+			bool queue_if_busy(std::function<void()> issue);
+			void start_next_request();
+			void dispatch_read_multiple(uint16_t handle, const std::uint8_t* begin, const std::uint8_t* end);
+			void read_multiple_start_blob(const std::uint8_t* begin, const std::uint8_t* end, size_t length);
+			void read_multiple_finish_blob();
+			void read_multiple_continue();
 			void fail(Disconnect);
 			Characteristic* characteristic_of_handle(uint16_t handle);
 			void close_and_cleanup();
@@ -355,6 +413,10 @@ namespace BLEPP
 			std::function<void()> cb_write_response = buggerall;
 			std::function<void(Characteristic&, const PDUNotificationOrIndication&)> cb_notify_or_indicate;
 			std::function<void(Characteristic&, const PDUReadResponse&)> cb_read;
+			std::function<void(Characteristic&, const std::uint8_t* begin, const std::uint8_t* end)> cb_read_multiple;
+			std::function<void()> cb_read_multiple_done = buggerall;
+			std::function<void(const WriteStreamStats&)> cb_stream_progress;
+			std::function<void(const WriteStreamStats&)> cb_stream_complete;
 
 
 			BLEGATTStateMachine(size_t bufsize=128);
@@ -366,8 +428,17 @@ namespace BLEPP
 			void connect(const std::string& addresa, bool blocking, bool pubaddr = true, std::string device = "");
 			void close();
 
+			//Take over an already connected ATT socket, such as the fd
+			//returned by BLEClientTransport::connect(). The state machine
+			//owns it from then on and closes it in close().
+			void attach(int fd);
+
 			int socket();
 		
+			//True when the caller should wait for the socket to become
+			//writable and then call write_and_process_next(): while
+			//connecting, while a write stream is waiting for room, and
+			//while PDUs are held back because the socket was full.
 			bool wait_on_write();
 			
 			bool is_idle()
@@ -375,9 +446,44 @@ namespace BLEPP
 				return state == Idle;
 			}
 			
-			void send_write_request(uint16_t handle, const uint8_t* data, int length);
+			//Requests issued while another is outstanding are queued and sent
+			//as soon as the previous response arrives, before any callbacks run.
+			//A completion callback, if given, replaces cb_read/cb_write_response
+			//for that request. Write commands are never queued.
+			void send_write_request(uint16_t handle, const uint8_t* data, int length, std::function<void()> on_written = nullptr);
 			void send_write_command(uint16_t handle, const uint8_t* data, int length);
-			void send_read_request(uint16_t handle);
+
+			//Send a large buffer as a series of MTU-3 sized write commands.
+			//The data is copied. Packets go out with non-blocking writes until
+			//the socket is full, then the stream waits for wait_on_write() /
+			//write_and_process_next(). cb_stream_progress is called whenever
+			//the stream stalls and cb_stream_complete when the last packet
+			//is sent. Only one stream may run at a time.
+			void stream_write_command(uint16_t handle, const uint8_t* data, size_t length);
+			void cancel_stream();
+			bool stream_active() const
+			{
+				return stream.active;
+			}
+
+			void send_read_request(uint16_t handle, std::function<void(const PDUReadResponse&)> on_read = nullptr);
+
+			//Number of requests waiting behind the one in flight
+			size_t queued_requests() const
+			{
+				return request_queue.size();
+			}
+
+			//Read several values using as few round trips as possible. Handles
+			//are packed into Read Multiple Variable Length requests as densely
+			//as the MTU allows. Each value is passed to cb_read_multiple (on the
+			//characteristic if set, else on the state machine), then
+			//cb_read_multiple_done is called. A value cut short at the MTU is
+			//completed with Read Blob requests before it is passed on. Servers
+			//without Read Multiple Variable support are read one handle at a
+			//time instead.
+			void read_multiple(const std::vector<uint16_t>& handles);
+			void read_multiple(const std::vector<Characteristic*>& characteristics);
 
 			void read_primary_services();
 			void find_all_characteristics();
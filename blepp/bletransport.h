@@ -67,7 +67,7 @@ namespace BLEPP
 	{
 		uint16_t conn_handle;
 		std::string peer_address;
-		uint8_t peer_address_type;
+		uint8_t peer_address_type = 0;
 		uint16_t mtu = 23;  // Default ATT MTU
 	};
 
@@ -132,6 +132,27 @@ namespace BLEPP
 		/// @return 0 on success, negative error code on failure
 		virtual int process_events() = 0;
 
+		/// Wait for transport activity and dispatch it
+		/// Accepts pending connections and delivers received PDUs via the
+		/// callbacks. The default implementation polls accept_connection()
+		/// and process_events() and then sleeps for up to 10 ms; transports
+		/// with pollable descriptors override this to block until ready.
+		/// @param timeout_ms Maximum time to wait (-1 = no limit)
+		/// @return 0 or number of events handled on success, negative error code on failure
+		virtual int wait_events(int timeout_ms);
+
+		/// Interrupt a wait_events() call in progress on another thread
+		virtual void wakeup() {}
+
+		/// Check whether a connection can take another PDU right now
+		/// Used to pace traffic the server is free to hold back, such as
+		/// coalesced notifications. The default assumes it always can.
+		/// A transport that returns false must call on_tx_ready once the
+		/// connection has room again.
+		/// @param conn_handle Connection handle
+		/// @return true if send_pdu() would neither block nor queue behind a backlog
+		virtual bool can_send(uint16_t /*conn_handle*/) const { return true; }
+
 		// Callbacks
 
 		/// Called when a client connects
@@ -145,6 +166,16 @@ namespace BLEPP
 
 		/// Called when MTU changes
 		std::function<void(uint16_t conn_handle, uint16_t mtu)> on_mtu_changed;
+
+		/// Called when a PDU that send_pdu() accepted is dropped unsent,
+		/// e.g. evicted from a full transmit queue. Delivered from the
+		/// event loop with no transport locks held.
+		std::function<void(uint16_t conn_handle, const uint8_t* data, size_t len)> on_pdu_dropped;
+
+		/// Called when a connection for which can_send() returned false
+		/// can take PDUs again. Delivered from the event loop with no
+		/// transport locks held.
+		std::function<void(uint16_t conn_handle)> on_tx_ready;
 	};
 
 	/// Factory function to create appropriate server transport based on build configuration
@@ -29,7 +29,6 @@
 
 #include <blepp/bleclienttransport.h>
 #include <map>
-#include <set>
 
 namespace BLEPP
 {
@@ -75,7 +74,7 @@ namespace BLEPP
 		bool scanning_;
 		ScanParams scan_params_;
 
-		std::set<std::string> seen_devices_;  // For duplicate filtering
+		std::vector<uint8_t> rx_buf_;         // Receive buffers for batched HCI reads
 		std::map<int, ConnectionInfo> connections_;
 		mutable std::string mac_address_;  // Cached BLE MAC address
 
@@ -84,6 +83,8 @@ namespace BLEPP
 		int set_scan_parameters(const ScanParams& params);
 		int set_scan_enable(bool enable, bool filter_duplicates);
 		int read_hci_events(std::vector<AdvertisementData>& ads, int timeout_ms);
+		int drain_hci_events(std::vector<AdvertisementData>& ads);
+		int handle_hci_event(const uint8_t* buf, size_t len, std::vector<AdvertisementData>& ads);
 		int parse_advertising_report(const uint8_t* data, size_t len, std::vector<AdvertisementData>& ads);
 	};
 
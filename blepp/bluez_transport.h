@@ -28,8 +28,11 @@
 #ifdef BLEPP_SERVER_SUPPORT
 
 #include <blepp/bletransport.h>
+#include <blepp/tx_queue.h>
 #include <map>
+#include <set>
 #include <memory>
+#include <mutex>
 
 namespace BLEPP
 {
@@ -63,6 +66,17 @@ namespace BLEPP
 
 		int process_events() override;
 
+		int wait_events(int timeout_ms) override;
+		void wakeup() override;
+
+		bool can_send(uint16_t conn_handle) const override;
+
+		/// Transmit queue counters for a connection
+		TxQueueStats tx_stats(uint16_t conn_handle) const;
+
+		/// Cap the bytes held in transmit queues across all connections
+		void set_tx_queue_limit(size_t max_bytes);
+
 	private:
 		struct Connection
 		{
@@ -75,11 +89,21 @@ namespace BLEPP
 		int hci_dev_id_;
 		int hci_fd_;                // HCI socket for advertising control
 		int l2cap_listen_fd_;       // L2CAP listening socket (CID 4 - ATT)
+		int epoll_fd_;              // Reactor for the listen, connection and wakeup fds
+		int wakeup_fd_;             // eventfd used to interrupt wait_events()
 		bool advertising_;
 		uint16_t next_conn_handle_;
 
 		std::map<uint16_t, Connection> connections_;
 
+		/// PDUs waiting for room in a connection's socket (guarded by tx_mutex_)
+		TxQueue tx_queue_;
+		mutable std::mutex tx_mutex_;
+
+		/// Connections can_send() turned away, to be told when they have
+		/// room through on_tx_ready (guarded by tx_mutex_)
+		mutable std::set<uint16_t> tx_waiting_;
+
 		// Helper methods
 
 		/// Send SSV6158 vendor command to enable ACL/Event routing
@@ -111,6 +135,32 @@ namespace BLEPP
 		int build_scan_response_data(const AdvertisingParams& params,
 		                            uint8_t* data, uint8_t* len);
 
+		/// Create the epoll reactor and register the listen and wakeup fds
+		int setup_reactor();
+
+		/// Receive one PDU from a connection and pass it to on_data_received
+		void service_connection(uint16_t conn_handle);
+
+		/// Write one PDU without blocking
+		/// @return Bytes written, 0 if the socket is full, negative on error
+		static int write_pdu(int fd, const uint8_t* data, size_t len);
+
+		/// Write queued PDUs for a connection and watch for writability
+		/// while any are left. Caller holds tx_mutex_.
+		void flush_tx(const Connection& conn);
+
+		/// Watch a connection for writability while it has queued PDUs
+		/// or is waiting for on_tx_ready. Caller holds tx_mutex_.
+		void watch_tx(const Connection& conn, bool queued) const;
+
+		/// Call on_tx_ready for waiting connections that have room again.
+		/// Caller must not hold tx_mutex_.
+		void report_tx_ready();
+
+		/// Pass PDUs the transmit queue dropped to on_pdu_dropped.
+		/// Caller must not hold tx_mutex_.
+		void report_dropped();
+
 		/// Accept connection on L2CAP socket
 		int accept_l2cap_connection();
 
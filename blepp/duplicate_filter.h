@@ -0,0 +1,134 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef __INC_BLEPP_DUPLICATE_FILTER_H
+#define __INC_BLEPP_DUPLICATE_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Software duplicate filter configuration
+	struct DuplicateFilterParams
+	{
+		/// Let a device report again once this long has passed since it
+		/// last did (0 = report each device once per scan)
+		uint32_t ttl_ms = 0;
+
+		/// Most devices tracked at once. When full, devices not heard
+		/// from for longest are forgotten and will report again.
+		size_t max_entries = 4096;
+
+		/// Also report an advert whose payload differs from the last
+		/// one reported for the device
+		bool report_payload_changes = false;
+
+		/// Also report an advert whose RSSI has moved at least this far
+		/// from the last one reported for the device (0 = ignore RSSI)
+		uint8_t rssi_delta = 0;
+	};
+
+	/// RSSI value meaning the controller could not measure it
+	static const int8_t rssi_unavailable = 127;
+
+	/// Duplicate filter for scan results
+	///
+	/// Devices are keyed by packed 48-bit address, address type and
+	/// advertising event type, in an open-addressing hash table sized
+	/// from max_entries, so lookups are constant time and memory stays
+	/// bounded however long a scan runs. Each entry keeps a 64-bit hash
+	/// of the payload and the RSSI last reported, so that with
+	/// report_payload_changes and rssi_delta only adverts that say
+	/// something new get through. Not thread safe.
+	class DuplicateFilter
+	{
+	public:
+		explicit DuplicateFilter(const DuplicateFilterParams& params = DuplicateFilterParams());
+
+		/// Change the configuration; forgets every device
+		void set_params(const DuplicateFilterParams& params);
+
+		const DuplicateFilterParams& params() const { return params_; }
+
+		/// Decide whether to report an advert, and remember it if so
+		/// @param address Packed address, as from pack_address()
+		/// @param address_type 0 = public, 1 = random
+		/// @param event_type Advertising event type (ADV_IND, SCAN_RSP, etc.)
+		/// @param rssi Received signal strength in dBm
+		/// @param data AD payload
+		/// @param len Length of the payload
+		/// @param now_ms Monotonic time in milliseconds
+		/// @return true if the advert should be reported
+		bool check(uint64_t address, uint8_t address_type, uint8_t event_type, int8_t rssi,
+		           const uint8_t* data, size_t len, uint64_t now_ms);
+
+		/// As above, timed with the steady clock
+		bool check(uint64_t address, uint8_t address_type, uint8_t event_type, int8_t rssi,
+		           const uint8_t* data, size_t len);
+
+		/// Forget every device
+		void clear();
+
+		/// Number of devices tracked
+		size_t size() const { return size_; }
+
+		/// Adverts passed since construction or the last set_params()
+		uint64_t reported() const { return reported_; }
+
+		/// Adverts held back since construction or the last set_params()
+		uint64_t suppressed() const { return suppressed_; }
+
+		/// 64-bit FNV-1a hash of an advert payload
+		static uint64_t payload_hash(const uint8_t* data, size_t len);
+
+	private:
+		struct Entry
+		{
+			uint64_t key;           // 0 marks an empty slot
+			uint64_t last_report_ms;
+			uint64_t last_seen_ms;  // Last advert, reported or not
+			uint64_t payload_hash;
+			int8_t rssi;
+		};
+
+		/// Slot holding key, or the empty slot where it belongs
+		size_t find(uint64_t key) const;
+
+		/// Make room for one more device: drop expired devices, then if
+		/// that is not enough, the half not heard from for longest
+		void make_room(uint64_t now_ms);
+
+		/// Put back the entries that survive a sweep
+		void rebuild(const std::vector<Entry>& keep);
+
+		DuplicateFilterParams params_;
+		std::vector<Entry> table_;
+		size_t mask_;
+		size_t size_;
+		uint64_t reported_;
+		uint64_t suppressed_;
+	};
+
+} // namespace BLEPP
+
+#endif // __INC_BLEPP_DUPLICATE_FILTER_H
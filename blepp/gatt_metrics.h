@@ -0,0 +1,199 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_GATT_METRICS_H
+#define __INC_BLEPP_GATT_METRICS_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Log-linear latency histogram in the style of HdrHistogram
+	/// Values below 16ns are counted exactly. Every power of two above
+	/// that is split into 16 equal buckets, so a recorded value is known
+	/// to within 1/16 (about 6%). Buckets are allocated only up to the
+	/// largest value seen, and values over about 68s are clamped.
+	class LatencyHistogram
+	{
+	public:
+		LatencyHistogram();
+
+		/// Record one sample
+		/// @param ns Latency in nanoseconds
+		void record(uint64_t ns);
+
+		/// Number of samples recorded
+		uint64_t count() const { return count_; }
+
+		/// Sum of all samples in nanoseconds
+		uint64_t sum() const { return sum_; }
+
+		/// Smallest and largest samples, 0 if empty
+		uint64_t min() const { return count_ ? min_ : 0; }
+		uint64_t max() const { return max_; }
+
+		/// Mean in nanoseconds, 0 if empty
+		double mean() const;
+
+		/// Value at a percentile
+		/// @param percentile 0 to 100
+		/// @return Upper bound of the bucket holding that sample, in nanoseconds
+		uint64_t value_at_percentile(double percentile) const;
+
+		/// Forget all samples
+		void reset();
+
+	private:
+		static const unsigned sub_bucket_bits = 4;
+		static const uint64_t sub_buckets = 1 << sub_bucket_bits;
+		static const uint64_t max_value = (1ULL << 36) - 1;
+
+		static size_t bucket_index(uint64_t ns);
+		static uint64_t bucket_upper_bound(size_t index);
+
+		std::vector<uint64_t> counts_;
+		uint64_t count_;
+		uint64_t sum_;
+		uint64_t min_;
+		uint64_t max_;
+	};
+
+	/// Requests of one ATT opcode received by the server
+	struct OpcodeMetrics
+	{
+		uint64_t requests = 0;        ///< PDUs received
+		uint64_t errors = 0;          ///< Error Responses sent for them
+		LatencyHistogram handler_ns;  ///< Time spent handling each PDU
+	};
+
+	/// Read and write callback activity on one attribute
+	struct AttributeMetrics
+	{
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+		uint64_t errors = 0;          ///< Callbacks that returned an ATT error
+		LatencyHistogram read_ns;     ///< Time spent in invoke_read_callback
+		LatencyHistogram write_ns;    ///< Time spent in invoke_write_callback
+	};
+
+	/// Traffic on one connection
+	struct ConnectionMetrics
+	{
+		std::string peer_address;
+		uint64_t pdus_in = 0;
+		uint64_t pdus_out = 0;
+		uint64_t bytes_in = 0;
+		uint64_t bytes_out = 0;
+		uint64_t error_responses = 0;
+		uint64_t notifications = 0;       ///< Notifications and indications sent
+		uint64_t notification_drops = 0;  ///< Notifications the transport refused
+		uint64_t notifications_superseded = 0; ///< Coalesced values replaced before being sent
+	};
+
+	/// Point-in-time copy of everything GATTServerMetrics has counted
+	struct GATTServerMetricsSnapshot
+	{
+		std::map<uint8_t, OpcodeMetrics> opcodes;          ///< Keyed by request opcode
+		std::map<uint16_t, AttributeMetrics> attributes;   ///< Keyed by attribute handle
+		std::map<uint16_t, ConnectionMetrics> connections; ///< Open connections, by handle
+		ConnectionMetrics closed;   ///< Totals of connections that have gone away
+	};
+
+	/// Request, callback and traffic counters for BLEGATTServer
+	/// Thread safe; the server records into it from whichever thread
+	/// delivers PDUs, and readers take snapshots.
+	///
+	/// Recording is off by default: it costs a lock per counter update and
+	/// two clock reads per PDU. Turn it on with set_enabled().
+	class GATTServerMetrics
+	{
+	public:
+		/// Start or stop recording
+		/// Connections are tracked either way, so per-connection counters
+		/// work for connections opened while recording was off.
+		void set_enabled(bool enabled);
+
+		/// @return true if counters are being recorded
+		bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+		/// Copy out the current counters
+		GATTServerMetricsSnapshot snapshot() const;
+
+		/// Write all counters in the Prometheus text exposition format
+		/// Latencies are exported as summaries in seconds.
+		/// @param os Stream to write to
+		void write_prometheus(std::ostream& os) const;
+
+		/// Prometheus text exposition of all counters
+		std::string prometheus() const;
+
+		/// Zero every counter; open connections are kept
+		void reset();
+
+		// Recording, called by the server. Apart from the connection
+		// events these do nothing while recording is off.
+
+		void connection_opened(uint16_t conn_handle, const std::string& peer_address);
+		void connection_closed(uint16_t conn_handle);
+
+		/// A PDU was received and handled
+		void record_request(uint16_t conn_handle, uint8_t opcode, size_t len, uint64_t handler_ns);
+
+		/// A PDU was passed to the transport
+		/// @param ok false if the transport refused it
+		void record_sent(uint16_t conn_handle, size_t len, bool ok);
+
+		/// An Error Response was sent for a request
+		void record_error_response(uint16_t conn_handle, uint8_t opcode);
+
+		/// A notification or indication was sent or dropped
+		void record_notification(uint16_t conn_handle, bool dropped);
+
+		/// A coalesced notification was replaced by a newer value
+		void record_notification_superseded(uint16_t conn_handle);
+
+		/// A read or write callback ran
+		/// @param rc The callback's result, 0 or an ATT error code
+		void record_read_callback(uint16_t handle, uint64_t ns, int rc);
+		void record_write_callback(uint16_t handle, uint64_t ns, int rc);
+
+	private:
+		std::atomic<bool> enabled_{false};
+		mutable std::mutex mutex_;
+		GATTServerMetricsSnapshot m_;
+	};
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_GATT_METRICS_H
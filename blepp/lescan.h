@@ -29,7 +29,8 @@
 #include <string>
 #include <stdexcept>
 #include <cstdint>
-#include <set>
+#include <functional>
+#include <memory>
 #include <unistd.h>
 #include <blepp/blestatemachine.h> //for UUID. FIXME mofo
 #include <blepp/bleclienttransport.h>
@@ -66,6 +67,21 @@ namespace BLEPP
 			bool complete;
 		};
 
+		/// Service Data AD structure: the service's UUID and its data
+		struct ServiceData
+		{
+			UUID uuid;
+			std::vector<uint8_t> data;
+		};
+
+		/// Slave Connection Interval Range, in units of 1.25ms
+		/// (0xFFFF means no specific minimum or maximum)
+		struct ConnectionIntervalRange
+		{
+			uint16_t min = 0;
+			uint16_t max = 0;
+		};
+
 		struct Flags
 		{
 			bool LE_limited_discoverable=0;
@@ -86,8 +102,17 @@ namespace BLEPP
 		Name*  local_name = nullptr;
 		Flags* flags = nullptr;
 
+		bool has_tx_power = false;
+		int8_t tx_power = 0;              ///< TX power level in dBm
+
+		bool has_appearance = false;
+		uint16_t appearance = 0;          ///< GAP appearance value
+
+		bool has_connection_interval = false;
+		ConnectionIntervalRange connection_interval;
+
 		std::vector<std::vector<uint8_t>> manufacturer_specific_data;
-		std::vector<std::vector<uint8_t>> service_data;
+		std::vector<ServiceData> service_data;
 		std::vector<std::vector<uint8_t>> unparsed_data_with_types;
 		std::vector<std::vector<uint8_t>> raw_packet;
 
@@ -108,6 +133,12 @@ namespace BLEPP
 			, uuid_128_bit_complete(other.uuid_128_bit_complete)
 			, local_name(other.local_name ? new Name(*other.local_name) : nullptr)
 			, flags(other.flags ? new Flags(*other.flags) : nullptr)
+			, has_tx_power(other.has_tx_power)
+			, tx_power(other.tx_power)
+			, has_appearance(other.has_appearance)
+			, appearance(other.appearance)
+			, has_connection_interval(other.has_connection_interval)
+			, connection_interval(other.connection_interval)
 			, manufacturer_specific_data(other.manufacturer_specific_data)
 			, service_data(other.service_data)
 			, unparsed_data_with_types(other.unparsed_data_with_types)
@@ -128,6 +159,12 @@ namespace BLEPP
 				local_name = other.local_name ? new Name(*other.local_name) : nullptr;
 				delete flags;
 				flags = other.flags ? new Flags(*other.flags) : nullptr;
+				has_tx_power = other.has_tx_power;
+				tx_power = other.tx_power;
+				has_appearance = other.has_appearance;
+				appearance = other.appearance;
+				has_connection_interval = other.has_connection_interval;
+				connection_interval = other.connection_interval;
 				manufacturer_specific_data = other.manufacturer_specific_data;
 				service_data = other.service_data;
 				unparsed_data_with_types = other.unparsed_data_with_types;
@@ -147,6 +184,12 @@ namespace BLEPP
 			, uuid_128_bit_complete(other.uuid_128_bit_complete)
 			, local_name(other.local_name)
 			, flags(other.flags)
+			, has_tx_power(other.has_tx_power)
+			, tx_power(other.tx_power)
+			, has_appearance(other.has_appearance)
+			, appearance(other.appearance)
+			, has_connection_interval(other.has_connection_interval)
+			, connection_interval(other.connection_interval)
 			, manufacturer_specific_data(std::move(other.manufacturer_specific_data))
 			, service_data(std::move(other.service_data))
 			, unparsed_data_with_types(std::move(other.unparsed_data_with_types))
@@ -172,6 +215,12 @@ namespace BLEPP
 				delete flags;
 				flags = other.flags;
 				other.flags = nullptr;
+				has_tx_power = other.has_tx_power;
+				tx_power = other.tx_power;
+				has_appearance = other.has_appearance;
+				appearance = other.appearance;
+				has_connection_interval = other.has_connection_interval;
+				connection_interval = other.connection_interval;
 				manufacturer_specific_data = std::move(other.manufacturer_specific_data);
 				service_data = std::move(other.service_data);
 				unparsed_data_with_types = std::move(other.unparsed_data_with_types);
@@ -197,6 +246,165 @@ namespace BLEPP
 			using HCIScannerError::HCIScannerError;
 	};
 
+	/// Non-owning, bounds checked view of a run of bytes, typically inside an
+	/// HCI buffer. Popping past the end throws std::out_of_range.
+	class Span
+	{
+		private:
+			const uint8_t* begin_;
+			const uint8_t* end_;
+
+		public:
+			Span()
+			:begin_(nullptr),end_(nullptr)
+			{
+			}
+
+			Span(const uint8_t* d, size_t length)
+			:begin_(d),end_(d + length)
+			{
+			}
+
+			Span(const std::vector<uint8_t>& d)
+			:begin_(d.data()),end_(begin_ + d.size())
+			{
+			}
+
+			Span(const Span&) = default;
+			Span& operator=(const Span&) = default;
+
+			Span pop_front(size_t length)
+			{
+				if(length > size())
+					throw std::out_of_range("");
+
+				Span s = *this;
+				s.end_ = begin_ + length;
+
+				begin_ += length;
+				return s;
+			}
+			const uint8_t* begin() const
+			{
+				return begin_;
+			}
+			const uint8_t* end() const
+			{
+				return end_;
+			}
+
+			const uint8_t& operator[](const size_t i) const
+			{
+				if(i >= size())
+					throw std::out_of_range("");
+				return begin_[i];
+			}
+
+			bool empty() const
+			{
+				return size()==0;
+			}
+
+			size_t size() const
+			{
+				return end_ - begin_;
+			}
+
+			const uint8_t* data() const
+			{
+				return begin_;
+			}
+
+			const uint8_t& pop_front()
+			{
+				if(begin_ == end_)
+					throw std::out_of_range("");
+
+				begin_++;
+				return *(begin_-1);
+			}
+	};
+
+	/// Pack a 6 byte little endian (HCI order) device address into the low
+	/// 48 bits of an integer.
+	inline uint64_t pack_address(const uint8_t* a)
+	{
+		uint64_t r=0;
+		for(int i=5; i >= 0; i--)
+			r = (r << 8) | a[i];
+		return r;
+	}
+
+	/// Format a packed 48-bit address as "xx:xx:xx:xx:xx:xx", most significant byte first.
+	std::string address_to_string(uint64_t address);
+
+	/// Allocation-free view of a single advertising report.
+	///
+	/// All spans point into the buffer which was parsed, so a view is only
+	/// valid for as long as that buffer is. Call to_response() to materialise
+	/// an owning AdvertisingResponse.
+	struct AdvertisementView
+	{
+		/// A legacy advert carries at most 31 bytes, so at most 15 AD structures.
+		static const size_t max_ad_structures = 16;
+
+		/// One AD structure: the type byte followed by its payload.
+		struct ADStructure
+		{
+			Span chunk;
+
+			uint8_t type() const { return chunk[0]; }
+			Span payload() const { Span s = chunk; s.pop_front(); return s; }
+		};
+
+		uint64_t address = 0;
+		uint8_t address_type = 0;
+		LeAdvertisingEventType type = LeAdvertisingEventType::ADV_IND;
+		int8_t rssi = 0;
+
+		/// The complete AD payload
+		Span data;
+
+		ADStructure ad[max_ad_structures];
+		size_t num_ad = 0;
+
+		/// Index the AD structures in a raw advertising payload.
+		/// @param payload AD payload (sequence of length, type, data)
+		/// @return false if the payload is malformed or has too many structures
+		bool parse_ad_structures(Span payload);
+
+		/// Find the first AD structure of the given GAP type
+		/// @return Pointer into ad[], or nullptr if not present
+		const ADStructure* find(uint8_t gap_type) const;
+
+		std::string address_string() const { return address_to_string(address); }
+
+		/// Build an owning AdvertisingResponse from the view.
+		AdvertisingResponse to_response() const;
+	};
+
+	/// Decode the AD structures of a raw advertising payload into the typed
+	/// fields of an AdvertisingResponse (flags, UUIDs, name, manufacturer and
+	/// service data, and so on). The address, type, RSSI and raw_packet are
+	/// left alone.
+	/// @param payload AD payload (sequence of length, type, data)
+	/// @param rsp Response to fill in
+	/// @throws std::out_of_range if the payload is malformed
+	void decode_ad_payload(Span payload, AdvertisingResponse& rsp);
+
+	/// Maximum number of reports in a single LE Advertising Report event.
+	static const size_t max_advertising_reports = 25;
+
+	/// Parse an HCI advertising packet without allocating.
+	/// Reports with corrupted AD data are skipped, as are any beyond max_views.
+	/// @param p Raw HCI packet data
+	/// @param len Length of the packet
+	/// @param views Output array, which will point into p
+	/// @param max_views Size of the output array
+	/// @return Number of views filled in
+	/// @throws HCIParseError if packet is malformed
+	size_t parse_advertisement_views(const uint8_t* p, size_t len, AdvertisementView* views, size_t max_views);
+
 	/// Parse HCI advertising packet data
 	/// This is a standalone function available regardless of transport backend
 	/// It's also accessible via HCIScanner::parse_packet() for compatibility
@@ -205,6 +413,51 @@ namespace BLEPP
 	/// @throws HCIParseError if packet is malformed
 	std::vector<AdvertisingResponse> parse_advertisement_packet(const std::vector<uint8_t>& p);
 
+	/// Largest AD payload in a legacy advertising report
+	static const size_t max_scan_record_data = 31;
+
+	/// One advertising report, as queued by asynchronous scanning.
+	///
+	/// Records are fixed size, so the ring is allocated once by start_async()
+	/// and never grows. The reports it is filled from still come out of the
+	/// transport as AdvertisementData, which allocates per report.
+	struct ScanRecord
+	{
+		uint64_t address = 0;
+		uint8_t address_type = 0;
+		LeAdvertisingEventType type = LeAdvertisingEventType::ADV_IND;
+		int8_t rssi = 0;
+		uint8_t length = 0;
+		uint8_t data[max_scan_record_data];
+
+		/// Index the record without copying it. The view points into the record.
+		/// @return false if the AD payload is malformed
+		bool view(AdvertisementView& v) const;
+	};
+
+	/// Tuning for asynchronous scanning
+	struct AsyncScanParams
+	{
+		size_t capacity = 1024;      ///< Ring slots, rounded up to a power of two
+		size_t max_batch = 64;       ///< Most records handed to one callback
+		int poll_timeout_ms = 100;   ///< Longest the reader blocks in the transport, bounding stop()
+	};
+
+	/// Counters for asynchronous scanning
+	struct AsyncScanStats
+	{
+		uint64_t received = 0;       ///< Reports read from the transport
+		uint64_t rejected = 0;       ///< Dropped by the transport's scan filter
+		uint64_t reported = 0;       ///< Passed by the transport's scan and duplicate filters
+		uint64_t suppressed = 0;     ///< Dropped by the transport as software duplicates
+		uint64_t delivered = 0;      ///< Handed to the callback or drained
+		uint64_t overflowed = 0;     ///< Dropped because the ring was full
+		uint64_t oversized = 0;      ///< Dropped because the payload did not fit a record
+		uint64_t transport_errors = 0;
+		size_t depth = 0;            ///< Records waiting now
+		size_t peak_depth = 0;       ///< Most records ever waiting at once
+	};
+
 	// Forward declaration
 	class BLEClientTransport;
 
@@ -238,22 +491,53 @@ namespace BLEPP
 		/// @return Vector of advertising responses
 		std::vector<AdvertisingResponse> get_advertisements(int timeout_ms = 0);
 
+		/// Receives a contiguous run of records, valid only for the duration of the call
+		typedef std::function<void(const ScanRecord* records, size_t count)> BatchCallback;
+
+		/// Start scanning on a dedicated reader thread, delivering batches of
+		/// records to a callback on a worker thread. A slow callback only
+		/// fills the ring; the reader keeps draining the transport, and
+		/// reports that find the ring full are counted and dropped.
+		/// @param params Scan parameters
+		/// @param on_batch Called on the worker thread
+		/// @param async Ring and batching parameters
+		void start_async(const ScanParams& params, BatchCallback on_batch,
+		                 const AsyncScanParams& async = AsyncScanParams());
+
+		/// Start scanning on a dedicated reader thread, with records collected
+		/// by drain() instead of a callback
+		void start_async(const ScanParams& params, const AsyncScanParams& async = AsyncScanParams());
+
+		/// Take queued records, in arrival order. Only valid after start_async()
+		/// without a callback, and only from one thread at a time. Records left
+		/// when the scanner stops can still be drained.
+		/// @param out Output array
+		/// @param max_records Size of the output array
+		/// @param timeout_ms How long to wait for the first record (0 = don't wait)
+		/// @return Number of records copied to out
+		size_t drain(ScanRecord* out, size_t max_records, int timeout_ms = 0);
+
+		/// Counters for the current or last asynchronous scan
+		AsyncScanStats async_stats() const;
+
 		/// Check if scanner is running
 		bool is_running() const { return running_; }
 
 	private:
-		struct FilterEntry
-		{
-			explicit FilterEntry(const AdvertisingResponse&);
-			const std::string mac_address;
-			int type;
-			bool operator<(const FilterEntry&) const;
-		};
-
+		struct AsyncScan;
 		BLEClientTransport* transport_;
 		bool running_;
 		FilterDuplicates filter_mode_;
-		std::set<FilterEntry> scanned_devices_;
+		std::unique_ptr<AsyncScan> async_;
+
+		/// Reader thread: move reports from the transport into the ring
+		void read_loop();
+
+		/// Worker thread: hand queued records to the callback
+		void deliver_loop();
+
+		/// Join the asynchronous threads, if any
+		void stop_async();
 	};
 
 }
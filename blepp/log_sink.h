@@ -0,0 +1,98 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_LOG_SINK_H
+#define __INC_BLEPP_LOG_SINK_H
+
+#include <blepp/logging.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace BLEPP
+{
+	/// On-disk layout of records written by the async log sink
+	enum class LogSinkFormat
+	{
+		/// One line per record, as LOG() writes to std::clog
+		Text,
+
+		/// Length-prefixed little-endian records:
+		///   uint16 length of the rest of the record
+		///   uint8  level
+		///   uint8  flags (bit 0: message was truncated)
+		///   uint64 timestamp, nanoseconds since the epoch
+		///   uint32 line
+		///   uint16 function length, then the function name
+		///   uint16 file length, then the file name
+		///   message bytes, to the end of the record
+		Binary
+	};
+
+	/// Async log sink configuration
+	struct LogSinkParams
+	{
+		/// Records buffered between producers and the writer thread,
+		/// rounded up to a power of two
+		size_t capacity = 1024;
+
+		/// How long the writer thread sleeps when the buffer is empty
+		int flush_interval_ms = 5;
+
+		LogSinkFormat format = LogSinkFormat::Text;
+	};
+
+	/// Longest message kept per record; the rest is cut off and the
+	/// record flagged as truncated
+	static const size_t log_sink_max_message = 232;
+
+	/// Route LOG() output through a background writer thread
+	///
+	/// While the sink runs, LOG() formats its message into a per-thread
+	/// buffer and pushes it, with the raw timestamp and source location,
+	/// into a bounded lock-free ring. The calling thread never blocks and
+	/// never touches the fd: if the ring is full the record is dropped
+	/// and counted. Timestamps and the line header are formatted by the
+	/// writer thread.
+	///
+	/// @param fd Descriptor to write to; not closed by stop_async_log()
+	/// @param params Ring size, idle interval and output format
+	/// @return 0 on success, -1 if the sink is already running or fd is invalid
+	int start_async_log(int fd, const LogSinkParams& params = LogSinkParams());
+
+	/// Open (append, create) a file and route LOG() output to it
+	/// @return 0 on success, -1 on error
+	int start_async_log(const std::string& path, const LogSinkParams& params = LogSinkParams());
+
+	/// Write out everything buffered, stop the writer thread and go
+	/// back to logging on std::clog. Call before exiting, or records
+	/// still in the ring are lost.
+	void stop_async_log();
+
+	/// True while the async sink is running
+	bool async_log_running();
+
+	/// Records dropped because the ring was full, since the process started
+	uint64_t async_log_dropped();
+}
+
+#endif
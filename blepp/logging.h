@@ -27,6 +27,7 @@
 #include <chrono>
 #include <iomanip>
 #include <cstdint>
+#include <atomic>
 #include <blepp/xtoa.h>
 
 namespace BLEPP
@@ -41,6 +42,15 @@ namespace BLEPP
 		Trace
 	};
 
+	//Most verbose level compiled in, as a number (0 = Error ... 4 = Trace).
+	//Statements above it are removed entirely, whatever log_level says,
+	//and ENTER() compiles to nothing below Trace.
+	#ifndef BLEPP_MIN_LOG_LEVEL
+	#define BLEPP_MIN_LOG_LEVEL 4
+	#endif
+
+	constexpr LogLevels min_log_level = static_cast<LogLevels>(BLEPP_MIN_LOG_LEVEL);
+
 	static const char* log_types[] = 
 	{
 		"error",
@@ -54,6 +64,11 @@ namespace BLEPP{
 
 	extern LogLevels log_level;
 
+	//Set while the async sink (blepp/log_sink.h) is running. LOG() then
+	//writes into a per-thread record instead of std::clog.
+	extern std::atomic<bool> async_log_active;
+	std::ostream& async_log_stream(LogLevels x, const char* function, const int line, const char* file);
+
 	template<class T> const T& log_no_uint8(const T& a)
 	{
 		return a;
@@ -65,6 +80,9 @@ namespace BLEPP{
 	
 	inline std::ostream& log_line_header(LogLevels x, const char* function, const int line, const char* file)
 	{
+		if(async_log_active.load(std::memory_order_relaxed))
+			return async_log_stream(x, function, line, file);
+
 		std::clog << log_types[x] << " " <<  std::fixed << std::setprecision(6) << std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::system_clock::now().time_since_epoch()).count();
 		if(log_level >= Debug)
 			std::clog << " " << function;
@@ -75,10 +93,17 @@ namespace BLEPP{
 	}
 
 
+	//True if a statement at level X would be logged. The compile time
+	//check comes first, so disabled levels fold away. Use it to guard
+	//diagnostics that need more than a single LOG() to produce.
+	#define LOG_ENABLED(X) ((X) <= BLEPP::min_log_level && (X) <= BLEPP::log_level)
+
 	#define LOGVAR(Y, X) LOG(Y,  #X << " = " << log_no_uint8(X))
 	#define LOGVARHEX(Y, X) LOG(Y,  #X << " = " << std::hex <<log_no_uint8(X) <<std::dec)
+
+	//Y is only evaluated when the statement is logged.
 	#define LOG(X, Y) do{\
-		if(X <= BLEPP::log_level)\
+		if(LOG_ENABLED(X))\
 			log_line_header(X, __FUNCTION__, __LINE__, __FILE__) << Y << std::endl;\
 	}while(0)
 
@@ -102,6 +127,10 @@ namespace BLEPP{
 
 	};
 
+	#if BLEPP_MIN_LOG_LEVEL >= 4
 	#define ENTER() EnterThenLeave log_enter_then_leave(__FUNCTION__, __LINE__, __FILE__);
+	#else
+	#define ENTER() do{}while(0)
+	#endif
 }
 #endif
@@ -0,0 +1,229 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_LOOPBACK_TRANSPORT_H
+#define __INC_BLEPP_LOOPBACK_TRANSPORT_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/bletransport.h>
+#include <blepp/bleclienttransport.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+
+namespace BLEPP
+{
+	/// Link emulation settings for LoopbackTransport
+	struct LoopbackParams
+	{
+		/// ATT MTU of a new connection, before any MTU exchange
+		uint16_t mtu = 23;
+
+		/// Largest MTU set_mtu() will accept; PDUs longer than the
+		/// current MTU are discarded as a real controller would
+		uint16_t max_mtu = 517;
+
+		/// One-way delay added to every PDU, in microseconds
+		uint32_t latency_us = 0;
+
+		/// Hold PDUs until the next connection event, using the interval
+		/// requested in ClientConnectionParams::max_interval
+		bool emulate_conn_interval = false;
+
+		/// PDUs delivered per direction per connection event (0 = no limit)
+		uint16_t max_pdus_per_event = 0;
+
+		/// PDUs waiting to reach a client before can_send() reports
+		/// false, to emulate a full controller buffer (0 = no limit)
+		uint16_t tx_window = 0;
+
+		/// Probability in [0, 1] that a PDU is silently dropped
+		double loss_rate = 0.0;
+
+		/// Seed for the loss generator, so runs are reproducible
+		uint32_t seed = 1;
+	};
+
+	/// Counters for traffic carried by a LoopbackTransport
+	struct LoopbackStats
+	{
+		uint64_t pdus_to_server = 0;
+		uint64_t pdus_to_client = 0;
+		uint64_t bytes_to_server = 0;
+		uint64_t bytes_to_client = 0;
+		uint64_t dropped = 0;       ///< Lost to loss_rate injection
+		uint64_t oversized = 0;     ///< Discarded for exceeding the MTU
+	};
+
+	/// In-process transport that connects a BLEClientTransport user to a
+	/// BLETransport user without a radio
+	///
+	/// Each connection is an AF_UNIX SOCK_SEQPACKET socketpair, which keeps
+	/// the message boundaries of an L2CAP ATT channel. connect() hands the
+	/// client end to the caller, so it can be passed straight to
+	/// BLEGATTStateMachine::attach(). The transport keeps the other end and
+	/// applies latency, connection-interval and loss emulation to PDUs in
+	/// both directions. All traffic is moved by the server side's event
+	/// loop (wait_events() or process_events()), so a BLEGATTServer must be
+	/// running for the client to see responses.
+	///
+	/// Both base classes declare get_fd(), disconnect(), get_mtu(),
+	/// set_mtu() and the callback members. The methods overload on their
+	/// argument types; callbacks must be qualified, e.g.
+	/// transport.BLEClientTransport::on_connected.
+	///
+	/// Client and server sides may be used from different threads.
+	class LoopbackTransport : public BLETransport, public BLEClientTransport
+	{
+	public:
+		explicit LoopbackTransport(const LoopbackParams& params = LoopbackParams());
+		~LoopbackTransport() override;
+
+		const LoopbackParams& params() const { return params_; }
+
+		/// Snapshot of the traffic counters
+		LoopbackStats stats() const;
+
+		// BLETransport interface implementation
+
+		int start_advertising(const AdvertisingParams& params) override;
+		int stop_advertising() override;
+		bool is_advertising() const override;
+
+		int accept_connection() override;
+		int disconnect(uint16_t conn_handle) override;
+		int get_fd() const override;
+
+		int send_pdu(uint16_t conn_handle, const uint8_t* data, size_t len) override;
+		int recv_pdu(uint16_t conn_handle, uint8_t* buf, size_t len) override;
+
+		int set_mtu(uint16_t conn_handle, uint16_t mtu) override;
+		uint16_t get_mtu(uint16_t conn_handle) const override;
+
+		int process_events() override;
+
+		int wait_events(int timeout_ms) override;
+		void wakeup() override;
+
+		bool can_send(uint16_t conn_handle) const override;
+
+		// BLEClientTransport interface implementation
+
+		int start_scan(const ScanParams& params) override;
+		int stop_scan() override;
+		int get_advertisements(std::vector<AdvertisementData>& ads, int timeout_ms = 0) override;
+
+		/// Open a connection to the advertising server side
+		/// @return Client end of the socketpair; closing it disconnects
+		int connect(const ClientConnectionParams& params) override;
+		int disconnect(int fd) override;
+		int get_fd(int fd) const override;
+
+		int send(int fd, const uint8_t* data, size_t len) override;
+		int receive(int fd, uint8_t* data, size_t max_len) override;
+
+		uint16_t get_mtu(int fd) const override;
+		int set_mtu(int fd, uint16_t mtu) override;
+
+		const char* get_transport_name() const override;
+		bool is_available() const override;
+		std::string get_mac_address() const override;
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		struct Packet
+		{
+			Clock::time_point due;
+			std::vector<uint8_t> data;
+		};
+
+		/// One direction of a link
+		struct Channel
+		{
+			std::deque<Packet> queue;       // In due order
+			int64_t last_event = -1;        // Connection event of the newest packet
+			uint16_t event_count = 0;       // Packets already due in that event
+		};
+
+		struct Link
+		{
+			uint16_t conn_handle;
+			int client_fd;                  // Owned by the client once connect() returns
+			int radio_fd;                   // Transport's end of the socketpair
+			uint16_t mtu;
+			Clock::time_point epoch;        // Time of connection event 0
+			Clock::duration interval;       // Zero when not emulated
+			bool announced;                 // on_connected has been called
+			bool closed;                    // Client end has gone away
+			mutable bool tx_waiting;        // can_send() said no; report room via on_tx_ready
+			Channel to_server;
+			Channel to_client;
+		};
+
+		LoopbackParams params_;
+		mutable std::mutex mutex_;
+		std::map<uint16_t, Link> links_;
+		uint16_t next_conn_handle_;
+		int epoll_fd_;
+		int wakeup_fd_;
+
+		bool advertising_;
+		AdvertisingParams adv_params_;
+		bool scanning_;
+		Clock::time_point next_adv_;
+
+		std::mt19937 rng_;
+		LoopbackStats stats_;
+
+		/// Queue a PDU on a channel, applying loss, MTU and timing emulation
+		/// @return true if the PDU was queued
+		bool enqueue(Link& link, Channel& channel, const uint8_t* data, size_t len);
+
+		/// Read everything the client has written into to_server
+		void drain_radio(Link& link);
+
+		/// Write due to_client packets to the client end
+		void flush_to_client(Link& link, Clock::time_point now);
+
+		/// Milliseconds until the next queued packet falls due (-1 = none)
+		int next_due_ms() const;
+
+		Link* find_link_by_fd(int fd);
+		const Link* find_link_by_fd(int fd) const;
+
+		/// Close the transport's end of a link and forget it
+		void remove_link(std::map<uint16_t, Link>::iterator it);
+
+		/// Build the advertising report the client sees while scanning
+		AdvertisementData build_advertisement() const;
+	};
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_LOOPBACK_TRANSPORT_H
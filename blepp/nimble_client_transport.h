@@ -31,7 +31,6 @@
 #include <mutex>
 #include <map>
 #include <queue>
-#include <set>
 #include <vector>
 #include <thread>
 #include <atomic>
@@ -96,7 +95,6 @@ namespace BLEPP
 		ScanParams scan_params_;
 		std::queue<AdvertisementData> scan_results_;
 		std::mutex scan_mutex_;
-		std::set<std::string> seen_devices_;  // For duplicate filtering
 
 		std::map<int, ConnectionInfo> connections_;  // fd -> connection info
 		std::map<uint16_t, int> handle_to_fd_;       // Nimble handle -> fd
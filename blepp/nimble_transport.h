@@ -28,11 +28,13 @@
 #ifdef BLEPP_NIMBLE_SUPPORT
 
 #include <blepp/bletransport.h>
+#include <blepp/tx_queue.h>
 #include <map>
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <semaphore.h>
 #include <vector>
 
@@ -72,6 +74,14 @@ namespace BLEPP
 
 		int process_events() override;
 
+		bool can_send(uint16_t conn_handle) const override;
+
+		/// Transmit queue counters for a connection
+		TxQueueStats tx_stats(uint16_t conn_handle) const;
+
+		/// Cap the bytes held in transmit queues across all connections
+		void set_tx_queue_limit(size_t max_bytes);
+
 		/// Register GATT services with NimBLE stack
 		/// @param services Vector of service definitions
 		/// @return 0 on success, negative on error
@@ -123,6 +133,14 @@ namespace BLEPP
 		std::mutex rx_mutex_;
 		std::queue<PendingPDU> rx_queue_;
 
+		// PDUs the controller had no buffer for (guarded by tx_mutex_)
+		TxQueue tx_queue_;
+		mutable std::mutex tx_mutex_;
+
+		// Connections can_send() turned away, to be told when they have
+		// room through on_tx_ready (guarded by tx_mutex_)
+		mutable std::set<uint16_t> tx_waiting_;
+
 		// Internal structures for Nimble ioctl communication
 		struct status_async {
 			uint8_t type;           // Event type
@@ -154,6 +172,15 @@ namespace BLEPP
 		/// Process HCI event data
 		void process_hci_event(const uint8_t* data, size_t len);
 
+		/// Wrap an ATT PDU in an HCI ACL packet and hand it to the controller
+		/// @return Bytes written, 0 if the controller is out of buffers, negative on error
+		int write_acl(uint16_t conn_handle, const uint8_t* data, size_t len);
+
+		/// Retry queued PDUs on every connection, then pass any the
+		/// transmit queue dropped to on_pdu_dropped, and call on_tx_ready
+		/// for waiting connections whose queue has emptied
+		void flush_tx();
+
 		/// Send HCI command
 		int send_hci_command(const uint8_t* cmd, size_t len);
 
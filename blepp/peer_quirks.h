@@ -0,0 +1,133 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_PEER_QUIRKS_H
+#define __INC_BLEPP_PEER_QUIRKS_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/bletransport.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Workarounds for bugs in a particular peer's GATT client
+	struct PeerQuirks
+	{
+		/// Hold Read By Group Type responses back by this long (0 = send at once).
+		/// Some Android stacks only queue a request after transmitting it, so a
+		/// response that arrives first is dropped and discovery stalls until
+		/// the 5 s ATT timeout.
+		uint16_t discovery_response_delay_ms = 0;
+	};
+
+	/// Chooses the quirks for a peer
+	/// Called with client_mtu == 0 when the peer connects, and again with the
+	/// MTU from its Exchange MTU Request, which is when a fingerprint is available.
+	typedef std::function<PeerQuirks(const ConnectionParams& peer, uint16_t client_mtu)> PeerQuirkPolicy;
+
+	/// What an Android GATT client looks like when it connects
+	/// A peer matches if its Exchange MTU Request asks for client_mtu and it
+	/// either connected from a random address or its public address has one
+	/// of the listed OUIs. The MTU alone is not enough: other stacks ask for
+	/// 517 as well, but rarely from a random address.
+	struct AndroidFingerprint
+	{
+		uint16_t client_mtu = 517;      ///< Android 14 and later always ask for the maximum
+		uint8_t address_type = 1;       ///< Phones connect from a resolvable private (random) address
+		std::vector<uint32_t> ouis;     ///< Public address OUIs to accept as well
+	};
+
+	/// Rule based PeerQuirkPolicy
+	/// Rules are checked in order: OUI, address type, Android fingerprint,
+	/// client MTU, and finally default_quirks. Nothing is matched unless it
+	/// was added, so an empty table applies no quirks to anyone.
+	class PeerQuirkTable
+	{
+	public:
+		/// Quirks for peers that match no other rule
+		PeerQuirks default_quirks;
+
+		/// Match peers whose address starts with an OUI
+		/// @param oui 24-bit OUI, e.g. 0x001A7D
+		/// @param quirks Quirks to apply
+		void add_oui(uint32_t oui, const PeerQuirks& quirks);
+
+		/// Match peers by address type, as reported by the transport
+		/// @param address_type ConnectionParams::peer_address_type value
+		/// @param quirks Quirks to apply
+		void add_address_type(uint8_t address_type, const PeerQuirks& quirks);
+
+		/// Match peers by the MTU in their Exchange MTU Request
+		/// This is a heuristic, not an identification: Android 14 and later ask
+		/// for 517, but so do other stacks. Only use it for quirks that are
+		/// harmless when they hit the wrong peer.
+		/// @param client_mtu MTU to match
+		/// @param quirks Quirks to apply
+		void add_client_mtu(uint16_t client_mtu, const PeerQuirks& quirks);
+
+		/// Match peers that look like an Android GATT client
+		/// Only matches once the peer's Exchange MTU Request has been seen.
+		/// @param quirks Quirks to apply
+		/// @param fingerprint How to recognise Android
+		void set_android_quirks(const PeerQuirks& quirks,
+		                        const AndroidFingerprint& fingerprint = AndroidFingerprint());
+
+		PeerQuirks operator()(const ConnectionParams& peer, uint16_t client_mtu) const;
+
+		/// Check a peer against an Android fingerprint
+		/// @param fingerprint Fingerprint to match
+		/// @param peer Peer connection parameters
+		/// @param client_mtu MTU from the peer's Exchange MTU Request (0 = none yet)
+		/// @return true if the peer looks like Android
+		static bool is_android(const AndroidFingerprint& fingerprint,
+		                       const ConnectionParams& peer, uint16_t client_mtu);
+
+		/// Extract the OUI from an address of the form "AA:BB:CC:DD:EE:FF"
+		/// @param address Peer address string
+		/// @param oui Set to the 24-bit OUI on success
+		/// @return true on success, false if the address is malformed
+		static bool parse_oui(const std::string& address, uint32_t& oui);
+
+	private:
+		std::vector<std::pair<uint32_t, PeerQuirks>> ouis_;
+		std::vector<std::pair<uint8_t, PeerQuirks>> address_types_;
+		std::vector<std::pair<uint16_t, PeerQuirks>> client_mtus_;
+		bool have_android_ = false;
+		AndroidFingerprint android_fingerprint_;
+		PeerQuirks android_;
+	};
+
+	/// The policy BLEGATTServer uses unless one is set: peers that look like
+	/// Android get a 20 ms discovery response delay, everyone else none.
+	PeerQuirkTable default_peer_quirk_policy();
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_PEER_QUIRKS_H
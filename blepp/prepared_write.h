@@ -0,0 +1,134 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_PREPARED_WRITE_H
+#define __INC_BLEPP_PREPARED_WRITE_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Fixed-size slab allocator for queued Prepare Write values
+	/// All storage is allocated up front, so the memory held by prepared
+	/// writes is bounded however many peers are connected. Not thread safe;
+	/// the owner serialises access.
+	class PreparedWritePool
+	{
+	public:
+		/// Bytes of value data held by one slab
+		static const size_t slab_size = 64;
+
+		/// Sentinel for "no slab"
+		static const uint32_t no_slab = 0xFFFFFFFF;
+
+		/// Constructor
+		/// @param max_bytes Total value bytes the pool can hold, rounded up to whole slabs
+		explicit PreparedWritePool(size_t max_bytes = 16384);
+
+		/// Reallocate the pool with a new size
+		/// @param max_bytes Total value bytes the pool can hold
+		/// @return 0 on success, -1 if any slabs are still in use
+		int resize(size_t max_bytes);
+
+		/// Copy data into a chain of slabs
+		/// @return Head of the chain, or no_slab if there is not enough room
+		uint32_t store(const uint8_t* data, size_t len);
+
+		/// Append len bytes held in the chain starting at head to out
+		void copy_out(uint32_t head, size_t len, std::vector<uint8_t>& out) const;
+
+		/// Return a chain of slabs to the pool
+		void release(uint32_t head);
+
+		/// Total capacity in bytes
+		size_t capacity() const { return next_.size() * slab_size; }
+
+		/// Bytes not currently held by any chain
+		size_t available() const { return free_slabs_ * slab_size; }
+
+	private:
+		std::vector<uint8_t> storage_;
+		std::vector<uint32_t> next_;   ///< Next slab in a chain or the free list
+		uint32_t free_head_;
+		size_t free_slabs_;
+	};
+
+	/// Per-connection queue of Prepare Write Requests awaiting Execute
+	/// Values live in a PreparedWritePool; the queue only records where.
+	class PreparedWriteQueue
+	{
+	public:
+		struct Entry
+		{
+			uint16_t handle;
+			uint16_t offset;
+			uint16_t length;
+			uint32_t head;     ///< First slab holding the value
+		};
+
+		PreparedWriteQueue() : bytes_(0) {}
+
+		/// Queue a prepared value
+		/// @param pool Pool to hold the value
+		/// @param max_bytes Per-queue limit on queued value bytes
+		/// @return 0 on success, -1 if the queue or the pool is full
+		int push(PreparedWritePool& pool, uint16_t handle, uint16_t offset,
+		         const uint8_t* data, size_t len, size_t max_bytes);
+
+		/// Assembled value for one attribute
+		struct Write
+		{
+			uint16_t handle;
+			uint16_t offset;               ///< Offset of the first queued segment
+			std::vector<uint8_t> value;    ///< Segments merged at their offsets, relative to offset
+		};
+
+		/// Merge the queued segments per handle, in order of first appearance, and empty the queue
+		/// @param pool Pool holding the values
+		/// @param out Assembled writes
+		/// @param error_handle Set to the offending handle on failure
+		/// @return 0 on success, or an ATT error code if the segments for a handle are not contiguous
+		int drain(PreparedWritePool& pool, std::vector<Write>& out, uint16_t& error_handle);
+
+		/// Drop everything queued and return the slabs to the pool
+		void cancel(PreparedWritePool& pool);
+
+		bool empty() const { return entries_.empty(); }
+
+		/// Value bytes currently queued
+		size_t bytes() const { return bytes_; }
+
+	private:
+		std::vector<Entry> entries_;
+		size_t bytes_;
+	};
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_PREPARED_WRITE_H
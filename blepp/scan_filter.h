@@ -0,0 +1,123 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef __INC_BLEPP_SCAN_FILTER_H
+#define __INC_BLEPP_SCAN_FILTER_H
+
+#include <blepp/uuid.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Conditions on an advert. An advert matches the rule if it meets
+	/// every condition that is set; unset conditions match anything.
+	struct ScanFilterRule
+	{
+		/// Leading bytes of the device address, most significant first,
+		/// e.g. "C0:98:E5" for one vendor's OUI
+		std::string address_prefix;
+
+		/// Matches if any of these is advertised, in a service UUID list
+		/// or as service data. Short and 128-bit forms of one UUID match
+		/// each other.
+		std::vector<bt_uuid_t> service_uuids;
+
+		/// Manufacturer data company ID (-1 = any)
+		int32_t company_id = -1;
+
+		/// Manufacturer data bytes after the company ID to compare
+		std::vector<uint8_t> manufacturer_data;
+
+		/// Bits of manufacturer_data to compare (empty = all of them)
+		std::vector<uint8_t> manufacturer_mask;
+
+		/// Leading characters of the shortened or complete local name
+		std::string name_prefix;
+
+		/// Weakest RSSI accepted, in dBm (-128 = any)
+		int8_t min_rssi = -128;
+	};
+
+	/// Filter applied to adverts before they are parsed or copied
+	///
+	/// Rules are compiled into a flat instruction table when added, and
+	/// evaluated straight on the raw AD bytes of each report, so adverts
+	/// that don't match cost no allocation. An advert passes if it
+	/// matches any rule; a filter with no rules passes everything.
+	class ScanFilter
+	{
+	public:
+		/// Compile a rule and add it to the filter
+		/// @throws std::invalid_argument if the rule is malformed
+		void add(const ScanFilterRule& rule);
+
+		/// Remove every rule
+		void clear();
+
+		/// True if the filter has no rules
+		bool empty() const { return program_.empty(); }
+
+		/// Evaluate the filter against one advertising report
+		/// @param address Packed address, as from pack_address()
+		/// @param rssi Received signal strength in dBm
+		/// @param data AD payload
+		/// @param len Length of the payload
+		/// @return true if the report should be kept
+		bool matches(uint64_t address, int8_t rssi, const uint8_t* data, size_t len) const;
+
+	private:
+		enum Opcode : uint8_t
+		{
+			OpRule,          ///< Starts a rule of length instructions
+			OpMinRssi,
+			OpAddress,       ///< (address & mask) == value
+			OpNamePrefix,    ///< length pool bytes at offset
+			OpManufacturer,  ///< length data bytes, then length mask bytes, at offset
+			OpServiceUUID    ///< length 16-byte canonical UUIDs at offset
+		};
+
+		struct Instruction
+		{
+			Opcode op;
+			int8_t rssi;
+			uint16_t company;
+			uint32_t offset;
+			uint32_t length;
+			uint64_t value;
+			uint64_t mask;
+		};
+
+		/// Append the instructions for one rule
+		void compile(const ScanFilterRule& rule);
+
+		bool execute(const Instruction& in, uint64_t address, int8_t rssi,
+		             const uint8_t* data, size_t len) const;
+
+		std::vector<Instruction> program_;
+		std::vector<uint8_t> pool_;     // Patterns and UUIDs referenced by instructions
+	};
+
+} // namespace BLEPP
+
+#endif // __INC_BLEPP_SCAN_FILTER_H
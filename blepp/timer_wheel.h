@@ -0,0 +1,104 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_TIMER_WHEEL_H
+#define __INC_BLEPP_TIMER_WHEEL_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Hashed timing wheel for short, coarse-grained deferred work
+	/// Timers are scheduled from any thread and fired by whichever thread
+	/// calls advance(), normally the server event loop.
+	class TimerWheel
+	{
+	public:
+		typedef std::function<void()> Callback;
+
+		/// Identifies a scheduled timer; 0 is never used
+		typedef uint64_t TimerId;
+
+		/// Constructor
+		/// @param tick_ms Resolution of the wheel in milliseconds
+		/// @param num_slots Number of slots; longer delays wrap round the wheel
+		explicit TimerWheel(unsigned int tick_ms = 5, size_t num_slots = 64);
+
+		/// Schedule a callback
+		/// @param delay_ms Delay in milliseconds, rounded up to a whole tick
+		/// @param cb Callback to run once the delay has passed
+		/// @return Id for cancel()
+		TimerId schedule(unsigned int delay_ms, Callback cb);
+
+		/// Drop a timer without running it
+		/// A timer that advance() has already taken off the wheel runs anyway.
+		/// @param id Id returned by schedule()
+		/// @return true if the timer was pending
+		bool cancel(TimerId id);
+
+		/// Time until the earliest pending timer is due
+		/// @return Milliseconds to wait, or -1 if no timers are pending
+		int next_timeout_ms() const;
+
+		/// Run every timer that has come due
+		/// @return Number of callbacks run
+		int advance();
+
+		/// Number of timers waiting to fire
+		size_t pending() const;
+
+		/// Drop all pending timers without running them
+		void clear();
+
+	private:
+		struct Timer
+		{
+			TimerId id;
+			uint64_t due_tick;  ///< Value of ticks_ at which it fires
+			Callback cb;
+		};
+
+		const unsigned int tick_ms_;
+		std::vector<std::vector<Timer>> slots_;
+		uint64_t ticks_;    ///< Ticks processed; the current slot is ticks_ % slots
+		std::chrono::steady_clock::time_point last_tick_;
+		TimerId next_id_;
+		std::unordered_map<TimerId, uint64_t> due_;  ///< Due tick of each pending timer
+		std::multiset<uint64_t> deadlines_;          ///< Due ticks, earliest first
+		mutable std::mutex mutex_;
+	};
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_TIMER_WHEEL_H
@@ -0,0 +1,145 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_TX_QUEUE_H
+#define __INC_BLEPP_TX_QUEUE_H
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace BLEPP
+{
+	/// Transmit priority of an outgoing ATT PDU, most urgent first
+	enum class TxPriority : uint8_t
+	{
+		Response = 0,      ///< Responses, errors and anything else a peer is waiting on
+		Indication = 1,
+		Notification = 2
+	};
+
+	/// Number of TxPriority classes
+	static const size_t tx_priority_classes = 3;
+
+	/// Transmit counters for one connection
+	struct TxQueueStats
+	{
+		size_t depth[tx_priority_classes] = {};     ///< PDUs waiting, by class
+		size_t bytes = 0;                           ///< Bytes waiting
+		size_t peak_depth = 0;                      ///< Most PDUs ever waiting at once
+		uint64_t sent[tx_priority_classes] = {};    ///< PDUs written, by class
+		uint64_t queued[tx_priority_classes] = {};  ///< PDUs that had to wait, by class
+		uint64_t dropped[tx_priority_classes] = {}; ///< PDUs refused or evicted at the memory cap, or failed
+	};
+
+	/// A queued PDU that was evicted or failed to write
+	struct DroppedPdu
+	{
+		uint16_t conn_handle;
+		std::vector<uint8_t> pdu;
+	};
+
+	/// Per-connection transmit scheduler for server transports
+	/// A PDU is written straight away unless something at least as urgent
+	/// is already waiting on its connection. Otherwise, or if the write
+	/// would block, it is queued by priority class and written by flush()
+	/// once the link has room: responses first, then indications, then
+	/// notifications. Queued bytes are capped across all connections;
+	/// at the cap, less urgent PDUs are evicted to make room for more
+	/// urgent ones. send() has already reported success for a queued PDU,
+	/// so one that is later evicted or fails to write is kept for
+	/// take_dropped(). Not thread safe; the owning transport serialises access.
+	class TxQueue
+	{
+	public:
+		/// Writes one PDU to the link
+		/// @return Positive if written, 0 if it would block, negative on error
+		typedef std::function<int(const uint8_t* data, size_t len)> Writer;
+
+		/// Constructor
+		/// @param max_bytes Cap on bytes queued across all connections
+		explicit TxQueue(size_t max_bytes = 65536);
+
+		/// Change the cap; PDUs already queued are kept
+		void set_max_bytes(size_t max_bytes) { max_bytes_ = max_bytes; }
+
+		/// Priority class of a PDU, from its opcode
+		static TxPriority classify(const uint8_t* pdu, size_t len);
+
+		/// Write a PDU, or queue it
+		/// @return 0 if written or queued, -1 if the write failed or there is no room
+		int send(uint16_t conn_handle, const uint8_t* data, size_t len, const Writer& write);
+
+		/// Write queued PDUs, most urgent first, until the link would block
+		/// PDUs whose write fails are dropped.
+		/// @return Number of PDUs still queued on the connection
+		size_t flush(uint16_t conn_handle, const Writer& write);
+
+		/// True if nothing is queued on the connection
+		bool empty(uint16_t conn_handle) const;
+
+		/// Connections with anything queued
+		std::vector<uint16_t> pending() const;
+
+		/// Forget a connection, everything queued on it and anything it had dropped
+		void remove(uint16_t conn_handle);
+
+		/// True if take_dropped() has anything to hand over
+		bool has_dropped() const { return !dropped_.empty(); }
+
+		/// Queued PDUs dropped since the last call, oldest first
+		std::vector<DroppedPdu> take_dropped();
+
+		/// Counters for a connection (all zero if unknown)
+		TxQueueStats stats(uint16_t conn_handle) const;
+
+		/// Bytes queued across all connections
+		size_t bytes() const { return bytes_; }
+
+	private:
+		struct Backlog
+		{
+			std::deque<std::vector<uint8_t>> pdus[tx_priority_classes];
+			TxQueueStats stats;
+		};
+
+		/// Drop the oldest PDU less urgent than priority, preferring this connection
+		/// @return false if there is none
+		bool evict(uint16_t conn_handle, TxPriority priority);
+
+		std::map<uint16_t, Backlog> backlogs_;
+		std::vector<DroppedPdu> dropped_;
+		size_t max_bytes_;
+		size_t bytes_;
+	};
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
+#endif // __INC_BLEPP_TX_QUEUE_H
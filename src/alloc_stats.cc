@@ -0,0 +1,159 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/alloc_stats.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace BLEPP
+{
+
+static const size_t num_subsystems = static_cast<size_t>(AllocSubsystem::Count);
+
+// Static storage, so zero before any allocation can happen
+static std::atomic<uint64_t> allocation_count[num_subsystems];
+static std::atomic<uint64_t> allocation_bytes[num_subsystems];
+
+thread_local AllocSubsystem AllocScope::current_ = AllocSubsystem::Other;
+
+bool alloc_stats_enabled()
+{
+#ifdef BLEPP_ALLOC_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+AllocCounters alloc_stats(AllocSubsystem subsystem)
+{
+	AllocCounters counters;
+	size_t i = static_cast<size_t>(subsystem);
+	if (i < num_subsystems) {
+		counters.allocations = allocation_count[i].load(std::memory_order_relaxed);
+		counters.bytes = allocation_bytes[i].load(std::memory_order_relaxed);
+	}
+	return counters;
+}
+
+void reset_alloc_stats()
+{
+	for (size_t i = 0; i < num_subsystems; i++) {
+		allocation_count[i].store(0, std::memory_order_relaxed);
+		allocation_bytes[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+const char* alloc_subsystem_name(AllocSubsystem subsystem)
+{
+	switch (subsystem) {
+		case AllocSubsystem::Other:           return "other";
+		case AllocSubsystem::Scanner:         return "scanner";
+		case AllocSubsystem::ClientTransport: return "client_transport";
+		case AllocSubsystem::StateMachine:    return "state_machine";
+		case AllocSubsystem::Server:          return "server";
+		case AllocSubsystem::AttributeDB:     return "attribute_db";
+		default:                              return "unknown";
+	}
+}
+
+#ifdef BLEPP_ALLOC_STATS
+static void* counted_alloc(size_t n)
+{
+	size_t i = static_cast<size_t>(AllocScope::current());
+	allocation_count[i].fetch_add(1, std::memory_order_relaxed);
+	allocation_bytes[i].fetch_add(n, std::memory_order_relaxed);
+
+	for (;;) {
+		if (void* p = std::malloc(n ? n : 1)) {
+			return p;
+		}
+
+		std::new_handler handler = std::get_new_handler();
+		if (!handler) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+#endif
+
+} // namespace BLEPP
+
+#ifdef BLEPP_ALLOC_STATS
+
+// Replacing the global allocation functions is the only way to see the
+// allocations made inside standard containers and std::function. This
+// applies to the whole process, which is acceptable for an opt-in
+// instrumentation build.
+
+void* operator new(size_t n)
+{
+	return BLEPP::counted_alloc(n);
+}
+
+void* operator new[](size_t n)
+{
+	return BLEPP::counted_alloc(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept
+{
+	try {
+		return BLEPP::counted_alloc(n);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept
+{
+	try {
+		return BLEPP::counted_alloc(n);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
+
+#endif // BLEPP_ALLOC_STATS
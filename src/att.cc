@@ -145,6 +145,10 @@ namespace BLEPP
 				return "Read Multi Request";
 			case ATT_OP_READ_MULTI_RESP:
 				return "Read Multi Resources";
+			case ATT_OP_READ_MULTI_VAR_REQ:
+				return "Read Multi Variable Request";
+			case ATT_OP_READ_MULTI_VAR_RESP:
+				return "Read Multi Variable Response";
 			case ATT_OP_READ_BY_GROUP_REQ:
 				return "Read By Group Request";
 			case ATT_OP_READ_BY_GROUP_RESP:
@@ -689,6 +693,28 @@ namespace BLEPP
 		return min_len;
 	}
 
+	uint16_t enc_read_multi_req(const uint16_t *handles, size_t num, bool variable,
+							uint8_t *pdu, size_t len)
+	{
+		const size_t min_len = sizeof(pdu[0]) + 2 * sizeof(handles[0]);
+		size_t i;
+
+		if (pdu == NULL || handles == NULL)
+			return 0;
+
+		if (num < 2 || len < min_len)
+			return 0;
+
+		if (len < sizeof(pdu[0]) + num * sizeof(handles[0]))
+			return 0;
+
+		pdu[0] = variable ? ATT_OP_READ_MULTI_VAR_REQ : ATT_OP_READ_MULTI_REQ;
+		for (i = 0; i < num; i++)
+			att_put_u16(handles[i], &pdu[1 + 2 * i]);
+
+		return sizeof(pdu[0]) + num * sizeof(handles[0]);
+	}
+
 	uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 										size_t len)
 	{
@@ -27,10 +27,10 @@
 #include <blepp/bleattributedb.h>
 #include <blepp/gatt_services.h>
 #include <blepp/logging.h>
+#include <blepp/pretty_printers.h>
+#include <blepp/alloc_stats.h>
 #include <blepp/att.h>
 #include <algorithm>
-#include <sstream>
-#include <iomanip>
 #include <cstring>
 
 namespace BLEPP
@@ -45,6 +45,7 @@ static const UUID UUID_CCCD(0x2902);  // Client Characteristic Configuration Des
 
 BLEAttributeDatabase::BLEAttributeDatabase()
 	: next_handle_(1)  // Handles start at 1 (0 is invalid)
+	, generation_(0)
 {
 	ENTER();
 }
@@ -64,6 +65,52 @@ uint16_t BLEAttributeDatabase::allocate_handle()
 	return next_handle_++;
 }
 
+BLEAttributeDatabase::UUIDKey BLEAttributeDatabase::uuid_key(const UUID& uuid)
+{
+	bt_uuid_t u128;
+	bt_uuid_to_uuid128(&uuid, &u128);
+
+	UUIDKey key;
+	memcpy(key.data(), &u128.value.u128, key.size());
+	return key;
+}
+
+void BLEAttributeDatabase::insert_attribute(Attribute&& attr)
+{
+	uint16_t handle = attr.handle;
+	generation_++;
+	std::vector<uint16_t>& postings = type_index_[uuid_key(attr.uuid)];
+
+	// Handles are allocated in ascending order, so both of these are
+	// normally appends.
+	if (attributes_.empty() || attributes_.back().handle < handle) {
+		attributes_.push_back(std::move(attr));
+	} else {
+		auto it = std::lower_bound(attributes_.begin(), attributes_.end(), handle,
+			[](const Attribute& a, uint16_t h) { return a.handle < h; });
+		if (it != attributes_.end() && it->handle == handle) {
+			// Replacing an existing handle: drop it from its old postings list
+			std::vector<uint16_t>& old = type_index_[uuid_key(it->uuid)];
+			old.erase(std::lower_bound(old.begin(), old.end(), handle));
+			*it = std::move(attr);
+		} else {
+			attributes_.insert(it, std::move(attr));
+		}
+	}
+
+	if (postings.empty() || postings.back() < handle) {
+		postings.push_back(handle);
+	} else {
+		postings.insert(std::lower_bound(postings.begin(), postings.end(), handle), handle);
+	}
+}
+
+std::vector<Attribute>::const_iterator BLEAttributeDatabase::lower_bound(uint16_t handle) const
+{
+	return std::lower_bound(attributes_.begin(), attributes_.end(), handle,
+		[](const Attribute& a, uint16_t h) { return a.handle < h; });
+}
+
 uint8_t BLEAttributeDatabase::flags_to_properties(uint16_t flags)
 {
 	uint8_t props = 0;
@@ -96,6 +143,7 @@ uint8_t BLEAttributeDatabase::flags_to_permissions(uint16_t flags)
 uint16_t BLEAttributeDatabase::add_primary_service(const UUID& uuid)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	uint16_t handle = allocate_handle();
 	if (handle == 0) return 0;
@@ -117,16 +165,10 @@ uint16_t BLEAttributeDatabase::add_primary_service(const UUID& uuid)
 		attr.value.resize(16);
 		memcpy(attr.value.data(), uuid.value.u128.data, 16);
 
-		// Debug: log the UUID bytes
-		std::stringstream uuid_hex;
-		uuid_hex << std::hex << std::setfill('0');
-		for (int i = 0; i < 16; i++) {
-			uuid_hex << std::setw(2) << (int)attr.value[i] << " ";
-		}
-		LOG(Info, "Stored primary service UUID bytes (little-endian for ATT): " << uuid_hex.str());
+		LOG(Info, "Stored primary service UUID bytes (little-endian for ATT): " << to_hex(attr.value));
 	}
 
-	attributes_[handle] = attr;
+	insert_attribute(std::move(attr));
 
 	// Track service for end_group_handle updates
 	services_.push_back({handle, handle});
@@ -138,6 +180,7 @@ uint16_t BLEAttributeDatabase::add_primary_service(const UUID& uuid)
 uint16_t BLEAttributeDatabase::add_secondary_service(const UUID& uuid)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	uint16_t handle = allocate_handle();
 	if (handle == 0) return 0;
@@ -158,16 +201,10 @@ uint16_t BLEAttributeDatabase::add_secondary_service(const UUID& uuid)
 		attr.value.resize(16);
 		memcpy(attr.value.data(), uuid.value.u128.data, 16);
 
-		// Debug: log the UUID bytes
-		std::stringstream uuid_hex;
-		uuid_hex << std::hex << std::setfill('0');
-		for (int i = 0; i < 16; i++) {
-			uuid_hex << std::setw(2) << (int)attr.value[i] << " ";
-		}
-		LOG(Info, "Stored secondary service UUID bytes (little-endian for ATT): " << uuid_hex.str());
+		LOG(Info, "Stored secondary service UUID bytes (little-endian for ATT): " << to_hex(attr.value));
 	}
 
-	attributes_[handle] = attr;
+	insert_attribute(std::move(attr));
 
 	services_.push_back({handle, handle});
 
@@ -179,6 +216,7 @@ uint16_t BLEAttributeDatabase::add_include(uint16_t service_handle,
                                            uint16_t included_service_handle)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	uint16_t handle = allocate_handle();
 	if (handle == 0) return 0;
@@ -210,7 +248,7 @@ uint16_t BLEAttributeDatabase::add_include(uint16_t service_handle,
 		attr.value.push_back((uuid16 >> 8) & 0xFF);
 	}
 
-	attributes_[handle] = attr;
+	insert_attribute(std::move(attr));
 
 	update_service_end_handle(service_handle, handle);
 
@@ -224,6 +262,7 @@ uint16_t BLEAttributeDatabase::add_characteristic(uint16_t service_handle,
                                                   uint8_t permissions)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	// Allocate handles for:
 	// 1. Characteristic declaration
@@ -258,7 +297,7 @@ uint16_t BLEAttributeDatabase::add_characteristic(uint16_t service_handle,
 		memcpy(&decl_attr.value[start_pos], uuid.value.u128.data, 16);
 	}
 
-	attributes_[decl_handle] = decl_attr;
+	insert_attribute(std::move(decl_attr));
 
 	// 2. Add characteristic value
 	Attribute value_attr;
@@ -268,7 +307,7 @@ uint16_t BLEAttributeDatabase::add_characteristic(uint16_t service_handle,
 	value_attr.permissions = permissions;
 	value_attr.properties = properties;
 
-	attributes_[value_handle] = value_attr;
+	insert_attribute(std::move(value_attr));
 
 	update_service_end_handle(service_handle, value_handle);
 
@@ -291,6 +330,7 @@ uint16_t BLEAttributeDatabase::add_descriptor(uint16_t char_handle,
                                               uint8_t permissions)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	uint16_t handle = allocate_handle();
 	if (handle == 0) return 0;
@@ -301,7 +341,7 @@ uint16_t BLEAttributeDatabase::add_descriptor(uint16_t char_handle,
 	attr.uuid = uuid;
 	attr.permissions = permissions;
 
-	attributes_[handle] = attr;
+	insert_attribute(std::move(attr));
 
 	// Find the service this belongs to and update end handle
 	// (char_handle should be a characteristic value, so search backwards for service)
@@ -362,6 +402,7 @@ void BLEAttributeDatabase::update_service_end_handle(uint16_t service_handle,
 int BLEAttributeDatabase::register_services(const std::vector<GATTServiceDef>& services)
 {
 	ENTER();
+	ALLOC_SCOPE(AttributeDB);
 
 	for (const auto& svc_def : services) {
 		// Add service
@@ -471,14 +512,19 @@ int BLEAttributeDatabase::register_services(const std::vector<GATTServiceDef>& s
 
 Attribute* BLEAttributeDatabase::get_attribute(uint16_t handle)
 {
-	auto it = attributes_.find(handle);
-	return (it != attributes_.end()) ? &it->second : nullptr;
+	return const_cast<Attribute*>(static_cast<const BLEAttributeDatabase*>(this)->get_attribute(handle));
 }
 
 const Attribute* BLEAttributeDatabase::get_attribute(uint16_t handle) const
 {
-	auto it = attributes_.find(handle);
-	return (it != attributes_.end()) ? &it->second : nullptr;
+	// Fast path: handles are dense from 1, so the attribute is usually at
+	// handle - 1. Fall back to a binary search if a handle was skipped.
+	if (handle != 0 && handle <= attributes_.size() && attributes_[handle - 1].handle == handle) {
+		return &attributes_[handle - 1];
+	}
+
+	auto it = lower_bound(handle);
+	return (it != attributes_.end() && it->handle == handle) ? &*it : nullptr;
 }
 
 std::vector<const Attribute*> BLEAttributeDatabase::find_by_type(
@@ -486,24 +532,26 @@ std::vector<const Attribute*> BLEAttributeDatabase::find_by_type(
 	uint16_t end_handle,
 	const UUID& type) const
 {
-	ENTER();
-	LOG(Debug, "Searching for type=" << type.str() << " in range [" << start_handle << ", " << end_handle << "]");
-	LOG(Debug, "Total attributes in database: " << attributes_.size());
+	ALLOC_SCOPE(AttributeDB);
 
 	std::vector<const Attribute*> results;
 
-	for (const auto& pair : attributes_) {
-		const auto& attr = pair.second;
-		if (attr.handle >= start_handle && attr.handle <= end_handle) {
-			LOG(Debug, "Checking handle " << attr.handle << " with UUID " << attr.uuid.str());
-			if (attr.uuid == type) {
-				LOG(Debug, "  -> MATCH!");
-				results.push_back(&attr);
-			}
-		}
+	auto idx = type_index_.find(uuid_key(type));
+	if (idx == type_index_.end() || start_handle > end_handle) {
+		return results;
+	}
+
+	const std::vector<uint16_t>& postings = idx->second;
+	auto first = std::lower_bound(postings.begin(), postings.end(), start_handle);
+	auto last = std::upper_bound(first, postings.end(), end_handle);
+
+	results.reserve(last - first);
+	for (auto it = first; it != last; ++it) {
+		results.push_back(get_attribute(*it));
 	}
 
-	LOG(Debug, "Found " << results.size() << " matching attributes");
+	LOG(Debug, "find_by_type " << type.str() << " [" << start_handle << ", " << end_handle
+	    << "]: " << results.size() << " matches");
 	return results;
 }
 
@@ -513,14 +561,13 @@ std::vector<const Attribute*> BLEAttributeDatabase::find_by_type_value(
 	const UUID& type,
 	const std::vector<uint8_t>& value) const
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	std::vector<const Attribute*> results;
 
-	for (const auto& pair : attributes_) {
-		const auto& attr = pair.second;
-		if (attr.handle >= start_handle && attr.handle <= end_handle) {
-			if (attr.uuid == type && attr.value == value) {
-				results.push_back(&attr);
-			}
+	for (const Attribute* attr : find_by_type(start_handle, end_handle, type)) {
+		if (attr->value == value) {
+			results.push_back(attr);
 		}
 	}
 
@@ -531,13 +578,12 @@ std::vector<const Attribute*> BLEAttributeDatabase::get_range(
 	uint16_t start_handle,
 	uint16_t end_handle) const
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	std::vector<const Attribute*> results;
 
-	for (const auto& pair : attributes_) {
-		const auto& attr = pair.second;
-		if (attr.handle >= start_handle && attr.handle <= end_handle) {
-			results.push_back(&attr);
-		}
+	for (auto it = lower_bound(start_handle); it != attributes_.end() && it->handle <= end_handle; ++it) {
+		results.push_back(&*it);
 	}
 
 	return results;
@@ -545,14 +591,20 @@ std::vector<const Attribute*> BLEAttributeDatabase::get_range(
 
 void BLEAttributeDatabase::clear()
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	attributes_.clear();
+	type_index_.clear();
 	services_.clear();
 	next_handle_ = 1;
+	generation_++;
 }
 
 int BLEAttributeDatabase::set_characteristic_value(uint16_t char_value_handle,
                                                    const std::vector<uint8_t>& value)
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	auto attr = get_attribute(char_value_handle);
 	if (!attr) {
 		LOG(Warning, "Characteristic value handle " << char_value_handle << " not found");
@@ -570,6 +622,8 @@ int BLEAttributeDatabase::set_characteristic_value(uint16_t char_value_handle,
 
 std::vector<uint8_t> BLEAttributeDatabase::get_characteristic_value(uint16_t char_value_handle) const
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	auto attr = get_attribute(char_value_handle);
 	if (!attr) {
 		return {};
@@ -586,6 +640,8 @@ int BLEAttributeDatabase::set_read_callback(uint16_t char_value_handle,
                                            std::function<int(uint16_t conn_handle, uint16_t offset,
                                                             std::vector<uint8_t>& out_data)> cb)
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	auto attr = get_attribute(char_value_handle);
 	if (!attr) return -1;
 
@@ -597,6 +653,8 @@ int BLEAttributeDatabase::set_write_callback(uint16_t char_value_handle,
                                             std::function<int(uint16_t conn_handle,
                                                              const std::vector<uint8_t>& data)> cb)
 {
+	ALLOC_SCOPE(AttributeDB);
+
 	auto attr = get_attribute(char_value_handle);
 	if (!attr) return -1;
 
@@ -25,6 +25,8 @@
 
 #ifdef BLEPP_SERVER_SUPPORT
 #include <blepp/bletransport.h>
+#include <thread>
+#include <chrono>
 #endif
 
 #ifdef BLEPP_BLUEZ_SUPPORT
@@ -44,6 +46,44 @@
 namespace BLEPP
 {
 
+void BLEClientTransport::reset_report_filter(const ScanParams& params)
+{
+	scan_filter_ = params.filter;
+	filter_duplicates_ = params.filter_duplicates;
+	seen_devices_.set_params(params.duplicate_filter);
+	rejected_.store(0, std::memory_order_relaxed);
+	reported_.store(0, std::memory_order_relaxed);
+	suppressed_.store(0, std::memory_order_relaxed);
+}
+
+bool BLEClientTransport::accept_report(uint64_t address, uint8_t address_type, uint8_t event_type,
+                                       int8_t rssi, const uint8_t* data, size_t len)
+{
+	if (!scan_filter_.matches(address, rssi, data, len)) {
+		rejected_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Hardware mode leaves duplicates to the controller
+	if (filter_duplicates_ == ScanParams::FilterDuplicates::Software &&
+	    !seen_devices_.check(address, address_type, event_type, rssi, data, len)) {
+		suppressed_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	reported_.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+ScanFilterStats BLEClientTransport::get_scan_filter_stats() const
+{
+	ScanFilterStats stats;
+	stats.rejected = rejected_.load(std::memory_order_relaxed);
+	stats.reported = reported_.load(std::memory_order_relaxed);
+	stats.suppressed = suppressed_.load(std::memory_order_relaxed);
+	return stats;
+}
+
 BLEClientTransport* create_client_transport()
 {
 	ENTER();
@@ -110,6 +150,20 @@ BLEClientTransport* create_nimble_client_transport()
 
 #ifdef BLEPP_SERVER_SUPPORT
 
+int BLETransport::wait_events(int timeout_ms)
+{
+	accept_connection();
+	int rc = process_events();
+
+	// Nothing to block on, so fall back to a short sleep to avoid busy-waiting
+	int sleep_ms = (timeout_ms < 0 || timeout_ms > 10) ? 10 : timeout_ms;
+	if (sleep_ms > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+	}
+
+	return rc;
+}
+
 BLETransport* create_server_transport()
 {
 	ENTER();
@@ -75,11 +75,75 @@ namespace BLEPP
 		test_fd_<BLEDevice::WriteError>(read(sock, buf, len), line);
 	}
 
+	int BLEDevice::write_pdu(const uint8_t* data, int len)
+	{
+		//PDUs already held back go first, to keep the order
+		if(!pending.empty())
+		{
+			pending.emplace_back(data, data + len);
+			return 0;
+		}
+
+		int ret = send(sock, data, len, MSG_DONTWAIT);
+
+		//A write command stream can leave the socket full. Hold
+		//the PDU for flush_pending() rather than waiting or failing.
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+		{
+			pending.emplace_back(data, data + len);
+			return 0;
+		}
+
+		return ret;
+	}
+
+	bool BLEDevice::flush_pending()
+	{
+		while(!pending.empty())
+		{
+			int ret = send(sock, pending.front().data(), pending.front().size(), MSG_DONTWAIT);
+			if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+				return false;
+			test(ret, Write);
+			pending.pop_front();
+		}
+		return true;
+	}
+
+	int BLEDevice::try_send_write_command(uint16_t handle, const uint8_t* data, int length)
+	{
+		int len = enc_write_cmd(handle, data, length, buf.data(), buf.size());
+		test_pdu(len);
+		if(!pending.empty())
+			return 0;
+		int ret = send(sock, buf.data(), len, MSG_DONTWAIT);
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+			return 0;
+		test(ret, Write);
+		return 1;
+	}
+
 	void BLEDevice::send_read_request(uint16_t handle)
 	{
 		int len = enc_read_req(handle, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
+		test(ret, Write);
+	}
+
+	void BLEDevice::send_read_blob_request(uint16_t handle, uint16_t offset)
+	{
+		int len = enc_read_blob_req(handle, offset, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(buf.data(), len);
+		test(ret, Write);
+	}
+
+	void BLEDevice::send_read_multiple(const uint16_t* handles, int num, bool variable_length)
+	{
+		int len = enc_read_multi_req(handles, num, variable_length, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -87,7 +151,7 @@ namespace BLEPP
 	{
 		int len = enc_read_by_type_req(start, end, const_cast<bt_uuid_t*>(&uuid), buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -95,7 +159,7 @@ namespace BLEPP
 	{
 		int len = enc_find_info_req(start, end, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -103,7 +167,7 @@ namespace BLEPP
 	{
 		int len = enc_read_by_grp_req(start, end, const_cast<bt_uuid_t*>(&uuid), buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -111,7 +175,7 @@ namespace BLEPP
 	{
 		int len = enc_write_req(handle, data, length, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -125,7 +189,7 @@ namespace BLEPP
 	{
 		int len = enc_confirmation(buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -133,7 +197,7 @@ namespace BLEPP
 	{
 		int len = enc_write_cmd(handle, data, length, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -164,7 +228,7 @@ namespace BLEPP
 			return;
 		}
 		LOG(Debug,"Sending MTU Request " << req_mtu);
-		int len = write(sock,my_req_pdu,3); //send MTU request before we resize our buffer, to spec
+		int len = write_pdu(my_req_pdu,3); //send MTU request before we resize our buffer, to spec
 		test(len, Write);
 		//TODO
 		// We are just accepting the remote end max recv MTU as our max
@@ -184,7 +248,7 @@ namespace BLEPP
 			LOG(Error,"Recovered local MTU to " << my_last_mtu);
 			return;
 		}
-		len = write(sock,my_resp_pdu,3); //send MTU response
+		len = write_pdu(my_resp_pdu,3); //send MTU response
 		test(len, Write);
 		LOG(Debug,"Sending MTU Resp " << my_current_mtu);
 	}
@@ -26,6 +26,8 @@
 
 #include <blepp/blegattserver.h>
 #include <blepp/logging.h>
+#include <blepp/pretty_printers.h>
+#include <blepp/alloc_stats.h>
 #include <blepp/att.h>
 
 #ifdef BLEPP_NIMBLE_SUPPORT
@@ -36,9 +38,7 @@
 #include <cstring>
 #include <thread>
 #include <chrono>
-#include <sstream>
-#include <iomanip>
-#include <unistd.h>  // for usleep()
+#include <memory>
 
 namespace BLEPP
 {
@@ -71,15 +71,60 @@ namespace BLEPP
 #define ATT_OP_HANDLE_NOTIFY            0x1B
 #define ATT_OP_HANDLE_INDICATE          0x1D
 #define ATT_OP_HANDLE_CONFIRM           0x1E
+#define ATT_OP_READ_MULTIPLE_VAR_REQ    0x20
+#define ATT_OP_READ_MULTIPLE_VAR_RSP    0x21
 #define ATT_OP_SIGNED_WRITE_CMD         0xD2
 
 // Default MTU
 #define ATT_DEFAULT_MTU                 23
 #define ATT_MAX_MTU                     517
 
+// Longest attribute value allowed by the spec
+#define ATT_MAX_VALUE_LEN               512
+
+/// Start of a timed section; the clock is only read while metrics are on
+static std::chrono::steady_clock::time_point metrics_start(const GATTServerMetrics& metrics)
+{
+	return metrics.enabled() ? std::chrono::steady_clock::now()
+	                         : std::chrono::steady_clock::time_point();
+}
+
+/// Nanoseconds since metrics_start(), 0 while metrics are off
+static uint64_t elapsed_ns(const GATTServerMetrics& metrics, std::chrono::steady_clock::time_point start)
+{
+	if (!metrics.enabled() || start == std::chrono::steady_clock::time_point()) {
+		return 0;
+	}
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/// Queue an indication's completion callback to run once the lock is released
+static void indication_done(std::vector<std::function<void()>>& done, uint16_t conn_handle,
+                            PendingIndication& ind, IndicationResult result)
+{
+	if (ind.on_complete) {
+		IndicationCallback cb = std::move(ind.on_complete);
+		uint16_t char_val_handle = ind.char_val_handle;
+		done.push_back([cb, conn_handle, char_val_handle, result]() {
+			cb(conn_handle, char_val_handle, result);
+		});
+	}
+}
+
+static void run_deferred(std::vector<std::function<void()>>& done)
+{
+	for (auto& call : done) {
+		call_user(call);
+	}
+}
+
 BLEGATTServer::BLEGATTServer(std::unique_ptr<BLETransport> transport)
-	: transport_(std::move(transport))
+	: quirk_policy(default_peer_quirk_policy())
+	, transport_(std::move(transport))
 	, running_(false)
+	, prepared_write_max_bytes_(2048)
+	, discovery_cache_generation_(0)
 {
 	ENTER();
 
@@ -97,6 +142,15 @@ BLEGATTServer::BLEGATTServer(std::unique_ptr<BLETransport> transport)
 		this->on_transport_data_received(conn_handle, data, len);
 	};
 
+	transport_->on_pdu_dropped = [this](uint16_t conn_handle,
+	                                    const uint8_t* data, size_t len) {
+		this->on_transport_pdu_dropped(conn_handle, data, len);
+	};
+
+	transport_->on_tx_ready = [this](uint16_t conn_handle) {
+		this->flush_coalesced(conn_handle);
+	};
+
 	LOG(Info, "BLEGATTServer created");
 }
 
@@ -109,9 +163,11 @@ BLEGATTServer::~BLEGATTServer()
 int BLEGATTServer::register_services(const std::vector<GATTServiceDef>& services)
 {
 	ENTER();
+	ALLOC_SCOPE(Server);
 
 	// Register with attribute database (for BlueZ transport)
 	int rc = db_.register_services(services);
+	invalidate_discovery_cache();
 	if (rc != 0) {
 		return rc;
 	}
@@ -152,6 +208,7 @@ bool BLEGATTServer::is_advertising() const
 int BLEGATTServer::run()
 {
 	ENTER();
+	ALLOC_SCOPE(Server);
 
 	{
 		std::lock_guard<std::mutex> lock(running_mutex_);
@@ -160,31 +217,38 @@ int BLEGATTServer::run()
 
 	LOG(Info, "GATT server running");
 
-	// Accept connections and process events
+	// Block until the transport has connections or data to handle, or a
+	// timer is due. stop() wakes the transport so the loop notices promptly.
 	while (running_) {
-		// Accept new connections (non-blocking or with timeout)
-		transport_->accept_connection();
-
-		// Process transport events
-		transport_->process_events();
+		if (transport_->wait_events(timers_.next_timeout_ms()) < 0) {
+			LOG(Warning, "Transport event wait failed");
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
 
-		// Small sleep to prevent busy-wait
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		timers_.advance();
 	}
 
+	timers_.clear();
+
 	LOG(Info, "GATT server stopped");
 	return 0;
 }
 
 void BLEGATTServer::stop()
 {
-	std::lock_guard<std::mutex> lock(running_mutex_);
-	running_ = false;
+	{
+		std::lock_guard<std::mutex> lock(running_mutex_);
+		running_ = false;
+	}
+
+	transport_->wakeup();
 }
 
 int BLEGATTServer::notify(uint16_t conn_handle, uint16_t char_val_handle,
                          const std::vector<uint8_t>& data)
 {
+	ALLOC_SCOPE(Server);
+
 	std::lock_guard<std::mutex> lock(connections_mutex_);
 
 	auto it = connections_.find(conn_handle);
@@ -208,37 +272,318 @@ int BLEGATTServer::notify(uint16_t conn_handle, uint16_t char_val_handle,
 	pdu.push_back((char_val_handle >> 8) & 0xFF);
 	pdu.insert(pdu.end(), data.begin(), data.end());
 
-	return transport_->send_pdu(conn_handle, pdu.data(), pdu.size());
+	return send_notification(it->second, char_val_handle, pdu);
 }
 
-int BLEGATTServer::indicate(uint16_t conn_handle, uint16_t char_val_handle,
-                           const std::vector<uint8_t>& data)
+int BLEGATTServer::notify_all(uint16_t char_val_handle, const std::vector<uint8_t>& data)
+{
+	ALLOC_SCOPE(Server);
+
+	std::vector<uint8_t> pdu;
+	pdu.reserve(3 + data.size());
+	pdu.push_back(ATT_OP_HANDLE_NOTIFY);
+	pdu.push_back(char_val_handle & 0xFF);
+	pdu.push_back((char_val_handle >> 8) & 0xFF);
+	pdu.insert(pdu.end(), data.begin(), data.end());
+
+	std::lock_guard<std::mutex> lock(connections_mutex_);
+
+	auto it = notify_subscribers_.find(char_val_handle);
+	if (it == notify_subscribers_.end()) {
+		return 0;
+	}
+
+	bool coalesced = coalesced_handles_.count(char_val_handle) != 0;
+	int sent = 0;
+	for (uint16_t conn_handle : it->second) {
+		int rc;
+		if (coalesced) {
+			// The subscriber index is kept in step with connections_, but
+			// never create a connection here if they disagree
+			auto conn = connections_.find(conn_handle);
+			if (conn == connections_.end()) {
+				continue;
+			}
+			rc = send_notification(conn->second, char_val_handle, pdu);
+		} else {
+			rc = send_pdu(conn_handle, pdu.data(), pdu.size());
+			metrics_.record_notification(conn_handle, rc < 0);
+		}
+		if (rc >= 0) {
+			sent++;
+		}
+	}
+
+	return sent;
+}
+
+void BLEGATTServer::set_notify_coalescing(uint16_t char_val_handle, bool enable)
+{
+	std::lock_guard<std::mutex> lock(connections_mutex_);
+
+	if (enable) {
+		coalesced_handles_.insert(char_val_handle);
+	} else {
+		// Anything already held back still goes out on the next flush
+		coalesced_handles_.erase(char_val_handle);
+	}
+}
+
+int BLEGATTServer::send_notification(ConnectionState& conn, uint16_t char_val_handle,
+                                     const std::vector<uint8_t>& pdu)
+{
+	if (coalesced_handles_.count(char_val_handle)) {
+		bool room = transport_->can_send(conn.conn_handle);
+
+		// Whatever is still waiting is older than this value, so it is
+		// either replaced or made redundant by sending this one now
+		auto pending = conn.coalesced.find(char_val_handle);
+		if (pending != conn.coalesced.end()) {
+			metrics_.record_notification_superseded(conn.conn_handle);
+			if (room) {
+				conn.coalesced.erase(pending);
+			} else {
+				pending->second = pdu;
+				return 0;
+			}
+		}
+
+		// can_send() returning false has the transport report room
+		// through on_tx_ready, which sends what is held here
+		if (!room) {
+			conn.coalesced[char_val_handle] = pdu;
+			return 0;
+		}
+	}
+
+	int rc = send_pdu(conn.conn_handle, pdu.data(), pdu.size());
+	metrics_.record_notification(conn.conn_handle, rc < 0);
+	return rc;
+}
+
+void BLEGATTServer::flush_coalesced(uint16_t conn_handle)
 {
 	std::lock_guard<std::mutex> lock(connections_mutex_);
 
 	auto it = connections_.find(conn_handle);
 	if (it == connections_.end()) {
-		LOG(Error, "Connection " << conn_handle << " not found");
-		return -1;
+		return;
 	}
 
-	// Check if client enabled indications
-	uint16_t cccd = it->second.cccd_values[char_val_handle];
-	if (!(cccd & 0x0002)) {
-		LOG(Warning, "Indications not enabled for handle " << char_val_handle);
-		return -1;
+	ConnectionState& conn = it->second;
+	while (!conn.coalesced.empty() && transport_->can_send(conn_handle)) {
+		auto pending = conn.coalesced.begin();
+		int rc = send_pdu(conn_handle, pending->second.data(), pending->second.size());
+		metrics_.record_notification(conn_handle, rc < 0);
+		conn.coalesced.erase(pending);
 	}
+}
 
-	// Build ATT_OP_HANDLE_INDICATE PDU
-	std::vector<uint8_t> pdu;
-	pdu.reserve(3 + data.size());
-	pdu.push_back(ATT_OP_HANDLE_INDICATE);
-	pdu.push_back(char_val_handle & 0xFF);
-	pdu.push_back((char_val_handle >> 8) & 0xFF);
-	pdu.insert(pdu.end(), data.begin(), data.end());
+int BLEGATTServer::indicate(uint16_t conn_handle, uint16_t char_val_handle,
+                           const std::vector<uint8_t>& data,
+                           IndicationCallback on_complete)
+{
+	ALLOC_SCOPE(Server);
+
+	DeferredCalls done;
 
-	// TODO: Wait for ATT_OP_HANDLE_CONFIRM from client
-	return transport_->send_pdu(conn_handle, pdu.data(), pdu.size());
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+
+		auto it = connections_.find(conn_handle);
+		if (it == connections_.end()) {
+			LOG(Error, "Connection " << conn_handle << " not found");
+			return -1;
+		}
+
+		// Check if client enabled indications
+		ConnectionState& conn = it->second;
+		uint16_t cccd = conn.cccd_values[char_val_handle];
+		if (!(cccd & 0x0002)) {
+			LOG(Warning, "Indications not enabled for handle " << char_val_handle);
+			return -1;
+		}
+
+		// The in-flight indication, if any, can no longer be replaced or dropped
+		auto first_unsent = conn.indications.begin() + (conn.indication_in_flight ? 1 : 0);
+		bool queued = false;
+
+		if (indication_params_.overflow == IndicationOverflow::Coalesce) {
+			for (auto q = first_unsent; q != conn.indications.end(); ++q) {
+				if (q->char_val_handle == char_val_handle) {
+					indication_done(done, conn_handle, *q, IndicationResult::Superseded);
+					q->value = data;
+					q->on_complete = std::move(on_complete);
+					queued = true;
+					break;
+				}
+			}
+		}
+
+		if (!queued) {
+			if (conn.indications.size() >= indication_params_.max_depth) {
+				if (indication_params_.overflow != IndicationOverflow::DropOldest ||
+				    first_unsent == conn.indications.end()) {
+					LOG(Warning, "Indication queue full on connection " << conn_handle);
+					return -1;
+				}
+
+				indication_done(done, conn_handle, *first_unsent, IndicationResult::Dropped);
+				conn.indications.erase(first_unsent);
+			}
+
+			conn.indications.push_back(PendingIndication{char_val_handle, data, std::move(on_complete)});
+		}
+
+		send_next_indication(conn, done);
+	}
+
+	run_deferred(done);
+	return 0;
+}
+
+void BLEGATTServer::set_indication_params(const IndicationParams& params)
+{
+	std::lock_guard<std::mutex> lock(connections_mutex_);
+	indication_params_ = params;
+}
+
+size_t BLEGATTServer::pending_indications(uint16_t conn_handle)
+{
+	std::lock_guard<std::mutex> lock(connections_mutex_);
+
+	auto it = connections_.find(conn_handle);
+	return it == connections_.end() ? 0 : it->second.indications.size();
+}
+
+void BLEGATTServer::send_next_indication(ConnectionState& conn, DeferredCalls& done)
+{
+	while (!conn.indication_in_flight && !conn.indications.empty()) {
+		PendingIndication& ind = conn.indications.front();
+
+		// Build ATT_OP_HANDLE_INDICATE PDU
+		std::vector<uint8_t> pdu;
+		pdu.reserve(3 + ind.value.size());
+		pdu.push_back(ATT_OP_HANDLE_INDICATE);
+		pdu.push_back(ind.char_val_handle & 0xFF);
+		pdu.push_back((ind.char_val_handle >> 8) & 0xFF);
+		pdu.insert(pdu.end(), ind.value.begin(), ind.value.end());
+
+		int rc = send_pdu(conn.conn_handle, pdu.data(), pdu.size());
+		metrics_.record_notification(conn.conn_handle, rc < 0);
+		if (rc < 0) {
+			indication_done(done, conn.conn_handle, ind, IndicationResult::Dropped);
+			conn.indications.pop_front();
+			continue;
+		}
+
+		conn.indication_in_flight = true;
+		uint32_t seq = ++conn.indication_seq;
+		uint16_t conn_handle = conn.conn_handle;
+		conn.indication_timer = timers_.schedule(indication_params_.timeout_ms, [this, conn_handle, seq]() {
+			indication_timeout(conn_handle, seq);
+		});
+
+		// Indications can be sent from any thread, so make sure the loop sees the timer
+		transport_->wakeup();
+	}
+}
+
+void BLEGATTServer::handle_indication_confirm(uint16_t conn_handle)
+{
+	DeferredCalls done;
+
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+
+		auto it = connections_.find(conn_handle);
+		if (it == connections_.end() || !it->second.indication_in_flight) {
+			LOG(Warning, "Unexpected indication confirmation on connection " << conn_handle);
+			return;
+		}
+
+		ConnectionState& conn = it->second;
+		LOG(Debug, "Indication confirmed: handle=0x" << std::hex
+		           << conn.indications.front().char_val_handle << std::dec);
+
+		// The timeout is no longer needed; leaving it on the wheel would
+		// keep the event loop waking up every tick until it expired
+		timers_.cancel(conn.indication_timer);
+		conn.indication_timer = 0;
+
+		indication_done(done, conn_handle, conn.indications.front(), IndicationResult::Confirmed);
+		conn.indications.pop_front();
+		conn.indication_in_flight = false;
+		send_next_indication(conn, done);
+	}
+
+	run_deferred(done);
+}
+
+void BLEGATTServer::indication_timeout(uint16_t conn_handle, uint32_t seq)
+{
+	DeferredCalls done;
+
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+
+		// Confirmed, or the connection has gone away, in the meantime
+		auto it = connections_.find(conn_handle);
+		if (it == connections_.end() || !it->second.indication_in_flight ||
+		    it->second.indication_seq != seq) {
+			return;
+		}
+
+		ConnectionState& conn = it->second;
+		LOG(Warning, "Indication on connection " << conn_handle << " handle 0x" << std::hex
+		             << conn.indications.front().char_val_handle << std::dec << " not confirmed");
+
+		// Strictly the bearer is unusable after an ATT timeout, but a late
+		// confirmation is harmless, so carry on with the rest of the queue
+		indication_done(done, conn_handle, conn.indications.front(), IndicationResult::Timeout);
+		conn.indications.pop_front();
+		conn.indication_in_flight = false;
+		conn.indication_timer = 0;
+		send_next_indication(conn, done);
+	}
+
+	run_deferred(done);
+}
+
+void BLEGATTServer::on_transport_pdu_dropped(uint16_t conn_handle, const uint8_t* data, size_t len)
+{
+	// Only indications are waited on; a dropped notification is just lost
+	if (len < 3 || data[0] != ATT_OP_HANDLE_INDICATE) {
+		return;
+	}
+
+	uint16_t char_val_handle = data[1] | (data[2] << 8);
+	DeferredCalls done;
+
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+
+		auto it = connections_.find(conn_handle);
+		if (it == connections_.end() || !it->second.indication_in_flight ||
+		    it->second.indications.front().char_val_handle != char_val_handle) {
+			return;
+		}
+
+		ConnectionState& conn = it->second;
+		LOG(Warning, "Indication on connection " << conn_handle << " handle 0x" << std::hex
+		             << char_val_handle << std::dec << " dropped by the transport");
+
+		// No confirmation can come, so fail it now rather than at the timeout
+		timers_.cancel(conn.indication_timer);
+		conn.indication_timer = 0;
+
+		indication_done(done, conn_handle, conn.indications.front(), IndicationResult::Dropped);
+		conn.indications.pop_front();
+		conn.indication_in_flight = false;
+		send_next_indication(conn, done);
+	}
+
+	run_deferred(done);
 }
 
 int BLEGATTServer::disconnect(uint16_t conn_handle)
@@ -258,50 +603,141 @@ ConnectionState* BLEGATTServer::get_connection_state(uint16_t conn_handle)
 	return &it->second;
 }
 
+int BLEGATTServer::set_prepared_write_limits(size_t pool_bytes, size_t per_connection_bytes)
+{
+	std::lock_guard<std::mutex> lock(connections_mutex_);
+
+	if (prepared_write_pool_.resize(pool_bytes) != 0) {
+		LOG(Warning, "Cannot resize prepared write pool while writes are queued");
+		return -1;
+	}
+
+	prepared_write_max_bytes_ = per_connection_bytes;
+	return 0;
+}
+
+// Discovery response cache
+//
+// Discovery responses are a pure function of the database layout and the
+// connection MTU, so reconnecting clients that rediscover the whole database
+// are answered from here. Entries are dropped when db_.generation() moves.
+
+void BLEGATTServer::invalidate_discovery_cache()
+{
+	std::lock_guard<std::mutex> lock(discovery_cache_mutex_);
+	discovery_cache_.clear();
+	discovery_cache_generation_ = db_.generation();
+}
+
+bool BLEGATTServer::find_cached_response(const DiscoveryCacheKey& key,
+                                        std::vector<uint8_t>& rsp)
+{
+	std::lock_guard<std::mutex> lock(discovery_cache_mutex_);
+
+	if (discovery_cache_generation_ != db_.generation()) {
+		discovery_cache_.clear();
+		discovery_cache_generation_ = db_.generation();
+		return false;
+	}
+
+	auto it = discovery_cache_.find(key);
+	if (it == discovery_cache_.end()) {
+		return false;
+	}
+
+	rsp = it->second;
+	return true;
+}
+
+void BLEGATTServer::cache_response(const DiscoveryCacheKey& key,
+                                  const std::vector<uint8_t>& rsp)
+{
+	std::lock_guard<std::mutex> lock(discovery_cache_mutex_);
+
+	if (discovery_cache_generation_ != db_.generation()) {
+		discovery_cache_.clear();
+		discovery_cache_generation_ = db_.generation();
+	}
+
+	if (discovery_cache_.size() >= discovery_cache_max_entries) {
+		discovery_cache_.clear();
+	}
+
+	discovery_cache_[key] = rsp;
+}
+
 // Transport callbacks
 
 void BLEGATTServer::on_transport_connected(const ConnectionParams& params)
 {
 	ENTER();
+	ALLOC_SCOPE(Server);
 
 	std::lock_guard<std::mutex> lock(connections_mutex_);
 
 	ConnectionState state;
 	state.conn_handle = params.conn_handle;
+	state.peer_address = params.peer_address;
+	state.peer_address_type = params.peer_address_type;
 	state.mtu = ATT_DEFAULT_MTU;
 	state.connected = true;
+	state.connection_time = std::chrono::steady_clock::now();
+	if (quirk_policy) {
+		state.quirks = call_user(quirk_policy, params, 0);
+	}
 
 	connections_[params.conn_handle] = state;
+	metrics_.connection_opened(params.conn_handle, params.peer_address);
 
 	LOG(Info, "Client connected: handle=" << params.conn_handle
 	          << " addr=" << params.peer_address);
 
 	// Call user callback
 	if (on_connected) {
-		on_connected(params.conn_handle, params.peer_address);
+		call_user(on_connected, params.conn_handle, params.peer_address);
 	}
 }
 
 void BLEGATTServer::on_transport_disconnected(uint16_t conn_handle)
 {
 	ENTER();
+	ALLOC_SCOPE(Server);
+
+	DeferredCalls done;
 
 	{
 		std::lock_guard<std::mutex> lock(connections_mutex_);
-		connections_.erase(conn_handle);
+		auto it = connections_.find(conn_handle);
+		if (it != connections_.end()) {
+			it->second.prepared_writes.cancel(prepared_write_pool_);
+			for (const auto& cccd : it->second.cccd_values) {
+				remove_notify_subscriber(cccd.first, conn_handle);
+			}
+			for (auto& ind : it->second.indications) {
+				indication_done(done, conn_handle, ind, IndicationResult::Disconnected);
+			}
+			if (it->second.indication_in_flight) {
+				timers_.cancel(it->second.indication_timer);
+			}
+			connections_.erase(it);
+		}
 	}
+	metrics_.connection_closed(conn_handle);
+	run_deferred(done);
 
 	LOG(Info, "Client disconnected: handle=" << conn_handle);
 
 	// Call user callback
 	if (on_disconnected) {
-		on_disconnected(conn_handle);
+		call_user(on_disconnected, conn_handle);
 	}
 }
 
 void BLEGATTServer::on_transport_data_received(uint16_t conn_handle,
                                               const uint8_t* data, size_t len)
 {
+	ALLOC_SCOPE(Server);
+
 	if (len < 1) {
 		LOG(Error, "Received empty PDU");
 		return;
@@ -316,6 +752,7 @@ void BLEGATTServer::handle_att_pdu(uint16_t conn_handle,
                                   const uint8_t* pdu, size_t len)
 {
 	uint8_t opcode = pdu[0];
+	auto start = metrics_start(metrics_);
 
 	LOG(Debug, "ATT PDU: conn=" << conn_handle << " opcode=0x"
 	           << std::hex << (int)opcode << std::dec << " len=" << len);
@@ -345,6 +782,11 @@ void BLEGATTServer::handle_att_pdu(uint16_t conn_handle,
 		handle_read_blob_req(conn_handle, pdu, len);
 		break;
 
+	case ATT_OP_READ_MULTIPLE_REQ:
+	case ATT_OP_READ_MULTIPLE_VAR_REQ:
+		handle_read_multiple_req(conn_handle, pdu, len);
+		break;
+
 	case ATT_OP_READ_BY_GROUP_TYPE_REQ:
 		handle_read_by_group_type_req(conn_handle, pdu, len);
 		break;
@@ -370,22 +812,17 @@ void BLEGATTServer::handle_att_pdu(uint16_t conn_handle,
 		break;
 
 	case ATT_OP_HANDLE_CONFIRM:
-		// Confirmation for indication - just acknowledge
-		LOG(Debug, "Received indication confirmation");
+		handle_indication_confirm(conn_handle);
 		break;
 
 	default:
-		// Log hex dump of unknown opcode
-		std::stringstream hex_dump;
-		hex_dump << std::hex << std::setfill('0');
-		for (size_t i = 0; i < len && i < 32; i++) {
-			hex_dump << std::setw(2) << (int)pdu[i] << " ";
-		}
-		LOG(Warning, "Unsupported ATT opcode: 0x" << std::hex << (int)opcode
-		            << " PDU: " << hex_dump.str());
+		LOG(Warning, "Unsupported ATT opcode: 0x" << std::hex << (int)opcode << std::dec
+		            << " PDU: " << to_hex(pdu, std::min<size_t>(len, 32)));
 		send_error_response(conn_handle, opcode, 0x0000, BLE_ATT_ERR_REQ_NOT_SUPPORTED);
 		break;
 	}
+
+	metrics_.record_request(conn_handle, opcode, len, elapsed_ns(metrics_, start));
 }
 
 // MTU Exchange
@@ -407,12 +844,22 @@ void BLEGATTServer::handle_mtu_exchange_req(uint16_t conn_handle,
 	uint16_t server_mtu = ATT_MAX_MTU;
 	uint16_t negotiated_mtu = std::min(client_mtu, server_mtu);
 
-	// Update connection state
+	// Update connection state, and take a second look at the peer's quirks
+	// now that its MTU request is available as a fingerprint
 	{
 		std::lock_guard<std::mutex> lock(connections_mutex_);
 		auto it = connections_.find(conn_handle);
 		if (it != connections_.end()) {
 			it->second.mtu = negotiated_mtu;
+
+			if (quirk_policy) {
+				ConnectionParams peer;
+				peer.conn_handle = conn_handle;
+				peer.peer_address = it->second.peer_address;
+				peer.peer_address_type = it->second.peer_address_type;
+				peer.mtu = negotiated_mtu;
+				it->second.quirks = call_user(quirk_policy, peer, client_mtu);
+			}
 		}
 	}
 
@@ -426,7 +873,7 @@ void BLEGATTServer::handle_mtu_exchange_req(uint16_t conn_handle,
 
 	// Call user callback
 	if (on_mtu_exchanged) {
-		on_mtu_exchanged(conn_handle, negotiated_mtu);
+		call_user(on_mtu_exchanged, conn_handle, negotiated_mtu);
 	}
 }
 
@@ -437,7 +884,7 @@ void BLEGATTServer::send_mtu_exchange_rsp(uint16_t conn_handle, uint16_t server_
 	rsp[1] = server_mtu & 0xFF;
 	rsp[2] = (server_mtu >> 8) & 0xFF;
 
-	transport_->send_pdu(conn_handle, rsp, sizeof(rsp));
+	send_pdu(conn_handle, rsp, sizeof(rsp));
 }
 
 // Find Information (UUID discovery)
@@ -463,20 +910,29 @@ void BLEGATTServer::handle_find_info_req(uint16_t conn_handle,
 		return;
 	}
 
-	// Get all attributes in range
-	auto attrs = db_.get_range(start_handle, end_handle);
+	uint16_t mtu = transport_->get_mtu(conn_handle);
+	DiscoveryCacheKey key = {ATT_OP_FIND_INFO_REQ, start_handle, end_handle, mtu, {}};
 
-	if (attrs.empty()) {
-		send_error_response(conn_handle, ATT_OP_FIND_INFO_REQ, start_handle,
-		                   BLE_ATT_ERR_ATTR_NOT_FOUND);
-		return;
+	std::vector<uint8_t> rsp;
+	if (!find_cached_response(key, rsp)) {
+		// Get all attributes in range
+		auto attrs = db_.get_range(start_handle, end_handle);
+
+		if (attrs.empty()) {
+			rsp = error_pdu(ATT_OP_FIND_INFO_REQ, start_handle, BLE_ATT_ERR_ATTR_NOT_FOUND);
+		} else {
+			build_find_info_rsp(mtu, attrs, rsp);
+		}
+
+		cache_response(key, rsp);
 	}
 
-	send_find_info_rsp(conn_handle, attrs);
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
-void BLEGATTServer::send_find_info_rsp(uint16_t conn_handle,
-                                      const std::vector<const Attribute*>& attrs)
+void BLEGATTServer::build_find_info_rsp(uint16_t mtu,
+                                       const std::vector<const Attribute*>& attrs,
+                                       std::vector<uint8_t>& rsp)
 {
 	if (attrs.empty()) return;
 
@@ -484,12 +940,11 @@ void BLEGATTServer::send_find_info_rsp(uint16_t conn_handle,
 	uint8_t format = attrs[0]->uuid.type == BT_UUID16 ? 0x01 : 0x02;
 	uint8_t handle_uuid_len = (format == 0x01) ? 4 : 18;
 
-	std::vector<uint8_t> rsp;
+	rsp.clear();
 	rsp.reserve(2 + attrs.size() * handle_uuid_len);
 	rsp.push_back(ATT_OP_FIND_INFO_RSP);
 	rsp.push_back(format);
 
-	uint16_t mtu = transport_->get_mtu(conn_handle);
 	size_t max_data = mtu - 2;  // Opcode + format
 
 	for (const auto* attr : attrs) {
@@ -518,8 +973,6 @@ void BLEGATTServer::send_find_info_rsp(uint16_t conn_handle,
 			rsp.insert(rsp.end(), uuid128_data, uuid128_data + 16);
 		}
 	}
-
-	transport_->send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 // Read By Type (characteristic/descriptor discovery)
@@ -559,28 +1012,42 @@ void BLEGATTServer::handle_read_by_type_req(uint16_t conn_handle,
 		return;
 	}
 
-	// Find attributes matching type in range
-	auto attrs = db_.find_by_type(start_handle, end_handle, type_uuid);
+	uint16_t mtu = transport_->get_mtu(conn_handle);
 
-	if (attrs.empty()) {
-		send_error_response(conn_handle, ATT_OP_READ_BY_TYPE_REQ, start_handle,
-		                   BLE_ATT_ERR_ATTR_NOT_FOUND);
-		return;
+	// Include and characteristic declarations are fixed once registered; any
+	// other type may be backed by a read callback or a writable value.
+	bool cacheable = type_uuid == UUID(0x2802) || type_uuid == UUID(0x2803);
+	DiscoveryCacheKey key = {ATT_OP_READ_BY_TYPE_REQ, start_handle, end_handle, mtu,
+	                         std::vector<uint8_t>(pdu + 5, pdu + len)};
+
+	std::vector<uint8_t> rsp;
+	if (!cacheable || !find_cached_response(key, rsp)) {
+		// Find attributes matching type in range
+		auto attrs = db_.find_by_type(start_handle, end_handle, type_uuid);
+
+		if (attrs.empty()) {
+			rsp = error_pdu(ATT_OP_READ_BY_TYPE_REQ, start_handle, BLE_ATT_ERR_ATTR_NOT_FOUND);
+		} else {
+			build_read_by_type_rsp(conn_handle, mtu, attrs, rsp);
+		}
+
+		if (cacheable) {
+			cache_response(key, rsp);
+		}
 	}
 
-	send_read_by_type_rsp(conn_handle, attrs);
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
-void BLEGATTServer::send_read_by_type_rsp(uint16_t conn_handle,
-                                         const std::vector<const Attribute*>& attrs)
+void BLEGATTServer::build_read_by_type_rsp(uint16_t conn_handle, uint16_t mtu,
+                                          const std::vector<const Attribute*>& attrs,
+                                          std::vector<uint8_t>& rsp)
 {
 	if (attrs.empty()) return;
 
-	std::vector<uint8_t> rsp;
+	rsp.clear();
 	rsp.push_back(ATT_OP_READ_BY_TYPE_RSP);
 
-	uint16_t mtu = transport_->get_mtu(conn_handle);
-
 	// Determine pair length from first attribute
 	std::vector<uint8_t> first_value;
 	const auto* first_attr = attrs[0];
@@ -614,8 +1081,6 @@ void BLEGATTServer::send_read_by_type_rsp(uint16_t conn_handle,
 		size_t value_len = std::min(value.size(), (size_t)(pair_len - 2));
 		rsp.insert(rsp.end(), value.begin(), value.begin() + value_len);
 	}
-
-	transport_->send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 // Read By Group Type (primary service discovery)
@@ -644,16 +1109,9 @@ void BLEGATTServer::handle_read_by_group_type_req(uint16_t conn_handle,
 		return;
 	}
 
-	// Log request bytes
-	std::stringstream req_hex;
-	req_hex << std::hex << std::setfill('0');
-	for (size_t i = 0; i < len; i++) {
-		req_hex << std::setw(2) << (int)pdu[i] << " ";
-	}
-
 	LOG(Debug, "Read By Group Type: start=0x" << std::hex << start_handle
 	           << " end=0x" << end_handle << " type=" << type_uuid.str() << std::dec
-	           << " [" << req_hex.str() << "]");
+	           << " [" << to_hex(pdu, len) << "]");
 
 	// Only Primary Service (0x2800) is a grouping attribute
 	if (type_uuid != UUID(0x2800)) {
@@ -662,33 +1120,59 @@ void BLEGATTServer::handle_read_by_group_type_req(uint16_t conn_handle,
 		return;
 	}
 
-	// Find primary services in range
-	auto attrs = db_.find_by_type(start_handle, end_handle, type_uuid);
+	uint16_t mtu = transport_->get_mtu(conn_handle);
+	DiscoveryCacheKey key = {ATT_OP_READ_BY_GROUP_TYPE_REQ, start_handle, end_handle, mtu,
+	                         std::vector<uint8_t>(pdu + 5, pdu + len)};
+
+	std::vector<uint8_t> rsp;
+	if (!find_cached_response(key, rsp)) {
+		// Find primary services in range
+		auto attrs = db_.find_by_type(start_handle, end_handle, type_uuid);
 
-	LOG(Debug, "Found " << attrs.size() << " services matching type " << type_uuid.str());
+		LOG(Debug, "Found " << attrs.size() << " services matching type " << type_uuid.str());
 
-	if (attrs.empty()) {
-		LOG(Debug, "No services found in range, sending Attribute Not Found error");
-		send_error_response(conn_handle, ATT_OP_READ_BY_GROUP_TYPE_REQ,
-		                   start_handle, BLE_ATT_ERR_ATTR_NOT_FOUND);
+		if (attrs.empty()) {
+			LOG(Debug, "No services found in range, sending Attribute Not Found error");
+			rsp = error_pdu(ATT_OP_READ_BY_GROUP_TYPE_REQ, start_handle,
+			                BLE_ATT_ERR_ATTR_NOT_FOUND);
+		} else {
+			build_read_by_group_type_rsp(mtu, attrs, rsp);
+		}
+
+		cache_response(key, rsp);
+	}
+
+	if (rsp[0] != ATT_OP_READ_BY_GROUP_TYPE_RSP) {
+		send_pdu(conn_handle, rsp.data(), rsp.size());
 		return;
 	}
 
-	// Check if this is a continuation request (start_handle > 1)
-	// If so, and we found services, this means we're continuing discovery
-	if (start_handle > 1) {
-		LOG(Debug, "Continuation request from handle " << start_handle);
+	// Android GATT client has a race condition where it queues the command AFTER sending the request.
+	// If our response arrives before Android queues the command (lines 497-498 in att_protocol.cc),
+	// gatt_cmd_dequeue() returns NULL and the response is silently dropped.
+	// This causes a 5-second timeout and retry.
+	// Peers flagged by the quirk policy get the response deferred on the timer
+	// wheel, which gives Android time to queue the command without blocking
+	// the event loop for everyone else.
+	uint16_t delay_ms = 0;
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+		auto it = connections_.find(conn_handle);
+		if (it != connections_.end()) {
+			delay_ms = it->second.quirks.discovery_response_delay_ms;
+		}
 	}
 
-	send_read_by_group_type_rsp(conn_handle, attrs);
+	send_pdu_deferred(conn_handle, std::move(rsp), delay_ms);
 }
 
-void BLEGATTServer::send_read_by_group_type_rsp(uint16_t conn_handle,
-                                               const std::vector<const Attribute*>& attrs)
+void BLEGATTServer::build_read_by_group_type_rsp(uint16_t mtu,
+                                                const std::vector<const Attribute*>& attrs,
+                                                std::vector<uint8_t>& rsp)
 {
 	if (attrs.empty()) return;
 
-	std::vector<uint8_t> rsp;
+	rsp.clear();
 	rsp.push_back(ATT_OP_READ_BY_GROUP_TYPE_RSP);
 
 	// Determine pair length from first attribute
@@ -699,8 +1183,6 @@ void BLEGATTServer::send_read_by_group_type_rsp(uint16_t conn_handle,
 	uint8_t pair_len = 4 + uuid_size;
 	rsp.push_back(pair_len);
 
-	uint16_t mtu = transport_->get_mtu(conn_handle);
-
 	LOG(Debug, "Building Read By Group Type response: uuid_size=" << (int)uuid_size
 	           << " pair_len=" << (int)pair_len << " mtu=" << mtu);
 
@@ -745,13 +1227,7 @@ void BLEGATTServer::send_read_by_group_type_rsp(uint16_t conn_handle,
 		            << " (may indicate incomplete service data)");
 	}
 
-	// Log hex dump of response
-	std::stringstream hex_dump;
-	hex_dump << std::hex << std::setfill('0');
-	for (size_t i = 0; i < rsp.size(); i++) {
-		hex_dump << std::setw(2) << (int)rsp[i] << " ";
-	}
-	LOG(Debug, "Sending Read By Group Type response: " << rsp.size() << " bytes: " << hex_dump.str());
+	LOG(Debug, "Sending Read By Group Type response: " << rsp.size() << " bytes: " << to_hex(rsp));
 
 	// Additional validation: Check that data length matches what length field claims
 	if (rsp.size() >= 2) {
@@ -763,16 +1239,39 @@ void BLEGATTServer::send_read_by_group_type_rsp(uint16_t conn_handle,
 		           << " calculated_size=" << expected_total
 		           << " actual_size=" << rsp.size());
 	}
+}
 
-	// CRITICAL FIX: Add small delay before sending response
-	// Android GATT client has a race condition where it queues the command AFTER sending the request.
-	// If our response arrives before Android queues the command (lines 497-498 in att_protocol.cc),
-	// gatt_cmd_dequeue() returns NULL and the response is silently dropped.
-	// This causes a 5-second timeout and retry.
-	// Delay ensures Android has time to queue the command before our response arrives.
-	usleep(20000);  // 20ms delay
+int BLEGATTServer::send_pdu(uint16_t conn_handle, const uint8_t* data, size_t len)
+{
+	int rc = transport_->send_pdu(conn_handle, data, len);
+	metrics_.record_sent(conn_handle, len, rc >= 0);
+	if (len >= 2 && data[0] == ATT_OP_ERROR) {
+		metrics_.record_error_response(conn_handle, data[1]);
+	}
+	return rc;
+}
+
+void BLEGATTServer::send_pdu_deferred(uint16_t conn_handle, std::vector<uint8_t>&& pdu,
+                                     uint16_t delay_ms)
+{
+	if (delay_ms == 0) {
+		send_pdu(conn_handle, pdu.data(), pdu.size());
+		return;
+	}
+
+	LOG(Debug, "Deferring " << pdu.size() << " byte response to connection "
+	           << conn_handle << " by " << delay_ms << "ms");
 
-	transport_->send_pdu(conn_handle, rsp.data(), rsp.size());
+	std::shared_ptr<std::vector<uint8_t>> held = std::make_shared<std::vector<uint8_t>>(std::move(pdu));
+	timers_.schedule(delay_ms, [this, conn_handle, held]() {
+		// The peer may have gone away while the response was held back
+		if (get_connection_state(conn_handle)) {
+			send_pdu(conn_handle, held->data(), held->size());
+		}
+	});
+
+	// Handlers can run on a transport thread, so make sure the loop sees the timer
+	transport_->wakeup();
 }
 
 // Read Request
@@ -818,20 +1317,21 @@ void BLEGATTServer::handle_read_req(uint16_t conn_handle,
 }
 
 void BLEGATTServer::send_read_rsp(uint16_t conn_handle,
-                                 const std::vector<uint8_t>& value)
+                                 const std::vector<uint8_t>& value,
+                                 uint8_t opcode)
 {
 	uint16_t mtu = transport_->get_mtu(conn_handle);
 	size_t max_data = mtu - 1;  // Opcode
 
 	std::vector<uint8_t> rsp;
 	rsp.reserve(1 + std::min(value.size(), max_data));
-	rsp.push_back(ATT_OP_READ_RSP);
+	rsp.push_back(opcode);
 
 	// Truncate to MTU if necessary
 	size_t send_len = std::min(value.size(), max_data);
 	rsp.insert(rsp.end(), value.begin(), value.begin() + send_len);
 
-	transport_->send_pdu(conn_handle, rsp.data(), rsp.size());
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 // Read Blob Request (for long attributes)
@@ -884,7 +1384,84 @@ void BLEGATTServer::handle_read_blob_req(uint16_t conn_handle,
 
 	// Send from offset
 	std::vector<uint8_t> blob_value(value.begin() + offset, value.end());
-	send_read_rsp(conn_handle, blob_value);
+	send_read_rsp(conn_handle, blob_value, ATT_OP_READ_BLOB_RSP);
+}
+
+// Read Multiple / Read Multiple Variable
+
+void BLEGATTServer::handle_read_multiple_req(uint16_t conn_handle,
+                                            const uint8_t* pdu, size_t len)
+{
+	uint8_t opcode = pdu[0];
+	bool variable = opcode == ATT_OP_READ_MULTIPLE_VAR_REQ;
+
+	// Two or more handles
+	if (len < 5 || (len - 1) % 2 != 0) {
+		send_error_response(conn_handle, opcode, 0x0000, BLE_ATT_ERR_INVALID_PDU);
+		return;
+	}
+
+	LOG(Debug, "Read Multiple" << (variable ? " Variable" : "") << " Request: "
+	           << (len - 1) / 2 << " handles");
+
+	uint16_t mtu = transport_->get_mtu(conn_handle);
+	size_t max_len = mtu;
+
+	std::vector<uint8_t> rsp;
+	rsp.reserve(max_len);
+	rsp.push_back(variable ? ATT_OP_READ_MULTIPLE_VAR_RSP : ATT_OP_READ_MULTIPLE_RSP);
+
+	// Every handle must be readable, even the ones whose values will not
+	// fit; the first failure is reported and nothing else is returned.
+	std::vector<uint8_t> value;
+	bool full = false;
+	for (size_t i = 1; i < len; i += 2) {
+		uint16_t handle = pdu[i] | (pdu[i + 1] << 8);
+
+		auto* attr = db_.get_attribute(handle);
+		if (!attr) {
+			send_error_response(conn_handle, opcode, handle, BLE_ATT_ERR_INVALID_HANDLE);
+			return;
+		}
+
+		if (!(attr->permissions & ATT_PERM_READ)) {
+			send_error_response(conn_handle, opcode, handle, BLE_ATT_ERR_READ_NOT_PERM);
+			return;
+		}
+
+		value.clear();
+		int result = invoke_read_callback(attr, conn_handle, 0, value);
+		if (result != 0) {
+			send_error_response(conn_handle, opcode, handle, result);
+			return;
+		}
+
+		if (full) {
+			continue;
+		}
+
+		size_t room = max_len > rsp.size() ? max_len - rsp.size() : 0;
+		if (variable) {
+			// A tuple needs its length and at least one byte of a non-empty
+			// value. Once one does not fit, the rest are left for the client
+			// to ask for again.
+			if (room < 2 + std::min<size_t>(value.size(), 1)) {
+				full = true;
+				continue;
+			}
+			room -= 2;
+
+			// The length is always the full value's, which is how the
+			// client learns a value was cut and needs a Read Blob
+			rsp.push_back(value.size() & 0xFF);
+			rsp.push_back((value.size() >> 8) & 0xFF);
+		}
+
+		// Values past the MTU are cut off, as the spec requires
+		rsp.insert(rsp.end(), value.begin(), value.begin() + std::min(room, value.size()));
+	}
+
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 // Write Request
@@ -939,7 +1516,7 @@ void BLEGATTServer::handle_write_req(uint16_t conn_handle,
 void BLEGATTServer::send_write_rsp(uint16_t conn_handle)
 {
 	uint8_t rsp = ATT_OP_WRITE_RSP;
-	transport_->send_pdu(conn_handle, &rsp, 1);
+	send_pdu(conn_handle, &rsp, 1);
 }
 
 // Write Command (no response)
@@ -979,17 +1556,169 @@ void BLEGATTServer::handle_write_cmd(uint16_t conn_handle,
 void BLEGATTServer::handle_prepare_write_req(uint16_t conn_handle,
                                             const uint8_t* pdu, size_t len)
 {
-	// TODO: Implement prepared write queue
-	send_error_response(conn_handle, ATT_OP_PREPARE_WRITE_REQ, 0x0000,
-	                   BLE_ATT_ERR_REQ_NOT_SUPPORTED);
+	if (len < 5) {
+		send_error_response(conn_handle, ATT_OP_PREPARE_WRITE_REQ, 0x0000,
+		                   BLE_ATT_ERR_INVALID_PDU);
+		return;
+	}
+
+	uint16_t handle = pdu[1] | (pdu[2] << 8);
+	uint16_t offset = pdu[3] | (pdu[4] << 8);
+
+	LOG(Debug, "Prepare Write Request: handle=0x" << std::hex << handle
+	           << std::dec << " offset=" << offset << " len=" << (len - 5));
+
+	auto* attr = db_.get_attribute(handle);
+	if (!attr) {
+		send_error_response(conn_handle, ATT_OP_PREPARE_WRITE_REQ, handle,
+		                   BLE_ATT_ERR_INVALID_HANDLE);
+		return;
+	}
+
+	if (!(attr->permissions & ATT_PERM_WRITE)) {
+		send_error_response(conn_handle, ATT_OP_PREPARE_WRITE_REQ, handle,
+		                   BLE_ATT_ERR_WRITE_NOT_PERM);
+		return;
+	}
+
+	int rc = -1;
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+		auto it = connections_.find(conn_handle);
+		if (it != connections_.end()) {
+			rc = it->second.prepared_writes.push(prepared_write_pool_, handle, offset,
+			                                     pdu + 5, len - 5, prepared_write_max_bytes_);
+		}
+	}
+
+	if (rc != 0) {
+		send_error_response(conn_handle, ATT_OP_PREPARE_WRITE_REQ, handle,
+		                   BLE_ATT_ERR_PREPARE_QUEUE_FULL);
+		return;
+	}
+
+	// The response echoes the request so the client can verify what was queued
+	std::vector<uint8_t> rsp(pdu, pdu + len);
+	rsp[0] = ATT_OP_PREPARE_WRITE_RSP;
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 void BLEGATTServer::handle_execute_write_req(uint16_t conn_handle,
                                             const uint8_t* pdu, size_t len)
 {
-	// TODO: Implement prepared write queue
-	send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, 0x0000,
-	                   BLE_ATT_ERR_REQ_NOT_SUPPORTED);
+	if (len < 2 || pdu[1] > 0x01) {
+		send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, 0x0000,
+		                   BLE_ATT_ERR_INVALID_PDU);
+		return;
+	}
+
+	bool execute = pdu[1] == 0x01;
+
+	LOG(Debug, "Execute Write Request: " << (execute ? "write" : "cancel"));
+
+	// Take the queued values out under the lock; callbacks run without it
+	std::vector<PreparedWriteQueue::Write> writes;
+	uint16_t error_handle = 0;
+	int rc = 0;
+	{
+		std::lock_guard<std::mutex> lock(connections_mutex_);
+		auto it = connections_.find(conn_handle);
+		if (it != connections_.end()) {
+			if (execute) {
+				rc = it->second.prepared_writes.drain(prepared_write_pool_, writes, error_handle);
+			} else {
+				it->second.prepared_writes.cancel(prepared_write_pool_);
+			}
+		}
+	}
+
+	if (rc != 0) {
+		send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, error_handle, rc);
+		return;
+	}
+
+	// Check every write before applying any, so a bad one leaves all
+	// attributes untouched. The current values are kept so that a write
+	// callback refusing its value part way through can be rolled back.
+	std::vector<Attribute*> targets;
+	std::vector<std::vector<uint8_t>> previous(writes.size());
+	for (size_t i = 0; i < writes.size(); i++) {
+		auto& w = writes[i];
+		auto* attr = db_.get_attribute(w.handle);
+		if (!attr) {
+			send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, w.handle,
+			                   BLE_ATT_ERR_INVALID_HANDLE);
+			return;
+		}
+
+		invoke_read_callback(attr, conn_handle, 0, previous[i]);
+
+		if (w.offset > 0) {
+			// Splice onto the existing value; the write callback takes whole values
+			if (previous[i].size() < w.offset) {
+				send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, w.handle,
+				                   BLE_ATT_ERR_INVALID_OFFSET);
+				return;
+			}
+			std::vector<uint8_t> base(previous[i].begin(), previous[i].begin() + w.offset);
+			base.insert(base.end(), w.value.begin(), w.value.end());
+			w.value.swap(base);
+		}
+
+		if (w.value.size() > ATT_MAX_VALUE_LEN) {
+			send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, w.handle,
+			                   BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN);
+			return;
+		}
+
+		targets.push_back(attr);
+	}
+
+	for (size_t i = 0; i < writes.size(); i++) {
+		Attribute* attr = targets[i];
+		const std::vector<uint8_t>& value = writes[i].value;
+
+		if (attr->uuid == UUID(0x2902) && value.size() == 2) {
+			handle_cccd_write(conn_handle, attr->handle, value[0] | (value[1] << 8));
+		}
+
+		rc = invoke_write_callback(attr, conn_handle, value);
+		if (rc != 0) {
+			rollback_execute_write(conn_handle, targets, previous, i);
+			send_error_response(conn_handle, ATT_OP_EXECUTE_WRITE_REQ, attr->handle, rc);
+			return;
+		}
+	}
+
+	uint8_t rsp = ATT_OP_EXECUTE_WRITE_RSP;
+	send_pdu(conn_handle, &rsp, 1);
+}
+
+void BLEGATTServer::rollback_execute_write(uint16_t conn_handle,
+                                           const std::vector<Attribute*>& targets,
+                                           const std::vector<std::vector<uint8_t>>& previous,
+                                           size_t failed)
+{
+	// The failed attribute refused its value, so only its CCCD state can
+	// have changed; the ones before it are written back newest first
+	Attribute* attr = targets[failed];
+	if (attr->uuid == UUID(0x2902) && previous[failed].size() == 2) {
+		handle_cccd_write(conn_handle, attr->handle, previous[failed][0] | (previous[failed][1] << 8));
+	}
+
+	for (size_t i = failed; i-- > 0;) {
+		attr = targets[i];
+		const std::vector<uint8_t>& value = previous[i];
+
+		if (attr->uuid == UUID(0x2902) && value.size() == 2) {
+			handle_cccd_write(conn_handle, attr->handle, value[0] | (value[1] << 8));
+		}
+
+		if (invoke_write_callback(attr, conn_handle, value) != 0) {
+			LOG(Warning, "Could not restore handle 0x" << std::hex << attr->handle
+			             << std::dec << " after a failed Execute Write");
+		}
+	}
 }
 
 void BLEGATTServer::handle_signed_write_cmd(uint16_t conn_handle,
@@ -1018,21 +1747,41 @@ void BLEGATTServer::handle_find_by_type_value_req(uint16_t conn_handle,
 	LOG(Debug, "Find By Type Value: start=0x" << std::hex << start_handle
 	           << " end=0x" << end_handle << " type=0x" << type << std::dec);
 
-	// Find attributes
-	auto attrs = db_.find_by_type_value(start_handle, end_handle,
-	                                    UUID(type), value);
+	uint16_t mtu = transport_->get_mtu(conn_handle);
 
-	if (attrs.empty()) {
-		send_error_response(conn_handle, ATT_OP_FIND_BY_TYPE_VALUE_REQ,
-		                   start_handle, BLE_ATT_ERR_ATTR_NOT_FOUND);
-		return;
-	}
+	// Service declarations are fixed once registered; other values can change
+	bool cacheable = type == 0x2800 || type == 0x2801;
+	DiscoveryCacheKey key = {ATT_OP_FIND_BY_TYPE_VALUE_REQ, start_handle, end_handle, mtu,
+	                         std::vector<uint8_t>(pdu + 5, pdu + len)};
 
-	// Build response
 	std::vector<uint8_t> rsp;
+	if (!cacheable || !find_cached_response(key, rsp)) {
+		// Find attributes
+		auto attrs = db_.find_by_type_value(start_handle, end_handle,
+		                                    UUID(type), value);
+
+		if (attrs.empty()) {
+			rsp = error_pdu(ATT_OP_FIND_BY_TYPE_VALUE_REQ, start_handle,
+			                BLE_ATT_ERR_ATTR_NOT_FOUND);
+		} else {
+			build_find_by_type_value_rsp(mtu, attrs, rsp);
+		}
+
+		if (cacheable) {
+			cache_response(key, rsp);
+		}
+	}
+
+	send_pdu(conn_handle, rsp.data(), rsp.size());
+}
+
+void BLEGATTServer::build_find_by_type_value_rsp(uint16_t mtu,
+                                                const std::vector<const Attribute*>& attrs,
+                                                std::vector<uint8_t>& rsp)
+{
+	rsp.clear();
 	rsp.push_back(ATT_OP_FIND_BY_TYPE_VALUE_RSP);
 
-	uint16_t mtu = transport_->get_mtu(conn_handle);
 	size_t max_data = mtu - 1;
 
 	for (const auto* attr : attrs) {
@@ -1048,23 +1797,22 @@ void BLEGATTServer::handle_find_by_type_value_req(uint16_t conn_handle,
 		rsp.push_back(attr->end_group_handle & 0xFF);
 		rsp.push_back((attr->end_group_handle >> 8) & 0xFF);
 	}
-
-	transport_->send_pdu(conn_handle, rsp.data(), rsp.size());
 }
 
 // Error Response
 
+std::vector<uint8_t> BLEGATTServer::error_pdu(uint8_t opcode, uint16_t handle,
+                                             uint8_t error_code)
+{
+	return {ATT_OP_ERROR, opcode, (uint8_t)(handle & 0xFF),
+	        (uint8_t)((handle >> 8) & 0xFF), error_code};
+}
+
 void BLEGATTServer::send_error_response(uint16_t conn_handle, uint8_t opcode,
                                        uint16_t handle, uint8_t error_code)
 {
-	uint8_t rsp[5];
-	rsp[0] = ATT_OP_ERROR;
-	rsp[1] = opcode;
-	rsp[2] = handle & 0xFF;
-	rsp[3] = (handle >> 8) & 0xFF;
-	rsp[4] = error_code;
-
-	transport_->send_pdu(conn_handle, rsp, sizeof(rsp));
+	std::vector<uint8_t> rsp = error_pdu(opcode, handle, error_code);
+	send_pdu(conn_handle, rsp.data(), rsp.size());
 
 	LOG(Debug, "ATT Error: opcode=0x" << std::hex << (int)opcode
 	           << " handle=0x" << handle
@@ -1091,6 +1839,16 @@ void BLEGATTServer::handle_cccd_write(uint16_t conn_handle, uint16_t cccd_handle
 	uint16_t char_handle = cccd_handle - 1;
 	it->second.cccd_values[char_handle] = value;
 
+	if (value & 0x0001) {
+		std::vector<uint16_t>& subs = notify_subscribers_[char_handle];
+		auto pos = std::lower_bound(subs.begin(), subs.end(), conn_handle);
+		if (pos == subs.end() || *pos != conn_handle) {
+			subs.insert(pos, conn_handle);
+		}
+	} else {
+		remove_notify_subscriber(char_handle, conn_handle);
+	}
+
 	if (value & 0x0001) {
 		LOG(Info, "Notifications enabled for characteristic 0x"
 		          << std::hex << char_handle << std::dec);
@@ -1105,34 +1863,56 @@ void BLEGATTServer::handle_cccd_write(uint16_t conn_handle, uint16_t cccd_handle
 	}
 }
 
+void BLEGATTServer::remove_notify_subscriber(uint16_t char_val_handle, uint16_t conn_handle)
+{
+	auto it = notify_subscribers_.find(char_val_handle);
+	if (it == notify_subscribers_.end()) {
+		return;
+	}
+
+	std::vector<uint16_t>& subs = it->second;
+	subs.erase(std::remove(subs.begin(), subs.end(), conn_handle), subs.end());
+	if (subs.empty()) {
+		notify_subscribers_.erase(it);
+	}
+}
+
 // Callback invocation helpers
 
 int BLEGATTServer::invoke_read_callback(const Attribute* attr, uint16_t conn_handle,
                                        uint16_t offset, std::vector<uint8_t>& out_data)
 {
-	if (attr->read_cb) {
-		return attr->read_cb(conn_handle, offset, out_data);
-	}
+	auto start = metrics_start(metrics_);
+	int rc = 0;
 
-	// No callback - use static value
-	if (offset >= attr->value.size()) {
-		return BLE_ATT_ERR_INVALID_OFFSET;
+	if (attr->read_cb) {
+		rc = call_user(attr->read_cb, conn_handle, offset, out_data);
+	} else if (offset > attr->value.size()) {
+		// No callback - use static value; reading at the end gives an empty value
+		rc = BLE_ATT_ERR_INVALID_OFFSET;
+	} else {
+		out_data.assign(attr->value.begin() + offset, attr->value.end());
 	}
 
-	out_data.assign(attr->value.begin() + offset, attr->value.end());
-	return 0;
+	metrics_.record_read_callback(attr->handle, elapsed_ns(metrics_, start), rc);
+	return rc;
 }
 
 int BLEGATTServer::invoke_write_callback(Attribute* attr, uint16_t conn_handle,
                                         const std::vector<uint8_t>& data)
 {
+	auto start = metrics_start(metrics_);
+	int rc = 0;
+
 	if (attr->write_cb) {
-		return attr->write_cb(conn_handle, data);
+		rc = call_user(attr->write_cb, conn_handle, data);
+	} else {
+		// No callback - update static value
+		attr->value = data;
 	}
 
-	// No callback - update static value
-	attr->value = data;
-	return 0;
+	metrics_.record_write_callback(attr->handle, elapsed_ns(metrics_, start), rc);
+	return rc;
 }
 
 } // namespace BLEPP
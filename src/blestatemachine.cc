@@ -25,6 +25,7 @@
 #include "blepp/att_pdu.h"
 #include "blepp/pretty_printers.h"
 #include "blepp/blestatemachine.h"
+#include "blepp/alloc_stats.h"
 
 #include <algorithm>
 
@@ -152,15 +153,33 @@ namespace BLEPP
 			log_fd(::close(sock));
 		sock = -1;
 		primary_services.clear();
+		read_multiple_variable_supported=true;
+		request_queue.clear();
+		stream = WriteStream();
+		dev.pending.clear();
 	}
 
 	void BLEGATTStateMachine::close()
 	{
 		close_and_cleanup();
-		cb_disconnected(Disconnect(Disconnect::ConnectionClosed, 0));
+		call_user(cb_disconnected, Disconnect(Disconnect::ConnectionClosed, 0));
 
 	}
 
+	void BLEGATTStateMachine::attach(int fd)
+	{
+		ENTER();
+
+		if(state != Disconnected)
+			throw std::logic_error("Error trying to attach a socket while already connected");
+
+		//The socket is already connected, so go straight to Idle as
+		//a successful blocking connect() does.
+		sock = fd;
+		state = Idle;
+		call_user(cb_connected);
+	}
+
 #ifdef BLEPP_BLUEZ_SUPPORT
 	int log_l2cap_options(int sock)
 	{
@@ -198,6 +217,7 @@ namespace BLEPP
 	:dev(sock)
 	{
 		ENTER();
+		ALLOC_SCOPE(StateMachine);
 		close_and_cleanup();
 		buf.resize(bufsize);
 	}
@@ -311,7 +331,7 @@ namespace BLEPP
 				throw SocketGetSockOptFailed(strerror(errno));
 			}
 
-			cb_connected();
+			call_user(cb_connected);
 		}
 		else if(errno == EINPROGRESS)
 		{
@@ -322,7 +342,7 @@ namespace BLEPP
 		else if(errno == ENETUNREACH || errno == EHOSTUNREACH)
 		{
 			close_and_cleanup();
-			cb_disconnected(Disconnect(Disconnect::Reason::ConnectionFailed, errno));
+			call_user(cb_disconnected, Disconnect(Disconnect::Reason::ConnectionFailed, errno));
 		}
 		else
 		{
@@ -345,6 +365,39 @@ namespace BLEPP
 		next_handle_to_read=-1;
 		last_request=-1;
 		read_req_handle=-1;
+		read_multiple_handles.clear();
+		read_multiple_batch=0;
+		read_multiple_blob=false;
+		read_multiple_partial.clear();
+		read_multiple_length=0;
+		read_done = nullptr;
+		write_done = nullptr;
+	}
+
+	bool BLEGATTStateMachine::queue_if_busy(std::function<void()> issue)
+	{
+		ALLOC_SCOPE(StateMachine);
+
+		if(state == Idle)
+			return false;
+
+		if(state == Disconnected || state == Connecting)
+			throw std::logic_error("Error trying to issue command while not connected");
+
+		//ATT allows one outstanding request, so hold this one until the
+		//current request completes.
+		request_queue.push_back(std::move(issue));
+		return true;
+	}
+
+	void BLEGATTStateMachine::start_next_request()
+	{
+		if(state != Idle || request_queue.empty())
+			return;
+
+		std::function<void()> issue = std::move(request_queue.front());
+		request_queue.pop_front();
+		issue();
 	}
 
 
@@ -379,6 +432,29 @@ namespace BLEPP
 				last_request = ATT_OP_READ_REQ;
 				//data already sent
 			}
+			else if(state == AwaitingReadMultipleResponse && read_multiple_blob)
+			{
+				last_request = ATT_OP_READ_BLOB_REQ;
+				dev.send_read_blob_request(read_multiple_handles[0], read_multiple_partial.size());
+			}
+			else if(state == AwaitingReadMultipleResponse)
+			{
+				//Each handle takes 2 bytes after the opcode. A request needs at
+				//least two handles, so a lone handle uses a plain read.
+				size_t per_request = read_multiple_variable_supported ? (dev.buf.size() - 1) / 2 : 1;
+				read_multiple_batch = std::min(std::max<size_t>(per_request, 1), read_multiple_handles.size());
+
+				if(read_multiple_batch == 1)
+				{
+					last_request = ATT_OP_READ_REQ;
+					dev.send_read_request(read_multiple_handles[0]);
+				}
+				else
+				{
+					last_request = ATT_OP_READ_MULTI_VAR_REQ;
+					dev.send_read_multiple(read_multiple_handles.data(), read_multiple_batch, true);
+				}
+			}
 		}
 		catch(BLEDevice::WriteError)
 		{
@@ -396,8 +472,8 @@ namespace BLEPP
 
 	void BLEGATTStateMachine::read_primary_services()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		if(queue_if_busy([this](){ read_primary_services(); }))
+			return;
 		state = ReadingPrimaryService;
 		next_handle_to_read=1;
 		state_machine_write();
@@ -405,8 +481,8 @@ namespace BLEPP
 
 	void BLEGATTStateMachine::find_all_characteristics()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		if(queue_if_busy([this](){ find_all_characteristics(); }))
+			return;
 		state = FindAllCharacteristics;
 		next_handle_to_read=1;
 		state_machine_write();
@@ -414,8 +490,8 @@ namespace BLEPP
 
 	void BLEGATTStateMachine::get_client_characteristic_configuration()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		if(queue_if_busy([this](){ get_client_characteristic_configuration(); }))
+			return;
 		state = GetClientCharaceristicConfiguration;
 		next_handle_to_read=1;
 		state_machine_write();
@@ -425,14 +501,18 @@ namespace BLEPP
 	{
 		LOG(Trace, "BLEGATTStateMachine::enable_indications(Characteristic&)");
 
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		
 		if(!c.indicate && indicate)
 			throw std::logic_error("Error: this is not indicateable");
 		if(!c.notify && notify)
 			throw std::logic_error("Error: this is not notifiable");
 
+		//Write commands need no response, so only requests wait their turn
+		Characteristic* cp = &c;
+		if(type == WriteType::Request && queue_if_busy([=](){ set_notify_and_indicate(*cp, notify, indicate, type); }))
+			return;
+		if(state == Disconnected || state == Connecting)
+			throw std::logic_error("Error trying to issue command while not connected");
+
 		//FIXME: check for CCC
 		c.ccc_last_known_value = notify | (indicate << 1);
 
@@ -456,7 +536,7 @@ namespace BLEPP
 
 	bool BLEGATTStateMachine::wait_on_write()
 	{
-		if(state == Connecting)
+		if(state == Connecting || stream.active || dev.has_pending())
 			return true;
 		else
 			return false;
@@ -465,7 +545,7 @@ namespace BLEPP
 	void BLEGATTStateMachine::fail(Disconnect d)
 	{
 		close_and_cleanup();
-		cb_disconnected(d);
+		call_user(cb_disconnected, d);
 	}
 
 	void BLEGATTStateMachine::unexpected_error(const PDUErrorResponse& r)
@@ -481,6 +561,7 @@ namespace BLEPP
 	void BLEGATTStateMachine::write_and_process_next()
 	{
 		ENTER();
+		ALLOC_SCOPE(StateMachine);
 		try
 		{
 			LOG(Debug, "State is: " << state);
@@ -498,15 +579,22 @@ namespace BLEPP
 				{
 					//Connected, so go to the idle state
 					reset();
-					cb_connected();
+					call_user(cb_connected);
 				}
 				else
 				{
 					close_and_cleanup();
-					cb_disconnected(Disconnect(Disconnect::Reason::ConnectionFailed, errval));
+					call_user(cb_disconnected, Disconnect(Disconnect::Reason::ConnectionFailed, errval));
 				}
 
 			}
+			else if(dev.has_pending() || stream.active)
+			{
+				//PDUs held back while the socket was full go out before the
+				//stream carries on
+				if(dev.flush_pending() && stream.active)
+					pump_stream();
+			}
 			else
 			{
 				LOG(Error, "Not implemented!");
@@ -525,6 +613,7 @@ namespace BLEPP
 	void BLEGATTStateMachine::read_and_process_next()
 	{
 		ENTER();
+		ALLOC_SCOPE(StateMachine);
 		//This is always an error
 		if(state == Connecting)
 			throw std::logic_error("Trying to read socket while connecting");
@@ -553,9 +642,9 @@ namespace BLEPP
 				if(c)
 				{
 					if(c->cb_notify_or_indicate)
-						c->cb_notify_or_indicate(n);
+						call_user(c->cb_notify_or_indicate, n);
 					else if(cb_notify_or_indicate)
-						cb_notify_or_indicate(*c, n);
+						call_user(cb_notify_or_indicate, *c, n);
 					else
 						LOG(Warning, "Notify arrived, but no callback set\n");
 				}
@@ -599,7 +688,8 @@ namespace BLEPP
 						{
 							//Maybe ? Indicates that the last one has been read.
 							reset();
-							cb_services_read();
+							start_next_request();
+							call_user(cb_services_read);
 						}
 						else
 							unexpected_error(r);
@@ -621,7 +711,8 @@ namespace BLEPP
 						if(primary_services.back().end_handle == 0xffff)
 						{
 							reset();
-							cb_services_read();
+							start_next_request();
+							call_user(cb_services_read);
 						}
 						else
 						{
@@ -638,7 +729,8 @@ namespace BLEPP
 						{
 							//Maybe ? Indicates that the last one has been read.
 							reset();
-							cb_find_characteristics();
+							start_next_request();
+							call_user(cb_find_characteristics);
 						}
 						else
 							unexpected_error(r);
@@ -704,7 +796,8 @@ namespace BLEPP
 						{
 							//Maybe ? Indicates that the last one has been read.
 							reset();
-							cb_get_client_characteristic_configuration();
+							start_next_request();
+							call_user(cb_get_client_characteristic_configuration);
 						}
 						else
 							unexpected_error(r);
@@ -741,8 +834,98 @@ namespace BLEPP
 						unexpected_error(r);
 					else
 					{
+						std::function<void()> done = std::move(write_done);
 						reset();
-						cb_write_response();
+						start_next_request();
+
+						if(done)
+							call_user(done);
+						else
+							call_user(cb_write_response);
+					}
+				}
+				else if(state == AwaitingReadMultipleResponse)
+				{
+					if(r.type() == ATT_OP_ERROR)
+					{
+						uint8_t code = PDUErrorResponse(r).error_code();
+						if(last_request == ATT_OP_READ_MULTI_VAR_REQ && code == ATT_ECODE_REQ_NOT_SUPP)
+						{
+							//Pre 5.2 server: carry on one handle at a time
+							LOG(Info, "Read Multiple Variable not supported, falling back to single reads");
+							read_multiple_variable_supported = false;
+							state_machine_write();
+						}
+						else if(last_request == ATT_OP_READ_BLOB_REQ && (code == ATT_ECODE_ATTR_NOT_LONG || code == ATT_ECODE_INVALID_OFFSET))
+						{
+							//The value ended exactly at the MTU
+							read_multiple_finish_blob();
+							read_multiple_continue();
+						}
+						else
+							unexpected_error(r);
+					}
+					else if(r.type() == ATT_OP_READ_BLOB_RESP)
+					{
+						PDUReadBlobResponse read(r);
+						read_multiple_partial.insert(read_multiple_partial.end(), read.value().first, read.value().second);
+
+						//A short response, or reaching the length the server
+						//gave, marks the end of the value
+						bool complete = read.num_elements() < (int)dev.buf.size() - 1 || (read_multiple_length != 0 && read_multiple_partial.size() >= read_multiple_length);
+						if(complete)
+							read_multiple_finish_blob();
+						read_multiple_continue();
+					}
+					else if(r.type() == ATT_OP_READ_RESP)
+					{
+						PDUReadResponse read(r);
+
+						//A value filling the whole response may continue
+						if(read.num_elements() == (int)dev.buf.size() - 1)
+							read_multiple_start_blob(read.value().first, read.value().second, 0);
+						else
+						{
+							uint16_t handle = read_multiple_handles[0];
+							read_multiple_handles.erase(read_multiple_handles.begin());
+							dispatch_read_multiple(handle, read.value().first, read.value().second);
+						}
+						read_multiple_continue();
+					}
+					else
+					{
+						PDUReadMultipleVariableResponse read(r);
+
+						//Only the values that arrived are done, and values that
+						//did not fit at all are requested again. The last one
+						//may be cut short, which its full length shows.
+						size_t done = 0;
+						bool cut = false;
+						while(done < read_multiple_batch && (int)done < read.num_elements())
+						{
+							cut = read.truncated(done);
+							if(cut)
+								break;
+							done++;
+						}
+
+						if(cut)
+							read_multiple_start_blob(read.value(done).first, read.value(done).second, read.value_length(done));
+						else if(done == 0)
+						{
+							LOG(Warning, "Empty Read Multiple Variable response, skipping " << read_multiple_batch << " handles");
+							done = read_multiple_batch;
+						}
+
+						//Values are dispatched from a copy, since a callback
+						//may reset the state machine.
+						std::vector<uint16_t> batch(read_multiple_handles.begin(), read_multiple_handles.begin() + done);
+						read_multiple_handles.erase(read_multiple_handles.begin(), read_multiple_handles.begin() + done);
+
+						for(size_t i=0; i < batch.size() && (int)i < read.num_elements(); i++)
+							dispatch_read_multiple(batch[i], read.value(i).first, read.value(i).second);
+
+						read_multiple_continue();
 					}
 				}
 				else if(state == AwaitingReadResponse)
@@ -754,18 +937,25 @@ namespace BLEPP
 					else
 					{
 						uint16_t h = read_req_handle;
+						std::function<void(const PDUReadResponse&)> done = std::move(read_done);
 						reset();
 
+						//The response stays in buf, so the next request can go
+						//out before the callbacks run.
+						start_next_request();
+
 						PDUReadResponse read(r);
 						Characteristic* c = characteristic_of_handle(h);
 						LOG(Debug, "Read response: handle requested was " << to_hex(h));
 
-						if(c)
+						if(done)
+							call_user(done, read);
+						else if(c)
 						{
 							if(c->cb_read)
-								c->cb_read(read);
+								call_user(c->cb_read, read);
 							else if(cb_read)
-								cb_read(*c, read);
+								call_user(cb_read, *c, read);
 							else
 								LOG(Warning, "Read arrived, but no callback set\n");
 						}
@@ -796,26 +986,116 @@ namespace BLEPP
 		return nullptr;
 	}
 
-	void BLEGATTStateMachine::send_read_request(uint16_t handle)
+	void BLEGATTStateMachine::send_read_request(uint16_t handle, std::function<void(const PDUReadResponse&)> on_read)
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		if(queue_if_busy([=](){ send_read_request(handle, on_read); }))
+			return;
 		dev.send_read_request(handle);
 		read_req_handle = handle;
+		read_done = on_read;
 		state = AwaitingReadResponse;
 		state_machine_write();
 	}
 
+	void BLEGATTStateMachine::read_multiple(const std::vector<uint16_t>& handles)
+	{
+		ALLOC_SCOPE(StateMachine);
+
+		if(queue_if_busy([=](){ read_multiple(handles); }))
+			return;
+
+		if(handles.empty())
+		{
+			call_user(cb_read_multiple_done);
+			return;
+		}
+
+		read_multiple_handles = handles;
+		state = AwaitingReadMultipleResponse;
+		state_machine_write();
+	}
+
+	void BLEGATTStateMachine::read_multiple(const std::vector<Characteristic*>& characteristics)
+	{
+		std::vector<uint16_t> handles;
+		for(const Characteristic* c: characteristics)
+			handles.push_back(c->value_handle);
+		read_multiple(handles);
+	}
+
+	void BLEGATTStateMachine::read_multiple_start_blob(const uint8_t* begin, const uint8_t* end, size_t length)
+	{
+		read_multiple_blob = true;
+		read_multiple_partial.assign(begin, end);
+		read_multiple_length = length;
+	}
+
+	void BLEGATTStateMachine::read_multiple_finish_blob()
+	{
+		//Move the value out first; the callback may reset the state machine
+		uint16_t handle = read_multiple_handles[0];
+		std::vector<uint8_t> value;
+		value.swap(read_multiple_partial);
+		if(read_multiple_length != 0 && value.size() > read_multiple_length)
+			value.resize(read_multiple_length);
+
+		read_multiple_blob = false;
+		read_multiple_length = 0;
+		read_multiple_handles.erase(read_multiple_handles.begin());
+		dispatch_read_multiple(handle, value.data(), value.data() + value.size());
+	}
+
+	void BLEGATTStateMachine::read_multiple_continue()
+	{
+		//A callback may have closed or reset the state machine
+		if(state != AwaitingReadMultipleResponse)
+			return;
+
+		if(read_multiple_handles.empty())
+		{
+			reset();
+			start_next_request();
+			call_user(cb_read_multiple_done);
+		}
+		else
+			state_machine_write();
+	}
+
+	void BLEGATTStateMachine::dispatch_read_multiple(uint16_t handle, const uint8_t* begin, const uint8_t* end)
+	{
+		Characteristic* c = characteristic_of_handle(handle);
+
+		if(c)
+		{
+			if(c->cb_read_multiple)
+				call_user(c->cb_read_multiple, begin, end);
+			else if(cb_read_multiple)
+				call_user(cb_read_multiple, *c, begin, end);
+			else
+				LOG(Warning, "Read arrived, but no callback set\n");
+		}
+		else
+			LOG(Warning, "Read arrived for unknown handle " << to_hex(handle));
+	}
+
 	void Characteristic::read_request()
 	{
 		s->send_read_request(value_handle);
 	}
 
-	void BLEGATTStateMachine::send_write_request(uint16_t handle, const uint8_t* data, int length)
+	void BLEGATTStateMachine::send_write_request(uint16_t handle, const uint8_t* data, int length, std::function<void()> on_written)
 	{
+		ALLOC_SCOPE(StateMachine);
+
 		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		{
+			//The caller's buffer may not outlive the wait, so keep a copy
+			std::vector<uint8_t> copy(data, data + length);
+			if(queue_if_busy([=](){ send_write_request(handle, copy.data(), copy.size(), on_written); }))
+				return;
+		}
 		dev.send_write_request(handle, data, length);
+		write_done = on_written;
 		state = AwaitingWriteResponse;
 		state_machine_write();
 	}
@@ -827,8 +1107,9 @@ namespace BLEPP
 
 	void BLEGATTStateMachine::send_write_command(uint16_t handle, const uint8_t* data, int length)
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
+		//Commands have no response, so they can go out while a request is pending
+		if(state == Disconnected || state == Connecting)
+			throw std::logic_error("Error trying to issue command while not connected");
 		dev.send_write_command(handle, data, length);
 	}
 
@@ -837,6 +1118,77 @@ namespace BLEPP
 		s->send_write_command(value_handle, data, length);
 	}
 
+	void BLEGATTStateMachine::stream_write_command(uint16_t handle, const uint8_t* data, size_t length)
+	{
+		ALLOC_SCOPE(StateMachine);
+
+		if(state == Disconnected || state == Connecting)
+			throw std::logic_error("Error trying to issue command while not connected");
+		if(stream.active)
+			throw std::logic_error("Error: a write stream is already in progress");
+
+		stream = WriteStream();
+		stream.active = true;
+		stream.handle = handle;
+		stream.data.assign(data, data + length);
+		stream.stats.total_bytes = length;
+		stream.start = std::chrono::steady_clock::now();
+
+		try
+		{
+			pump_stream();
+		}
+		catch(BLEDevice::WriteError)
+		{
+			fail(Disconnect(Disconnect::Reason::WriteError, errno));
+		}
+	}
+
+	void BLEGATTStateMachine::cancel_stream()
+	{
+		stream = WriteStream();
+	}
+
+	void BLEGATTStateMachine::pump_stream()
+	{
+		//A write command carries the opcode and handle, leaving MTU-3 for data
+		size_t chunk = dev.buf.size() - 3;
+
+		while(stream.offset < stream.data.size())
+		{
+			size_t n = std::min(chunk, stream.data.size() - stream.offset);
+
+			if(!dev.try_send_write_command(stream.handle, stream.data.data() + stream.offset, n))
+			{
+				//Socket full: the kernel's send buffer is our credit. Resume
+				//once select()/poll() reports the socket writable.
+				stream.stats.stalls++;
+				stream.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stream.start).count();
+				if(cb_stream_progress)
+					call_user(cb_stream_progress, stream.stats);
+				return;
+			}
+
+			stream.offset += n;
+			stream.stats.bytes_sent += n;
+			stream.stats.packets++;
+		}
+
+		stream.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stream.start).count();
+		WriteStreamStats stats = stream.stats;
+		stream = WriteStream();
+
+		LOG(Debug, "Write stream complete: " << stats.bytes_sent << " bytes in " << stats.packets << " packets, " << stats.bytes_per_second() << " B/s");
+
+		if(cb_stream_complete)
+			call_user(cb_stream_complete, stats);
+	}
+
+	void Characteristic::stream_write_command(const uint8_t* data, size_t length)
+	{
+		s->stream_write_command(value_handle, data, length);
+	}
+
 
 	void Characteristic::set_notify_and_indicate(bool notify, bool indicate, WriteType type)
 	{
@@ -25,7 +25,9 @@
 #ifdef BLEPP_BLUEZ_SUPPORT
 
 #include <blepp/bluez_client_transport.h>
+#include <blepp/lescan.h>
 #include <blepp/logging.h>
+#include <blepp/alloc_stats.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -43,6 +45,9 @@
 #include <iomanip>
 #include <algorithm>
 
+// Number of HCI events fetched per recvmmsg() call when batching
+#define HCI_BATCH_CHUNK 16
+
 namespace BLEPP
 {
 
@@ -217,6 +222,7 @@ int BlueZClientTransport::start_scan(const ScanParams& params)
 	}
 
 	scan_params_ = params;
+	rx_buf_.resize(HCI_BATCH_CHUNK * HCI_MAX_EVENT_SIZE);
 	LOG(Debug, "Scan params: type=" << (int)params.scan_type
 	          << " interval=" << params.interval_ms << "ms"
 	          << " window=" << params.window_ms << "ms"
@@ -238,7 +244,7 @@ int BlueZClientTransport::start_scan(const ScanParams& params)
 	}
 
 	scanning_ = true;
-	seen_devices_.clear();
+	reset_report_filter(params);
 
 	LOG(Info, "BLE scanning started successfully on hci" << hci_dev_id_ << " (fd=" << hci_fd_ << ")");
 	return 0;
@@ -302,6 +308,7 @@ int BlueZClientTransport::set_scan_enable(bool enable, bool filter_duplicates)
 int BlueZClientTransport::get_advertisements(std::vector<AdvertisementData>& ads, int timeout_ms)
 {
 	ENTER();
+	ALLOC_SCOPE(ClientTransport);
 	static int call_count = 0;
 	static auto last_log = std::chrono::steady_clock::now();
 	call_count++;
@@ -326,8 +333,6 @@ int BlueZClientTransport::read_hci_events(std::vector<AdvertisementData>& ads, i
 {
 	ENTER();
 	static int select_count = 0;
-	static int event_count = 0;
-	static int ad_count = 0;
 
 	select_count++;
 
@@ -355,15 +360,78 @@ int BlueZClientTransport::read_hci_events(std::vector<AdvertisementData>& ads, i
 		return 0;
 	}
 
-	// Read HCI event
-	uint8_t buf[HCI_MAX_EVENT_SIZE];
-	ssize_t len = read(hci_fd_, buf, sizeof(buf));
+	return drain_hci_events(ads);
+}
 
-	if (len < 0) {
-		LOG(Error, "read() failed: " << strerror(errno));
-		return -1;
+int BlueZClientTransport::drain_hci_events(std::vector<AdvertisementData>& ads)
+{
+	static int ad_count = 0;
+
+	const unsigned int max_batch = std::max<unsigned int>(scan_params_.max_batch, 1);
+	const auto deadline = std::chrono::steady_clock::now()
+	                    + std::chrono::microseconds(scan_params_.batch_budget_us);
+
+	struct mmsghdr msgs[HCI_BATCH_CHUNK];
+	struct iovec iov[HCI_BATCH_CHUNK];
+
+	unsigned int events = 0;
+	int num_ads = 0;
+
+	// Keep pulling events off the socket with one recvmmsg() per chunk
+	// until it runs dry, the batch is full or the time budget is spent.
+	while (events < max_batch) {
+		unsigned int want = std::min<unsigned int>(HCI_BATCH_CHUNK, max_batch - events);
+
+		memset(msgs, 0, sizeof(msgs[0]) * want);
+		for (unsigned int i = 0; i < want; i++) {
+			iov[i].iov_base = rx_buf_.data() + i * HCI_MAX_EVENT_SIZE;
+			iov[i].iov_len = HCI_MAX_EVENT_SIZE;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int n = recvmmsg(hci_fd_, msgs, want, MSG_DONTWAIT, nullptr);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+
+			LOG(Error, "recvmmsg() failed: " << strerror(errno));
+			if (events == 0) {
+				return -1;
+			}
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			num_ads += handle_hci_event(rx_buf_.data() + i * HCI_MAX_EVENT_SIZE,
+			                            msgs[i].msg_len, ads);
+		}
+		events += n;
+
+		if (static_cast<unsigned int>(n) < want) {
+			break;  // Socket drained
+		}
+
+		if (scan_params_.batch_budget_us != 0 && std::chrono::steady_clock::now() >= deadline) {
+			break;
+		}
 	}
 
+	if (num_ads > 0) {
+		ad_count += num_ads;
+		LOG(Debug, "Received " << num_ads << " advertisement(s) in " << events
+		          << " event(s), total=" << ad_count);
+	}
+	return num_ads;
+}
+
+int BlueZClientTransport::handle_hci_event(const uint8_t* buf, size_t len,
+                                           std::vector<AdvertisementData>& ads)
+{
+	static int event_count = 0;
+
 	event_count++;
 
 	// The first byte is the HCI packet type (0x04 = HCI_EVENT_PKT)
@@ -374,13 +442,12 @@ int BlueZClientTransport::read_hci_events(std::vector<AdvertisementData>& ads, i
 	}
 
 	// Parse HCI event (skip the packet type byte)
-	hci_event_hdr* hdr = (hci_event_hdr*)(buf + 1);
+	const hci_event_hdr* hdr = (const hci_event_hdr*)(buf + 1);
 	len -= 1;  // Adjust length to account for skipped packet type byte
 
 	// Log occasionally for debugging
 	if (event_count % 1000 == 1) {
-		LOG(Debug, "HCI event stats: " << event_count << " events, "
-		          << ad_count << " advertisements received");
+		LOG(Debug, "HCI event stats: " << event_count << " events");
 	}
 
 	if (hdr->evt != EVT_LE_META_EVENT) {
@@ -395,13 +462,8 @@ int BlueZClientTransport::read_hci_events(std::vector<AdvertisementData>& ads, i
 	//   hdr->plen = buf[2] = Param Length
 	// Subevent starts at buf[1] + sizeof(hci_event_hdr) = buf[1] + 2 = buf[3]
 	// So we need: buf + 1 + 2 for the subevent data
-	int num_ads = parse_advertising_report(buf + 3,  // Skip: pkt_type(1) + evt(1) + plen(1)
-	                                       len - 2, ads);  // Adjust length
-	if (num_ads > 0) {
-		ad_count += num_ads;
-		LOG(Debug, "Received " << num_ads << " advertisement(s), total=" << ad_count);
-	}
-	return num_ads;
+	return parse_advertising_report(buf + 3,  // Skip: pkt_type(1) + evt(1) + plen(1)
+	                                len - 2, ads);  // Adjust length
 }
 
 int BlueZClientTransport::parse_advertising_report(const uint8_t* data, size_t len,
@@ -423,6 +485,7 @@ int BlueZClientTransport::parse_advertising_report(const uint8_t* data, size_t l
 
 	uint8_t num_reports = data[1];
 	const uint8_t* ptr = data + 2;
+	int added = 0;
 	const uint8_t* end = data + len;
 
 	for (uint8_t i = 0; i < num_reports && ptr < end; i++) {
@@ -432,16 +495,25 @@ int BlueZClientTransport::parse_advertising_report(const uint8_t* data, size_t l
 		ad.event_type = ptr[0];
 		ad.address_type = ptr[1];
 
-		// Parse address (6 bytes, little-endian)
-		char addr_str[18];
-		ba2str((bdaddr_t*)(ptr + 2), addr_str);
-		ad.address = addr_str;
-
+		const uint8_t* addr = ptr + 2;
 		uint8_t data_len = ptr[8];
 		ptr += 9;
 
 		if (ptr + data_len + 1 > end) break;
 
+		// Apply the scan filter and software duplicate filtering before
+		// anything is copied out of the event
+		if (!accept_report(pack_address(addr), ad.address_type, ad.event_type,
+		                   (int8_t)ptr[data_len], ptr, data_len)) {
+			ptr += data_len + 1;
+			continue;
+		}
+
+		// Parse address (6 bytes, little-endian)
+		char addr_str[18];
+		ba2str((bdaddr_t*)addr, addr_str);
+		ad.address = addr_str;
+
 		// Copy advertising data
 		ad.data.assign(ptr, ptr + data_len);
 		ptr += data_len;
@@ -450,28 +522,22 @@ int BlueZClientTransport::parse_advertising_report(const uint8_t* data, size_t l
 		ad.rssi = (int8_t)(*ptr);
 		ptr++;
 
-		// Apply software duplicate filtering if Software mode is selected
-		if (scan_params_.filter_duplicates == ScanParams::FilterDuplicates::Software) {
-			if (seen_devices_.count(ad.address) > 0) {
-				continue;  // Skip duplicate
-			}
-			seen_devices_.insert(ad.address);
-		}
-
 		ads.push_back(ad);
+		added++;
 
 		// Call callback if set
 		if (on_advertisement) {
-			on_advertisement(ad);
+			call_user(on_advertisement, ad);
 		}
 	}
 
-	return ads.size();
+	return added;
 }
 
 int BlueZClientTransport::connect(const ClientConnectionParams& params)
 {
 	ENTER();
+	ALLOC_SCOPE(ClientTransport);
 
 	// Create L2CAP socket
 	int sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
@@ -513,7 +579,7 @@ int BlueZClientTransport::connect(const ClientConnectionParams& params)
 
 	// Call callback if set
 	if (on_connected) {
-		on_connected(sock);
+		call_user(on_connected, sock);
 	}
 
 	return sock;
@@ -537,7 +603,7 @@ int BlueZClientTransport::disconnect(int fd)
 
 	// Call callback if set
 	if (on_disconnected) {
-		on_disconnected(fd);
+		call_user(on_disconnected, fd);
 	}
 
 	return 0;
@@ -551,6 +617,8 @@ int BlueZClientTransport::get_fd(int fd) const
 
 int BlueZClientTransport::send(int fd, const uint8_t* data, size_t len)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	auto it = connections_.find(fd);
 	if (it == connections_.end()) {
 		LOG(Error, "Invalid connection fd=" << fd);
@@ -568,6 +636,8 @@ int BlueZClientTransport::send(int fd, const uint8_t* data, size_t len)
 
 int BlueZClientTransport::receive(int fd, uint8_t* data, size_t max_len)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	auto it = connections_.find(fd);
 	if (it == connections_.end()) {
 		LOG(Error, "Invalid connection fd=" << fd);
@@ -588,7 +658,7 @@ int BlueZClientTransport::receive(int fd, uint8_t* data, size_t max_len)
 
 	// Call callback if set
 	if (on_data_received) {
-		on_data_received(fd, data, received);
+		call_user(on_data_received, fd, data, received);
 	}
 
 	return received;
@@ -26,6 +26,7 @@
 
 #include <blepp/bluez_transport.h>
 #include <blepp/logging.h>
+#include <blepp/pretty_printers.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -34,13 +35,20 @@
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <cstring>
 #include <stdexcept>
-#include <sstream>
-#include <iomanip>
+
+// epoll tokens for the non-connection fds. Connections use their handle,
+// which always fits in 16 bits.
+#define EPOLL_TOKEN_LISTEN   0x10000
+#define EPOLL_TOKEN_WAKEUP   0x10001
+#define EPOLL_MAX_EVENTS     16
 
 namespace BLEPP
 {
@@ -49,6 +57,8 @@ BlueZTransport::BlueZTransport(int hci_dev_id)
 	: hci_dev_id_(hci_dev_id)
 	, hci_fd_(-1)
 	, l2cap_listen_fd_(-1)
+	, epoll_fd_(-1)
+	, wakeup_fd_(-1)
 	, advertising_(false)
 	, next_conn_handle_(1)
 {
@@ -66,6 +76,11 @@ BlueZTransport::BlueZTransport(int hci_dev_id)
 		throw std::runtime_error("Failed to set up L2CAP server");
 	}
 
+	// Without a reactor wait_events() falls back to polling, so this is not fatal
+	if (setup_reactor() < 0) {
+		LOG(Warning, "Failed to set up epoll reactor, falling back to polling");
+	}
+
 	LOG(Info, "BlueZTransport initialized on hci" << hci_dev_id_);
 }
 
@@ -195,6 +210,48 @@ int BlueZTransport::setup_l2cap_server()
 	return 0;
 }
 
+int BlueZTransport::setup_reactor()
+{
+	ENTER();
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		LOG(Error, "epoll_create1() failed: " << strerror(errno));
+		return -1;
+	}
+
+	wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_ < 0) {
+		LOG(Error, "eventfd() failed: " << strerror(errno));
+		close(epoll_fd_);
+		epoll_fd_ = -1;
+		return -1;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+
+	ev.data.u64 = EPOLL_TOKEN_LISTEN;
+	int rc = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, l2cap_listen_fd_, &ev);
+
+	if (rc == 0) {
+		ev.data.u64 = EPOLL_TOKEN_WAKEUP;
+		rc = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+	}
+
+	if (rc < 0) {
+		LOG(Error, "Failed to register fds with epoll: " << strerror(errno));
+		close(wakeup_fd_);
+		wakeup_fd_ = -1;
+		close(epoll_fd_);
+		epoll_fd_ = -1;
+		return -1;
+	}
+
+	LOG(Debug, "epoll reactor ready (fd=" << epoll_fd_ << ")");
+	return 0;
+}
+
 int BlueZTransport::start_advertising(const AdvertisingParams& params)
 {
 	ENTER();
@@ -523,6 +580,15 @@ int BlueZTransport::accept_l2cap_connection()
 
 	connections_[conn_handle] = conn;
 
+	if (epoll_fd_ >= 0) {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u64 = conn_handle;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+			LOG(Error, "Failed to register connection fd with epoll: " << strerror(errno));
+		}
+	}
+
 	LOG(Info, "Client connected: " << peer_addr << " (handle=" << conn_handle << ")");
 
 	// Notify callback
@@ -548,9 +614,18 @@ int BlueZTransport::disconnect(uint16_t conn_handle)
 		return -1;
 	}
 
+	if (epoll_fd_ >= 0) {
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+	}
 	close(it->second.fd);
 	connections_.erase(it);
 
+	{
+		std::lock_guard<std::mutex> lock(tx_mutex_);
+		tx_queue_.remove(conn_handle);
+		tx_waiting_.erase(conn_handle);
+	}
+
 	LOG(Info, "Disconnected connection handle " << conn_handle);
 
 	if (on_disconnected) {
@@ -573,27 +648,132 @@ int BlueZTransport::send_pdu(uint16_t conn_handle, const uint8_t* data, size_t l
 		return -1;
 	}
 
-	// Log hex dump of data being sent
-	std::stringstream hex_dump;
-	hex_dump << std::hex << std::setfill('0');
-	for (size_t i = 0; i < len; i++) {
-		hex_dump << std::setw(2) << (int)data[i] << " ";
+	LOG(Debug, "Sending " << len << " bytes: " << to_hex(data, len));
+
+	int fd = it->second.fd;
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+
+	if (tx_queue_.send(conn_handle, data, len, [fd](const uint8_t* d, size_t n) {
+		return write_pdu(fd, d, n);
+	}) < 0) {
+		return -1;
+	}
+
+	// Anything left over goes out when the socket becomes writable
+	if (!tx_queue_.empty(conn_handle)) {
+		flush_tx(it->second);
+	}
+
+	// The caller may hold its own locks, so let the event loop report evictions
+	if (tx_queue_.has_dropped()) {
+		wakeup();
 	}
-	LOG(Debug, "Sending " << std::dec << len << " bytes: " << hex_dump.str());
 
-	ssize_t sent = send(it->second.fd, data, len, 0);
+	return len;
+}
+
+int BlueZTransport::write_pdu(int fd, const uint8_t* data, size_t len)
+{
+	ssize_t sent = send(fd, data, len, MSG_DONTWAIT);
 	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
 		LOG(Error, "send() failed: " << strerror(errno));
 		return -1;
 	}
 
 	if ((size_t)sent != len) {
 		LOG(Warning, "Partial send: sent=" << sent << " expected=" << len);
-	} else {
-		LOG(Debug, "Successfully sent " << sent << " bytes to connection " << conn_handle);
 	}
 
-	return sent;
+	return sent > 0 ? sent : -1;
+}
+
+void BlueZTransport::flush_tx(const Connection& conn)
+{
+	int fd = conn.fd;
+	size_t left = tx_queue_.flush(conn.conn_handle, [fd](const uint8_t* d, size_t n) {
+		return write_pdu(fd, d, n);
+	});
+
+	watch_tx(conn, left != 0);
+}
+
+void BlueZTransport::watch_tx(const Connection& conn, bool queued) const
+{
+	// Without a reactor, process_events() retries instead
+	if (epoll_fd_ >= 0) {
+		struct epoll_event ev = {};
+		ev.events = (queued || tx_waiting_.count(conn.conn_handle)) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		ev.data.u64 = conn.conn_handle;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+	}
+}
+
+void BlueZTransport::report_tx_ready()
+{
+	std::vector<uint16_t> ready;
+	{
+		std::lock_guard<std::mutex> lock(tx_mutex_);
+		for (auto it = tx_waiting_.begin(); it != tx_waiting_.end();) {
+			auto conn = connections_.find(*it);
+			if (conn == connections_.end()) {
+				it = tx_waiting_.erase(it);
+				continue;
+			}
+
+			struct pollfd pfd = {conn->second.fd, POLLOUT, 0};
+			if (!tx_queue_.empty(*it) || poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) {
+				++it;
+				continue;
+			}
+
+			ready.push_back(*it);
+			it = tx_waiting_.erase(it);
+			watch_tx(conn->second, false);
+		}
+	}
+
+	for (uint16_t conn_handle : ready) {
+		if (on_tx_ready) {
+			on_tx_ready(conn_handle);
+		}
+	}
+}
+
+bool BlueZTransport::can_send(uint16_t conn_handle) const
+{
+	auto it = connections_.find(conn_handle);
+	if (it == connections_.end()) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+
+	// Writable means the socket send buffer has room for another PDU
+	struct pollfd pfd = {it->second.fd, POLLOUT, 0};
+	if (tx_queue_.empty(conn_handle) && poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT)) {
+		return true;
+	}
+
+	// Have the event loop say when there is room
+	if (tx_waiting_.insert(conn_handle).second) {
+		watch_tx(it->second, !tx_queue_.empty(conn_handle));
+	}
+	return false;
+}
+
+TxQueueStats BlueZTransport::tx_stats(uint16_t conn_handle) const
+{
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+	return tx_queue_.stats(conn_handle);
+}
+
+void BlueZTransport::set_tx_queue_limit(size_t max_bytes)
+{
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+	tx_queue_.set_max_bytes(max_bytes);
 }
 
 int BlueZTransport::recv_pdu(uint16_t conn_handle, uint8_t* buf, size_t len)
@@ -604,7 +784,7 @@ int BlueZTransport::recv_pdu(uint16_t conn_handle, uint8_t* buf, size_t len)
 		return -1;
 	}
 
-	ssize_t received = recv(it->second.fd, buf, len, 0);
+	ssize_t received = recv(it->second.fd, buf, len, MSG_DONTWAIT);
 	if (received < 0) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			return 0;  // No data available
@@ -615,7 +795,10 @@ int BlueZTransport::recv_pdu(uint16_t conn_handle, uint8_t* buf, size_t len)
 			disconnect(conn_handle);
 			return 0;
 		}
-		LOG(Error, "recv() failed: " << strerror(errno));
+		// Anything else is unrecoverable too. Leaving the fd registered
+		// would make the level-triggered epoll loop report it forever.
+		LOG(Error, "recv() failed on connection " << conn_handle << ": " << strerror(errno) << " - disconnecting");
+		disconnect(conn_handle);
 		return -1;
 	}
 
@@ -660,18 +843,114 @@ int BlueZTransport::process_events()
 	// Check for incoming connections
 	accept_l2cap_connection();
 
-	// Check for data on existing connections
-	for (auto& pair : connections_) {
-		uint8_t buf[512];
-		int received = recv_pdu(pair.first, buf, sizeof(buf));
-		if (received > 0 && on_data_received) {
-			on_data_received(pair.first, buf, received);
+	// Check for data on existing connections. recv_pdu() may disconnect,
+	// which erases from connections_, so walk a copy of the handles.
+	std::vector<uint16_t> handles;
+	handles.reserve(connections_.size());
+	for (const auto& pair : connections_) {
+		handles.push_back(pair.first);
+	}
+
+	for (uint16_t conn_handle : handles) {
+		service_connection(conn_handle);
+	}
+
+	// Retry anything the sockets had no room for
+	{
+		std::lock_guard<std::mutex> lock(tx_mutex_);
+		for (const auto& pair : connections_) {
+			if (!tx_queue_.empty(pair.first)) {
+				flush_tx(pair.second);
+			}
 		}
 	}
 
+	report_dropped();
+	report_tx_ready();
 	return 0;
 }
 
+void BlueZTransport::report_dropped()
+{
+	std::vector<DroppedPdu> dropped;
+	{
+		std::lock_guard<std::mutex> lock(tx_mutex_);
+		dropped = tx_queue_.take_dropped();
+	}
+
+	for (const auto& d : dropped) {
+		LOG(Debug, "Dropped queued " << d.pdu.size() << " byte PDU on connection " << d.conn_handle);
+		if (on_pdu_dropped) {
+			on_pdu_dropped(d.conn_handle, d.pdu.data(), d.pdu.size());
+		}
+	}
+}
+
+void BlueZTransport::service_connection(uint16_t conn_handle)
+{
+	uint8_t buf[512];
+	int received = recv_pdu(conn_handle, buf, sizeof(buf));
+	if (received > 0 && on_data_received) {
+		on_data_received(conn_handle, buf, received);
+	}
+}
+
+int BlueZTransport::wait_events(int timeout_ms)
+{
+	if (epoll_fd_ < 0) {
+		return BLETransport::wait_events(timeout_ms);
+	}
+
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int n = epoll_wait(epoll_fd_, events, EPOLL_MAX_EVENTS, timeout_ms);
+
+	if (n < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		LOG(Error, "epoll_wait() failed: " << strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		uint64_t token = events[i].data.u64;
+
+		if (token == EPOLL_TOKEN_WAKEUP) {
+			uint64_t count;
+			if (read(wakeup_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				LOG(Warning, "Failed to drain wakeup fd: " << strerror(errno));
+			}
+		} else if (token == EPOLL_TOKEN_LISTEN) {
+			accept_l2cap_connection();
+		} else {
+			// An earlier event in this batch may have closed the connection
+			uint16_t conn_handle = static_cast<uint16_t>(token);
+			auto it = connections_.find(conn_handle);
+			if (it != connections_.end() && (events[i].events & EPOLLOUT)) {
+				std::lock_guard<std::mutex> lock(tx_mutex_);
+				flush_tx(it->second);
+			}
+			if (it != connections_.end() && (events[i].events & ~EPOLLOUT)) {
+				service_connection(conn_handle);
+			}
+		}
+	}
+
+	report_dropped();
+	report_tx_ready();
+	return n;
+}
+
+void BlueZTransport::wakeup()
+{
+	if (wakeup_fd_ >= 0) {
+		uint64_t one = 1;
+		if (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			LOG(Warning, "Failed to signal wakeup fd: " << strerror(errno));
+		}
+	}
+}
+
 void BlueZTransport::cleanup()
 {
 	ENTER();
@@ -684,10 +963,22 @@ void BlueZTransport::cleanup()
 	// Close all connections
 	for (auto& pair : connections_) {
 		close(pair.second.fd);
+		tx_queue_.remove(pair.first);
 	}
 	connections_.clear();
+	tx_waiting_.clear();
 
 	// Close sockets
+	if (epoll_fd_ >= 0) {
+		close(epoll_fd_);
+		epoll_fd_ = -1;
+	}
+
+	if (wakeup_fd_ >= 0) {
+		close(wakeup_fd_);
+		wakeup_fd_ = -1;
+	}
+
 	if (l2cap_listen_fd_ >= 0) {
 		close(l2cap_listen_fd_);
 		l2cap_listen_fd_ = -1;
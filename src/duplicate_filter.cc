@@ -0,0 +1,200 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include <blepp/duplicate_filter.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+namespace BLEPP
+{
+
+/// Flag set in every key, so no real device has the empty key
+static const uint64_t key_present = 1ULL << 63;
+
+static uint64_t make_key(uint64_t address, uint8_t address_type, uint8_t event_type)
+{
+	return key_present
+	     | (static_cast<uint64_t>(event_type & 0x7f) << 56)
+	     | (static_cast<uint64_t>(address_type) << 48)
+	     | (address & 0xffffffffffffULL);
+}
+
+/// Spread the key bits; device addresses share long prefixes
+static size_t hash_key(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return static_cast<size_t>(key);
+}
+
+DuplicateFilter::DuplicateFilter(const DuplicateFilterParams& params)
+	: mask_(0)
+	, size_(0)
+	, reported_(0)
+	, suppressed_(0)
+{
+	set_params(params);
+}
+
+void DuplicateFilter::set_params(const DuplicateFilterParams& params)
+{
+	params_ = params;
+	params_.max_entries = std::max<size_t>(params_.max_entries, 1);
+
+	// Keep the load factor at or under one half
+	size_t slots = 2;
+	while (slots < params_.max_entries * 2) {
+		slots <<= 1;
+	}
+
+	table_.assign(slots, Entry());
+	mask_ = slots - 1;
+	size_ = 0;
+	reported_ = 0;
+	suppressed_ = 0;
+}
+
+void DuplicateFilter::clear()
+{
+	std::fill(table_.begin(), table_.end(), Entry());
+	size_ = 0;
+}
+
+uint64_t DuplicateFilter::payload_hash(const uint8_t* data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+size_t DuplicateFilter::find(uint64_t key) const
+{
+	size_t i = hash_key(key) & mask_;
+	while (table_[i].key != 0 && table_[i].key != key) {
+		i = (i + 1) & mask_;
+	}
+	return i;
+}
+
+/// True if the RSSI has moved far enough to be worth reporting
+static bool rssi_moved(int8_t last, int8_t rssi, uint8_t delta)
+{
+	if (delta == 0 || last == rssi_unavailable || rssi == rssi_unavailable) {
+		return false;
+	}
+	return std::abs(static_cast<int>(rssi) - static_cast<int>(last)) >= delta;
+}
+
+bool DuplicateFilter::check(uint64_t address, uint8_t address_type, uint8_t event_type, int8_t rssi,
+                            const uint8_t* data, size_t len, uint64_t now_ms)
+{
+	uint64_t key = make_key(address, address_type, event_type);
+	uint64_t hash = params_.report_payload_changes ? payload_hash(data, len) : 0;
+
+	size_t i = find(key);
+	Entry& e = table_[i];
+
+	if (e.key == key) {
+		e.last_seen_ms = now_ms;
+
+		bool expired = params_.ttl_ms != 0 && now_ms - e.last_report_ms >= params_.ttl_ms;
+		bool changed = params_.report_payload_changes && hash != e.payload_hash;
+		if (!expired && !changed && !rssi_moved(e.rssi, rssi, params_.rssi_delta)) {
+			suppressed_++;
+			return false;
+		}
+
+		e.last_report_ms = now_ms;
+		e.payload_hash = hash;
+		e.rssi = rssi;
+		reported_++;
+		return true;
+	}
+
+	if (size_ == params_.max_entries) {
+		make_room(now_ms);
+		i = find(key);
+	}
+
+	table_[i].key = key;
+	table_[i].last_report_ms = now_ms;
+	table_[i].last_seen_ms = now_ms;
+	table_[i].payload_hash = hash;
+	table_[i].rssi = rssi;
+	size_++;
+	reported_++;
+	return true;
+}
+
+bool DuplicateFilter::check(uint64_t address, uint8_t address_type, uint8_t event_type, int8_t rssi,
+                            const uint8_t* data, size_t len)
+{
+	uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	return check(address, address_type, event_type, rssi, data, len, now_ms);
+}
+
+void DuplicateFilter::make_room(uint64_t now_ms)
+{
+	std::vector<Entry> keep;
+	keep.reserve(size_);
+
+	uint64_t oldest = now_ms;
+	for (const Entry& e : table_) {
+		if (e.key == 0) {
+			continue;
+		}
+		if (params_.ttl_ms != 0 && now_ms - e.last_report_ms >= params_.ttl_ms) {
+			continue;  // Would report again anyway
+		}
+		oldest = std::min(oldest, e.last_seen_ms);
+		keep.push_back(e);
+	}
+
+	if (keep.size() == params_.max_entries) {
+		// Nothing expired; forget every device not heard from since the
+		// midpoint of the remaining last-seen times. That always includes
+		// the quietest, and all of them if they share one timestamp.
+		uint64_t cutoff = oldest + (now_ms - oldest) / 2;
+		keep.erase(std::remove_if(keep.begin(), keep.end(), [cutoff](const Entry& e) {
+			return e.last_seen_ms <= cutoff;
+		}), keep.end());
+	}
+
+	rebuild(keep);
+}
+
+void DuplicateFilter::rebuild(const std::vector<Entry>& keep)
+{
+	clear();
+	for (const Entry& e : keep) {
+		table_[find(e.key)] = e;
+	}
+	size_ = keep.size();
+}
+
+} // namespace BLEPP
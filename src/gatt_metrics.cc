@@ -0,0 +1,457 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/gatt_metrics.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+namespace BLEPP
+{
+
+const unsigned LatencyHistogram::sub_bucket_bits;
+const uint64_t LatencyHistogram::sub_buckets;
+const uint64_t LatencyHistogram::max_value;
+
+// Latency histogram
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+size_t LatencyHistogram::bucket_index(uint64_t ns)
+{
+	if (ns < sub_buckets) {
+		return ns;
+	}
+
+	unsigned msb = 63 - __builtin_clzll(ns);
+	unsigned shift = msb - sub_bucket_bits;
+	return sub_buckets + shift * sub_buckets + ((ns >> shift) & (sub_buckets - 1));
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(size_t index)
+{
+	if (index < sub_buckets) {
+		return index;
+	}
+
+	unsigned shift = (index - sub_buckets) / sub_buckets;
+	uint64_t sub = (index - sub_buckets) % sub_buckets;
+	return ((sub_buckets + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	ns = std::min(ns, max_value);
+
+	size_t i = bucket_index(ns);
+	if (i >= counts_.size()) {
+		counts_.resize(i + 1, 0);
+	}
+	counts_[i]++;
+
+	count_++;
+	sum_ += ns;
+	min_ = std::min(min_, ns);
+	max_ = std::max(max_, ns);
+}
+
+double LatencyHistogram::mean() const
+{
+	return count_ ? (double)sum_ / count_ : 0.0;
+}
+
+uint64_t LatencyHistogram::value_at_percentile(double percentile) const
+{
+	if (count_ == 0) {
+		return 0;
+	}
+
+	percentile = std::max(0.0, std::min(percentile, 100.0));
+	uint64_t target = (uint64_t)std::ceil(percentile / 100.0 * count_);
+	target = std::max<uint64_t>(target, 1);
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts_.size(); i++) {
+		seen += counts_[i];
+		if (seen >= target) {
+			return std::min(bucket_upper_bound(i), max_);
+		}
+	}
+	return max_;
+}
+
+void LatencyHistogram::reset()
+{
+	counts_.clear();
+	count_ = 0;
+	sum_ = 0;
+	min_ = UINT64_MAX;
+	max_ = 0;
+}
+
+// Server metrics
+
+void GATTServerMetrics::set_enabled(bool enabled)
+{
+	enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+GATTServerMetricsSnapshot GATTServerMetrics::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return m_;
+}
+
+void GATTServerMetrics::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	m_.opcodes.clear();
+	m_.attributes.clear();
+	m_.closed = ConnectionMetrics();
+	for (auto& c : m_.connections) {
+		std::string peer = c.second.peer_address;
+		c.second = ConnectionMetrics();
+		c.second.peer_address = peer;
+	}
+}
+
+void GATTServerMetrics::connection_opened(uint16_t conn_handle, const std::string& peer_address)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	ConnectionMetrics& c = m_.connections[conn_handle];
+	c = ConnectionMetrics();
+	c.peer_address = peer_address;
+}
+
+void GATTServerMetrics::connection_closed(uint16_t conn_handle)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = m_.connections.find(conn_handle);
+	if (it == m_.connections.end()) {
+		return;
+	}
+
+	const ConnectionMetrics& c = it->second;
+	m_.closed.pdus_in += c.pdus_in;
+	m_.closed.pdus_out += c.pdus_out;
+	m_.closed.bytes_in += c.bytes_in;
+	m_.closed.bytes_out += c.bytes_out;
+	m_.closed.error_responses += c.error_responses;
+	m_.closed.notifications += c.notifications;
+	m_.closed.notification_drops += c.notification_drops;
+	m_.closed.notifications_superseded += c.notifications_superseded;
+	m_.connections.erase(it);
+}
+
+void GATTServerMetrics::record_request(uint16_t conn_handle, uint8_t opcode, size_t len,
+                                       uint64_t handler_ns)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	OpcodeMetrics& op = m_.opcodes[opcode];
+	op.requests++;
+	op.handler_ns.record(handler_ns);
+
+	auto it = m_.connections.find(conn_handle);
+	if (it != m_.connections.end()) {
+		it->second.pdus_in++;
+		it->second.bytes_in += len;
+	}
+}
+
+void GATTServerMetrics::record_sent(uint16_t conn_handle, size_t len, bool ok)
+{
+	if (!ok || !enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = m_.connections.find(conn_handle);
+	if (it != m_.connections.end()) {
+		it->second.pdus_out++;
+		it->second.bytes_out += len;
+	}
+}
+
+void GATTServerMetrics::record_error_response(uint16_t conn_handle, uint8_t opcode)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	m_.opcodes[opcode].errors++;
+
+	auto it = m_.connections.find(conn_handle);
+	if (it != m_.connections.end()) {
+		it->second.error_responses++;
+	}
+}
+
+void GATTServerMetrics::record_notification(uint16_t conn_handle, bool dropped)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = m_.connections.find(conn_handle);
+	if (it == m_.connections.end()) {
+		return;
+	}
+
+	if (dropped) {
+		it->second.notification_drops++;
+	} else {
+		it->second.notifications++;
+	}
+}
+
+void GATTServerMetrics::record_notification_superseded(uint16_t conn_handle)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = m_.connections.find(conn_handle);
+	if (it != m_.connections.end()) {
+		it->second.notifications_superseded++;
+	}
+}
+
+void GATTServerMetrics::record_read_callback(uint16_t handle, uint64_t ns, int rc)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	AttributeMetrics& a = m_.attributes[handle];
+	a.reads++;
+	a.read_ns.record(ns);
+	if (rc != 0) {
+		a.errors++;
+	}
+}
+
+void GATTServerMetrics::record_write_callback(uint16_t handle, uint64_t ns, int rc)
+{
+	if (!enabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	AttributeMetrics& a = m_.attributes[handle];
+	a.writes++;
+	a.write_ns.record(ns);
+	if (rc != 0) {
+		a.errors++;
+	}
+}
+
+// Prometheus exposition
+
+namespace
+{
+	const char* opcode_name(uint8_t opcode)
+	{
+		switch (opcode) {
+			case 0x02: return "mtu_req";
+			case 0x04: return "find_info_req";
+			case 0x06: return "find_by_type_value_req";
+			case 0x08: return "read_by_type_req";
+			case 0x0A: return "read_req";
+			case 0x0C: return "read_blob_req";
+			case 0x0E: return "read_multiple_req";
+			case 0x10: return "read_by_group_type_req";
+			case 0x12: return "write_req";
+			case 0x16: return "prepare_write_req";
+			case 0x18: return "execute_write_req";
+			case 0x1E: return "handle_value_confirm";
+			case 0x20: return "read_multiple_var_req";
+			case 0x52: return "write_cmd";
+			case 0xD2: return "signed_write_cmd";
+			default:   return "unknown";
+		}
+	}
+
+	std::string opcode_labels(uint8_t opcode)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "opcode=\"0x%02x\",name=\"%s\"", opcode, opcode_name(opcode));
+		return buf;
+	}
+
+	std::string handle_label(uint16_t handle)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "handle=\"0x%04x\"", handle);
+		return buf;
+	}
+
+	std::string connection_labels(uint16_t conn_handle, const std::string& peer)
+	{
+		// Peer addresses are hex and colons, so need no escaping
+		return "conn=\"" + std::to_string(conn_handle) + "\",peer=\"" + peer + "\"";
+	}
+
+	void header(std::ostream& os, const char* name, const char* type, const char* help)
+	{
+		os << "# HELP " << name << " " << help << "\n"
+		   << "# TYPE " << name << " " << type << "\n";
+	}
+
+	void summary(std::ostream& os, const char* name, const std::string& labels,
+	             const LatencyHistogram& h)
+	{
+		static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+		for (double q : quantiles) {
+			os << name << "{" << labels << ",quantile=\"" << q << "\"} "
+			   << h.value_at_percentile(q * 100) * 1e-9 << "\n";
+		}
+		os << name << "_sum{" << labels << "} " << h.sum() * 1e-9 << "\n";
+		os << name << "_count{" << labels << "} " << h.count() << "\n";
+	}
+}
+
+void GATTServerMetrics::write_prometheus(std::ostream& os) const
+{
+	GATTServerMetricsSnapshot s = snapshot();
+
+	header(os, "blepp_gatt_requests_total", "counter", "ATT PDUs received, by opcode");
+	for (const auto& op : s.opcodes) {
+		os << "blepp_gatt_requests_total{" << opcode_labels(op.first) << "} " << op.second.requests << "\n";
+	}
+
+	header(os, "blepp_gatt_error_responses_total", "counter", "Error Responses sent, by request opcode");
+	for (const auto& op : s.opcodes) {
+		os << "blepp_gatt_error_responses_total{" << opcode_labels(op.first) << "} " << op.second.errors << "\n";
+	}
+
+	header(os, "blepp_gatt_handler_seconds", "summary", "Time spent handling an ATT PDU");
+	for (const auto& op : s.opcodes) {
+		summary(os, "blepp_gatt_handler_seconds", opcode_labels(op.first), op.second.handler_ns);
+	}
+
+	header(os, "blepp_gatt_attribute_reads_total", "counter", "Read callbacks run, by attribute handle");
+	for (const auto& a : s.attributes) {
+		os << "blepp_gatt_attribute_reads_total{" << handle_label(a.first) << "} " << a.second.reads << "\n";
+	}
+
+	header(os, "blepp_gatt_attribute_writes_total", "counter", "Write callbacks run, by attribute handle");
+	for (const auto& a : s.attributes) {
+		os << "blepp_gatt_attribute_writes_total{" << handle_label(a.first) << "} " << a.second.writes << "\n";
+	}
+
+	header(os, "blepp_gatt_attribute_errors_total", "counter", "Callbacks that returned an ATT error");
+	for (const auto& a : s.attributes) {
+		os << "blepp_gatt_attribute_errors_total{" << handle_label(a.first) << "} " << a.second.errors << "\n";
+	}
+
+	header(os, "blepp_gatt_read_callback_seconds", "summary", "Time spent in attribute read callbacks");
+	for (const auto& a : s.attributes) {
+		if (a.second.reads) {
+			summary(os, "blepp_gatt_read_callback_seconds", handle_label(a.first), a.second.read_ns);
+		}
+	}
+
+	header(os, "blepp_gatt_write_callback_seconds", "summary", "Time spent in attribute write callbacks");
+	for (const auto& a : s.attributes) {
+		if (a.second.writes) {
+			summary(os, "blepp_gatt_write_callback_seconds", handle_label(a.first), a.second.write_ns);
+		}
+	}
+
+	// Connections that have gone away are reported under conn="closed"
+	std::vector<std::pair<std::string, const ConnectionMetrics*>> conns;
+	for (const auto& c : s.connections) {
+		conns.emplace_back(connection_labels(c.first, c.second.peer_address), &c.second);
+	}
+	conns.emplace_back("conn=\"closed\",peer=\"\"", &s.closed);
+
+	header(os, "blepp_gatt_connection_pdus_total", "counter", "ATT PDUs received and sent");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_connection_pdus_total{" << c.first << ",direction=\"in\"} " << c.second->pdus_in << "\n";
+		os << "blepp_gatt_connection_pdus_total{" << c.first << ",direction=\"out\"} " << c.second->pdus_out << "\n";
+	}
+
+	header(os, "blepp_gatt_connection_bytes_total", "counter", "ATT bytes received and sent");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_connection_bytes_total{" << c.first << ",direction=\"in\"} " << c.second->bytes_in << "\n";
+		os << "blepp_gatt_connection_bytes_total{" << c.first << ",direction=\"out\"} " << c.second->bytes_out << "\n";
+	}
+
+	header(os, "blepp_gatt_connection_error_responses_total", "counter", "Error Responses sent");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_connection_error_responses_total{" << c.first << "} " << c.second->error_responses << "\n";
+	}
+
+	header(os, "blepp_gatt_notifications_total", "counter", "Notifications and indications sent");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_notifications_total{" << c.first << "} " << c.second->notifications << "\n";
+	}
+
+	header(os, "blepp_gatt_notification_drops_total", "counter", "Notifications and indications the transport refused");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_notification_drops_total{" << c.first << "} " << c.second->notification_drops << "\n";
+	}
+
+	header(os, "blepp_gatt_notifications_superseded_total", "counter", "Coalesced notifications replaced by a newer value before being sent");
+	for (const auto& c : conns) {
+		os << "blepp_gatt_notifications_superseded_total{" << c.first << "} " << c.second->notifications_superseded << "\n";
+	}
+}
+
+std::string GATTServerMetrics::prometheus() const
+{
+	std::ostringstream os;
+	write_prometheus(os);
+	return os.str();
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
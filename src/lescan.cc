@@ -2,11 +2,18 @@
 #include "blepp/bleclienttransport.h"
 #include "blepp/pretty_printers.h"
 #include "blepp/gap.h"
+#include "blepp/alloc_stats.h"
 
 #include <string>
 #include <cstring>
 #include <cerrno>
 #include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #ifdef BLEPP_BLUEZ_SUPPORT
 #include <bluetooth/hci_lib.h>
@@ -24,72 +31,6 @@
 
 namespace BLEPP
 {
-	class Span
-	{
-		private:
-			const uint8_t* begin_;
-			const uint8_t* end_;
-
-		public:
-			Span(const std::vector<uint8_t>& d)
-			:begin_(d.data()),end_(begin_ + d.size())
-			{
-			}
-
-			Span(const Span&) = default;
-
-			Span pop_front(size_t length)
-			{
-				if(length > size())
-					throw std::out_of_range("");
-					
-				Span s = *this;
-				s.end_ = begin_ + length;
-
-				begin_ += length;	
-				return s;
-			}	
-			const uint8_t* begin() const
-			{
-				return begin_;
-			}
-			const uint8_t* end() const
-			{
-				return end_;
-			}
-			
-			const uint8_t& operator[](const size_t i) const
-			{
-				if(i >= size())
-					throw std::out_of_range("");
-				return begin_[i];
-			}
-
-			bool empty() const
-			{
-				return size()==0;
-			}
-
-			size_t size() const
-			{
-				return end_ - begin_;
-			}
-
-			const uint8_t* data() const
-			{
-				return begin_;
-			}
-
-			const uint8_t& pop_front()
-			{
-				if(begin_ == end_)
-					throw std::out_of_range("");
-
-				begin_++;
-				return *(begin_-1);
-			}
-	};
-
 	AdvertisingResponse::Flags::Flags(std::vector<uint8_t>&& s)
 	:flag_data(s)
 	{
@@ -122,19 +63,158 @@ namespace BLEPP
 	// BLEScanner - Transport-agnostic scanner implementation
 	// ===================================================================
 
-	BLEScanner::FilterEntry::FilterEntry(const AdvertisingResponse& ad)
-	:mac_address(ad.address), type(static_cast<int>(ad.type))
+	namespace
 	{
+		/// Bounded single-producer, single-consumer ring of scan records.
+		/// The reader fills the slot from claim() in place and publishes
+		/// it; the consumer reads contiguous runs in place and releases
+		/// them with consume(). A full ring makes claim() fail.
+		class ScanRing
+		{
+		public:
+			explicit ScanRing(size_t capacity)
+				: slots_(capacity)
+				, mask_(capacity - 1)
+				, head_(0)
+				, tail_(0)
+			{
+			}
+
+			/// Producer side only. The slot to fill, or nullptr if full.
+			ScanRecord* claim()
+			{
+				size_t head = head_.load(std::memory_order_relaxed);
+				if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+					return nullptr;
+				}
+				return &slots_[head & mask_];
+			}
+
+			void publish()
+			{
+				head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+
+			/// Consumer side only. Up to max records, stopping at the wrap.
+			size_t peek(const ScanRecord*& first, size_t max)
+			{
+				size_t tail = tail_.load(std::memory_order_relaxed);
+				size_t run = head_.load(std::memory_order_acquire) - tail;
+				size_t index = tail & mask_;
+
+				run = std::min(run, std::min(max, slots_.size() - index));
+				first = &slots_[index];
+				return run;
+			}
+
+			void consume(size_t n)
+			{
+				tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+			}
+
+			size_t size() const
+			{
+				return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+			}
+
+		private:
+			std::vector<ScanRecord> slots_;
+			const size_t mask_;
+			std::atomic<size_t> head_;
+			char pad_[64];               // Keep the consumer's position off the reader's cache line
+			std::atomic<size_t> tail_;
+		};
+
+		/// Parse "XX:XX:XX:XX:XX:XX" into the packed form used by AdvertisementView
+		bool parse_address(const std::string& s, uint64_t& address)
+		{
+			if (s.size() != 17) {
+				return false;
+			}
+
+			uint64_t r = 0;
+			for (size_t i = 0; i < s.size(); i++) {
+				char c = s[i];
+				if (i % 3 == 2) {
+					if (c != ':') {
+						return false;
+					}
+					continue;
+				}
+
+				int nibble;
+				if (c >= '0' && c <= '9') {
+					nibble = c - '0';
+				} else if (c >= 'a' && c <= 'f') {
+					nibble = c - 'a' + 10;
+				} else if (c >= 'A' && c <= 'F') {
+					nibble = c - 'A' + 10;
+				} else {
+					return false;
+				}
+				r = (r << 4) | nibble;
+			}
+
+			address = r;
+			return true;
+		}
+
+		size_t round_up_power_of_two(size_t n)
+		{
+			size_t r = 2;
+			while (r < n) {
+				r <<= 1;
+			}
+			return r;
+		}
 	}
 
-	bool BLEScanner::FilterEntry::operator<(const FilterEntry& e) const
+	/// State shared by the reader, the worker and the consumer
+	struct BLEScanner::AsyncScan
 	{
-		if(mac_address < e.mac_address)
-			return true;
-		else if(mac_address > e.mac_address)
-			return false;
-		else
-			return type < e.type;
+		AsyncScan(const AsyncScanParams& p, BatchCallback cb)
+			: params(p)
+			, on_batch(std::move(cb))
+			, ring(round_up_power_of_two(p.capacity))
+			, stopping(false)
+			, finished(false)
+			, received(0)
+			, delivered(0)
+			, overflowed(0)
+			, oversized(0)
+			, transport_errors(0)
+			, peak_depth(0)
+		{
+		}
+
+		AsyncScanParams params;
+		BatchCallback on_batch;
+		ScanRing ring;
+
+		std::thread reader;
+		std::thread worker;
+		std::atomic<bool> stopping;  // Tells the reader to exit
+		std::atomic<bool> finished;  // Reader has exited; the worker exits once the ring is empty
+
+		// Wakes the worker or a waiting drain() when records arrive
+		std::mutex mutex;
+		std::condition_variable ready;
+
+		std::atomic<uint64_t> received;
+		std::atomic<uint64_t> delivered;
+		std::atomic<uint64_t> overflowed;
+		std::atomic<uint64_t> oversized;
+		std::atomic<uint64_t> transport_errors;
+		std::atomic<size_t> peak_depth;
+	};
+
+	bool ScanRecord::view(AdvertisementView& v) const
+	{
+		v.address = address;
+		v.address_type = address_type;
+		v.type = type;
+		v.rssi = rssi;
+		return v.parse_ad_structures(Span(data, length));
 	}
 
 	BLEScanner::BLEScanner(BLEClientTransport* transport)
@@ -166,7 +246,7 @@ namespace BLEPP
 			return;
 		}
 
-		// Store the filter mode from params for use in get_advertisements()
+		// Remembered so that start(bool) keeps the same mode
 		filter_mode_ = params.filter_duplicates;
 
 		int result = transport_->start_scan(params);
@@ -174,11 +254,209 @@ namespace BLEPP
 			throw HCIScannerError("Failed to start scan");
 		}
 
-		scanned_devices_.clear();
+		async_.reset();
 		running_ = true;
 		LOG(Info, "BLE scanner started");
 	}
 
+	void BLEScanner::start_async(const ScanParams& params, BatchCallback on_batch,
+	                             const AsyncScanParams& async)
+	{
+		ENTER();
+		if (running_) {
+			LOG(Trace, "Scanner is already running");
+			return;
+		}
+
+		filter_mode_ = params.filter_duplicates;
+
+		int result = transport_->start_scan(params);
+		if (result < 0) {
+			throw HCIScannerError("Failed to start scan");
+		}
+
+		async_.reset(new AsyncScan(async, std::move(on_batch)));
+		running_ = true;
+
+		async_->reader = std::thread(&BLEScanner::read_loop, this);
+		if (async_->on_batch) {
+			async_->worker = std::thread(&BLEScanner::deliver_loop, this);
+		}
+
+		LOG(Info, "BLE scanner started (async, " << (async_->on_batch ? "callback" : "drain") << " mode)");
+	}
+
+	void BLEScanner::start_async(const ScanParams& params, const AsyncScanParams& async)
+	{
+		start_async(params, BatchCallback(), async);
+	}
+
+	void BLEScanner::read_loop()
+	{
+		AsyncScan& a = *async_;
+		std::vector<AdvertisementData> ads;
+
+		while (!a.stopping.load(std::memory_order_relaxed)) {
+			int result = transport_->get_advertisements(ads, a.params.poll_timeout_ms);
+			if (result < 0) {
+				// Keep going; a wedged transport costs one poll timeout per retry
+				a.transport_errors.fetch_add(1, std::memory_order_relaxed);
+				std::this_thread::sleep_for(std::chrono::milliseconds(a.params.poll_timeout_ms));
+				continue;
+			}
+
+			size_t published = 0;
+			for (const auto& ad : ads) {
+				a.received.fetch_add(1, std::memory_order_relaxed);
+
+				if (ad.data.size() > max_scan_record_data) {
+					a.oversized.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+
+				ScanRecord* r = a.ring.claim();
+				if (!r) {
+					a.overflowed.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+
+				r->address = 0;
+				parse_address(ad.address, r->address);
+				r->address_type = ad.address_type;
+				r->type = static_cast<LeAdvertisingEventType>(ad.event_type);
+				r->rssi = ad.rssi;
+				r->length = ad.data.size();
+				memcpy(r->data, ad.data.data(), ad.data.size());
+				a.ring.publish();
+				published++;
+			}
+
+			if (published) {
+				size_t depth = a.ring.size();
+				if (depth > a.peak_depth.load(std::memory_order_relaxed)) {
+					a.peak_depth.store(depth, std::memory_order_relaxed);
+				}
+
+				// One wakeup per transport batch, not per record
+				{
+					std::lock_guard<std::mutex> lock(a.mutex);
+				}
+				a.ready.notify_one();
+			}
+		}
+	}
+
+	void BLEScanner::deliver_loop()
+	{
+		AsyncScan& a = *async_;
+
+		for (;;) {
+			const ScanRecord* first;
+			size_t n = a.ring.peek(first, std::max<size_t>(a.params.max_batch, 1));
+
+			if (n) {
+				try {
+					call_user(a.on_batch, first, n);
+				} catch (std::exception& e) {
+					LOG(Error, "Scan callback threw: " << e.what());
+				}
+				a.ring.consume(n);
+				a.delivered.fetch_add(n, std::memory_order_relaxed);
+				continue;
+			}
+
+			if (a.finished.load(std::memory_order_acquire)) {
+				// Catch anything published just before the reader exited
+				if (a.ring.size() == 0) {
+					return;
+				}
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(a.mutex);
+			a.ready.wait_for(lock, std::chrono::milliseconds(a.params.poll_timeout_ms), [&a] {
+				return a.ring.size() != 0 || a.finished.load(std::memory_order_acquire);
+			});
+		}
+	}
+
+	size_t BLEScanner::drain(ScanRecord* out, size_t max_records, int timeout_ms)
+	{
+		if (!async_ || async_->on_batch) {
+			throw HCIScannerError("drain() needs start_async() without a callback");
+		}
+
+		AsyncScan& a = *async_;
+
+		if (timeout_ms > 0 && a.ring.size() == 0) {
+			std::unique_lock<std::mutex> lock(a.mutex);
+			a.ready.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&a] {
+				return a.ring.size() != 0 || a.finished.load(std::memory_order_acquire);
+			});
+		}
+
+		// At most two runs, either side of the wrap
+		size_t copied = 0;
+		while (copied < max_records) {
+			const ScanRecord* first;
+			size_t n = a.ring.peek(first, max_records - copied);
+			if (n == 0) {
+				break;
+			}
+			std::copy(first, first + n, out + copied);
+			a.ring.consume(n);
+			copied += n;
+		}
+
+		a.delivered.fetch_add(copied, std::memory_order_relaxed);
+		return copied;
+	}
+
+	AsyncScanStats BLEScanner::async_stats() const
+	{
+		AsyncScanStats s;
+		if (!async_) {
+			return s;
+		}
+
+		s.received = async_->received.load(std::memory_order_relaxed);
+		s.delivered = async_->delivered.load(std::memory_order_relaxed);
+		s.overflowed = async_->overflowed.load(std::memory_order_relaxed);
+		s.oversized = async_->oversized.load(std::memory_order_relaxed);
+		s.transport_errors = async_->transport_errors.load(std::memory_order_relaxed);
+		s.depth = async_->ring.size();
+		s.peak_depth = async_->peak_depth.load(std::memory_order_relaxed);
+
+		// Filtering happens in the transport, before the reader sees a report
+		ScanFilterStats filter = transport_->get_scan_filter_stats();
+		s.rejected = filter.rejected;
+		s.reported = filter.reported;
+		s.suppressed = filter.suppressed;
+		return s;
+	}
+
+	void BLEScanner::stop_async()
+	{
+		if (!async_) {
+			return;
+		}
+
+		async_->stopping = true;
+		if (async_->reader.joinable()) {
+			async_->reader.join();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(async_->mutex);
+			async_->finished = true;
+		}
+		async_->ready.notify_all();
+
+		if (async_->worker.joinable()) {
+			async_->worker.join();
+		}
+	}
+
 	void BLEScanner::start(bool passive)
 	{
 		ScanParams params;
@@ -196,6 +474,9 @@ namespace BLEPP
 			return;
 		}
 
+		// The reader must be out of the transport before the scan is stopped
+		stop_async();
+
 		int result = transport_->stop_scan();
 		if (result < 0) {
 			throw HCIScannerError("Failed to stop scan");
@@ -207,10 +488,16 @@ namespace BLEPP
 
 	std::vector<AdvertisingResponse> BLEScanner::get_advertisements(int timeout_ms)
 	{
+		ALLOC_SCOPE(Scanner);
+
 		if (!running_) {
 			throw HCIScannerError("Scanner not running");
 		}
 
+		if (async_) {
+			throw HCIScannerError("Scanner is in async mode; use drain()");
+		}
+
 		// Get advertisements from transport
 		std::vector<AdvertisementData> ads;
 		int result = transport_->get_advertisements(ads, timeout_ms);
@@ -222,24 +509,20 @@ namespace BLEPP
 		std::vector<AdvertisingResponse> responses;
 		for (const auto& ad : ads) {
 			AdvertisingResponse resp;
+
+			try {
+				decode_ad_payload(ad.data, resp);
+			} catch (std::out_of_range&) {
+				// Keep the report, with only the raw payload to go on
+				LOG(Warning, "Corrupted data sent by device " << ad.address);
+				resp = AdvertisingResponse();
+			}
+
 			resp.address = ad.address;
 			resp.type = static_cast<LeAdvertisingEventType>(ad.event_type);
 			resp.rssi = ad.rssi;
-
-			// Store raw packet data for later parsing if needed
-			// The transport's AdvertisementData.data contains the raw advertising payload
-			// Applications can parse this using parse_advertisement_packet() if needed
 			resp.raw_packet.push_back(ad.data);
 
-			// Software filtering if enabled
-			if (filter_mode_ == FilterDuplicates::Software) {
-				FilterEntry entry(resp);
-				if (scanned_devices_.count(entry)) {
-					continue;  // Skip duplicate
-				}
-				scanned_devices_.insert(entry);
-			}
-
 			responses.push_back(std::move(resp));
 		}
 
@@ -251,21 +534,233 @@ namespace BLEPP
 	// These functions parse HCI advertisement packets and are used by
 	// BLEScanner with any transport backend (BlueZ, Nimble, etc.)
 
-	// Forward declarations for internal parsing functions
-	std::vector<AdvertisingResponse> parse_event_packet(Span packet);
-	std::vector<AdvertisingResponse> parse_le_meta_event(Span packet);
-	std::vector<AdvertisingResponse> parse_le_meta_event_advertisement(Span packet);
+	std::string address_to_string(uint64_t address)
+	{
+		static const char digits[] = "0123456789abcdef";
+		char buf[17];
+		char* o = buf;
 
-	// Standalone function
-	std::vector<AdvertisingResponse> parse_advertisement_packet(const std::vector<uint8_t>& p)
+		for(int i=5; i >= 0; i--)
+		{
+			uint8_t b = (address >> (8*i)) & 0xff;
+			*o++ = digits[b >> 4];
+			*o++ = digits[b & 0x0f];
+			if(i != 0)
+				*o++ = ':';
+		}
+
+		return std::string(buf, o);
+	}
+
+	bool AdvertisementView::parse_ad_structures(Span payload)
+	{
+		data = payload;
+		num_ad = 0;
+
+		try{
+			while(!payload.empty())
+			{
+				//Format is length, type, crap
+				int length = payload.pop_front();
+				Span chunk = payload.pop_front(length);
+
+				//A zero length structure has no type field
+				if(chunk.empty() || num_ad == max_ad_structures)
+					return false;
+
+				ad[num_ad++].chunk = chunk;
+			}
+		}
+		catch(std::out_of_range&)
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	const AdvertisementView::ADStructure* AdvertisementView::find(uint8_t gap_type) const
+	{
+		for(size_t i=0; i < num_ad; i++)
+			if(ad[i].type() == gap_type)
+				return ad + i;
+
+		return nullptr;
+	}
+
+	AdvertisingResponse AdvertisementView::to_response() const
+	{
+		ALLOC_SCOPE(Scanner);
+
+		AdvertisingResponse rsp;
+		rsp.address = address_string();
+		rsp.type = type;
+		rsp.rssi = rssi;
+		rsp.raw_packet.push_back({data.begin(), data.end()});
+
+		// parse_ad_structures() has already checked the payload
+		decode_ad_payload(data, rsp);
+
+		return rsp;
+	}
+
+	void decode_ad_payload(Span payload, AdvertisingResponse& rsp)
+	{
+		while(!payload.empty())
+		{
+			//Format is length, type, crap
+			int length = payload.pop_front();
+			Span chunk = payload.pop_front(length);
+			uint8_t gap_type = chunk[0];
+			LOGVAR(Debug, gap_type);
+
+			if(gap_type == GAP::flags)
+			{
+				rsp.flags = new AdvertisingResponse::Flags({chunk.begin(), chunk.end()});
+
+				if(LOG_ENABLED(Info))
+				{
+					LOG(Info, "Flags = " << to_hex(rsp.flags->flag_data));
+
+					if(rsp.flags->LE_limited_discoverable)
+						LOG(Info, "        LE limited discoverable");
+
+					if(rsp.flags->LE_general_discoverable)
+						LOG(Info, "        LE general discoverable");
+
+					if(rsp.flags->BR_EDR_unsupported)
+						LOG(Info, "        BR/EDR unsupported");
+
+					if(rsp.flags->simultaneous_LE_BR_host)
+						LOG(Info, "        simultaneous LE BR host");
+
+					if(rsp.flags->simultaneous_LE_BR_controller)
+						LOG(Info, "        simultaneous LE BR controller");
+				}
+			}
+			else if(gap_type == GAP::incomplete_list_of_16_bit_UUIDs || gap_type == GAP::complete_list_of_16_bit_UUIDs)
+			{
+				rsp.uuid_16_bit_complete = (gap_type == GAP::complete_list_of_16_bit_UUIDs);
+				chunk.pop_front(); //remove the type field
+
+				while(!chunk.empty())
+				{
+					uint16_t u = chunk.pop_front() + chunk.pop_front()*256;
+					rsp.UUIDs.push_back(UUID(u));
+				}
+			}
+			else if(gap_type == GAP::incomplete_list_of_32_bit_UUIDs || gap_type == GAP::complete_list_of_32_bit_UUIDs)
+			{
+				rsp.uuid_32_bit_complete = (gap_type == GAP::complete_list_of_32_bit_UUIDs);
+				chunk.pop_front(); //remove the type field
+
+				while(!chunk.empty())
+				{
+					UUID u;
+					bt_uuid32_create(&u, att_get_u32(chunk.pop_front(4).data()));
+					rsp.UUIDs.push_back(u);
+				}
+			}
+			else if(gap_type == GAP::incomplete_list_of_128_bit_UUIDs || gap_type == GAP::complete_list_of_128_bit_UUIDs)
+			{
+				rsp.uuid_128_bit_complete = (gap_type == GAP::complete_list_of_128_bit_UUIDs);
+				chunk.pop_front(); //remove the type field
+
+				while(!chunk.empty())
+					rsp.UUIDs.push_back(UUID::from(att_get_uuid128(chunk.pop_front(16).data())));
+			}
+			else if(gap_type == GAP::shortened_local_name || gap_type == GAP::complete_local_name)
+			{
+				chunk.pop_front();
+				AdvertisingResponse::Name* n = new AdvertisingResponse::Name();
+				n->complete = gap_type==GAP::complete_local_name;
+				n->name = std::string(chunk.begin(), chunk.end());
+				delete rsp.local_name;
+				rsp.local_name = n;
+
+				LOG(Info, "Name (" << (n->complete?"complete":"incomplete") << "): " << n->name);
+			}
+			else if(gap_type == GAP::manufacturer_data)
+			{
+				chunk.pop_front();
+				rsp.manufacturer_specific_data.push_back({chunk.begin(), chunk.end()});
+				LOG(Info, "Manufacturer data: " << to_hex(chunk));
+			}
+			else if(gap_type == GAP::service_data_16_bit_UUID || gap_type == GAP::service_data_32_bit_UUID || gap_type == GAP::service_data_128_bit_UUID)
+			{
+				chunk.pop_front();
+				AdvertisingResponse::ServiceData sd;
+
+				if(gap_type == GAP::service_data_16_bit_UUID)
+					sd.uuid = UUID(att_get_u16(chunk.pop_front(2).data()));
+				else if(gap_type == GAP::service_data_32_bit_UUID)
+					bt_uuid32_create(&sd.uuid, att_get_u32(chunk.pop_front(4).data()));
+				else
+					sd.uuid = UUID::from(att_get_uuid128(chunk.pop_front(16).data()));
+
+				sd.data.assign(chunk.begin(), chunk.end());
+				LOG(Info, "Service data for " << to_str(sd.uuid) << ": " << to_hex(chunk));
+				rsp.service_data.push_back(std::move(sd));
+			}
+			else if(gap_type == GAP::tx_power_level)
+			{
+				chunk.pop_front();
+				rsp.tx_power = static_cast<int8_t>(chunk.pop_front());
+				rsp.has_tx_power = true;
+				LOG(Info, "TX power: " << (int)rsp.tx_power << " dBm");
+			}
+			else if(gap_type == GAP::appearance)
+			{
+				chunk.pop_front();
+				rsp.appearance = att_get_u16(chunk.pop_front(2).data());
+				rsp.has_appearance = true;
+				LOG(Info, "Appearance: " << rsp.appearance);
+			}
+			else if(gap_type == GAP::slave_connection_interval_range)
+			{
+				chunk.pop_front();
+				rsp.connection_interval.min = att_get_u16(chunk.pop_front(2).data());
+				rsp.connection_interval.max = att_get_u16(chunk.pop_front(2).data());
+				rsp.has_connection_interval = true;
+				LOG(Info, "Connection interval: " << rsp.connection_interval.min << " - " << rsp.connection_interval.max);
+			}
+			else
+			{
+				rsp.unparsed_data_with_types.push_back({chunk.begin(), chunk.end()});
+
+				LOG(Info, "Unparsed chunk " << to_hex(chunk));
+			}
+		}
+
+		if(rsp.UUIDs.size() > 0 && LOG_ENABLED(Info))
+		{
+			LOG(Info, "UUIDs (128 bit " << (rsp.uuid_128_bit_complete?"complete":"incomplete")
+				  << ", 32 bit " << (rsp.uuid_32_bit_complete?"complete":"incomplete")
+				  << ", 16 bit " << (rsp.uuid_16_bit_complete?"complete":"incomplete") << " ):");
+
+			for(const auto& uuid: rsp.UUIDs)
+				LOG(Info, "    " << to_str(uuid));
+		}
+
+	}
+
+	// Internal parsing functions. These only ever fill in views, which point
+	// into the packet, so nothing below allocates unless logging is enabled.
+	static size_t parse_event_packet(Span packet, AdvertisementView* views, size_t max_views);
+	static size_t parse_le_meta_event(Span packet, AdvertisementView* views, size_t max_views);
+	static size_t parse_le_meta_event_advertisement(Span packet, AdvertisementView* views, size_t max_views);
+
+	size_t parse_advertisement_views(const uint8_t* p, size_t len, AdvertisementView* views, size_t max_views)
 	{
-		Span  packet(p);
-		LOG(Debug, to_hex(p));
+		ALLOC_SCOPE(Scanner);
+
+		Span packet(p, len);
+		LOG(Debug, to_hex(packet));
 
 		if(packet.size() < 1)
 		{
 			LOG(LogLevels::Error, "Empty packet received");
-			return {};
+			return 0;
 		}
 
 		uint8_t packet_id = packet.pop_front();
@@ -274,7 +769,7 @@ namespace BLEPP
 		if(packet_id == HCI_EVENT_PKT)
 		{
 			LOG(Debug, "Event packet received");
-			return parse_event_packet(packet);
+			return parse_event_packet(packet, views, max_views);
 		}
 		else
 		{
@@ -283,7 +778,32 @@ namespace BLEPP
 		}
 	}
 
-	std::vector<AdvertisingResponse> parse_event_packet(Span packet)
+	// Standalone function
+	std::vector<AdvertisingResponse> parse_advertisement_packet(const std::vector<uint8_t>& p)
+	{
+		ALLOC_SCOPE(Scanner);
+
+		AdvertisementView views[max_advertising_reports];
+		size_t n = parse_advertisement_views(p.data(), p.size(), views, max_advertising_reports);
+
+		std::vector<AdvertisingResponse> ret;
+		ret.reserve(n);
+
+		for(size_t i=0; i < n; i++)
+		{
+			try{
+				ret.push_back(views[i].to_response());
+			}
+			catch(std::out_of_range& r)
+			{
+				LOG(LogLevels::Error, "Corrupted data sent by device " << views[i].address_string());
+			}
+		}
+
+		return ret;
+	}
+
+	static size_t parse_event_packet(Span packet, AdvertisementView* views, size_t max_views)
 	{
 		if(packet.size() < 2)
 			throw HCIParseError("Truncated event packet");
@@ -300,7 +820,7 @@ namespace BLEPP
 			LOG(Info, "event_code = 0x" << std::hex << (int)event_code << ": Meta event" << std::dec);
 			LOGVAR(Info, length);
 
-			return parse_le_meta_event(packet);
+			return parse_le_meta_event(packet, views, max_views);
 		}
 		else
 		{
@@ -311,25 +831,25 @@ namespace BLEPP
 	}
 
 
-	std::vector<AdvertisingResponse> parse_le_meta_event(Span packet)
+	static size_t parse_le_meta_event(Span packet, AdvertisementView* views, size_t max_views)
 	{
 		uint8_t subevent_code = packet.pop_front();
 
 		if(subevent_code == 0x02) // see big blob of comments above
 		{
 			LOG(Info, "subevent_code = 0x02: LE Advertising Report Event");
-			return parse_le_meta_event_advertisement(packet);
+			return parse_le_meta_event_advertisement(packet, views, max_views);
 		}
 		else
 		{
 			LOGVAR(Info, subevent_code);
-			return {};
+			return 0;
 		}
 	}
 
-	std::vector<AdvertisingResponse> parse_le_meta_event_advertisement(Span packet)
+	static size_t parse_le_meta_event_advertisement(Span packet, AdvertisementView* views, size_t max_views)
 	{
-		std::vector<AdvertisingResponse> ret;
+		size_t n = 0;
 
 		uint8_t num_reports = packet.pop_front();
 		LOGVAR(Info, num_reports);
@@ -337,166 +857,71 @@ namespace BLEPP
 		for(int i=0; i < num_reports; i++)
 		{
 			LeAdvertisingEventType event_type = static_cast<LeAdvertisingEventType>(packet.pop_front());
-
-			if(event_type == LeAdvertisingEventType::ADV_IND)
-				LOG(Info, "event_type = 0x00 ADV_IND, Connectable undirected advertising");
-			else if(event_type == LeAdvertisingEventType::ADV_DIRECT_IND)
-				LOG(Info, "event_type = 0x01 ADV_DIRECT_IND, Connectable directed advertising");
-			else if(event_type == LeAdvertisingEventType::ADV_SCAN_IND)
-				LOG(Info, "event_type = 0x02 ADV_SCAN_IND, Scannable undirected advertising");
-			else if(event_type == LeAdvertisingEventType::ADV_NONCONN_IND)
-				LOG(Info, "event_type = 0x03 ADV_NONCONN_IND, Non connectable undirected advertising");
-			else if(event_type == LeAdvertisingEventType::SCAN_RSP)
-				LOG(Info, "event_type = 0x04 SCAN_RSP, Scan response");
-			else
-				LOG(Warning, "event_type = 0x" << std::hex << (int)event_type << std::dec << ", unknown");
-			
 			uint8_t address_type = packet.pop_front();
-
-			if(address_type == 0)
-				LOG(Info, "Address type = 0: Public device address");
-			else if(address_type == 1)
-				LOG(Info, "Address type = 0: Random device address");
-			else
-				LOG(Info, "Address type = 0x" << to_hex(address_type) << ": unknown");
-
-
-			std::string address;
-			for(int j=0; j < 6; j++)
-			{
-				std::ostringstream s;
-				s << std::hex << std::setw(2) << std::setfill('0') << (int) packet.pop_front();
-				if(j != 0)
-					s << ":";
-
-				address = s.str() + address;
-			}
-
-
-			LOGVAR(Info, address);
-
+			uint64_t address = pack_address(packet.pop_front(6).data());
 			uint8_t length = packet.pop_front();
-			LOGVAR(Info, length);
-			
-
 			Span data = packet.pop_front(length);
-
-			LOG(Debug, "Data = " << to_hex(data));
-
 			int8_t rssi = packet.pop_front();
 
-			if(rssi == 127)
-				LOG(Info, "RSSI = 127: unavailable");
-			else if(rssi <= 20)
-				LOG(Info, "RSSI = " << (int) rssi << " dBm");
-			else
-				LOG(Info, "RSSI = " << to_hex((uint8_t)rssi) << " unknown");
-
-			try{
-				AdvertisingResponse rsp;
-				rsp.address = address;
-				rsp.type = event_type;
-				rsp.rssi = rssi;
-				rsp.raw_packet.push_back({data.begin(), data.end()});
-
-				while(data.size() > 0)
-				{
-					LOGVAR(Debug, data.size());
-					LOG(Debug, "Packet = " << to_hex(data));
-					//Format is length, type, crap
-					int length = data.pop_front();
-					
-					LOGVAR(Debug, length);
-
-					Span chunk = data.pop_front(length);
-
-					uint8_t type = chunk[0];
-					LOGVAR(Debug, type);
-
-					if(type == GAP::flags)
-					{
-						rsp.flags = new AdvertisingResponse::Flags({chunk.begin(), chunk.end()});
-
-						LOG(Info, "Flags = " << to_hex(rsp.flags->flag_data));
-
-						if(rsp.flags->LE_limited_discoverable)
-							LOG(Info, "        LE limited discoverable");
-
-						if(rsp.flags->LE_general_discoverable)
-							LOG(Info, "        LE general discoverable");
-
-						if(rsp.flags->BR_EDR_unsupported)
-							LOG(Info, "        BR/EDR unsupported");
-
-						if(rsp.flags->simultaneous_LE_BR_host)
-							LOG(Info, "        simultaneous LE BR host");
-
-						if(rsp.flags->simultaneous_LE_BR_controller)
-							LOG(Info, "        simultaneous LE BR controller");
-					}
-					else if(type == GAP::incomplete_list_of_16_bit_UUIDs || type == GAP::complete_list_of_16_bit_UUIDs)
-					{
-						rsp.uuid_16_bit_complete = (type == GAP::complete_list_of_16_bit_UUIDs);
-						chunk.pop_front(); //remove the type field
-
-						while(!chunk.empty())
-						{
-							uint16_t u = chunk.pop_front() + chunk.pop_front()*256;
-							rsp.UUIDs.push_back(UUID(u));
-						}
-					}
-					else if(type == GAP::incomplete_list_of_128_bit_UUIDs || type == GAP::complete_list_of_128_bit_UUIDs)
-					{
-						rsp.uuid_128_bit_complete = (type == GAP::complete_list_of_128_bit_UUIDs);
-						chunk.pop_front(); //remove the type field
-
-						while(!chunk.empty())
-							rsp.UUIDs.push_back(UUID::from(att_get_uuid128(chunk.pop_front(16).data())));
-					}
-					else if(type == GAP::shortened_local_name || type == GAP::complete_local_name)
-					{
-						chunk.pop_front();
-						AdvertisingResponse::Name* n = new AdvertisingResponse::Name();
-						n->complete = type==GAP::complete_local_name;
-						n->name = std::string(chunk.begin(), chunk.end());
-						rsp.local_name = n;
-
-						LOG(Info, "Name (" << (n->complete?"complete":"incomplete") << "): " << n->name);
-					}
-					else if(type == GAP::manufacturer_data)
-					{
-						chunk.pop_front();
-						rsp.manufacturer_specific_data.push_back({chunk.begin(), chunk.end()});
-						LOG(Info, "Manufacturer data: " << to_hex(chunk));
-					}
-					else
-					{
-						rsp.unparsed_data_with_types.push_back({chunk.begin(), chunk.end()});
-
-						LOG(Info, "Unparsed chunk " << to_hex(chunk));
-					}
-				}
-
-				if(rsp.UUIDs.size() > 0)
-				{
-					LOG(Info, "UUIDs (128 bit " << (rsp.uuid_128_bit_complete?"complete":"incomplete")
-						  << ", 16 bit " << (rsp.uuid_16_bit_complete?"complete":"incomplete") << " ):");
+			if(event_type > LeAdvertisingEventType::SCAN_RSP)
+				LOG(Warning, "event_type = 0x" << std::hex << (int)event_type << std::dec << ", unknown");
 
-					for(const auto& uuid: rsp.UUIDs)
-						LOG(Info, "    " << to_str(uuid));
-				}
+			//Describing the report takes a dozen statements, so check
+			//the level once rather than in each of them.
+			if(LOG_ENABLED(Info))
+			{
+				if(event_type == LeAdvertisingEventType::ADV_IND)
+					LOG(Info, "event_type = 0x00 ADV_IND, Connectable undirected advertising");
+				else if(event_type == LeAdvertisingEventType::ADV_DIRECT_IND)
+					LOG(Info, "event_type = 0x01 ADV_DIRECT_IND, Connectable directed advertising");
+				else if(event_type == LeAdvertisingEventType::ADV_SCAN_IND)
+					LOG(Info, "event_type = 0x02 ADV_SCAN_IND, Scannable undirected advertising");
+				else if(event_type == LeAdvertisingEventType::ADV_NONCONN_IND)
+					LOG(Info, "event_type = 0x03 ADV_NONCONN_IND, Non connectable undirected advertising");
+				else if(event_type == LeAdvertisingEventType::SCAN_RSP)
+					LOG(Info, "event_type = 0x04 SCAN_RSP, Scan response");
+
+				if(address_type == 0)
+					LOG(Info, "Address type = 0: Public device address");
+				else if(address_type == 1)
+					LOG(Info, "Address type = 0: Random device address");
+				else
+					LOG(Info, "Address type = 0x" << to_hex(address_type) << ": unknown");
+
+				LOG(Info, "address = " << address_to_string(address));
+				LOGVAR(Info, length);
+				LOG(Debug, "Data = " << to_hex(data));
+
+				if(rssi == 127)
+					LOG(Info, "RSSI = 127: unavailable");
+				else if(rssi <= 20)
+					LOG(Info, "RSSI = " << (int) rssi << " dBm");
+				else
+					LOG(Info, "RSSI = " << to_hex((uint8_t)rssi) << " unknown");
+			}
 
-				ret.push_back(rsp);
+			if(n == max_views)
+			{
+				LOG(Warning, "Dropping advertising report, no space for more than " << max_views);
+				continue;
+			}
 
+			AdvertisementView& view = views[n];
+			view.address = address;
+			view.address_type = address_type;
+			view.type = event_type;
+			view.rssi = rssi;
 
-			}
-			catch(std::out_of_range& r)
+			if(!view.parse_ad_structures(data))
 			{
-				LOG(LogLevels::Error, "Corrupted data sent by device " << address);
+				LOG(LogLevels::Error, "Corrupted data sent by device " << address_to_string(address));
+				continue;
 			}
+
+			n++;
 		}
 
-		return ret;
+		return n;
 	}
 
 } // namespace BLEPP
@@ -0,0 +1,463 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/log_sink.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace BLEPP
+{
+
+std::atomic<bool> async_log_active(false);
+
+namespace
+{
+	enum
+	{
+		RecordTruncated = 0x01
+	};
+
+	/// One slot of the ring. The sequence number says whose turn it is:
+	/// equal to the slot's position when free for a producer, one past it
+	/// once the record is published for the writer.
+	struct LogRecord
+	{
+		std::atomic<size_t> sequence;
+		int64_t time_ns;
+		const char* function;
+		const char* file;
+		uint32_t line;
+		uint8_t level;
+		uint8_t flags;
+		uint16_t length;
+		char message[log_sink_max_message];
+	};
+
+	/// Bounded multi-producer, single-consumer ring of log records.
+	/// Producers claim a slot with a CAS on the enqueue position and
+	/// never wait; a full ring makes push() fail.
+	class LogRing
+	{
+	public:
+		explicit LogRing(size_t capacity)
+			: slots_(capacity)
+			, mask_(capacity - 1)
+			, enqueue_pos_(0)
+			, dequeue_pos_(0)
+		{
+			for (size_t i = 0; i < capacity; i++) {
+				slots_[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		bool push(const LogRecord& r)
+		{
+			LogRecord* slot;
+			size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+			for (;;) {
+				slot = &slots_[pos & mask_];
+				size_t seq = slot->sequence.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if (dif == 0) {
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (dif < 0) {
+					return false;
+				} else {
+					pos = enqueue_pos_.load(std::memory_order_relaxed);
+				}
+			}
+
+			slot->time_ns = r.time_ns;
+			slot->function = r.function;
+			slot->file = r.file;
+			slot->line = r.line;
+			slot->level = r.level;
+			slot->flags = r.flags;
+			slot->length = r.length;
+			memcpy(slot->message, r.message, r.length);
+			slot->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// Consumer side only. The record stays valid until release().
+		const LogRecord* front()
+		{
+			LogRecord* slot = &slots_[dequeue_pos_ & mask_];
+			if (slot->sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+				return nullptr;
+			}
+			return slot;
+		}
+
+		void release()
+		{
+			slots_[dequeue_pos_ & mask_].sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+			dequeue_pos_++;
+		}
+
+	private:
+		std::vector<LogRecord> slots_;
+		const size_t mask_;
+		std::atomic<size_t> enqueue_pos_;
+		char pad_[64];               // Keep the writer's position off the producers' cache line
+		size_t dequeue_pos_;
+	};
+
+	struct LogSink
+	{
+		std::mutex control;          // Serialises start and stop
+		std::unique_ptr<LogRing> ring;
+		std::thread writer;
+		std::atomic<bool> running{false};
+		std::atomic<int> producers{0}; // Threads inside push()
+		std::atomic<uint64_t> dropped{0};
+		LogSinkParams params;
+		int fd = -1;
+		bool owns_fd = false;
+	};
+
+	LogSink& sink()
+	{
+		// Never destroyed, so logging from static destructors stays safe
+		static LogSink* s = new LogSink;
+		return *s;
+	}
+
+	int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	void format_text(std::string& out, const LogRecord& r)
+	{
+		char header[64];
+		int n = snprintf(header, sizeof(header), "%s %lld.%06lld",
+		                 log_types[r.level],
+		                 (long long)(r.time_ns / 1000000000),
+		                 (long long)(r.time_ns % 1000000000 / 1000));
+		out.append(header, n);
+		if (log_level >= Debug) {
+			out += ' ';
+			out += r.function;
+		}
+		if (log_level >= Trace) {
+			n = snprintf(header, sizeof(header), ":%u", (unsigned)r.line);
+			out += ' ';
+			out += r.file;
+			out.append(header, n);
+		}
+		out += ": ";
+		out.append(r.message, r.length);
+		out += '\n';
+	}
+
+	template<class T> void put_le(std::string& out, T v)
+	{
+		for (size_t i = 0; i < sizeof(T); i++) {
+			out += (char)(v >> (8 * i) & 0xff);
+		}
+	}
+
+	void format_binary(std::string& out, const LogRecord& r)
+	{
+		size_t function_len = std::min<size_t>(strlen(r.function), 0xffff);
+		size_t file_len = std::min<size_t>(strlen(r.file), 0xffff);
+		size_t length = 1 + 1 + 8 + 4 + 2 + function_len + 2 + file_len + r.length;
+		if (length > 0xffff) {
+			file_len = 0;
+			length = 1 + 1 + 8 + 4 + 2 + function_len + 2 + r.length;
+		}
+
+		put_le<uint16_t>(out, length);
+		put_le<uint8_t>(out, r.level);
+		put_le<uint8_t>(out, r.flags);
+		put_le<uint64_t>(out, r.time_ns);
+		put_le<uint32_t>(out, r.line);
+		put_le<uint16_t>(out, function_len);
+		out.append(r.function, function_len);
+		put_le<uint16_t>(out, file_len);
+		out.append(r.file, file_len);
+		out.append(r.message, r.length);
+	}
+
+	/// Write all of buf, or give up on a hard error
+	bool write_all(int fd, const std::string& buf)
+	{
+		size_t done = 0;
+		while (done < buf.size()) {
+			ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			done += n;
+		}
+		return true;
+	}
+
+	/// Move everything in the ring to the fd
+	/// @return Number of records written
+	size_t drain(LogSink& s, std::string& out)
+	{
+		const size_t batch_bytes = 64 * 1024;
+		size_t records = 0, batched = 0;
+
+		out.clear();
+		while (const LogRecord* r = s.ring->front()) {
+			if (s.params.format == LogSinkFormat::Binary) {
+				format_binary(out, *r);
+			} else {
+				format_text(out, *r);
+			}
+			s.ring->release();
+			records++;
+			batched++;
+
+			if (out.size() >= batch_bytes) {
+				if (!write_all(s.fd, out)) {
+					s.dropped.fetch_add(batched, std::memory_order_relaxed);
+				}
+				out.clear();
+				batched = 0;
+			}
+		}
+
+		if (!out.empty() && !write_all(s.fd, out)) {
+			s.dropped.fetch_add(batched, std::memory_order_relaxed);
+		}
+		return records;
+	}
+
+	void writer_loop(LogSink* s)
+	{
+		std::string out;
+		while (s->running.load(std::memory_order_acquire)) {
+			if (drain(*s, out) == 0) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(s->params.flush_interval_ms));
+			}
+		}
+		drain(*s, out);
+	}
+
+	/// Per-thread record being built by one LOG() statement. The
+	/// std::endl at the end of the statement flushes the stream, which
+	/// publishes the record.
+	class LogRecordBuf : public std::streambuf
+	{
+	public:
+		LogRecordBuf()
+		{
+			record_.function = "";
+			record_.file = "";
+			setp(record_.message, record_.message);
+		}
+
+		void begin(LogLevels x, const char* function, int line, const char* file)
+		{
+			record_.time_ns = now_ns();
+			record_.function = function;
+			record_.file = file;
+			record_.line = line;
+			record_.level = x;
+			record_.flags = 0;
+			pending_ = true;
+			setp(record_.message, record_.message + sizeof(record_.message));
+		}
+
+	protected:
+		int_type overflow(int_type c) override
+		{
+			if (pending_ && c != traits_type::eof() && c != '\n') {
+				record_.flags |= RecordTruncated;
+			}
+			return traits_type::not_eof(c);
+		}
+
+		int sync() override
+		{
+			if (!pending_) {
+				return 0;
+			}
+
+			size_t length = pptr() - pbase();
+			if (length > 0 && record_.message[length - 1] == '\n') {
+				length--;
+			}
+			record_.length = length;
+			pending_ = false;
+			setp(record_.message, record_.message);
+
+			publish();
+			return 0;
+		}
+
+	private:
+		void publish()
+		{
+			LogSink& s = sink();
+
+			// Counted before checking async_log_active, so stop_async_log()
+			// can wait for every producer that saw the sink running
+			s.producers.fetch_add(1);
+			if (async_log_active.load()) {
+				if (!s.ring->push(record_)) {
+					s.dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+			} else {
+				// The sink stopped between the header and the std::endl
+				std::string out;
+				format_text(out, record_);
+				std::clog << out << std::flush;
+			}
+			s.producers.fetch_sub(1);
+		}
+
+		LogRecord record_;
+		bool pending_ = false;
+	};
+
+	struct LogRecordStream
+	{
+		LogRecordBuf buf;
+		std::ostream stream;
+		std::ios_base::fmtflags default_flags;
+
+		LogRecordStream()
+			: stream(&buf)
+			, default_flags(stream.flags())
+		{}
+	};
+
+	int start_locked(LogSink& s, int fd, bool owns_fd, const LogSinkParams& params)
+	{
+		if (fd < 0 || s.running.load()) {
+			return -1;
+		}
+
+		size_t capacity = 2;
+		while (capacity < params.capacity) {
+			capacity <<= 1;
+		}
+
+		s.ring.reset(new LogRing(capacity));
+		s.params = params;
+		s.params.capacity = capacity;
+		s.fd = fd;
+		s.owns_fd = owns_fd;
+		s.running.store(true);
+		s.writer = std::thread(writer_loop, &s);
+		async_log_active.store(true);
+		return 0;
+	}
+}
+
+std::ostream& async_log_stream(LogLevels x, const char* function, const int line, const char* file)
+{
+	static thread_local LogRecordStream s;
+
+	// Each statement starts from a clean stream, whatever the last
+	// one left behind
+	s.stream.flags(s.default_flags);
+	s.stream.precision(6);
+	s.stream.fill(' ');
+	s.buf.begin(x, function, line, file);
+	return s.stream;
+}
+
+int start_async_log(int fd, const LogSinkParams& params)
+{
+	LogSink& s = sink();
+	std::lock_guard<std::mutex> lock(s.control);
+	return start_locked(s, fd, false, params);
+}
+
+int start_async_log(const std::string& path, const LogSinkParams& params)
+{
+	LogSink& s = sink();
+	std::lock_guard<std::mutex> lock(s.control);
+
+	if (s.running.load()) {
+		return -1;
+	}
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	return start_locked(s, fd, true, params);
+}
+
+void stop_async_log()
+{
+	LogSink& s = sink();
+	std::lock_guard<std::mutex> lock(s.control);
+
+	if (!s.running.load()) {
+		return;
+	}
+
+	// New statements go to std::clog from here on; wait out any
+	// producer already pushing into the ring
+	async_log_active.store(false);
+	while (s.producers.load() != 0) {
+		std::this_thread::yield();
+	}
+
+	s.running.store(false, std::memory_order_release);
+	s.writer.join();
+	s.ring.reset();
+
+	if (s.owns_fd) {
+		close(s.fd);
+	}
+	s.fd = -1;
+	s.owns_fd = false;
+}
+
+bool async_log_running()
+{
+	return async_log_active.load(std::memory_order_relaxed);
+}
+
+uint64_t async_log_dropped()
+{
+	return sink().dropped.load(std::memory_order_relaxed);
+}
+
+} // namespace BLEPP
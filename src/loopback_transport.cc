@@ -0,0 +1,780 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/loopback_transport.h>
+#include <blepp/logging.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+// epoll token for the wakeup fd. Links use their handle, which always
+// fits in 16 bits.
+#define EPOLL_TOKEN_WAKEUP   0x10001
+#define EPOLL_MAX_EVENTS     16
+
+// Largest PDU read from a client end; anything over the MTU is discarded
+#define LOOPBACK_MAX_PDU     1024
+
+namespace BLEPP
+{
+
+static const char* const loopback_server_address = "00:00:00:00:00:01";
+static const uint64_t loopback_server_packed_address = 0x000000000001;
+static const char* const loopback_client_address = "00:00:00:00:00:02";
+
+LoopbackTransport::LoopbackTransport(const LoopbackParams& params)
+	: params_(params)
+	, next_conn_handle_(1)
+	, epoll_fd_(-1)
+	, wakeup_fd_(-1)
+	, advertising_(false)
+	, scanning_(false)
+	, rng_(params.seed)
+{
+	ENTER();
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		throw std::runtime_error("Failed to create loopback epoll fd");
+	}
+
+	wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_ < 0) {
+		close(epoll_fd_);
+		throw std::runtime_error("Failed to create loopback wakeup fd");
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = EPOLL_TOKEN_WAKEUP;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+	ENTER();
+
+	for (auto& pair : links_) {
+		close(pair.second.radio_fd);
+	}
+	links_.clear();
+
+	close(wakeup_fd_);
+	close(epoll_fd_);
+}
+
+LoopbackStats LoopbackTransport::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+bool LoopbackTransport::enqueue(Link& link, Channel& channel, const uint8_t* data, size_t len)
+{
+	if (params_.loss_rate > 0 &&
+	    std::uniform_real_distribution<double>(0.0, 1.0)(rng_) < params_.loss_rate) {
+		stats_.dropped++;
+		return false;
+	}
+
+	Clock::time_point due = Clock::now() + std::chrono::microseconds(params_.latency_us);
+
+	if (link.interval.count() > 0) {
+		// Round up to the next connection event, moving on when it is full.
+		// Packets never overtake each other, so a channel's events only grow.
+		int64_t event = (due - link.epoch + link.interval - Clock::duration(1)) / link.interval;
+		event = std::max(event, channel.last_event);
+
+		if (event == channel.last_event && params_.max_pdus_per_event &&
+		    channel.event_count >= params_.max_pdus_per_event) {
+			event++;
+		}
+		if (event != channel.last_event) {
+			channel.last_event = event;
+			channel.event_count = 0;
+		}
+		channel.event_count++;
+
+		due = link.epoch + link.interval * event;
+	}
+
+	Packet packet;
+	packet.due = due;
+	packet.data.assign(data, data + len);
+	channel.queue.push_back(std::move(packet));
+	return true;
+}
+
+void LoopbackTransport::drain_radio(Link& link)
+{
+	uint8_t buf[LOOPBACK_MAX_PDU];
+
+	while (!link.closed) {
+		ssize_t received = recv(link.radio_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (received < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG(Info, "Loopback connection " << link.conn_handle << " error: " << strerror(errno));
+				link.closed = true;
+			}
+			return;
+		}
+
+		// ATT PDUs are never empty, so this is the client closing its end
+		if (received == 0) {
+			LOG(Info, "Loopback connection " << link.conn_handle << " closed by client");
+			link.closed = true;
+			return;
+		}
+
+		if ((size_t)received > link.mtu) {
+			LOG(Warning, "Discarding " << received << " byte PDU from client, MTU is " << link.mtu);
+			stats_.oversized++;
+			continue;
+		}
+
+		enqueue(link, link.to_server, buf, received);
+	}
+}
+
+void LoopbackTransport::flush_to_client(Link& link, Clock::time_point now)
+{
+	std::deque<Packet>& queue = link.to_client.queue;
+
+	while (!link.closed && !queue.empty() && queue.front().due <= now) {
+		const std::vector<uint8_t>& data = queue.front().data;
+		ssize_t sent = ::send(link.radio_fd, data.data(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			// A full socket means the client is not reading; retry later
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG(Info, "Loopback connection " << link.conn_handle << " error: " << strerror(errno));
+				link.closed = true;
+			}
+			return;
+		}
+
+		stats_.pdus_to_client++;
+		stats_.bytes_to_client += data.size();
+		queue.pop_front();
+	}
+}
+
+int LoopbackTransport::next_due_ms() const
+{
+	Clock::time_point now = Clock::now();
+	int64_t best = -1;
+
+	for (const auto& pair : links_) {
+		const Link& link = pair.second;
+		for (const Channel* channel : {&link.to_server, &link.to_client}) {
+			if (channel->queue.empty()) {
+				continue;
+			}
+			int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+			                 channel->queue.front().due - now).count();
+			int64_t ms = std::max<int64_t>((us + 999) / 1000, 0);
+			if (best < 0 || ms < best) {
+				best = ms;
+			}
+		}
+	}
+
+	// Anything already due is a packet the client has no room for, so
+	// back off rather than spin
+	if (best == 0) {
+		best = 1;
+	}
+	return (int)best;
+}
+
+LoopbackTransport::Link* LoopbackTransport::find_link_by_fd(int fd)
+{
+	for (auto& pair : links_) {
+		if (pair.second.client_fd == fd) {
+			return &pair.second;
+		}
+	}
+	return nullptr;
+}
+
+const LoopbackTransport::Link* LoopbackTransport::find_link_by_fd(int fd) const
+{
+	return const_cast<LoopbackTransport*>(this)->find_link_by_fd(fd);
+}
+
+void LoopbackTransport::remove_link(std::map<uint16_t, Link>::iterator it)
+{
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second.radio_fd, nullptr);
+	close(it->second.radio_fd);
+	links_.erase(it);
+}
+
+AdvertisementData LoopbackTransport::build_advertisement() const
+{
+	AdvertisementData ad;
+	ad.address = loopback_server_address;
+	ad.address_type = 0;
+	ad.rssi = -40;
+	ad.event_type = 0;  // ADV_IND
+
+	if (adv_params_.advertising_data_len > 0) {
+		ad.data.assign(adv_params_.advertising_data,
+		               adv_params_.advertising_data + adv_params_.advertising_data_len);
+		return ad;
+	}
+
+	// Flags: LE General Discoverable, BR/EDR not supported
+	ad.data = {0x02, 0x01, 0x06};
+
+	if (!adv_params_.device_name.empty()) {
+		size_t name_len = std::min<size_t>(adv_params_.device_name.size(), 31 - ad.data.size() - 2);
+		ad.data.push_back(name_len + 1);
+		ad.data.push_back(0x09);  // Complete Local Name
+		ad.data.insert(ad.data.end(), adv_params_.device_name.begin(),
+		               adv_params_.device_name.begin() + name_len);
+	}
+
+	return ad;
+}
+
+// ===== BLETransport (server side) =====
+
+int LoopbackTransport::start_advertising(const AdvertisingParams& params)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	adv_params_ = params;
+	advertising_ = true;
+	next_adv_ = Clock::now();
+	return 0;
+}
+
+int LoopbackTransport::stop_advertising()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	advertising_ = false;
+	return 0;
+}
+
+bool LoopbackTransport::is_advertising() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return advertising_;
+}
+
+int LoopbackTransport::accept_connection()
+{
+	std::vector<ConnectionParams> connected;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto& pair : links_) {
+			Link& link = pair.second;
+			if (!link.announced) {
+				link.announced = true;
+
+				ConnectionParams conn;
+				conn.conn_handle = link.conn_handle;
+				conn.peer_address = loopback_client_address;
+				conn.mtu = link.mtu;
+				connected.push_back(conn);
+			}
+		}
+	}
+
+	for (const ConnectionParams& conn : connected) {
+		LOG(Info, "Accepted loopback connection " << conn.conn_handle);
+		if (BLETransport::on_connected) {
+			BLETransport::on_connected(conn);
+		}
+	}
+
+	return 0;
+}
+
+int LoopbackTransport::disconnect(uint16_t conn_handle)
+{
+	ENTER();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = links_.find(conn_handle);
+		if (it == links_.end()) {
+			LOG(Warning, "Connection handle " << conn_handle << " not found");
+			return -1;
+		}
+		remove_link(it);
+	}
+
+	LOG(Info, "Disconnected loopback connection " << conn_handle);
+
+	if (BLETransport::on_disconnected) {
+		BLETransport::on_disconnected(conn_handle);
+	}
+
+	return 0;
+}
+
+int LoopbackTransport::get_fd() const
+{
+	return epoll_fd_;
+}
+
+int LoopbackTransport::send_pdu(uint16_t conn_handle, const uint8_t* data, size_t len)
+{
+	bool pending;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = links_.find(conn_handle);
+		if (it == links_.end()) {
+			LOG(Error, "Connection handle " << conn_handle << " not found");
+			return -1;
+		}
+
+		Link& link = it->second;
+		if (len > link.mtu) {
+			LOG(Warning, "Refusing " << len << " byte PDU, MTU is " << link.mtu);
+			stats_.oversized++;
+			return -1;
+		}
+
+		enqueue(link, link.to_client, data, len);
+		flush_to_client(link, Clock::now());
+		pending = !link.to_client.queue.empty();
+	}
+
+	// Let a waiting event loop pick up the new deadline
+	if (pending) {
+		wakeup();
+	}
+
+	return len;
+}
+
+bool LoopbackTransport::can_send(uint16_t conn_handle) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = links_.find(conn_handle);
+	if (it == links_.end()) {
+		return false;
+	}
+
+	if (!params_.tx_window || it->second.to_client.queue.size() < params_.tx_window) {
+		return true;
+	}
+
+	// process_events() reports room once the client has taken enough
+	it->second.tx_waiting = true;
+	return false;
+}
+
+int LoopbackTransport::recv_pdu(uint16_t conn_handle, uint8_t* buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = links_.find(conn_handle);
+	if (it == links_.end()) {
+		LOG(Error, "Connection handle " << conn_handle << " not found");
+		return -1;
+	}
+
+	Link& link = it->second;
+	drain_radio(link);
+
+	std::deque<Packet>& queue = link.to_server.queue;
+	if (queue.empty() || queue.front().due > Clock::now()) {
+		return 0;
+	}
+
+	size_t n = std::min(len, queue.front().data.size());
+	memcpy(buf, queue.front().data.data(), n);
+	stats_.pdus_to_server++;
+	stats_.bytes_to_server += n;
+	queue.pop_front();
+
+	return n;
+}
+
+int LoopbackTransport::set_mtu(uint16_t conn_handle, uint16_t mtu)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = links_.find(conn_handle);
+		if (it == links_.end()) {
+			return -1;
+		}
+
+		mtu = std::min(mtu, params_.max_mtu);
+		it->second.mtu = mtu;
+	}
+
+	LOG(Debug, "Set MTU to " << mtu << " for loopback connection " << conn_handle);
+
+	if (on_mtu_changed) {
+		on_mtu_changed(conn_handle, mtu);
+	}
+
+	return 0;
+}
+
+uint16_t LoopbackTransport::get_mtu(uint16_t conn_handle) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = links_.find(conn_handle);
+	if (it == links_.end()) {
+		return 23;  // Default
+	}
+	return it->second.mtu;
+}
+
+int LoopbackTransport::process_events()
+{
+	std::vector<std::pair<uint16_t, std::vector<uint8_t>>> received;
+	std::vector<uint16_t> disconnected;
+	std::vector<uint16_t> ready;
+
+	// Announce new links before delivering anything on them
+	accept_connection();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (auto it = links_.begin(); it != links_.end();) {
+			Link& link = it->second;
+
+			// Read first, so PDUs with no added delay are due immediately
+			drain_radio(link);
+			Clock::time_point now = Clock::now();
+			flush_to_client(link, now);
+
+			if (link.tx_waiting && !link.closed && link.to_client.queue.size() < params_.tx_window) {
+				link.tx_waiting = false;
+				ready.push_back(link.conn_handle);
+			}
+
+			std::deque<Packet>& queue = link.to_server.queue;
+			while (!queue.empty() && queue.front().due <= now) {
+				stats_.pdus_to_server++;
+				stats_.bytes_to_server += queue.front().data.size();
+				received.emplace_back(link.conn_handle, std::move(queue.front().data));
+				queue.pop_front();
+			}
+
+			if (link.closed) {
+				disconnected.push_back(link.conn_handle);
+				remove_link(it++);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Callbacks run unlocked, since the server answers from inside them
+	for (const auto& pdu : received) {
+		if (BLETransport::on_data_received) {
+			BLETransport::on_data_received(pdu.first, pdu.second.data(), pdu.second.size());
+		}
+	}
+
+	for (uint16_t conn_handle : ready) {
+		if (BLETransport::on_tx_ready) {
+			BLETransport::on_tx_ready(conn_handle);
+		}
+	}
+
+	for (uint16_t conn_handle : disconnected) {
+		if (BLETransport::on_disconnected) {
+			BLETransport::on_disconnected(conn_handle);
+		}
+	}
+
+	return received.size() + disconnected.size() + ready.size();
+}
+
+int LoopbackTransport::wait_events(int timeout_ms)
+{
+	int due_ms;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		due_ms = next_due_ms();
+	}
+
+	if (due_ms >= 0 && (timeout_ms < 0 || due_ms < timeout_ms)) {
+		timeout_ms = due_ms;
+	}
+
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int n = epoll_wait(epoll_fd_, events, EPOLL_MAX_EVENTS, timeout_ms);
+
+	if (n < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		LOG(Error, "epoll_wait() failed: " << strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.u64 == EPOLL_TOKEN_WAKEUP) {
+			uint64_t count;
+			if (read(wakeup_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				LOG(Warning, "Failed to drain wakeup fd: " << strerror(errno));
+			}
+		}
+	}
+
+	// Links are cheap to scan, and timed packets have no fd to report them
+	return process_events();
+}
+
+void LoopbackTransport::wakeup()
+{
+	uint64_t one = 1;
+	if (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		LOG(Warning, "Failed to signal wakeup fd: " << strerror(errno));
+	}
+}
+
+// ===== BLEClientTransport (client side) =====
+
+int LoopbackTransport::start_scan(const ScanParams& params)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	reset_report_filter(params);
+	scanning_ = true;
+	return 0;
+}
+
+int LoopbackTransport::stop_scan()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	scanning_ = false;
+	return 0;
+}
+
+int LoopbackTransport::get_advertisements(std::vector<AdvertisementData>& ads, int timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (!scanning_) {
+		LOG(Error, "get_advertisements() called while not scanning");
+		return -1;
+	}
+
+	// One report per advertising interval, like a real advertiser
+	Clock::time_point now = Clock::now();
+	if (!advertising_ || now < next_adv_) {
+		if (timeout_ms == 0) {
+			return 0;
+		}
+
+		Clock::time_point until = advertising_ ? next_adv_ : now + std::chrono::milliseconds(100);
+		if (timeout_ms > 0) {
+			until = std::min(until, now + std::chrono::milliseconds(timeout_ms));
+		}
+
+		lock.unlock();
+		std::this_thread::sleep_until(until);
+		lock.lock();
+
+		if (!scanning_ || !advertising_ || Clock::now() < next_adv_) {
+			return 0;
+		}
+	}
+
+	AdvertisementData ad = build_advertisement();
+	next_adv_ = Clock::now() + std::chrono::milliseconds(adv_params_.min_interval_ms);
+	if (!accept_report(loopback_server_packed_address, ad.address_type, ad.event_type,
+	                   ad.rssi, ad.data.data(), ad.data.size())) {
+		return 0;
+	}
+	lock.unlock();
+
+	ads.push_back(ad);
+	if (on_advertisement) {
+		on_advertisement(ad);
+	}
+
+	return 1;
+}
+
+int LoopbackTransport::connect(const ClientConnectionParams& params)
+{
+	ENTER();
+
+	int fds[2];
+	uint16_t conn_handle;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!advertising_) {
+			LOG(Error, "Loopback server is not advertising");
+			return -1;
+		}
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+			LOG(Error, "socketpair() failed: " << strerror(errno));
+			return -1;
+		}
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+		// Handle 0 is never used, and skip any still in use after wrapping
+		do {
+			conn_handle = next_conn_handle_++;
+		} while (conn_handle == 0 || links_.count(conn_handle));
+
+		Link link;
+		link.conn_handle = conn_handle;
+		link.client_fd = fds[0];
+		link.radio_fd = fds[1];
+		link.mtu = params_.mtu;
+		link.epoch = Clock::now();
+		link.interval = Clock::duration::zero();
+		if (params_.emulate_conn_interval) {
+			link.interval = std::chrono::microseconds(params.max_interval * 1250);
+		}
+		link.announced = false;
+		link.closed = false;
+		link.tx_waiting = false;
+
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u64 = conn_handle;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, link.radio_fd, &ev) < 0) {
+			LOG(Error, "epoll_ctl() failed: " << strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			return -1;
+		}
+
+		links_.insert(std::make_pair(conn_handle, std::move(link)));
+	}
+
+	LOG(Info, "Loopback connection " << conn_handle << " opened, client fd=" << fds[0]);
+
+	// The server side announces the link from its event loop
+	wakeup();
+
+	if (BLEClientTransport::on_connected) {
+		BLEClientTransport::on_connected(fds[0]);
+	}
+
+	return fds[0];
+}
+
+int LoopbackTransport::disconnect(int fd)
+{
+	ENTER();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		Link* link = find_link_by_fd(fd);
+		if (!link) {
+			LOG(Error, "Invalid connection fd=" << fd);
+			return -1;
+		}
+
+		// The server side sees the hangup on its end and tears the link down
+		link->client_fd = -1;
+		close(fd);
+	}
+
+	if (BLEClientTransport::on_disconnected) {
+		BLEClientTransport::on_disconnected(fd);
+	}
+
+	return 0;
+}
+
+int LoopbackTransport::get_fd(int fd) const
+{
+	return fd;
+}
+
+int LoopbackTransport::send(int fd, const uint8_t* data, size_t len)
+{
+	ssize_t sent = ::send(fd, data, len, MSG_NOSIGNAL);
+	if (sent < 0) {
+		LOG(Error, "Failed to send data on fd=" << fd << ": " << strerror(errno));
+		return -1;
+	}
+	return sent;
+}
+
+int LoopbackTransport::receive(int fd, uint8_t* data, size_t max_len)
+{
+	ssize_t received = recv(fd, data, max_len, 0);
+	if (received < 0) {
+		LOG(Error, "Failed to receive data on fd=" << fd << ": " << strerror(errno));
+		return -1;
+	}
+	return received;
+}
+
+uint16_t LoopbackTransport::get_mtu(int fd) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	const Link* link = find_link_by_fd(fd);
+	return link ? link->mtu : 23;
+}
+
+int LoopbackTransport::set_mtu(int fd, uint16_t mtu)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Link* link = find_link_by_fd(fd);
+	if (!link) {
+		return -1;
+	}
+	link->mtu = std::min(mtu, params_.max_mtu);
+	return 0;
+}
+
+const char* LoopbackTransport::get_transport_name() const
+{
+	return "Loopback";
+}
+
+bool LoopbackTransport::is_available() const
+{
+	return true;
+}
+
+std::string LoopbackTransport::get_mac_address() const
+{
+	return loopback_client_address;
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
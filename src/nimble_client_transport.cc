@@ -27,6 +27,7 @@
 #include <blepp/nimble_client_transport.h>
 #include <blepp/lescan.h>
 #include <blepp/logging.h>
+#include <blepp/alloc_stats.h>
 
 #include <cstdlib>
 #include <ctime>
@@ -304,6 +305,8 @@ int NimbleClientTransport::gap_event_callback(struct ble_gap_event* event, void*
 int NimbleClientTransport::gatt_event_callback(uint16_t conn_handle, uint16_t attr_handle,
                                               struct ble_gatt_access_ctxt* ctxt, void* arg)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	NimbleClientTransport* self = static_cast<NimbleClientTransport*>(arg);
 
 	// Note: This callback is for GATT server events (when acting as a peripheral).
@@ -317,6 +320,8 @@ int NimbleClientTransport::gatt_event_callback(uint16_t conn_handle, uint16_t at
 
 int NimbleClientTransport::handle_gap_event(struct ble_gap_event* event)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	switch (event->type) {
 	case BLE_GAP_EVENT_DISC:
 		handle_disc_event(&event->disc);
@@ -355,17 +360,15 @@ void NimbleClientTransport::handle_disc_event(const struct ble_gap_disc_desc* di
 {
 	std::lock_guard<std::mutex> lock(scan_mutex_);
 
+	// Apply the scan filter, and check for duplicates if software filtering is enabled
+	if (!accept_report(pack_address(disc->addr.val), disc->addr.type, disc->event_type,
+	                   disc->rssi, disc->data, disc->length_data)) {
+		return;
+	}
+
 	// Convert address to string
 	std::string addr_str = addr_to_string(disc->addr.val);
 
-	// Check for duplicates if software filtering is enabled
-	if (scan_params_.filter_duplicates == ScanParams::FilterDuplicates::Software) {
-		if (seen_devices_.find(addr_str) != seen_devices_.end()) {
-			return;  // Duplicate
-		}
-		seen_devices_.insert(addr_str);
-	}
-
 	// Create advertisement data structure
 	AdvertisementData ad;
 	ad.address = addr_str;
@@ -384,7 +387,7 @@ void NimbleClientTransport::handle_disc_event(const struct ble_gap_disc_desc* di
 
 	// Call on_advertisement callback if registered
 	if (on_advertisement) {
-		on_advertisement(ad);
+		call_user(on_advertisement, ad);
 	}
 }
 
@@ -430,7 +433,7 @@ void NimbleClientTransport::handle_connect_event(struct ble_gap_event* event)
 
 	// Call on_connected callback if registered
 	if (on_connected) {
-		on_connected(fd);
+		call_user(on_connected, fd);
 	}
 }
 
@@ -452,7 +455,7 @@ void NimbleClientTransport::handle_disconnect_event(struct ble_gap_event* event)
 
 	// Call on_disconnected callback before cleanup
 	if (on_disconnected) {
-		on_disconnected(fd);
+		call_user(on_disconnected, fd);
 	}
 
 	// Clean up connection state
@@ -502,7 +505,7 @@ void NimbleClientTransport::handle_notify_rx_event(struct ble_gap_event* event)
 
 		// Call on_data_received callback if registered
 		if (on_data_received) {
-			on_data_received(fd, data.data(), len);
+			call_user(on_data_received, fd, data.data(), len);
 		}
 	}
 }
@@ -564,7 +567,7 @@ int NimbleClientTransport::start_scan(const ScanParams& params)
 		while (!scan_results_.empty()) {
 			scan_results_.pop();
 		}
-		seen_devices_.clear();
+		reset_report_filter(params);
 	}
 
 	// Setup scan parameters
@@ -628,6 +631,8 @@ int NimbleClientTransport::stop_scan()
 
 int NimbleClientTransport::get_advertisements(std::vector<AdvertisementData>& ads, int timeout_ms)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	std::lock_guard<std::mutex> lock(scan_mutex_);
 
 	while (!scan_results_.empty()) {
@@ -644,6 +649,8 @@ int NimbleClientTransport::get_advertisements(std::vector<AdvertisementData>& ad
 
 int NimbleClientTransport::connect(const ClientConnectionParams& params)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	if (!initialized_) {
 		return -1;
 	}
@@ -746,6 +753,8 @@ int NimbleClientTransport::get_fd(int fd) const
 
 int NimbleClientTransport::send(int fd, const uint8_t* data, size_t len)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	std::lock_guard<std::mutex> lock(conn_mutex_);
 
 	auto it = connections_.find(fd);
@@ -777,6 +786,8 @@ int NimbleClientTransport::send(int fd, const uint8_t* data, size_t len)
 
 int NimbleClientTransport::receive(int fd, uint8_t* data, size_t max_len)
 {
+	ALLOC_SCOPE(ClientTransport);
+
 	std::lock_guard<std::mutex> lock(conn_mutex_);
 
 	auto it = connections_.find(fd);
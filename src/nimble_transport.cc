@@ -329,6 +329,14 @@ void NimbleTransport::cleanup()
 			ioctl_fd_ = -1;
 		}
 
+		{
+			std::lock_guard<std::mutex> lock(tx_mutex_);
+			for (uint16_t conn_handle : tx_queue_.pending()) {
+				tx_queue_.remove(conn_handle);
+			}
+			tx_waiting_.clear();
+		}
+
 		// Destroy semaphores
 		sem_destroy(&event_sem_);
 		sem_destroy(&ioctl_sem_);
@@ -447,6 +455,12 @@ void NimbleTransport::process_hci_event(const uint8_t* data, size_t len)
 				uint16_t conn_handle = (data[5] << 8) | data[4];
 				uint8_t reason = data[6];
 
+				if (status == 0) {
+					std::lock_guard<std::mutex> lock(tx_mutex_);
+					tx_queue_.remove(conn_handle);
+					tx_waiting_.erase(conn_handle);
+				}
+
 				if (status == 0 && on_disconnected) {
 					on_disconnected(conn_handle);
 					LOG(Info, "Disconnection complete: handle=" << conn_handle << " reason=" << (int)reason);
@@ -454,6 +468,11 @@ void NimbleTransport::process_hci_event(const uint8_t* data, size_t len)
 			}
 			break;
 
+		case 0x13:  // HCI_Number_Of_Completed_Packets
+			// The controller has freed ACL buffers
+			flush_tx();
+			break;
+
 		case 0x0E:  // HCI_Command_Complete
 			LOG(Debug, "Command complete event");
 			break;
@@ -967,6 +986,18 @@ int NimbleTransport::send_pdu(uint16_t conn_handle, const uint8_t* data, size_t
 		return -1;
 	}
 
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+
+	int ret = tx_queue_.send(conn_handle, data, len,
+		[this, conn_handle](const uint8_t* pdu, size_t pdu_len) {
+			return write_acl(conn_handle, pdu, pdu_len);
+		});
+
+	return ret < 0 ? -1 : static_cast<int>(len);
+}
+
+int NimbleTransport::write_acl(uint16_t conn_handle, const uint8_t* data, size_t len)
+{
 	// Build HCI ACL packet with L2CAP header
 	// Format:
 	//  [0-1]: Length (total packet length for ioctl)
@@ -1014,6 +1045,11 @@ int NimbleTransport::send_pdu(uint16_t conn_handle, const uint8_t* data, size_t
 	sem_post(&ioctl_sem_);
 
 	if (ret < 0) {
+		// The controller is out of ACL buffers; the PDU stays queued until
+		// Number of Completed Packets frees some
+		if (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS || errno == ENOMEM) {
+			return 0;
+		}
 		LOG(Error, "Failed to send HCI ACL data: " << strerror(errno));
 		return -1;
 	}
@@ -1086,11 +1122,79 @@ uint16_t NimbleTransport::get_mtu(uint16_t conn_handle) const
 
 int NimbleTransport::process_events()
 {
-	// Events are processed asynchronously by the event thread
-	// This function is for compatibility with the transport interface
+	// Events are processed asynchronously by the event thread; the
+	// ioctl has no writability signal, so retry queued PDUs here too
+	flush_tx();
 	return 0;
 }
 
+void NimbleTransport::flush_tx()
+{
+	std::vector<DroppedPdu> dropped;
+	std::vector<uint16_t> ready;
+
+	{
+		std::lock_guard<std::mutex> lock(tx_mutex_);
+
+		for (uint16_t conn_handle : tx_queue_.pending()) {
+			tx_queue_.flush(conn_handle,
+				[this, conn_handle](const uint8_t* pdu, size_t len) {
+					return write_acl(conn_handle, pdu, len);
+				});
+		}
+
+		dropped = tx_queue_.take_dropped();
+
+		for (auto it = tx_waiting_.begin(); it != tx_waiting_.end();) {
+			if (tx_queue_.empty(*it)) {
+				ready.push_back(*it);
+				it = tx_waiting_.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Evictions made by send_pdu() are reported here too, as its caller
+	// may hold locks that on_pdu_dropped needs
+	for (const auto& d : dropped) {
+		LOG(Debug, "Dropped queued " << d.pdu.size() << " byte PDU on connection " << d.conn_handle);
+		if (on_pdu_dropped) {
+			on_pdu_dropped(d.conn_handle, d.pdu.data(), d.pdu.size());
+		}
+	}
+
+	for (uint16_t conn_handle : ready) {
+		if (on_tx_ready) {
+			on_tx_ready(conn_handle);
+		}
+	}
+}
+
+bool NimbleTransport::can_send(uint16_t conn_handle) const
+{
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+	if (tx_queue_.empty(conn_handle)) {
+		return true;
+	}
+
+	// The next flush_tx() that empties the queue says so through on_tx_ready
+	tx_waiting_.insert(conn_handle);
+	return false;
+}
+
+TxQueueStats NimbleTransport::tx_stats(uint16_t conn_handle) const
+{
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+	return tx_queue_.stats(conn_handle);
+}
+
+void NimbleTransport::set_tx_queue_limit(size_t max_bytes)
+{
+	std::lock_guard<std::mutex> lock(tx_mutex_);
+	tx_queue_.set_max_bytes(max_bytes);
+}
+
 } // namespace BLEPP
 
 #endif // BLEPP_NIMBLE_SUPPORT
@@ -0,0 +1,156 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/peer_quirks.h>
+
+#include <cctype>
+
+namespace BLEPP
+{
+
+void PeerQuirkTable::add_oui(uint32_t oui, const PeerQuirks& quirks)
+{
+	ouis_.push_back(std::make_pair(oui & 0xFFFFFF, quirks));
+}
+
+void PeerQuirkTable::add_address_type(uint8_t address_type, const PeerQuirks& quirks)
+{
+	address_types_.push_back(std::make_pair(address_type, quirks));
+}
+
+void PeerQuirkTable::add_client_mtu(uint16_t client_mtu, const PeerQuirks& quirks)
+{
+	client_mtus_.push_back(std::make_pair(client_mtu, quirks));
+}
+
+void PeerQuirkTable::set_android_quirks(const PeerQuirks& quirks, const AndroidFingerprint& fingerprint)
+{
+	have_android_ = true;
+	android_fingerprint_ = fingerprint;
+	android_ = quirks;
+}
+
+PeerQuirks PeerQuirkTable::operator()(const ConnectionParams& peer, uint16_t client_mtu) const
+{
+	uint32_t oui;
+	if (!ouis_.empty() && parse_oui(peer.peer_address, oui)) {
+		for (const auto& rule : ouis_) {
+			if (rule.first == oui) {
+				return rule.second;
+			}
+		}
+	}
+
+	for (const auto& rule : address_types_) {
+		if (rule.first == peer.peer_address_type) {
+			return rule.second;
+		}
+	}
+
+	if (have_android_ && is_android(android_fingerprint_, peer, client_mtu)) {
+		return android_;
+	}
+
+	// client_mtu is 0 until the peer has sent an Exchange MTU Request
+	if (client_mtu != 0) {
+		for (const auto& rule : client_mtus_) {
+			if (rule.first == client_mtu) {
+				return rule.second;
+			}
+		}
+	}
+
+	return default_quirks;
+}
+
+bool PeerQuirkTable::is_android(const AndroidFingerprint& fingerprint,
+                                const ConnectionParams& peer, uint16_t client_mtu)
+{
+	// client_mtu is 0 until the peer has sent an Exchange MTU Request
+	if (client_mtu == 0 || client_mtu != fingerprint.client_mtu) {
+		return false;
+	}
+
+	if (peer.peer_address_type == fingerprint.address_type) {
+		return true;
+	}
+
+	uint32_t oui;
+	if (!fingerprint.ouis.empty() && parse_oui(peer.peer_address, oui)) {
+		for (uint32_t candidate : fingerprint.ouis) {
+			if ((candidate & 0xFFFFFF) == oui) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool PeerQuirkTable::parse_oui(const std::string& address, uint32_t& oui)
+{
+	// "AA:BB:CC..." - three hex pairs separated by colons
+	if (address.size() < 8) {
+		return false;
+	}
+
+	uint32_t value = 0;
+	for (size_t i = 0; i < 8; i++) {
+		char c = address[i];
+
+		if (i % 3 == 2) {
+			if (c != ':') {
+				return false;
+			}
+			continue;
+		}
+
+		if (!isxdigit(static_cast<unsigned char>(c))) {
+			return false;
+		}
+
+		int nibble = isdigit(static_cast<unsigned char>(c)) ? c - '0' : (tolower(c) - 'a' + 10);
+		value = (value << 4) | nibble;
+	}
+
+	oui = value;
+	return true;
+}
+
+PeerQuirkTable default_peer_quirk_policy()
+{
+	PeerQuirkTable table;
+
+	PeerQuirks android;
+	android.discovery_response_delay_ms = 20;
+	table.set_android_quirks(android);
+
+	return table;
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
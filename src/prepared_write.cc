@@ -0,0 +1,195 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/prepared_write.h>
+#include <blepp/att.h>
+#include <algorithm>
+#include <cstring>
+
+namespace BLEPP
+{
+
+const size_t PreparedWritePool::slab_size;
+const uint32_t PreparedWritePool::no_slab;
+
+PreparedWritePool::PreparedWritePool(size_t max_bytes)
+	: free_head_(no_slab)
+	, free_slabs_(0)
+{
+	resize(max_bytes);
+}
+
+int PreparedWritePool::resize(size_t max_bytes)
+{
+	if (free_slabs_ != next_.size()) {
+		return -1;
+	}
+
+	size_t num_slabs = (max_bytes + slab_size - 1) / slab_size;
+
+	storage_.assign(num_slabs * slab_size, 0);
+	next_.resize(num_slabs);
+
+	// Thread every slab onto the free list
+	for (size_t i = 0; i < num_slabs; i++) {
+		next_[i] = (i + 1 < num_slabs) ? i + 1 : no_slab;
+	}
+	free_head_ = num_slabs ? 0 : no_slab;
+	free_slabs_ = num_slabs;
+
+	return 0;
+}
+
+uint32_t PreparedWritePool::store(const uint8_t* data, size_t len)
+{
+	size_t needed = std::max<size_t>(1, (len + slab_size - 1) / slab_size);
+	if (needed > free_slabs_) {
+		return no_slab;
+	}
+
+	// Take the first `needed` slabs off the free list; they already form a chain
+	uint32_t head = free_head_;
+	uint32_t last = head;
+	for (size_t i = 0; i < needed; i++) {
+		size_t n = std::min(len, slab_size);
+		if (n) {
+			memcpy(&storage_[last * slab_size], data, n);
+			data += n;
+			len -= n;
+		}
+
+		if (i + 1 < needed) {
+			last = next_[last];
+		}
+	}
+
+	free_head_ = next_[last];
+	next_[last] = no_slab;
+	free_slabs_ -= needed;
+
+	return head;
+}
+
+void PreparedWritePool::copy_out(uint32_t head, size_t len, std::vector<uint8_t>& out) const
+{
+	for (uint32_t s = head; s != no_slab && len; s = next_[s]) {
+		size_t n = std::min(len, slab_size);
+		const uint8_t* p = &storage_[s * slab_size];
+		out.insert(out.end(), p, p + n);
+		len -= n;
+	}
+}
+
+void PreparedWritePool::release(uint32_t head)
+{
+	if (head == no_slab) {
+		return;
+	}
+
+	uint32_t last = head;
+	size_t count = 1;
+	while (next_[last] != no_slab) {
+		last = next_[last];
+		count++;
+	}
+
+	next_[last] = free_head_;
+	free_head_ = head;
+	free_slabs_ += count;
+}
+
+int PreparedWriteQueue::push(PreparedWritePool& pool, uint16_t handle, uint16_t offset,
+                             const uint8_t* data, size_t len, size_t max_bytes)
+{
+	if (bytes_ + len > max_bytes) {
+		return -1;
+	}
+
+	uint32_t head = pool.store(data, len);
+	if (head == PreparedWritePool::no_slab) {
+		return -1;
+	}
+
+	entries_.push_back(Entry{handle, offset, (uint16_t)len, head});
+	bytes_ += len;
+	return 0;
+}
+
+int PreparedWriteQueue::drain(PreparedWritePool& pool, std::vector<Write>& out,
+                              uint16_t& error_handle)
+{
+	int rc = 0;
+	out.clear();
+
+	for (const Entry& e : entries_) {
+		if (rc == 0) {
+			auto w = std::find_if(out.begin(), out.end(),
+			                      [&](const Write& x) { return x.handle == e.handle; });
+
+			if (w == out.end()) {
+				out.push_back(Write{e.handle, e.offset, {}});
+				pool.copy_out(e.head, e.length, out.back().value);
+			} else if (e.offset < w->offset || e.offset > w->offset + w->value.size()) {
+				// A gap or a segment before the start: nothing sensible to write
+				error_handle = e.handle;
+				rc = ATT_ECODE_INVALID_OFFSET;
+			} else {
+				// Later segments overwrite earlier ones where they overlap
+				std::vector<uint8_t> seg;
+				pool.copy_out(e.head, e.length, seg);
+				size_t at = e.offset - w->offset;
+				if (w->value.size() < at + seg.size()) {
+					w->value.resize(at + seg.size());
+				}
+				std::copy(seg.begin(), seg.end(), w->value.begin() + at);
+			}
+		}
+
+		pool.release(e.head);
+	}
+
+	entries_.clear();
+	bytes_ = 0;
+
+	if (rc != 0) {
+		out.clear();
+	}
+	return rc;
+}
+
+void PreparedWriteQueue::cancel(PreparedWritePool& pool)
+{
+	for (const Entry& e : entries_) {
+		pool.release(e.head);
+	}
+
+	entries_.clear();
+	bytes_ = 0;
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
@@ -0,0 +1,289 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include <blepp/scan_filter.h>
+#include <blepp/duplicate_filter.h>
+#include <blepp/att.h>
+#include <blepp/gap.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace BLEPP
+{
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/// Parse "XX:XX:..." (1 to 6 bytes) into a value and mask over the packed address
+static void parse_address_prefix(const std::string& s, uint64_t& value, uint64_t& mask)
+{
+	size_t bytes = (s.size() + 1) / 3;
+	if (bytes == 0 || bytes > 6 || s.size() != bytes * 3 - 1) {
+		throw std::invalid_argument("ScanFilter: bad address prefix \"" + s + "\"");
+	}
+
+	value = 0;
+	mask = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		if (i != 0 && s[i * 3 - 1] != ':') {
+			throw std::invalid_argument("ScanFilter: bad address prefix \"" + s + "\"");
+		}
+
+		int hi = hex_digit(s[i * 3]);
+		int lo = hex_digit(s[i * 3 + 1]);
+		if (hi < 0 || lo < 0) {
+			throw std::invalid_argument("ScanFilter: bad address prefix \"" + s + "\"");
+		}
+		uint64_t b = hi * 16 + lo;
+
+		unsigned shift = 40 - 8 * i;
+		value |= b << shift;
+		mask |= 0xffULL << shift;
+	}
+}
+
+/// Call f(type, payload, payload_len) on each AD structure until it returns
+/// true. Stops quietly at the first malformed structure.
+template<class F>
+static bool any_ad(const uint8_t* data, size_t len, F f)
+{
+	size_t i = 0;
+	while (i < len) {
+		size_t length = data[i];
+		if (length == 0 || i + 1 + length > len) {
+			return false;
+		}
+		if (f(data[i + 1], data + i + 2, length - 1)) {
+			return true;
+		}
+		i += 1 + length;
+	}
+	return false;
+}
+
+void ScanFilter::add(const ScanFilterRule& rule)
+{
+	size_t start = program_.size();
+	size_t pool_start = pool_.size();
+
+	try {
+		compile(rule);
+	} catch (...) {
+		program_.resize(start);
+		pool_.resize(pool_start);
+		throw;
+	}
+}
+
+void ScanFilter::compile(const ScanFilterRule& rule)
+{
+	size_t start = program_.size();
+	Instruction in = Instruction();
+
+	in.op = OpRule;
+	program_.push_back(in);
+
+	// Cheapest tests first
+	if (rule.min_rssi != -128) {
+		in = Instruction();
+		in.op = OpMinRssi;
+		in.rssi = rule.min_rssi;
+		program_.push_back(in);
+	}
+
+	if (!rule.address_prefix.empty()) {
+		in = Instruction();
+		in.op = OpAddress;
+		parse_address_prefix(rule.address_prefix, in.value, in.mask);
+		program_.push_back(in);
+	}
+
+	if (!rule.name_prefix.empty()) {
+		in = Instruction();
+		in.op = OpNamePrefix;
+		in.offset = pool_.size();
+		in.length = rule.name_prefix.size();
+		pool_.insert(pool_.end(), rule.name_prefix.begin(), rule.name_prefix.end());
+		program_.push_back(in);
+	}
+
+	if (rule.company_id >= 0 || !rule.manufacturer_data.empty()) {
+		if (rule.company_id < 0 || rule.company_id > 0xffff) {
+			throw std::invalid_argument("ScanFilter: manufacturer data needs a 16-bit company ID");
+		}
+		if (!rule.manufacturer_mask.empty() && rule.manufacturer_mask.size() != rule.manufacturer_data.size()) {
+			throw std::invalid_argument("ScanFilter: manufacturer mask and data differ in length");
+		}
+
+		in = Instruction();
+		in.op = OpManufacturer;
+		in.company = rule.company_id;
+		in.offset = pool_.size();
+		in.length = rule.manufacturer_data.size();
+
+		// Store the data pre-masked, then the mask
+		for (size_t i = 0; i < in.length; i++) {
+			uint8_t m = rule.manufacturer_mask.empty() ? 0xff : rule.manufacturer_mask[i];
+			pool_.push_back(rule.manufacturer_data[i] & m);
+		}
+		for (size_t i = 0; i < in.length; i++) {
+			pool_.push_back(rule.manufacturer_mask.empty() ? 0xff : rule.manufacturer_mask[i]);
+		}
+		program_.push_back(in);
+	}
+
+	if (!rule.service_uuids.empty()) {
+		in = Instruction();
+		in.op = OpServiceUUID;
+		in.offset = pool_.size();
+		in.length = rule.service_uuids.size();
+
+		// Compare everything in its 128-bit form
+		for (const bt_uuid_t& u : rule.service_uuids) {
+			bt_uuid_t u128;
+			bt_uuid_to_uuid128(&u, &u128);
+			const uint8_t* b = reinterpret_cast<const uint8_t*>(&u128.value.u128);
+			pool_.insert(pool_.end(), b, b + 16);
+		}
+		program_.push_back(in);
+	}
+
+	program_[start].length = program_.size() - start - 1;
+}
+
+void ScanFilter::clear()
+{
+	program_.clear();
+	pool_.clear();
+}
+
+bool ScanFilter::matches(uint64_t address, int8_t rssi, const uint8_t* data, size_t len) const
+{
+	if (program_.empty()) {
+		return true;
+	}
+
+	size_t pc = 0;
+	while (pc < program_.size()) {
+		const Instruction& rule = program_[pc];
+		size_t end = pc + 1 + rule.length;
+
+		bool ok = true;
+		for (size_t i = pc + 1; ok && i < end; i++) {
+			ok = execute(program_[i], address, rssi, data, len);
+		}
+		if (ok) {
+			return true;
+		}
+
+		pc = end;
+	}
+
+	return false;
+}
+
+bool ScanFilter::execute(const Instruction& in, uint64_t address, int8_t rssi,
+                         const uint8_t* data, size_t len) const
+{
+	const uint8_t* pool = pool_.data() + in.offset;
+
+	switch (in.op) {
+		case OpMinRssi:
+			return rssi != rssi_unavailable && rssi >= in.rssi;
+
+		case OpAddress:
+			return (address & in.mask) == in.value;
+
+		case OpNamePrefix:
+			return any_ad(data, len, [&](uint8_t type, const uint8_t* p, size_t n) {
+				return (type == GAP::shortened_local_name || type == GAP::complete_local_name)
+				    && n >= in.length && memcmp(p, pool, in.length) == 0;
+			});
+
+		case OpManufacturer:
+			return any_ad(data, len, [&](uint8_t type, const uint8_t* p, size_t n) {
+				if (type != GAP::manufacturer_data || n < 2 + in.length || att_get_u16(p) != in.company) {
+					return false;
+				}
+				for (size_t i = 0; i < in.length; i++) {
+					if ((p[2 + i] & pool[in.length + i]) != pool[i]) {
+						return false;
+					}
+				}
+				return true;
+			});
+
+		case OpServiceUUID:
+			return any_ad(data, len, [&](uint8_t type, const uint8_t* p, size_t n) {
+				size_t width;
+				bool service_data = false;
+
+				switch (type) {
+					case GAP::incomplete_list_of_16_bit_UUIDs:
+					case GAP::complete_list_of_16_bit_UUIDs:    width = 2; break;
+					case GAP::incomplete_list_of_32_bit_UUIDs:
+					case GAP::complete_list_of_32_bit_UUIDs:    width = 4; break;
+					case GAP::incomplete_list_of_128_bit_UUIDs:
+					case GAP::complete_list_of_128_bit_UUIDs:   width = 16; break;
+					case GAP::service_data_16_bit_UUID:         width = 2; service_data = true; break;
+					case GAP::service_data_32_bit_UUID:         width = 4; service_data = true; break;
+					case GAP::service_data_128_bit_UUID:        width = 16; service_data = true; break;
+					default:                                    return false;
+				}
+
+				// Service data carries one UUID, followed by the data
+				size_t count = service_data ? (n >= width ? 1 : 0) : n / width;
+
+				for (size_t i = 0; i < count; i++) {
+					const uint8_t* e = p + i * width;
+					bt_uuid_t u, u128;
+					if (width == 2) {
+						bt_uuid16_create(&u, att_get_u16(e));
+					} else if (width == 4) {
+						bt_uuid32_create(&u, att_get_u32(e));
+					} else {
+						u = att_get_uuid128(e);
+					}
+					bt_uuid_to_uuid128(&u, &u128);
+
+					for (size_t k = 0; k < in.length; k++) {
+						if (memcmp(pool + 16 * k, &u128.value.u128, 16) == 0) {
+							return true;
+						}
+					}
+				}
+				return false;
+			});
+
+		case OpRule:
+			break;
+	}
+
+	return false;
+}
+
+} // namespace BLEPP
@@ -0,0 +1,172 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/timer_wheel.h>
+
+namespace BLEPP
+{
+
+TimerWheel::TimerWheel(unsigned int tick_ms, size_t num_slots)
+	: tick_ms_(tick_ms ? tick_ms : 1)
+	, slots_(num_slots ? num_slots : 1)
+	, ticks_(0)
+	, last_tick_(std::chrono::steady_clock::now())
+	, next_id_(1)
+{
+}
+
+TimerWheel::TimerId TimerWheel::schedule(unsigned int delay_ms, Callback cb)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto now = std::chrono::steady_clock::now();
+
+	// An idle wheel is not advanced, so bring it up to date first
+	if (due_.empty()) {
+		last_tick_ = now;
+	}
+
+	// Count ticks from the last processed tick, so that a wheel which is
+	// running late does not fire early
+	auto since_tick = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_tick_).count();
+	uint64_t ticks = (since_tick + delay_ms + tick_ms_ - 1) / tick_ms_;
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	Timer t;
+	t.id = next_id_++;
+	t.due_tick = ticks_ + ticks;
+	t.cb = std::move(cb);
+
+	due_[t.id] = t.due_tick;
+	deadlines_.insert(t.due_tick);
+	slots_[t.due_tick % slots_.size()].push_back(std::move(t));
+
+	return next_id_ - 1;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = due_.find(id);
+	if (it == due_.end()) {
+		return false;
+	}
+
+	uint64_t due_tick = it->second;
+	due_.erase(it);
+	deadlines_.erase(deadlines_.find(due_tick));
+
+	std::vector<Timer>& slot = slots_[due_tick % slots_.size()];
+	for (size_t i = 0; i < slot.size(); i++) {
+		if (slot[i].id == id) {
+			slot[i] = std::move(slot.back());
+			slot.pop_back();
+			break;
+		}
+	}
+
+	return true;
+}
+
+int TimerWheel::next_timeout_ms() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (deadlines_.empty()) {
+		return -1;
+	}
+
+	auto next = last_tick_ + std::chrono::milliseconds(tick_ms_ * (*deadlines_.begin() - ticks_));
+	auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+	                next - std::chrono::steady_clock::now()).count();
+
+	return wait > 0 ? static_cast<int>(wait) : 0;
+}
+
+int TimerWheel::advance()
+{
+	std::vector<Callback> due;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto now = std::chrono::steady_clock::now();
+		if (due_.empty()) {
+			last_tick_ = now;
+			return 0;
+		}
+
+		const auto tick = std::chrono::milliseconds(tick_ms_);
+		while (!due_.empty() && last_tick_ + tick <= now) {
+			last_tick_ += tick;
+			ticks_++;
+
+			std::vector<Timer>& slot = slots_[ticks_ % slots_.size()];
+			for (size_t i = 0; i < slot.size(); ) {
+				if (slot[i].due_tick <= ticks_) {
+					due_.erase(slot[i].id);
+					deadlines_.erase(deadlines_.find(slot[i].due_tick));
+					due.push_back(std::move(slot[i].cb));
+					slot[i] = std::move(slot.back());
+					slot.pop_back();
+				} else {
+					i++;
+				}
+			}
+		}
+	}
+
+	// Run outside the lock so callbacks can schedule more timers
+	for (auto& cb : due) {
+		cb();
+	}
+
+	return due.size();
+}
+
+size_t TimerWheel::pending() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return due_.size();
+}
+
+void TimerWheel::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (auto& slot : slots_) {
+		slot.clear();
+	}
+	due_.clear();
+	deadlines_.clear();
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
@@ -0,0 +1,226 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2024
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <blepp/blepp_config.h>
+
+#ifdef BLEPP_SERVER_SUPPORT
+
+#include <blepp/tx_queue.h>
+#include <blepp/logging.h>
+
+#include <algorithm>
+
+namespace BLEPP
+{
+
+// Opcodes that do not answer a request
+#define ATT_OP_HANDLE_NOTIFY            0x1B
+#define ATT_OP_HANDLE_INDICATE          0x1D
+
+/// Total PDUs waiting on a connection
+static size_t total_depth(const TxQueueStats& stats)
+{
+	size_t depth = 0;
+	for (size_t i = 0; i < tx_priority_classes; i++) {
+		depth += stats.depth[i];
+	}
+	return depth;
+}
+
+TxQueue::TxQueue(size_t max_bytes)
+	: max_bytes_(max_bytes)
+	, bytes_(0)
+{
+}
+
+TxPriority TxQueue::classify(const uint8_t* pdu, size_t len)
+{
+	if (len == 0) {
+		return TxPriority::Response;
+	}
+
+	switch (pdu[0]) {
+		case ATT_OP_HANDLE_NOTIFY:   return TxPriority::Notification;
+		case ATT_OP_HANDLE_INDICATE: return TxPriority::Indication;
+		default:                     return TxPriority::Response;
+	}
+}
+
+int TxQueue::send(uint16_t conn_handle, const uint8_t* data, size_t len, const Writer& write)
+{
+	TxPriority priority = classify(data, len);
+	size_t cls = static_cast<size_t>(priority);
+	Backlog& b = backlogs_[conn_handle];
+
+	// Only go straight to the link if nothing as urgent is waiting,
+	// so PDUs of one class stay in order
+	bool waiting = false;
+	for (size_t i = 0; i <= cls; i++) {
+		waiting = waiting || !b.pdus[i].empty();
+	}
+
+	if (!waiting) {
+		int rc = write(data, len);
+		if (rc > 0) {
+			b.stats.sent[cls]++;
+			return 0;
+		}
+		if (rc < 0) {
+			b.stats.dropped[cls]++;
+			return -1;
+		}
+	}
+
+	while (bytes_ + len > max_bytes_) {
+		if (!evict(conn_handle, priority)) {
+			LOG(Warning, "TX queue full, dropping " << len << " byte PDU for connection " << conn_handle);
+			b.stats.dropped[cls]++;
+			return -1;
+		}
+	}
+
+	b.pdus[cls].emplace_back(data, data + len);
+	b.stats.queued[cls]++;
+	b.stats.depth[cls]++;
+	b.stats.bytes += len;
+	bytes_ += len;
+
+	b.stats.peak_depth = std::max(b.stats.peak_depth, total_depth(b.stats));
+
+	return 0;
+}
+
+bool TxQueue::evict(uint16_t conn_handle, TxPriority priority)
+{
+	for (size_t cls = tx_priority_classes - 1; cls > static_cast<size_t>(priority); cls--) {
+		auto victim = backlogs_.find(conn_handle);
+		if (victim == backlogs_.end() || victim->second.pdus[cls].empty()) {
+			for (victim = backlogs_.begin(); victim != backlogs_.end(); ++victim) {
+				if (!victim->second.pdus[cls].empty()) {
+					break;
+				}
+			}
+		}
+
+		if (victim != backlogs_.end() && !victim->second.pdus[cls].empty()) {
+			Backlog& b = victim->second;
+			size_t len = b.pdus[cls].front().size();
+			dropped_.push_back(DroppedPdu{victim->first, std::move(b.pdus[cls].front())});
+			b.pdus[cls].pop_front();
+			b.stats.depth[cls]--;
+			b.stats.dropped[cls]++;
+			b.stats.bytes -= len;
+			bytes_ -= len;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t TxQueue::flush(uint16_t conn_handle, const Writer& write)
+{
+	auto it = backlogs_.find(conn_handle);
+	if (it == backlogs_.end()) {
+		return 0;
+	}
+
+	Backlog& b = it->second;
+	for (;;) {
+		size_t cls = 0;
+		while (cls < tx_priority_classes && b.pdus[cls].empty()) {
+			cls++;
+		}
+		if (cls == tx_priority_classes) {
+			return 0;
+		}
+
+		std::vector<uint8_t>& pdu = b.pdus[cls].front();
+		int rc = write(pdu.data(), pdu.size());
+		if (rc == 0) {
+			break;
+		}
+
+		size_t len = pdu.size();
+		if (rc > 0) {
+			b.stats.sent[cls]++;
+		} else {
+			b.stats.dropped[cls]++;
+			dropped_.push_back(DroppedPdu{conn_handle, std::move(pdu)});
+		}
+
+		b.stats.depth[cls]--;
+		b.stats.bytes -= len;
+		bytes_ -= len;
+		b.pdus[cls].pop_front();
+	}
+
+	return total_depth(b.stats);
+}
+
+bool TxQueue::empty(uint16_t conn_handle) const
+{
+	auto it = backlogs_.find(conn_handle);
+	return it == backlogs_.end() || total_depth(it->second.stats) == 0;
+}
+
+std::vector<uint16_t> TxQueue::pending() const
+{
+	std::vector<uint16_t> handles;
+	for (const auto& entry : backlogs_) {
+		if (total_depth(entry.second.stats) != 0) {
+			handles.push_back(entry.first);
+		}
+	}
+	return handles;
+}
+
+void TxQueue::remove(uint16_t conn_handle)
+{
+	auto it = backlogs_.find(conn_handle);
+	if (it != backlogs_.end()) {
+		bytes_ -= it->second.stats.bytes;
+		backlogs_.erase(it);
+	}
+
+	// The connection is gone, so nobody is waiting on these any more
+	dropped_.erase(std::remove_if(dropped_.begin(), dropped_.end(), [conn_handle](const DroppedPdu& d) {
+		return d.conn_handle == conn_handle;
+	}), dropped_.end());
+}
+
+std::vector<DroppedPdu> TxQueue::take_dropped()
+{
+	std::vector<DroppedPdu> dropped;
+	dropped.swap(dropped_);
+	return dropped;
+}
+
+TxQueueStats TxQueue::stats(uint16_t conn_handle) const
+{
+	auto it = backlogs_.find(conn_handle);
+	return it == backlogs_.end() ? TxQueueStats() : it->second.stats;
+}
+
+} // namespace BLEPP
+
+#endif // BLEPP_SERVER_SUPPORT
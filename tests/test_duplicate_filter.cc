@@ -0,0 +1,200 @@
+#include <blepp/duplicate_filter.h>
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+using namespace BLEPP;
+
+//These helpers come before the check() macro, which would otherwise
+//swallow calls to DuplicateFilter::check
+
+static const uint8_t payload[] = {0x02, 0x01, 0x06};
+
+//Offer an advert at a given time
+static bool offer(DuplicateFilter& filter, uint64_t address, uint8_t address_type, uint8_t event_type,
+                  int8_t rssi, const std::vector<uint8_t>& data, uint64_t now_ms)
+{
+	return filter.check(address, address_type, event_type, rssi, data.data(), data.size(), now_ms);
+}
+
+//Offer an advert from a device with a fixed payload at a given time
+static bool seen(DuplicateFilter& filter, uint64_t address, uint64_t now_ms)
+{
+	return filter.check(address, 0, 0, -50, payload, sizeof(payload), now_ms);
+}
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	// Without a TTL each device is reported once; address type and event
+	// type tell devices apart
+	{
+		const std::vector<uint8_t> ad(payload, payload + sizeof(payload));
+		DuplicateFilter filter;
+		check(seen(filter, 1, 0));
+		check(!seen(filter, 1, 1000000));
+		check(offer(filter, 1, 1, 0, -50, ad, 0));
+		check(offer(filter, 1, 0, 4, -50, ad, 0));
+		check(filter.size() == 3);
+		check(filter.reported() == 3);
+		check(filter.suppressed() == 1);
+
+		filter.clear();
+		check(filter.size() == 0);
+		check(seen(filter, 1, 0));
+	}
+
+	// With a TTL a device reports again once that long has passed since
+	// it last reported; adverts suppressed in between do not extend it
+	{
+		DuplicateFilterParams params;
+		params.ttl_ms = 100;
+		DuplicateFilter filter(params);
+
+		check(seen(filter, 1, 1000));
+		check(!seen(filter, 1, 1050));
+		check(!seen(filter, 1, 1099));
+		check(seen(filter, 1, 1100));
+		check(!seen(filter, 1, 1150));
+		check(seen(filter, 1, 1250));
+		check(filter.reported() == 3);
+		check(filter.suppressed() == 3);
+	}
+
+	// When full, expired devices are forgotten first
+	{
+		DuplicateFilterParams params;
+		params.ttl_ms = 100;
+		params.max_entries = 4;
+		DuplicateFilter filter(params);
+
+		check(seen(filter, 1, 0));
+		check(seen(filter, 2, 0));
+		check(seen(filter, 3, 150));
+		check(seen(filter, 4, 150));
+		check(filter.size() == 4);
+
+		check(seen(filter, 5, 160));
+		check(filter.size() == 3);
+		check(!seen(filter, 3, 170));
+		check(!seen(filter, 4, 170));
+		check(!seen(filter, 5, 170));
+	}
+
+	// With nothing expired, the devices not heard from for longest are
+	// forgotten, even if they reported earlier than the ones kept
+	{
+		DuplicateFilterParams params;
+		params.max_entries = 4;
+		DuplicateFilter filter(params);
+
+		check(seen(filter, 1, 0));
+		check(seen(filter, 2, 0));
+		check(seen(filter, 3, 100));
+		check(seen(filter, 4, 100));
+
+		// Devices 1 and 2 are still advertising; 3 and 4 have gone quiet
+		check(!seen(filter, 1, 900));
+		check(!seen(filter, 2, 900));
+
+		check(seen(filter, 5, 1000));
+		check(filter.size() == 3);
+		check(!seen(filter, 1, 1000));
+		check(!seen(filter, 2, 1000));
+		check(!seen(filter, 5, 1000));
+		check(seen(filter, 3, 1000));
+	}
+
+	// Devices sharing one timestamp are all forgotten together
+	{
+		DuplicateFilterParams params;
+		params.max_entries = 2;
+		DuplicateFilter filter(params);
+
+		check(seen(filter, 1, 5));
+		check(seen(filter, 2, 5));
+		check(seen(filter, 3, 5));
+		check(filter.size() == 1);
+		check(seen(filter, 1, 5));
+	}
+
+	// A changed payload reports again when asked to, and only the first
+	// time it is seen; going back to an earlier payload is a change too
+	{
+		const std::vector<uint8_t> a = {0x02, 0x01, 0x06, 0x03, 0xFF, 0x01, 0x00};
+		const std::vector<uint8_t> b = {0x02, 0x01, 0x06, 0x03, 0xFF, 0x02, 0x00};
+
+		DuplicateFilter plain;
+		check(offer(plain, 1, 0, 0, -50, a, 0));
+		check(!offer(plain, 1, 0, 0, -50, b, 10));
+
+		DuplicateFilterParams params;
+		params.report_payload_changes = true;
+		DuplicateFilter filter(params);
+		check(offer(filter, 1, 0, 0, -50, a, 0));
+		check(!offer(filter, 1, 0, 0, -50, a, 10));
+		check(offer(filter, 1, 0, 0, -50, b, 20));
+		check(!offer(filter, 1, 0, 0, -50, b, 30));
+		check(offer(filter, 1, 0, 0, -50, a, 40));
+		check(!offer(filter, 1, 0, 0, -50, std::vector<uint8_t>(a), 50));
+		check(filter.reported() == 3);
+		check(filter.suppressed() == 3);
+
+		check(DuplicateFilter::payload_hash(a.data(), a.size()) != DuplicateFilter::payload_hash(b.data(), b.size()));
+		check(DuplicateFilter::payload_hash(nullptr, 0) == 0xcbf29ce484222325ULL);
+	}
+
+	// RSSI reports again once it has moved rssi_delta from the last value
+	// reported, in either direction; smaller steps never add up
+	{
+		const std::vector<uint8_t> ad(payload, payload + sizeof(payload));
+
+		DuplicateFilter plain;
+		check(offer(plain, 1, 0, 0, -50, ad, 0));
+		check(!offer(plain, 1, 0, 0, -90, ad, 10));
+
+		DuplicateFilterParams params;
+		params.rssi_delta = 10;
+		DuplicateFilter filter(params);
+		check(offer(filter, 1, 0, 0, -50, ad, 0));
+		check(!offer(filter, 1, 0, 0, -55, ad, 10));
+		check(!offer(filter, 1, 0, 0, -59, ad, 20));
+		check(offer(filter, 1, 0, 0, -60, ad, 30));
+		check(!offer(filter, 1, 0, 0, -51, ad, 40));
+		check(offer(filter, 1, 0, 0, -50, ad, 50));
+		check(offer(filter, 1, 0, 0, -30, ad, 60));
+
+		// 127 means the controller could not measure it, which is never a
+		// move, and a report with it leaves nothing to measure the next
+		// one from
+		check(!offer(filter, 1, 0, 0, rssi_unavailable, ad, 70));
+		check(offer(filter, 1, 0, 0, -90, ad, 80));
+		check(offer(filter, 2, 0, 0, rssi_unavailable, ad, 90));
+		check(!offer(filter, 2, 0, 0, -90, ad, 100));
+		check(!offer(filter, 2, 0, 0, -20, ad, 110));
+	}
+
+	// Changing the parameters forgets everything and resets the counters
+	{
+		DuplicateFilter filter;
+		check(seen(filter, 1, 0));
+		check(!seen(filter, 1, 0));
+
+		DuplicateFilterParams params;
+		params.ttl_ms = 10;
+		filter.set_params(params);
+		check(filter.size() == 0);
+		check(filter.reported() == 0 && filter.suppressed() == 0);
+		check(filter.params().ttl_ms == 10);
+		check(seen(filter, 1, 0));
+	}
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
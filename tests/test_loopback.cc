@@ -0,0 +1,419 @@
+#include <blepp/blegattserver.h>
+#include <blepp/blestatemachine.h>
+#include <blepp/loopback_transport.h>
+#include <blepp/logging.h>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+//Run the client until done() is true, failing if the server goes quiet
+static void pump(BLEGATTStateMachine& gatt, std::function<bool()> done)
+{
+	while(!done())
+	{
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(gatt.socket(), &read_set);
+		timeval tv = {2, 0};
+
+		check(select(gatt.socket() + 1, &read_set, NULL, NULL, &tv) > 0);
+		gatt.read_and_process_next();
+	}
+}
+
+//Send a raw ATT request on a connection and wait for the reply
+static std::vector<uint8_t> transact(int fd, const std::vector<uint8_t>& request)
+{
+	check(write(fd, request.data(), request.size()) == (ssize_t)request.size());
+
+	fd_set read_set;
+	FD_ZERO(&read_set);
+	FD_SET(fd, &read_set);
+	timeval tv = {2, 0};
+	check(select(fd + 1, &read_set, NULL, NULL, &tv) > 0);
+
+	uint8_t buf[512];
+	ssize_t len = read(fd, buf, sizeof(buf));
+	check(len > 0);
+	return std::vector<uint8_t>(buf, buf + len);
+}
+
+//As pump(), but also lets the client send what it has held back
+static void pump_both(BLEGATTStateMachine& gatt, std::function<bool()> done)
+{
+	while(!done())
+	{
+		fd_set read_set, write_set;
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		FD_SET(gatt.socket(), &read_set);
+		if(gatt.wait_on_write())
+			FD_SET(gatt.socket(), &write_set);
+		timeval tv = {2, 0};
+
+		check(select(gatt.socket() + 1, &read_set, &write_set, NULL, &tv) > 0);
+		if(FD_ISSET(gatt.socket(), &write_set))
+			gatt.write_and_process_next();
+		if(FD_ISSET(gatt.socket(), &read_set))
+			gatt.read_and_process_next();
+	}
+}
+
+int main()
+{
+	log_level = LogLevels::Warning;
+
+	// Server with one readable and writable characteristic
+	LoopbackTransport* loopback = new LoopbackTransport();
+	BLEGATTServer server{std::unique_ptr<BLETransport>(loopback)};
+
+	std::vector<uint8_t> stored = {42};
+	std::vector<GATTServiceDef> services(1);
+	services[0].type = GATTServiceType::PRIMARY;
+	services[0].uuid = UUID(0x180F);
+
+	GATTCharacteristicDef chr;
+	chr.uuid = UUID(0x2A19);
+	chr.flags = GATT_CHR_F_READ | GATT_CHR_F_WRITE;
+	chr.access_cb = [&](uint16_t, ATTAccessOp op, uint16_t, std::vector<uint8_t>& data) {
+		if (op == ATTAccessOp::WRITE_CHR)
+			stored = data;
+		else
+			data = stored;
+		return 0;
+	};
+	services[0].characteristics.push_back(chr);
+
+	// A second one that refuses values starting with 0xFF
+	std::vector<uint8_t> guarded = {0};
+	chr.uuid = UUID(0x2A1A);
+	chr.access_cb = [&](uint16_t, ATTAccessOp op, uint16_t, std::vector<uint8_t>& data) {
+		if (op != ATTAccessOp::WRITE_CHR) {
+			data = guarded;
+			return 0;
+		}
+		if (!data.empty() && data[0] == 0xFF)
+			return (int)BLE_ATT_ERR_UNLIKELY;
+		guarded = data;
+		return 0;
+	};
+	services[0].characteristics.push_back(chr);
+
+	// And a sink for write commands that reads back how much it has taken
+	std::mutex sink_mutex;
+	std::vector<uint8_t> sink;
+	chr.uuid = UUID(0x2A1B);
+	chr.flags = GATT_CHR_F_READ | GATT_CHR_F_WRITE_NO_RSP;
+	chr.access_cb = [&](uint16_t, ATTAccessOp op, uint16_t, std::vector<uint8_t>& data) {
+		std::lock_guard<std::mutex> lock(sink_mutex);
+		if (op == ATTAccessOp::WRITE_CHR) {
+			sink.insert(sink.end(), data.begin(), data.end());
+		} else {
+			uint32_t n = sink.size();
+			data = {(uint8_t)n, (uint8_t)(n >> 8), (uint8_t)(n >> 16), (uint8_t)(n >> 24)};
+		}
+		return 0;
+	};
+	services[0].characteristics.push_back(chr);
+	check(server.register_services(services) == 0);
+
+	AdvertisingParams adv;
+	adv.device_name = "loopback";
+	check(server.start_advertising(adv) == 0);
+	std::thread server_thread([&]{ server.run(); });
+
+	// Client connects through the transport's socketpair
+	ClientConnectionParams params;
+	int fd = loopback->connect(params);
+	check(fd >= 0);
+
+	BLEGATTStateMachine gatt;
+	bool connected = false;
+	gatt.cb_connected = [&]{ connected = true; };
+	gatt.attach(fd);
+	check(connected);
+
+	bool services_read = false;
+	gatt.cb_services_read = [&]{ services_read = true; };
+	gatt.read_primary_services();
+	pump(gatt, [&]{ return services_read; });
+	check(gatt.primary_services.size() == 1);
+	check(gatt.primary_services[0].uuid == UUID(0x180F));
+
+	bool found = false;
+	gatt.cb_find_characteristics = [&]{ found = true; };
+	gatt.find_all_characteristics();
+	pump(gatt, [&]{ return found; });
+	check(gatt.primary_services[0].characteristics.size() == 3);
+	uint16_t handle = gatt.primary_services[0].characteristics[0].value_handle;
+	uint16_t guarded_handle = gatt.primary_services[0].characteristics[1].value_handle;
+	uint16_t sink_handle = gatt.primary_services[0].characteristics[2].value_handle;
+
+	// Read
+	std::vector<uint8_t> value;
+	bool read = false;
+	gatt.send_read_request(handle, [&](const PDUReadResponse& r) {
+		value.assign(r.value().first, r.value().second);
+		read = true;
+	});
+	pump(gatt, [&]{ return read; });
+	check(value == std::vector<uint8_t>{42});
+
+	// Write, then read the new value back
+	const uint8_t written[] = {1, 2, 3};
+	bool acked = false;
+	gatt.send_write_request(handle, written, sizeof(written), [&]{ acked = true; });
+	pump(gatt, [&]{ return acked; });
+
+	read = false;
+	gatt.send_read_request(handle, [&](const PDUReadResponse& r) {
+		value.assign(r.value().first, r.value().second);
+		read = true;
+	});
+	pump(gatt, [&]{ return read; });
+	check(value == std::vector<uint8_t>(written, written + 3));
+
+	// Long write: two Prepare Write Requests on a raw second connection,
+	// each echoed back, then applied together by Execute Write
+	int raw = loopback->connect(params);
+	check(raw >= 0);
+
+	std::vector<uint8_t> long_value;
+	for (uint8_t i = 0; i < 30; i++)
+		long_value.push_back(100 + i);
+
+	std::vector<uint8_t> prepare = {0x16, (uint8_t)handle, (uint8_t)(handle >> 8), 0, 0};
+	prepare.insert(prepare.end(), long_value.begin(), long_value.begin() + 18);
+	std::vector<uint8_t> echo = transact(raw, prepare);
+	echo[0] = 0x16;
+	check(echo == prepare);
+	check(stored == std::vector<uint8_t>(written, written + 3));
+
+	prepare = {0x16, (uint8_t)handle, (uint8_t)(handle >> 8), 18, 0};
+	prepare.insert(prepare.end(), long_value.begin() + 18, long_value.end());
+	check(transact(raw, prepare)[0] == 0x17);
+
+	check(transact(raw, {0x18, 0x01}) == std::vector<uint8_t>{0x19});
+	check(stored == long_value);
+
+	// A cancelled queue writes nothing
+	prepare = {0x16, (uint8_t)handle, (uint8_t)(handle >> 8), 0, 0, 1};
+	check(transact(raw, prepare)[0] == 0x17);
+	check(transact(raw, {0x18, 0x00}) == std::vector<uint8_t>{0x19});
+	check(stored == long_value);
+
+	// When a later write callback refuses its value, the earlier writes
+	// are rolled back and the refusal is reported against its handle
+	check(transact(raw, prepare)[0] == 0x17);
+	prepare = {0x16, (uint8_t)guarded_handle, (uint8_t)(guarded_handle >> 8), 0, 0, 0xFF};
+	check(transact(raw, prepare)[0] == 0x17);
+
+	std::vector<uint8_t> refused = transact(raw, {0x18, 0x01});
+	check(refused == std::vector<uint8_t>({0x01, 0x18, (uint8_t)guarded_handle,
+	                                       (uint8_t)(guarded_handle >> 8), BLE_ATT_ERR_UNLIKELY}));
+	check(stored == long_value);
+	check(guarded == std::vector<uint8_t>{0});
+
+	// Read Multiple Variable cuts the value at the MTU, but its length
+	// field still gives the full length so the client knows to carry on
+	std::vector<uint8_t> multiple = transact(raw, {0x20, (uint8_t)handle, (uint8_t)(handle >> 8),
+	                                               (uint8_t)guarded_handle, (uint8_t)(guarded_handle >> 8)});
+	check(multiple.size() == 23);
+	check(multiple[0] == 0x21 && multiple[1] == 30 && multiple[2] == 0);
+	check(std::equal(multiple.begin() + 3, multiple.end(), long_value.begin()));
+
+	PDUReadMultipleVariableResponse variable(PDUResponse(multiple.data(), multiple.size()));
+	check(variable.num_elements() == 1);
+	check(variable.value_length(0) == 30);
+	check(variable.truncated(0));
+	close(raw);
+
+	// The client completes a cut value with Read Blob requests, then
+	// reads the values that did not fit
+	std::map<uint16_t, std::vector<uint8_t>> values;
+	bool read_all = false;
+	gatt.cb_read_multiple = [&](Characteristic& c, const uint8_t* begin, const uint8_t* end) {
+		values[c.value_handle].assign(begin, end);
+	};
+	gatt.cb_read_multiple_done = [&]{ read_all = true; };
+	gatt.read_multiple(std::vector<uint16_t>{handle, guarded_handle});
+	pump(gatt, [&]{ return read_all; });
+	check(values.size() == 2);
+	check(values[handle] == long_value);
+	check(values[guarded_handle] == std::vector<uint8_t>{0});
+
+	// Requests issued back to back are held and sent one at a time, in
+	// order, each completing before the next goes out
+	std::vector<int> order;
+	std::vector<uint8_t> before, after;
+	const uint8_t replacement[] = {7, 8};
+	gatt.send_read_request(handle, [&](const PDUReadResponse& r) {
+		before.assign(r.value().first, r.value().second);
+		order.push_back(1);
+	});
+	gatt.send_write_request(handle, replacement, sizeof(replacement), [&]{ order.push_back(2); });
+	gatt.send_read_request(handle, [&](const PDUReadResponse& r) {
+		after.assign(r.value().first, r.value().second);
+		order.push_back(3);
+	});
+	check(gatt.queued_requests() == 2);
+	pump(gatt, [&]{ return order.size() == 3; });
+	check(order == std::vector<int>({1, 2, 3}));
+	check(gatt.queued_requests() == 0);
+	check(gatt.is_idle());
+	check(before.size() == 22 && std::equal(before.begin(), before.end(), long_value.begin()));
+	check(after == std::vector<uint8_t>(replacement, replacement + 2));
+	check(stored == after);
+
+	// Stream more than the socket can buffer. The stream stalls, and a
+	// read issued meanwhile is held until the packets already sent have
+	// gone, so the server sees every packet in order and the read counts
+	// at least the bytes sent before it.
+	int sndbuf = 4096;
+	check(setsockopt(gatt.socket(), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+
+	std::vector<uint8_t> stream(64 * 1024);
+	for (size_t i = 0; i < stream.size(); i++)
+		stream[i] = i * 7 + (i >> 8);
+
+	bool streamed = false;
+	size_t progress = 0;
+	WriteStreamStats stream_stats;
+	gatt.cb_stream_progress = [&](const WriteStreamStats& s) { progress = s.bytes_sent; };
+	gatt.cb_stream_complete = [&](const WriteStreamStats& s) {
+		stream_stats = s;
+		streamed = true;
+	};
+	gatt.stream_write_command(sink_handle, stream.data(), stream.size());
+	check(gatt.stream_active());
+	check(gatt.wait_on_write());
+
+	size_t sent_before_read = progress;
+	check(sent_before_read > 0 && sent_before_read < stream.size());
+	uint32_t sink_count = 0;
+	bool counted = false;
+	gatt.send_read_request(sink_handle, [&](const PDUReadResponse& r) {
+		check(r.value().second - r.value().first == 4);
+		const uint8_t* v = r.value().first;
+		sink_count = v[0] | (v[1] << 8) | (v[2] << 16) | ((uint32_t)v[3] << 24);
+		counted = true;
+	});
+	pump_both(gatt, [&]{ return streamed && counted; });
+
+	check(!gatt.stream_active());
+	check(stream_stats.total_bytes == stream.size());
+	check(stream_stats.bytes_sent == stream.size());
+	check(stream_stats.packets == (stream.size() + 19) / 20);
+	check(stream_stats.stalls > 0);
+	check(sink_count >= sent_before_read && sink_count < stream.size());
+
+	// Write commands are not acknowledged, so give the server time to
+	// take the tail of the stream
+	bool all_taken = false;
+	for (int i = 0; i < 200 && !all_taken; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		std::lock_guard<std::mutex> lock(sink_mutex);
+		all_taken = sink.size() >= stream.size();
+	}
+	check(all_taken);
+	check(sink == stream);
+
+	// Read Blob Response carries a bare slice of the value
+	const uint8_t blob[] = {0x0D, 1, 2, 3};
+	PDUReadBlobResponse blob_rsp(PDUResponse(blob, sizeof(blob)));
+	check(blob_rsp.num_elements() == 3);
+	check(blob_rsp.value().first == blob + 1 && blob_rsp.value().second == blob + 4);
+
+	gatt.close();
+	server.stop();
+	server_thread.join();
+
+	check(stored == std::vector<uint8_t>(replacement, replacement + 2));
+	check(loopback->stats().pdus_to_server >= 6);
+
+	// Coalesced notifications on a link that takes one PDU per connection
+	// event: values sent while it is full replace each other, and the last
+	// one goes out once the transport reports room
+	{
+		LoopbackParams slow;
+		slow.emulate_conn_interval = true;
+		slow.tx_window = 1;
+		LoopbackTransport* link = new LoopbackTransport(slow);
+		BLEGATTServer notifier{std::unique_ptr<BLETransport>(link)};
+		notifier.metrics().set_enabled(true);
+
+		std::vector<GATTServiceDef> battery(1);
+		battery[0].type = GATTServiceType::PRIMARY;
+		battery[0].uuid = UUID(0x180F);
+		GATTCharacteristicDef level;
+		level.uuid = UUID(0x2A19);
+		level.flags = GATT_CHR_F_READ | GATT_CHR_F_NOTIFY;
+		level.access_cb = [](uint16_t, ATTAccessOp, uint16_t, std::vector<uint8_t>& data) {
+			data = {0};
+			return 0;
+		};
+		battery[0].characteristics.push_back(level);
+		check(notifier.register_services(battery) == 0);
+		check(notifier.start_advertising(adv) == 0);
+		std::thread notifier_thread([&]{ notifier.run(); });
+
+		params.max_interval = 8;
+		int slow_fd = link->connect(params);
+		check(slow_fd >= 0);
+
+		// Service at 1, characteristic declaration at 2, value at 3, CCCD at 4
+		check(transact(slow_fd, {0x12, 0x04, 0x00, 0x01, 0x00}) == std::vector<uint8_t>{0x13});
+		notifier.set_notify_coalescing(3, true);
+
+		for (int i = 0; i < 500; i++)
+			check(notifier.notify(1, 3, {(uint8_t)i, (uint8_t)(i >> 8)}) >= 0);
+
+		// Values arrive in order, ending with the last one sent
+		int received = 0, last = -1;
+		for (;;) {
+			fd_set read_set;
+			FD_ZERO(&read_set);
+			FD_SET(slow_fd, &read_set);
+			timeval tv = {0, 200000};
+			if (select(slow_fd + 1, &read_set, NULL, NULL, &tv) <= 0)
+				break;
+
+			uint8_t buf[32];
+			check(::read(slow_fd, buf, sizeof(buf)) == 5 && buf[0] == 0x1B);
+			int v = buf[3] | (buf[4] << 8);
+			check(v > last);
+			last = v;
+			received++;
+		}
+		check(last == 499);
+		check(received < 500);
+
+		ConnectionMetrics m = notifier.metrics().snapshot().connections.begin()->second;
+		check(m.notifications == (uint64_t)received);
+		check(m.notifications + m.notifications_superseded == 500);
+
+		close(slow_fd);
+		notifier.stop();
+		notifier_thread.join();
+	}
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
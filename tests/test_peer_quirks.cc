@@ -0,0 +1,200 @@
+#include <blepp/peer_quirks.h>
+#include <blepp/blegattserver.h>
+#include <blepp/logging.h>
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+// Records what the server sends; the test plays the client
+class MockTransport : public BLETransport
+{
+public:
+	int start_advertising(const AdvertisingParams&) override { return 0; }
+	int stop_advertising() override { return 0; }
+	bool is_advertising() const override { return false; }
+	int accept_connection() override { return 0; }
+	int disconnect(uint16_t) override { return 0; }
+	int get_fd() const override { return -1; }
+	int recv_pdu(uint16_t, uint8_t*, size_t) override { return 0; }
+	int set_mtu(uint16_t, uint16_t m) override { mtu_ = m; return 0; }
+	uint16_t get_mtu(uint16_t) const override { return mtu_; }
+	int process_events() override { return 0; }
+
+	int send_pdu(uint16_t, const uint8_t* data, size_t len) override
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		sent_.push_back(data[0]);
+		return static_cast<int>(len);
+	}
+
+	// Opcodes sent so far
+	std::vector<uint8_t> sent()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return sent_;
+	}
+
+	void connect(uint16_t conn_handle, const char* address, uint8_t address_type)
+	{
+		ConnectionParams params;
+		params.conn_handle = conn_handle;
+		params.peer_address = address;
+		params.peer_address_type = address_type;
+		on_connected(params);
+	}
+
+	void receive(uint16_t conn_handle, const std::vector<uint8_t>& pdu)
+	{
+		on_data_received(conn_handle, pdu.data(), pdu.size());
+	}
+
+private:
+	std::mutex mutex_;
+	std::vector<uint8_t> sent_;
+	uint16_t mtu_ = 23;
+};
+
+// Exchange MTU, then discover primary services, the way a client starts
+static void discover(MockTransport* transport, uint16_t conn_handle, uint16_t client_mtu)
+{
+	transport->receive(conn_handle, {0x02, (uint8_t)(client_mtu & 0xFF), (uint8_t)(client_mtu >> 8)});
+	transport->receive(conn_handle, {0x10, 0x01, 0x00, 0xFF, 0xFF, 0x00, 0x28});
+}
+
+static bool wait_for_sent(MockTransport* transport, size_t count)
+{
+	for (int i = 0; i < 100; i++) {
+		if (transport->sent().size() >= count) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return false;
+}
+
+static PeerQuirks delay(uint16_t ms)
+{
+	PeerQuirks q;
+	q.discovery_response_delay_ms = ms;
+	return q;
+}
+
+static ConnectionParams peer(const char* address, uint8_t address_type)
+{
+	ConnectionParams p;
+	p.peer_address = address;
+	p.peer_address_type = address_type;
+	return p;
+}
+
+int main()
+{
+	log_level = LogLevels::Warning;
+
+	// OUI parsing
+	uint32_t oui = 0;
+	check(PeerQuirkTable::parse_oui("00:1A:7D:DA:71:13", oui));
+	check(oui == 0x001A7D);
+	check(PeerQuirkTable::parse_oui("aa:bb:cc:dd:ee:ff", oui));
+	check(oui == 0xAABBCC);
+	check(!PeerQuirkTable::parse_oui("00:1A", oui));
+	check(!PeerQuirkTable::parse_oui("00-1A-7D-DA-71-13", oui));
+	check(!PeerQuirkTable::parse_oui("0G:1A:7D:DA:71:13", oui));
+
+	// An empty table applies no quirks, whatever the MTU
+	PeerQuirkTable empty;
+	check(empty(peer("00:1A:7D:DA:71:13", 0), 0).discovery_response_delay_ms == 0);
+	check(empty(peer("00:1A:7D:DA:71:13", 1), 517).discovery_response_delay_ms == 0);
+
+	PeerQuirkTable table;
+	table.default_quirks = delay(1);
+	table.add_oui(0x001A7D, delay(10));
+	table.add_oui(0x1001A7D, delay(11));   // masked to 24 bits, shadowed by the first rule
+	table.add_address_type(1, delay(20));
+	table.add_client_mtu(517, delay(30));
+
+	// OUI wins over address type and MTU
+	check(table(peer("00:1A:7D:DA:71:13", 1), 517).discovery_response_delay_ms == 10);
+	check(table(peer("00:1a:7d:00:00:00", 0), 0).discovery_response_delay_ms == 10);
+
+	// Address type wins over MTU
+	check(table(peer("11:22:33:44:55:66", 1), 517).discovery_response_delay_ms == 20);
+
+	// MTU rules only apply once an MTU is known
+	check(table(peer("11:22:33:44:55:66", 0), 517).discovery_response_delay_ms == 30);
+	check(table(peer("11:22:33:44:55:66", 0), 0).discovery_response_delay_ms == 1);
+	check(table(peer("11:22:33:44:55:66", 0), 247).discovery_response_delay_ms == 1);
+
+	// A malformed address skips the OUI rules
+	check(table(peer("bogus", 0), 0).discovery_response_delay_ms == 1);
+
+	// The table works as a PeerQuirkPolicy
+	PeerQuirkPolicy policy = table;
+	check(policy(peer("00:1A:7D:00:00:00", 0), 0).discovery_response_delay_ms == 10);
+
+	// Android fingerprint: the MTU plus a random address or a listed OUI
+	AndroidFingerprint android;
+	check(!PeerQuirkTable::is_android(android, peer("11:22:33:44:55:66", 1), 0));
+	check(PeerQuirkTable::is_android(android, peer("11:22:33:44:55:66", 1), 517));
+	check(!PeerQuirkTable::is_android(android, peer("11:22:33:44:55:66", 1), 247));
+	check(!PeerQuirkTable::is_android(android, peer("11:22:33:44:55:66", 0), 517));
+	android.ouis.push_back(0x112233);
+	check(PeerQuirkTable::is_android(android, peer("11:22:33:44:55:66", 0), 517));
+	check(!PeerQuirkTable::is_android(android, peer("11:22:34:44:55:66", 0), 517));
+
+	PeerQuirkTable fingerprinted;
+	fingerprinted.add_client_mtu(517, delay(30));
+	fingerprinted.set_android_quirks(delay(40));
+	check(fingerprinted(peer("11:22:33:44:55:66", 1), 517).discovery_response_delay_ms == 40);
+	check(fingerprinted(peer("11:22:33:44:55:66", 0), 517).discovery_response_delay_ms == 30);
+	check(fingerprinted(peer("11:22:33:44:55:66", 1), 0).discovery_response_delay_ms == 0);
+
+	// The default policy delays Android only
+	PeerQuirkTable defaults = default_peer_quirk_policy();
+	check(defaults(peer("11:22:33:44:55:66", 1), 517).discovery_response_delay_ms == 20);
+	check(defaults(peer("11:22:33:44:55:66", 0), 517).discovery_response_delay_ms == 0);
+	check(defaults(peer("11:22:33:44:55:66", 1), 247).discovery_response_delay_ms == 0);
+
+	// A default-constructed server still defers discovery responses to
+	// Android, and answers everyone else at once
+	{
+		MockTransport* transport = new MockTransport();
+		BLEGATTServer server{std::unique_ptr<BLETransport>(transport)};
+
+		std::vector<GATTServiceDef> services(1);
+		services[0].type = GATTServiceType::PRIMARY;
+		services[0].uuid = UUID(0x180F);
+		check(server.register_services(services) == 0);
+
+		transport->connect(1, "11:22:33:44:55:66", 0);
+		discover(transport, 1, 247);
+		check(transport->sent() == std::vector<uint8_t>({0x03, 0x11}));
+
+		transport->connect(2, "4a:22:33:44:55:66", 1);
+		discover(transport, 2, 517);
+		check(transport->sent().size() == 3);
+		check(transport->sent()[2] == 0x03);
+
+		std::thread server_thread([&]{ server.run(); });
+		check(wait_for_sent(transport, 4));
+		check(transport->sent()[3] == 0x11);
+
+		server.stop();
+		server_thread.join();
+	}
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <blepp/prepared_write.h>
+#include <blepp/att.h>
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+static std::vector<uint8_t> bytes(size_t len, uint8_t first)
+{
+	std::vector<uint8_t> v(len);
+	for (size_t i = 0; i < len; i++) {
+		v[i] = first + i;
+	}
+	return v;
+}
+
+int main()
+{
+	const size_t slab = PreparedWritePool::slab_size;
+
+	// Capacity is rounded up to whole slabs
+	PreparedWritePool pool(4 * slab - 1);
+	check(pool.capacity() == 4 * slab);
+	check(pool.available() == 4 * slab);
+
+	// A value spanning slabs is chained and copied back out intact
+	std::vector<uint8_t> big = bytes(slab + 10, 0);
+	uint32_t a = pool.store(big.data(), big.size());
+	check(a != PreparedWritePool::no_slab);
+	check(pool.available() == 2 * slab);
+
+	std::vector<uint8_t> out;
+	pool.copy_out(a, big.size(), out);
+	check(out == big);
+
+	// An empty value still takes a slab
+	uint32_t b = pool.store(nullptr, 0);
+	check(b != PreparedWritePool::no_slab);
+	check(pool.available() == slab);
+
+	// Not enough room leaves the pool untouched
+	check(pool.store(big.data(), big.size()) == PreparedWritePool::no_slab);
+	check(pool.available() == slab);
+
+	// Released chains go back on the free list and are reused whole
+	check(pool.resize(slab) == -1);
+	pool.release(a);
+	pool.release(PreparedWritePool::no_slab);
+	check(pool.available() == 3 * slab);
+
+	std::vector<uint8_t> three = bytes(3 * slab, 100);
+	uint32_t c = pool.store(three.data(), three.size());
+	check(c != PreparedWritePool::no_slab);
+	check(pool.available() == 0);
+	out.clear();
+	pool.copy_out(c, three.size(), out);
+	check(out == three);
+
+	pool.release(b);
+	pool.release(c);
+	check(pool.available() == 4 * slab);
+	check(pool.resize(2 * slab) == 0);
+	check(pool.capacity() == 2 * slab);
+
+	// Segments are merged per handle in order of first appearance; later
+	// segments overwrite earlier ones where they overlap
+	pool.resize(1024);
+	PreparedWriteQueue queue;
+	std::vector<uint8_t> s1 = bytes(10, 0);
+	std::vector<uint8_t> s2 = bytes(10, 50);
+	std::vector<uint8_t> s3 = {0xAA};
+	check(queue.push(pool, 0x20, 0, s1.data(), s1.size(), 512) == 0);
+	check(queue.push(pool, 0x10, 4, s3.data(), s3.size(), 512) == 0);
+	check(queue.push(pool, 0x20, 5, s2.data(), s2.size(), 512) == 0);
+	check(queue.push(pool, 0x20, 15, s3.data(), s3.size(), 512) == 0);
+	check(queue.bytes() == 22);
+	check(pool.available() == 1024 - 4 * slab);
+
+	std::vector<PreparedWriteQueue::Write> writes;
+	uint16_t error_handle = 0;
+	check(queue.drain(pool, writes, error_handle) == 0);
+	check(queue.empty());
+	check(queue.bytes() == 0);
+	check(pool.available() == 1024);
+	check(writes.size() == 2);
+	check(writes[0].handle == 0x20 && writes[0].offset == 0);
+	check(writes[1].handle == 0x10 && writes[1].offset == 4);
+	check(writes[1].value == s3);
+
+	std::vector<uint8_t> merged = bytes(5, 0);
+	merged.insert(merged.end(), s2.begin(), s2.end());
+	merged.push_back(0xAA);
+	check(writes[0].value == merged);
+
+	// A gap after the end is refused and nothing is written
+	check(queue.push(pool, 0x20, 0, s1.data(), s1.size(), 512) == 0);
+	check(queue.push(pool, 0x20, 11, s3.data(), s3.size(), 512) == 0);
+	check(queue.drain(pool, writes, error_handle) == ATT_ECODE_INVALID_OFFSET);
+	check(error_handle == 0x20);
+	check(writes.empty());
+	check(queue.empty());
+	check(pool.available() == 1024);
+
+	// So is a segment before the first one
+	check(queue.push(pool, 0x30, 8, s1.data(), s1.size(), 512) == 0);
+	check(queue.push(pool, 0x30, 2, s3.data(), s3.size(), 512) == 0);
+	check(queue.drain(pool, writes, error_handle) == ATT_ECODE_INVALID_OFFSET);
+	check(error_handle == 0x30);
+	check(pool.available() == 1024);
+
+	// The per-queue limit and the pool both cap what can be queued
+	check(queue.push(pool, 0x20, 0, s1.data(), s1.size(), 15) == 0);
+	check(queue.push(pool, 0x20, 10, s1.data(), s1.size(), 15) == -1);
+	check(queue.bytes() == 10);
+
+	std::vector<uint8_t> huge = bytes(1024, 0);
+	check(queue.push(pool, 0x20, 10, huge.data(), huge.size(), 4096) == -1);
+	check(queue.bytes() == 10);
+
+	// Cancelling drops everything and returns the slabs
+	check(queue.push(pool, 0x21, 0, s2.data(), s2.size(), 512) == 0);
+	queue.cancel(pool);
+	check(queue.empty());
+	check(queue.bytes() == 0);
+	check(pool.available() == 1024);
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
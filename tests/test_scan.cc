@@ -1,4 +1,5 @@
 #include <blepp/lescan.h>
+#include <blepp/gap.h>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -104,6 +105,62 @@ device: hci0 snap_len: 1500 filter: 0xffffffffffffffff
 	check(r.flags->simultaneous_LE_BR_controller);
 	check(r.flags->simultaneous_LE_BR_host);
 
+	//32 bit UUID list, TX power, appearance and connection interval range
+	r = parse_advertisement_packet(to_data("> 04 3E 1F 02 01 00 01 0B 57 16 21 76 7C 13 05 05 78 56 34 12 02 0A F4 03 19 C1 03 05 12 06 00 80 0C BC")).back();
+	check(r.UUIDs.size() == 1);
+	check(r.UUIDs[0] == UUID("12345678-0000-1000-8000-00805f9b34fb"));
+	check(r.uuid_32_bit_complete);
+	check(r.has_tx_power);
+	check(r.tx_power == -12);
+	check(r.has_appearance);
+	check(r.appearance == 0x03C1);
+	check(r.has_connection_interval);
+	check(r.connection_interval.min == 6);
+	check(r.connection_interval.max == 3200);
+	check(r.unparsed_data_with_types.empty());
+
+	//Service data, 16 and 128 bit
+	r = parse_advertisement_packet(to_data("> 04 3E 25 02 01 03 01 0B 57 16 21 76 7C 19 05 16 AA FE 10 00 12 21 64 97 81 D1 ED BA 6B AC 11 4C 9D 34 3E 20 09 73 2A BC")).back();
+	check(r.service_data.size() == 2);
+	check(r.service_data[0].uuid == UUID(0xFEAA));
+	check(r.service_data[0].data == std::vector<uint8_t>({0x10, 0x00}));
+	check(r.service_data[1].uuid == UUID("7309203e-349d-4c11-ac6b-baedd1819764"));
+	check(r.service_data[1].data == std::vector<uint8_t>({0x2A}));
+	check(!r.has_tx_power);
+	check(r.unparsed_data_with_types.empty());
+
+	std::vector<uint8_t> p = to_data("> 04 3E 17 02 01 00 01 0B 57 16 21 76 7C 0B 02 01 1A 07 FF 4C 00 10 02 0A 00 BC");
+	AdvertisementView views[max_advertising_reports];
+	check(parse_advertisement_views(p.data(), p.size(), views, max_advertising_reports) == 1);
+	check(views[0].address == 0x7c762116570bULL);
+	check(views[0].address_string() == "7c:76:21:16:57:0b");
+	check(views[0].address_type == 1);
+	check(views[0].rssi == (int8_t)0xBC);
+	check(views[0].num_ad == 2);
+	check(views[0].find(GAP::flags) == views[0].ad);
+	check(views[0].find(GAP::manufacturer_data)->payload().size() == 6);
+	check(views[0].find(GAP::complete_local_name) == nullptr);
+	check(views[0].data.begin() >= p.data() && views[0].data.end() <= p.data() + p.size());
+	check(views[0].to_response().address == r.address);
+
+	//Decoding a bare AD payload, as transports deliver it
+	std::vector<uint8_t> payload = {0x02, 0x01, 0x06, 0x03, 0x03, 0x0F, 0x18, 0x05, 0x09, 'T', 'e', 's', 't'};
+	AdvertisingResponse d;
+	decode_ad_payload(payload, d);
+	check(d.flags && d.flags->LE_general_discoverable);
+	check(d.UUIDs.size() == 1 && d.UUIDs[0] == UUID(0x180F));
+	check(d.local_name && d.local_name->complete && d.local_name->name == "Test");
+	check(d.raw_packet.empty());
+
+	bool threw = false;
+	try {
+		AdvertisingResponse bad;
+		decode_ad_payload(std::vector<uint8_t>({0x09, 0x09, 'T'}), bad);
+	} catch (std::out_of_range&) {
+		threw = true;
+	}
+	check(threw);
+
 	std::cout << "OK" << std::endl;
 	return 0;
 }
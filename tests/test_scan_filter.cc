@@ -0,0 +1,214 @@
+#include <blepp/lescan.h>
+#include <blepp/scan_filter.h>
+#include <iostream>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+static bool matches(const ScanFilter& filter, uint64_t address, int8_t rssi, const std::vector<uint8_t>& ad)
+{
+	return filter.matches(address, rssi, ad.data(), ad.size());
+}
+
+static ScanFilter only(const ScanFilterRule& rule)
+{
+	ScanFilter filter;
+	filter.add(rule);
+	return filter;
+}
+
+int main()
+{
+	// Flags, 16-bit service list {0x180D, 0x180F}, manufacturer data
+	// 0x004C 02 15 AA, complete local name "Sensor-12"
+	const std::vector<uint8_t> ad = {
+		0x02, 0x01, 0x06,
+		0x05, 0x03, 0x0D, 0x18, 0x0F, 0x18,
+		0x06, 0xFF, 0x4C, 0x00, 0x02, 0x15, 0xAA,
+		0x0A, 0x09, 'S', 'e', 'n', 's', 'o', 'r', '-', '1', '2'
+	};
+	const uint64_t addr = 0xC098E5123456ULL;
+
+	// No rules passes everything
+	ScanFilter all;
+	check(all.empty());
+	check(matches(all, addr, -50, ad));
+
+	// Address prefix
+	{
+		ScanFilterRule r;
+		r.address_prefix = "C0:98:E5";
+		ScanFilter f = only(r);
+		check(!f.empty());
+		check(matches(f, addr, -50, ad));
+		check(!matches(f, 0xC098E6000000ULL, -50, ad));
+
+		r.address_prefix = "c0:98:e5:12:34:56";
+		check(only(r).matches(addr, 0, nullptr, 0));
+		check(!only(r).matches(addr + 1, 0, nullptr, 0));
+	}
+
+	// Name prefix
+	{
+		ScanFilterRule r;
+		r.name_prefix = "Sens";
+		check(matches(only(r), addr, -50, ad));
+		r.name_prefix = "Sensor-12";
+		check(matches(only(r), addr, -50, ad));
+		r.name_prefix = "Sensor-123";
+		check(!matches(only(r), addr, -50, ad));
+		r.name_prefix = "sens";
+		check(!matches(only(r), addr, -50, ad));
+	}
+
+	// Company ID, with and without data and mask
+	{
+		ScanFilterRule r;
+		r.company_id = 0x004C;
+		check(matches(only(r), addr, -50, ad));
+
+		r.manufacturer_data = {0x02, 0x15};
+		check(matches(only(r), addr, -50, ad));
+
+		r.manufacturer_data = {0x02, 0x16};
+		check(!matches(only(r), addr, -50, ad));
+
+		r.manufacturer_data = {0x02, 0x10};
+		r.manufacturer_mask = {0xFF, 0xF0};
+		check(matches(only(r), addr, -50, ad));
+
+		r.manufacturer_mask = {0xFF, 0xFF};
+		check(!matches(only(r), addr, -50, ad));
+
+		r = ScanFilterRule();
+		r.company_id = 0x0059;
+		check(!matches(only(r), addr, -50, ad));
+	}
+
+	// Service UUIDs in a 16-bit list, in either form
+	{
+		ScanFilterRule r;
+		r.service_uuids = {UUID(0x180F)};
+		check(matches(only(r), addr, -50, ad));
+
+		r.service_uuids = {UUID("0000180d-0000-1000-8000-00805f9b34fb")};
+		check(matches(only(r), addr, -50, ad));
+
+		r.service_uuids = {UUID(0x1810)};
+		check(!matches(only(r), addr, -50, ad));
+	}
+
+	// Service UUIDs in a 128-bit list
+	{
+		const std::vector<uint8_t> ad128 = {
+			0x02, 0x01, 0x06,
+			0x11, 0x06, 0x64, 0x97, 0x81, 0xD1, 0xED, 0xBA, 0x6B, 0xAC,
+			            0x11, 0x4C, 0x9D, 0x34, 0x3E, 0x20, 0x09, 0x73
+		};
+
+		ScanFilterRule r;
+		r.service_uuids = {UUID(0x180F), UUID("7309203e-349d-4c11-ac6b-baedd1819764")};
+		check(matches(only(r), addr, -50, ad128));
+
+		r.service_uuids = {UUID("7309203e-349d-4c11-ac6b-baedd1819765")};
+		check(!matches(only(r), addr, -50, ad128));
+		check(!matches(only(r), addr, -50, ad));
+	}
+
+	// Service data counts as advertising the service
+	{
+		const std::vector<uint8_t> service_data = {0x05, 0x16, 0xAA, 0xFE, 0x10, 0x00};
+
+		ScanFilterRule r;
+		r.service_uuids = {UUID(0xFEAA)};
+		check(matches(only(r), addr, -50, service_data));
+		check(!matches(only(r), addr, -50, ad));
+	}
+
+	// RSSI, with an unmeasured RSSI never passing
+	{
+		ScanFilterRule r;
+		r.min_rssi = -60;
+		check(matches(only(r), addr, -60, ad));
+		check(!matches(only(r), addr, -61, ad));
+		check(!matches(only(r), addr, rssi_unavailable, ad));
+	}
+
+	// Rules are ORed; conditions within a rule are ANDed
+	ScanFilter f;
+	{
+		ScanFilterRule r;
+		r.company_id = 0x0059;
+		f.add(r);
+
+		r = ScanFilterRule();
+		r.name_prefix = "Sensor";
+		r.min_rssi = -40;
+		f.add(r);
+
+		check(!matches(f, addr, -50, ad));
+		check(matches(f, addr, -30, ad));
+	}
+
+	// Malformed rules are refused and leave the filter as it was
+	{
+		bool threw = false;
+		try {
+			ScanFilterRule r;
+			r.address_prefix = "C0:9";
+			f.add(r);
+		} catch (std::invalid_argument&) {
+			threw = true;
+		}
+		check(threw);
+
+		threw = false;
+		try {
+			ScanFilterRule r;
+			r.manufacturer_data = {1};
+			f.add(r);
+		} catch (std::invalid_argument&) {
+			threw = true;
+		}
+		check(threw);
+
+		threw = false;
+		try {
+			ScanFilterRule r;
+			r.company_id = 1;
+			r.manufacturer_data = {1};
+			r.manufacturer_mask = {1, 2};
+			f.add(r);
+		} catch (std::invalid_argument&) {
+			threw = true;
+		}
+		check(threw);
+
+		check(matches(f, addr, -30, ad));
+		check(!matches(f, addr, -50, ad));
+	}
+
+	// A truncated payload matches nothing that needs its contents
+	{
+		const std::vector<uint8_t> bad = {0x09, 0x09, 'S'};
+		ScanFilterRule r;
+		r.name_prefix = "S";
+		check(!matches(only(r), addr, 0, bad));
+	}
+
+	f.clear();
+	check(f.empty());
+	check(matches(f, addr, -50, ad));
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
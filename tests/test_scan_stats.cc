@@ -0,0 +1,144 @@
+#include <blepp/lescan.h>
+#include <blepp/bleclienttransport.h>
+#include <blepp/logging.h>
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+// Hands out each of its devices' adverts a fixed number of times, filtered
+// the way the real transports filter them
+class FakeTransport : public BLEClientTransport
+{
+public:
+	int devices = 3;
+	int repeats = 4;
+
+	int start_scan(const ScanParams& params) override
+	{
+		reset_report_filter(params);
+		sent_ = false;
+		return 0;
+	}
+
+	int stop_scan() override { return 0; }
+
+	int get_advertisements(std::vector<AdvertisementData>& ads, int) override
+	{
+		ads.clear();
+		if (sent_) {
+			return 0;
+		}
+		sent_ = true;
+
+		for (int r = 0; r < repeats; r++) {
+			for (int d = 0; d < devices; d++) {
+				const uint8_t addr[6] = {(uint8_t)d, 0x00, 0xDD, 0xCC, 0xBB, 0xAA};
+				const uint8_t data[3] = {0x02, 0x01, 0x06};
+				if (!accept_report(pack_address(addr), 0, 0, -50, data, sizeof(data))) {
+					continue;
+				}
+
+				AdvertisementData ad;
+				ad.address = address_to_string(pack_address(addr));
+				ad.address_type = 0;
+				ad.rssi = -50;
+				ad.event_type = 0;
+				ad.data.assign(data, data + sizeof(data));
+				ads.push_back(ad);
+			}
+		}
+		return ads.size();
+	}
+
+	int connect(const ClientConnectionParams&) override { return -1; }
+	int disconnect(int) override { return 0; }
+	int get_fd(int) const override { return -1; }
+	int send(int, const uint8_t*, size_t) override { return -1; }
+	int receive(int, uint8_t*, size_t) override { return -1; }
+	uint16_t get_mtu(int) const override { return 23; }
+	int set_mtu(int, uint16_t) override { return 0; }
+	const char* get_transport_name() const override { return "Fake"; }
+	bool is_available() const override { return true; }
+	std::string get_mac_address() const override { return ""; }
+
+private:
+	bool sent_ = false;
+};
+
+int main()
+{
+	log_level = LogLevels::Warning;
+
+	FakeTransport transport;
+	BLEScanner scanner(&transport);
+
+	// Software mode: each device is reported once, its repeats are suppressed
+	ScanParams params;
+	params.filter_duplicates = ScanParams::FilterDuplicates::Software;
+	scanner.start(params);
+	std::vector<AdvertisingResponse> ads = scanner.get_advertisements(0);
+	check(ads.size() == 3);
+	check(ads[0].address == "aa:bb:cc:dd:00:00");
+	check(ads[0].flags && ads[0].flags->LE_general_discoverable);
+	check(ads[0].raw_packet.size() == 1 && ads[0].raw_packet[0].size() == 3);
+	check(transport.get_scan_filter_stats().reported == 3);
+	check(transport.get_scan_filter_stats().suppressed == 9);
+	scanner.stop();
+
+	// Counters start again with each scan, and the scanner surfaces them
+	scanner.start_async(params);
+	ScanRecord records[16];
+	size_t total = 0;
+	for (int i = 0; i < 50 && total < 3; i++) {
+		total += scanner.drain(records + total, 16 - total, 20);
+	}
+	scanner.stop();
+	check(total == 3);
+
+	AsyncScanStats stats = scanner.async_stats();
+	check(stats.received == 3);
+	check(stats.reported == 3);
+	check(stats.suppressed == 9);
+	check(stats.delivered == 3);
+
+	// Without software filtering everything is reported
+	params.filter_duplicates = ScanParams::FilterDuplicates::Off;
+	scanner.start(params);
+	check(scanner.get_advertisements(0).size() == 12);
+	check(transport.get_scan_filter_stats().reported == 12);
+	check(transport.get_scan_filter_stats().suppressed == 0);
+	check(transport.get_scan_filter_stats().rejected == 0);
+	scanner.stop();
+
+	// The scan filter runs first, so rejected adverts never reach the duplicate filter
+	ScanFilterRule rule;
+	rule.address_prefix = "AA:BB:CC:DD:00:01";
+	params.filter.add(rule);
+	params.filter_duplicates = ScanParams::FilterDuplicates::Software;
+	scanner.start_async(params);
+	total = 0;
+	for (int i = 0; i < 50 && total < 1; i++) {
+		total += scanner.drain(records, 16, 20);
+	}
+	scanner.stop();
+	check(total == 1);
+	check(records[0].address == 0xAABBCCDD0001ULL);
+
+	stats = scanner.async_stats();
+	check(stats.received == 1);
+	check(stats.rejected == 8);
+	check(stats.reported == 1);
+	check(stats.suppressed == 3);
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include <blepp/timer_wheel.h>
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+static void sleep_ms(int ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int main()
+{
+	TimerWheel wheel(5, 8);
+	check(wheel.next_timeout_ms() == -1);
+	check(wheel.advance() == 0);
+
+	// The timeout is the earliest deadline, not the next tick
+	int fired = 0;
+	TimerWheel::TimerId late = wheel.schedule(200, [&]{ fired += 10; });
+	check(late != 0);
+	check(wheel.next_timeout_ms() > 150);
+
+	TimerWheel::TimerId soon = wheel.schedule(20, [&]{ fired += 1; });
+	check(soon != late);
+	check(wheel.pending() == 2);
+	check(wheel.next_timeout_ms() <= 25);
+	check(wheel.next_timeout_ms() > 10);
+
+	// Cancelling the earliest timer moves the deadline back out
+	check(wheel.cancel(soon));
+	check(!wheel.cancel(soon));
+	check(wheel.pending() == 1);
+	check(wheel.next_timeout_ms() > 150);
+
+	// Nothing fires early; the long timer wraps the 40 ms wheel
+	sleep_ms(60);
+	check(wheel.advance() == 0);
+	check(fired == 0);
+
+	check(wheel.cancel(late));
+	check(wheel.pending() == 0);
+	check(wheel.next_timeout_ms() == -1);
+
+	// Timers fire once their delay has passed
+	wheel.schedule(10, [&]{ fired += 1; });
+	TimerWheel::TimerId fired_id = wheel.schedule(10, [&]{ fired += 1; });
+	sleep_ms(30);
+	check(wheel.next_timeout_ms() == 0);
+	check(wheel.advance() == 2);
+	check(fired == 2);
+	check(!wheel.cancel(fired_id));
+	check(wheel.next_timeout_ms() == -1);
+
+	// clear() drops everything
+	wheel.schedule(10, [&]{ fired += 100; });
+	wheel.clear();
+	sleep_ms(20);
+	check(wheel.advance() == 0);
+	check(fired == 2);
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include <blepp/tx_queue.h>
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	const uint8_t notify[10] = {0x1B, 0x01};
+	const uint8_t indicate[10] = {0x1D, 0x02};
+	const uint8_t response[10] = {0x0B};
+
+	check(TxQueue::classify(notify, sizeof(notify)) == TxPriority::Notification);
+	check(TxQueue::classify(indicate, sizeof(indicate)) == TxPriority::Indication);
+	check(TxQueue::classify(response, sizeof(response)) == TxPriority::Response);
+	check(TxQueue::classify(response, 0) == TxPriority::Response);
+
+	bool link_full = false;
+	bool link_broken = false;
+	std::vector<uint8_t> written;
+	TxQueue::Writer write = [&](const uint8_t* data, size_t len) {
+		if (link_broken) {
+			return -1;
+		}
+		if (link_full) {
+			return 0;
+		}
+		written.push_back(data[0]);
+		return static_cast<int>(len);
+	};
+
+	// With room on the link, PDUs go straight out in the order sent
+	TxQueue queue(64);
+	check(queue.send(1, notify, sizeof(notify), write) == 0);
+	check(queue.send(1, response, sizeof(response), write) == 0);
+	check(written.size() == 2 && written[0] == 0x1B && written[1] == 0x0B);
+	check(queue.empty(1));
+
+	// Queued PDUs are flushed responses first, then indications, then notifications
+	written.clear();
+	link_full = true;
+	check(queue.send(1, notify, sizeof(notify), write) == 0);
+	check(queue.send(1, indicate, sizeof(indicate), write) == 0);
+	check(queue.send(1, response, sizeof(response), write) == 0);
+	check(!queue.empty(1));
+	check(queue.pending() == std::vector<uint16_t>{1});
+	check(queue.bytes() == 30);
+	check(queue.flush(1, write) == 3);
+
+	link_full = false;
+	check(queue.flush(1, write) == 0);
+	check(written.size() == 3);
+	check(written[0] == 0x0B && written[1] == 0x1D && written[2] == 0x1B);
+	check(queue.bytes() == 0);
+
+	TxQueueStats stats = queue.stats(1);
+	check(stats.sent[0] == 2 && stats.sent[1] == 1 && stats.sent[2] == 2);
+	check(stats.queued[0] == 1 && stats.queued[1] == 1 && stats.queued[2] == 1);
+	check(stats.peak_depth == 3);
+
+	// Nothing as urgent waiting, so a response overtakes a queued notification
+	written.clear();
+	link_full = true;
+	check(queue.send(1, notify, sizeof(notify), write) == 0);
+	link_full = false;
+	check(queue.send(1, response, sizeof(response), write) == 0);
+	check(written.size() == 1 && written[0] == 0x0B);
+	check(queue.flush(1, write) == 0);
+	check(!queue.has_dropped());
+
+	// At the cap, more urgent PDUs evict less urgent ones, preferring the
+	// same connection, and the evicted PDUs are handed back
+	link_full = true;
+	check(queue.send(2, notify, sizeof(notify), write) == 0);
+	check(queue.send(1, indicate, sizeof(indicate), write) == 0);
+	for (int i = 0; i < 4; i++) {
+		check(queue.send(1, notify, sizeof(notify), write) == 0);
+	}
+	check(queue.bytes() == 60);
+
+	check(queue.send(1, response, sizeof(response), write) == 0);
+	check(queue.bytes() == 60);
+	check(queue.stats(1).dropped[2] == 1);
+	check(queue.stats(2).dropped[2] == 0);
+
+	check(queue.send(2, response, sizeof(response), write) == 0);
+	check(queue.stats(2).dropped[2] == 1);
+
+	check(queue.has_dropped());
+	std::vector<DroppedPdu> dropped = queue.take_dropped();
+	check(dropped.size() == 2);
+	check(dropped[0].conn_handle == 1 && dropped[0].pdu[0] == 0x1B);
+	check(dropped[1].conn_handle == 2 && dropped[1].pdu[0] == 0x1B);
+	check(!queue.has_dropped());
+
+	// Indications are evicted once no notifications are left
+	for (int i = 0; i < 4; i++) {
+		check(queue.send(1, response, sizeof(response), write) == 0);
+	}
+	check(queue.stats(1).dropped[2] == 4);
+	check(queue.stats(1).dropped[1] == 1);
+	dropped = queue.take_dropped();
+	check(dropped.back().conn_handle == 1);
+	check(dropped.back().pdu == std::vector<uint8_t>(indicate, indicate + sizeof(indicate)));
+
+	// Nothing less urgent left, so a new PDU is refused, not queued
+	check(queue.send(1, notify, sizeof(notify), write) == -1);
+	check(queue.send(1, response, sizeof(response), write) == -1);
+	check(!queue.has_dropped());
+	check(queue.bytes() == 60);
+
+	// PDUs whose write fails while flushing are dropped and handed back too
+	link_full = false;
+	link_broken = true;
+	check(queue.flush(2, write) == 0);
+	dropped = queue.take_dropped();
+	check(dropped.size() == 1 && dropped[0].conn_handle == 2);
+
+	// Removing a connection forgets its backlog and anything it had dropped
+	link_full = true;
+	link_broken = false;
+	check(queue.send(3, notify, sizeof(notify), write) == 0);
+	check(queue.send(1, response, sizeof(response), write) == 0);
+	check(queue.has_dropped());
+	queue.remove(3);
+	check(!queue.has_dropped());
+	queue.remove(1);
+	check(queue.bytes() == 0);
+	check(queue.pending().empty());
+	check(queue.stats(1).sent[0] == 0);
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}